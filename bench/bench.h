@@ -0,0 +1,57 @@
+/*
+ * bench.h - microbenchmarks for mqttc
+ *
+ * Every benchmark runs in-process (socketpairs or plain buffers), so no
+ * broker is needed. Build with the mqttc-bench target and run
+ * 'mqttc-bench [name...]'; with no names every benchmark runs.
+ */
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline long long bench_nstime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* xorshift, so runs are repeatable without dragging in <random> */
+static inline uint32_t bench_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+int bench_reader(int argc, char **argv);
+int bench_writev(int argc, char **argv);
+int bench_batch(int argc, char **argv);
+int bench_loop(int argc, char **argv);
+int bench_shard(int argc, char **argv);
+int bench_timer(int argc, char **argv);
+int bench_inflight(int argc, char **argv);
+int bench_qos2(int argc, char **argv);
+int bench_persist(int argc, char **argv);
+int bench_decode(int argc, char **argv);
+int bench_encode(int argc, char **argv);
+int bench_codec(int argc, char **argv);
+int bench_alias(int argc, char **argv);
+int bench_flow(int argc, char **argv);
+int bench_pahoread(int argc, char **argv);
+int bench_readahead(int argc, char **argv);
+int bench_pahoclient(int argc, char **argv);
+int bench_resolve(int argc, char **argv);
+int bench_pipeline(int argc, char **argv);
+int bench_broker(int argc, char **argv);
+int bench_trie(int argc, char **argv);
+int bench_dispatch(int argc, char **argv);
+int bench_fanout(int argc, char **argv);
+int bench_retain(int argc, char **argv);
+
+#endif /* __BENCH_H */
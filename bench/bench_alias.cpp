@@ -0,0 +1,263 @@
+/*
+ * bench_alias.c - MQTT 5 topic aliases, bytes on the wire and their cost
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define MESSAGES 200000
+#define BATCH 4096
+#define PAYLOAD 16
+
+/* what a broker does with our stream: resolve every alias, check the topic */
+struct AliasBroker {
+	MqttTopicAliasTable aliases;
+	std::vector<std::string> const *topics;
+	std::vector<int> const *order;
+	long long next;
+	long long bad;
+};
+
+static void broker_frame(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	AliasBroker *b = (AliasBroker *)clientdata;
+	MqttPublishFields p;
+	std::string_view topic;
+	uint32_t alias = 0;
+	if (!mqtt_decode_publish(header, std::span<const char>(buffer, buflen), &p, MQTT_PROTOCOL_V5) ||
+		!mqtt_decode_properties(p.properties, [&](MqttProperty const &prop) {
+			if (prop.id == MQTT_PROP_TOPIC_ALIAS) alias = prop.value;
+			return true;
+		})) {
+		b->bad++;
+		return;
+	}
+	topic = p.topic;
+	if (alias && !topic.empty()) {
+		if (!b->aliases.set(alias, topic)) b->bad++;
+	} else if (alias) {
+		std::string const *t = b->aliases.get(alias);
+		if (t) topic = *t;
+	}
+	if (topic != (*b->topics)[(*b->order)[b->next++]]) b->bad++;
+}
+
+static void make_topics(std::vector<std::string> *topics, int count)
+{
+	char name[128];
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "factory/line-%02d/machine-%03d/sensor/temperature", i % 16, i);
+		topics->push_back(name);
+	}
+}
+
+/* a few topics carry most of the traffic: u^3 piles up near 0 */
+static void make_order(std::vector<int> *order, int ntopics)
+{
+	uint32_t seed = 4242;
+	for (int i = 0; i < MESSAGES; i++) {
+		double u = (bench_rand(&seed) % 1000000) / 1e6;
+		order->push_back((int)(u * u * u * ntopics));
+	}
+}
+
+static void send_connack(int fd, int aliasmax)
+{
+	char props[3];
+	char buffer[16];
+	size_t propslen = 0;
+	if (aliasmax > 0) {
+		mqtt_put_property_int(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, aliasmax);
+		propslen = sizeof(props);
+	}
+	size_t n = mqtt_encode_connack(buffer, false, 0, std::span<const char>(props, propslen));
+	anetWrite(fd, buffer, n);
+}
+
+/*
+ * Publish MESSAGES QoS0 messages corked and take the output buffer
+ * apart the way the broker would. protocol 4 is plain 3.1.1.
+ */
+static int run_publish(const char *name, int protocol, int aliasmax,
+	std::vector<std::string> const &topics, std::vector<int> const &order, double *base)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 1;
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->fd = sv[0];
+	mqtt->mqtt_set_protocol(protocol);
+	if (protocol == MQTT_PROTOCOL_V5) {
+		send_connack(sv[1], aliasmax);
+		mqtt->mqtt_read(sv[0], 0);
+	}
+	mqtt->mqtt_set_flush_threshold(SIZE_MAX); //keep it all for the broker side
+	mqtt->mqtt_cork(true);
+
+	AliasBroker broker;
+	broker.aliases.reset(aliasmax);
+	broker.topics = &topics;
+	broker.order = &order;
+	broker.next = 0;
+	broker.bad = 0;
+	MqttReader reader;
+
+	MqttMsg msg;
+	msg.payload.assign(PAYLOAD, 'x');
+	long long bytes = 0;
+	long long elapsed = 0;
+	for (int i = 0; i < MESSAGES; i += BATCH) {
+		long long start = bench_nstime();
+		for (int j = i; j < i + BATCH && j < MESSAGES; j++) {
+			msg.topic = topics[order[j]];
+			mqtt->mqtt_publish(&msg);
+		}
+		elapsed += bench_nstime() - start;
+		bytes += mqtt->obuf.size();
+		if (protocol == MQTT_PROTOCOL_V5) {
+			reader.feed(mqtt->obuf.data(), mqtt->obuf.size(), broker_frame, &broker);
+		}
+		mqtt->obuf.clear();
+	}
+	long long hits = mqtt->aliases_out.hits;
+	long long misses = mqtt->aliases_out.misses;
+
+	mqtt->corked = false;
+	close(sv[0]);
+	close(sv[1]);
+	mqtt->fd = -1;
+
+	if (protocol == MQTT_PROTOCOL_V5 && (broker.bad || broker.next != MESSAGES)) {
+		printf("  %-24s broker saw %lld bad of %lld messages!\n", name, broker.bad, broker.next);
+		return 1;
+	}
+	double per = (double)bytes / MESSAGES;
+	if (*base == 0) *base = per;
+	printf("  %-24s %7.1f bytes/msg %6.1f%% saved  alias hits %5.1f%%  %6.1f ns/msg\n", name,
+		per, 100.0 * (1 - per / *base), hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+		(double)elapsed / MESSAGES);
+	return 0;
+}
+
+static long long delivered;
+static long long mismatched;
+static std::vector<std::string> const *expect_topics;
+static std::vector<int> const *expect_order;
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)mqtt;
+	if (msg->topic != (*expect_topics)[(*expect_order)[delivered % MESSAGES]]) mismatched++;
+	delivered++;
+}
+
+/* the broker aliases what it sends us, up to the maximum in our CONNECT */
+static int run_inbound(const char *name, int aliasmax,
+	std::vector<std::string> const &topics, std::vector<int> const &order)
+{
+	std::vector<char> stream;
+	MqttTopicAliasCache aliases;
+	aliases.reset(aliasmax);
+	char payload[PAYLOAD];
+	memset(payload, 'x', PAYLOAD);
+	for (int i = 0; i < MESSAGES; i++) {
+		char props[3];
+		size_t propslen = 0;
+		bool known;
+		MqttPublishFields p;
+		p.topic = topics[order[i]];
+		uint16_t alias = aliases.lookup(p.topic, &known);
+		if (alias) {
+			mqtt_put_property_int(props, MQTT_PROP_TOPIC_ALIAS, alias);
+			propslen = sizeof(props);
+			if (known) p.topic = std::string_view();
+		}
+		p.properties = std::span<const char>(props, propslen);
+		p.payload = std::span<const char>(payload, PAYLOAD);
+		size_t off = stream.size();
+		size_t size = mqtt_packet_size(mqtt_publish_length(p, MQTT_PROTOCOL_V5));
+		stream.resize(off + size);
+		mqtt_encode_publish(std::span<char>(stream.data() + off, size), p, MQTT_PROTOCOL_V5);
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 1;
+	std::thread feed([&](){
+		anetWrite(sv[1], stream.data(), stream.size());
+	});
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->fd = sv[0];
+	mqtt->mqtt_set_protocol(MQTT_PROTOCOL_V5);
+	mqtt->aliases_in.reset(aliasmax); //as CONNECT would have
+	mqtt->mqtt_set_msg_view_callback(on_message);
+	delivered = 0;
+	mismatched = 0;
+	expect_topics = &topics;
+	expect_order = &order;
+
+	long long start = bench_nstime();
+	while (delivered < MESSAGES) {
+		mqtt->mqtt_read(sv[0], 0);
+	}
+	long long elapsed = bench_nstime() - start;
+
+	feed.join();
+	close(sv[0]);
+	close(sv[1]);
+	mqtt->fd = -1;
+	if (mismatched) {
+		printf("  %-24s %lld topics resolved wrong!\n", name, mismatched);
+		return 1;
+	}
+	printf("  %-24s %7.1f bytes/msg  %6.1f ns/msg\n", name,
+		(double)stream.size() / MESSAGES, (double)elapsed / MESSAGES);
+	return 0;
+}
+
+int bench_alias(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int rc = 0;
+	double base;
+
+	std::vector<std::string> one;
+	std::vector<int> same(MESSAGES, 0);
+	make_topics(&one, 1);
+	printf("  one %zu byte topic, %d byte payload, QoS0\n", one[0].size(), PAYLOAD);
+	base = 0;
+	rc |= run_publish("3.1.1", MQTT_PROTOCOL_V311, 0, one, same, &base);
+	rc |= run_publish("5, no aliases", MQTT_PROTOCOL_V5, 0, one, same, &base);
+	rc |= run_publish("5, aliases", MQTT_PROTOCOL_V5, 16, one, same, &base);
+
+	std::vector<std::string> topics;
+	std::vector<int> order;
+	make_topics(&topics, 1000);
+	make_order(&order, topics.size());
+	printf("  1000 topics, skewed\n");
+	base = 0;
+	rc |= run_publish("3.1.1", MQTT_PROTOCOL_V311, 0, topics, order, &base);
+	rc |= run_publish("5, no aliases", MQTT_PROTOCOL_V5, 0, topics, order, &base);
+	int maxes[] = {16, 64, 256, 1024};
+	for (int max : maxes) {
+		char name[32];
+		snprintf(name, sizeof(name), "5, alias maximum %d", max);
+		rc |= run_publish(name, MQTT_PROTOCOL_V5, max, topics, order, &base);
+	}
+
+	printf("  inbound, 1000 topics, skewed\n");
+	rc |= run_inbound("no aliases", 0, topics, order);
+	rc |= run_inbound("alias maximum 64", 64, topics, order);
+	rc |= run_inbound("alias maximum 1024", 1024, topics, order);
+	return rc;
+}
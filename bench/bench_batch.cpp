@@ -0,0 +1,73 @@
+/*
+ * bench_batch.c - small QoS0 publish bursts: one write per message vs. corked
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/mqtt.h"
+
+#define MESSAGES 1000000
+#define BATCH 1000
+
+enum Mode {
+	MODE_SINGLE,
+	MODE_BATCH,
+	MODE_CORK
+};
+
+static double run(Mode mode)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+
+	std::thread drain([&](){
+		std::vector<char> buf(1024 * 1024);
+		while (read(sv[1], buf.data(), buf.size()) > 0) {
+		}
+	});
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->fd = sv[0];
+	std::vector<MqttMsg> msgs(BATCH);
+	for (MqttMsg &msg : msgs) {
+		msg.topic = "Channel/Resource/telemetry";
+		msg.payload.assign(32, 'x');
+	}
+
+	long long start = bench_nstime();
+	if (mode == MODE_CORK) mqtt->mqtt_cork(true);
+	for (int i = 0; i < MESSAGES / BATCH; i++) {
+		if (mode == MODE_BATCH) {
+			mqtt->mqtt_publish_batch(msgs);
+			continue;
+		}
+		for (MqttMsg &msg : msgs) {
+			mqtt->mqtt_publish(&msg);
+		}
+	}
+	if (mode == MODE_CORK) mqtt->mqtt_cork(false);
+	shutdown(sv[0], SHUT_WR);
+	drain.join();
+	long long elapsed = bench_nstime() - start;
+	close(sv[0]);
+	close(sv[1]);
+	mqtt->fd = -1;
+	return elapsed / 1e9;
+}
+
+int bench_batch(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	double single = run(MODE_SINGLE);
+	double batch = run(MODE_BATCH);
+	double cork = run(MODE_CORK);
+	printf("  %-16s %12.0f msgs/s\n", "mqtt_publish", MESSAGES / single);
+	printf("  %-16s %12.0f msgs/s  (x%.1f)\n", "publish_batch", MESSAGES / batch, single / batch);
+	printf("  %-16s %12.0f msgs/s  (x%.1f)\n", "cork+flush", MESSAGES / cork, single / cork);
+	return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * bench_broker.c - mqttc clients through mqtt-hello-broker on loopback
+ */
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "../broker/broker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define WINDOW 2000 //messages ahead of delivery, per publisher
+
+struct BrokerCase {
+	const char *name;
+	int pubs;
+	int subs;
+	int qos;
+	int messages; //in total, across the publishers
+	const char *filter; //"%d" is the subscriber, for a 1:1 pairing
+	const char *topic; //"%d" is the publisher
+};
+
+struct BrokerState {
+	aeEventLoop *el;
+	BrokerCase const *bc;
+	std::vector<std::shared_ptr<Mqtt>> pubs;
+	std::vector<std::shared_ptr<Mqtt>> subs;
+	std::vector<MqttMsg> msgs; //one per publisher
+	int fanout;
+	int subacked;
+	int connacked;
+	long long sent;
+	long long received;
+	long long start;
+};
+
+static void pump(BrokerState *state)
+{
+	int n = state->bc->pubs;
+	while (state->sent < state->bc->messages &&
+		state->sent - state->received / state->fanout < (long long)WINDOW * n) {
+		int i = state->sent % n;
+		if (state->pubs[i]->mqtt_publish(&state->msgs[i]) < 0) break; //in-flight window full
+		state->sent++;
+	}
+}
+
+static void on_pub_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	BrokerState *state = (BrokerState *)mqtt->userdata;
+	if (rc != CONNACK_ACCEPT) return;
+	if (++state->connacked < state->bc->pubs) return;
+	state->start = bench_nstime();
+	pump(state);
+}
+
+static void on_puback(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	pump((BrokerState *)mqtt->userdata);
+}
+
+static void on_suback(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	BrokerState *state = (BrokerState *)mqtt->userdata;
+	if (++state->subacked < state->bc->subs) return;
+	//everyone is listening, bring the publishers in
+	for (auto &pub : state->pubs) pub->mqtt_connect();
+}
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)msg;
+	BrokerState *state = (BrokerState *)mqtt->userdata;
+	if (++state->received == (long long)state->bc->messages * state->fanout) {
+		aeStop(state->el);
+		return;
+	}
+	if (state->received % 256 == 0) pump(state);
+}
+
+static std::shared_ptr<Mqtt> client(BrokerState *state, int port, std::string const &clientid)
+{
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->userdata = state;
+	mqtt->mqtt_set_event_loop(state->el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid(clientid);
+	mqtt->mqtt_set_inflight_window(256);
+	return mqtt;
+}
+
+static int run(Broker *broker, int port, BrokerCase const *bc)
+{
+	char buf[256];
+	BrokerState state;
+	state.el = aeCreateEventLoop(1024);
+	state.bc = bc;
+	state.fanout = (bc->pubs == bc->subs) ? 1 : bc->subs;
+	state.subacked = state.connacked = 0;
+	state.sent = state.received = 0;
+
+	for (int i = 0; i < bc->pubs; i++) {
+		state.pubs.push_back(client(&state, port, "pub" + std::to_string(i)));
+		state.pubs[i]->mqtt_set_callback(CONNACK, on_pub_connack);
+		state.pubs[i]->mqtt_set_callback(PUBACK, on_puback);
+		MqttMsg msg;
+		msg.qos = bc->qos;
+		snprintf(buf, sizeof(buf), bc->topic, i);
+		msg.topic = buf;
+		msg.payload.assign(64, 'x');
+		state.msgs.push_back(msg);
+	}
+	for (int i = 0; i < bc->subs; i++) {
+		std::shared_ptr<Mqtt> sub = client(&state, port, "sub" + std::to_string(i));
+		sub->mqtt_set_callback(SUBACK, on_suback);
+		sub->mqtt_set_msg_view_callback(on_message);
+		if (sub->mqtt_connect() < 0) {
+			printf("  connect failed: %s\n", sub->errstr);
+			aeDeleteEventLoop(state.el);
+			return 1;
+		}
+		snprintf(buf, sizeof(buf), bc->filter, i);
+		sub->mqtt_subscribe(buf, bc->qos);
+		state.subs.push_back(sub);
+	}
+
+	long long delivered = broker->delivered;
+	aeMain(state.el);
+	long long elapsed = bench_nstime() - state.start;
+	delivered = broker->delivered - delivered;
+
+	printf("  %-10s %3d pub %3d sub  %8lld delivered  %9.0f msgs/s%s\n", bc->name, bc->pubs, bc->subs,
+		state.received, state.received / (elapsed / 1e9), delivered == state.received ? "" : "  LOST");
+	int rc = (delivered == state.received) ? 0 : 1;
+	state.pubs.clear();
+	state.subs.clear();
+	aeDeleteEventLoop(state.el);
+	return rc;
+}
+
+int bench_broker(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	static const BrokerCase cases[] = {
+		{"qos0 1:1", 8, 8, 0, 1000000, "bench/broker/%d", "bench/broker/%d"},
+		{"qos1 1:1", 8, 8, 1, 400000, "bench/broker/%d", "bench/broker/%d"},
+		{"fan-out", 1, 100, 0, 10000, "bench/+/fan/#", "bench/%d/fan/out"},
+	};
+
+	Broker broker;
+	char err[ANET_ERR_LEN];
+	int port = broker.listen_tcp("127.0.0.1", 0, err);
+	if (port == ANET_ERR) {
+		printf("  can't start the broker: %s\n", err);
+		return 1;
+	}
+	broker.start();
+
+	int rc = 0;
+	for (auto const &bc : cases) rc |= run(&broker, port, &bc);
+
+	broker.stop();
+	printf("  broker: %lld published, %lld delivered, %lld dropped\n", (long long)broker.published,
+		(long long)broker.delivered, (long long)broker.dropped);
+	return rc;
+}
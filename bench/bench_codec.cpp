@@ -0,0 +1,326 @@
+/*
+ * bench_codec.c - ns/packet to encode and decode every packet type with
+ * common/codec.h, directly and through paho's MQTTSerialize_* and
+ * MQTTDeserialize_* wrappers
+ */
+#include <string.h>
+#include <string_view>
+
+#include "bench.h"
+#include "../common/codec.h"
+#include "../paho/MQTTPacket.h"
+
+#define PACKETS 1000000
+#define ROUNDS 5
+#define SLOTS 64
+#define SLOT_SIZE 512
+
+static char ring[SLOTS][SLOT_SIZE];
+
+/*
+ * Encode PACKETS packets, each into the next slot of a ring so the
+ * stores can't be elided, and keep the best round. The ring is left
+ * holding SLOTS packets with ids 0..SLOTS-1 for the decoder.
+ */
+template <typename E>
+static double time_encode(E encode, size_t *len)
+{
+	long long best = -1;
+	long long total = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		long long start = bench_nstime();
+		for (int i = 0; i < PACKETS; i++) {
+			total += encode(std::span<char>(ring[i % SLOTS], SLOT_SIZE), i % SLOTS);
+		}
+		long long elapsed = bench_nstime() - start;
+		if (best < 0 || elapsed < best) best = elapsed;
+	}
+	*len = total / ((long long)ROUNDS * PACKETS);
+	return total > 0 ? (double)best / PACKETS : -1;
+}
+
+/* decode returns 0 on failure, else something that depends on the packet */
+template <typename D>
+static double time_decode(D decode, size_t len)
+{
+	long long best = -1;
+	for (int round = 0; round < ROUNDS; round++) {
+		long long sum = 0;
+		long long start = bench_nstime();
+		for (int i = 0; i < PACKETS; i++) {
+			int rc = decode(std::span<const char>(ring[i % SLOTS], len));
+			if (rc == 0) return -1;
+			sum += rc;
+		}
+		long long elapsed = bench_nstime() - start;
+		if (sum == 0) return -1;
+		if (best < 0 || elapsed < best) best = elapsed;
+	}
+	return (double)best / PACKETS;
+}
+
+/* both encoders must produce the same bytes, and both decoders accept them */
+template <typename E, typename D, typename PE, typename PD>
+static int run(const char *name, E encode, D decode, PE paho_encode, PD paho_decode)
+{
+	static char codec[SLOT_SIZE];
+	size_t len, plen;
+	double te = time_encode(encode, &len);
+	memcpy(codec, ring[1], len);
+	double tpe = time_encode(paho_encode, &plen);
+	if (te < 0 || tpe < 0 || len != plen || memcmp(codec, ring[1], len)) {
+		printf("  %-18s paho and codec packets differ!\n", name);
+		return 1;
+	}
+	double td = time_decode(decode, len);
+	double tpd = time_decode(paho_decode, len);
+	if (td < 0 || tpd < 0) {
+		printf("  %-18s decode failed!\n", name);
+		return 1;
+	}
+	printf("  %-18s %4zu bytes  %6.2f %6.2f  %6.2f %6.2f\n", name, len, te, td, tpe, tpd);
+	return 0;
+}
+
+static unsigned char *U(std::span<char> buf) { return (unsigned char *)buf.data(); }
+static unsigned char *U(std::span<const char> buf) { return (unsigned char *)buf.data(); }
+
+static MQTTString paho_string(const char *s)
+{
+	MQTTString m = MQTTString_initializer;
+	m.cstring = (char *)s;
+	return m;
+}
+
+/* fixed header split and the type's own decoder */
+template <typename F>
+static int decode_frame(std::span<const char> pkt, F body)
+{
+	uint8_t header;
+	std::span<const char> b;
+	if (mqtt_decode_frame(pkt, &header, &b) <= 0) return 0;
+	return body(header, b);
+}
+
+static int run_connect(const char *name, int version)
+{
+	MqttConnectFields c;
+	c.version = version;
+	c.clientid = "mqttc-bench-0001";
+	c.will = true;
+	c.willqos = 1;
+	c.willtopic = "Channel/Resource/will";
+	c.willmsg = "gone";
+	c.has_username = c.has_password = true;
+	c.username = "user";
+	c.password = "secret";
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = version;
+	data.clientID = paho_string("mqttc-bench-0001");
+	data.willFlag = 1;
+	data.will.qos = 1;
+	data.will.topicName = paho_string("Channel/Resource/will");
+	data.will.message = paho_string("gone");
+	data.username = paho_string("user");
+	data.password = paho_string("secret");
+
+	return run(name,
+		[&](std::span<char> buf, int id) { c.keepalive = id; return mqtt_encode_connect(buf, c); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				MqttConnectFields d;
+				return mqtt_decode_connect(body, &d) ? 1 + d.keepalive : 0;
+			});
+		},
+		[&](std::span<char> buf, int id) { data.keepAliveInterval = id; return MQTTSerialize_connect(U(buf), buf.size(), &data); },
+		[](std::span<const char> pkt) {
+			MQTTPacket_connectData d = MQTTPacket_connectData_initializer;
+			return MQTTDeserialize_connect(&d, U(pkt), pkt.size(), nullptr) ? 1 + d.keepAliveInterval : 0;
+		});
+}
+
+static int run_publish(const char *name, int qos, size_t payloadlen)
+{
+	static char payload[256];
+	MqttPublishFields p;
+	p.qos = qos;
+	p.topic = "Channel/Resource/sensor/temperature";
+	p.payload = std::span<const char>(payload, payloadlen);
+	MQTTString topic = paho_string("Channel/Resource/sensor/temperature");
+
+	return run(name,
+		[&](std::span<char> buf, int id) { p.id = id; return mqtt_encode_publish(buf, p); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t header, std::span<const char> body) {
+				MqttPublishFields d;
+				return mqtt_decode_publish(header, body, &d) ? 1 + d.id + (int)d.payload.size() : 0;
+			});
+		},
+		[&](std::span<char> buf, int id) {
+			return MQTTSerialize_publish(U(buf), buf.size(), 0, qos, 0, id, topic, (unsigned char *)payload, payloadlen);
+		},
+		[](std::span<const char> pkt) {
+			unsigned char dup, retained;
+			unsigned short id = 0;
+			int qos, len;
+			MQTTString t;
+			unsigned char *data;
+			return MQTTDeserialize_publish(&dup, &qos, &retained, &id, &t, &data, &len, U(pkt), pkt.size(), nullptr)
+				? 1 + id + len : 0;
+		});
+}
+
+template <uint8_t Header>
+static int run_ack(const char *name, int type)
+{
+	return run(name,
+		[](std::span<char> buf, int id) { return mqtt_encode_ack(buf, Header, id); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				uint16_t id;
+				return mqtt_decode_ack(body, &id) ? 1 + id : 0;
+			});
+		},
+		[=](std::span<char> buf, int id) { return MQTTSerialize_ack(U(buf), buf.size(), type, 0, id); },
+		[](std::span<const char> pkt) {
+			unsigned char type, dup;
+			unsigned short id;
+			return MQTTDeserialize_ack(&type, &dup, &id, U(pkt), pkt.size(), nullptr) ? 1 + id : 0;
+		});
+}
+
+int bench_codec(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	static const MqttTopicFilter filters[] = {
+		{"Channel/+/sensor/#", 1}, {"Channel/Resource/status", 0}, {"$SYS/broker/load/#", 2}
+	};
+	static const std::string_view topics[] = {filters[0].topic, filters[1].topic, filters[2].topic};
+	static const uint8_t granted[] = {1, 0, 0x80};
+	MQTTString pfilters[] = {
+		paho_string("Channel/+/sensor/#"), paho_string("Channel/Resource/status"), paho_string("$SYS/broker/load/#")
+	};
+	int pqos[] = {1, 0, 2};
+	int pgranted[] = {1, 0, 0x80};
+
+	printf("  %-18s %10s  %-13s  %s\n", "", "", "codec enc/dec", "paho API enc/dec (ns/packet)");
+	int rc = 0;
+	rc |= run_connect("CONNECT 3.1", MQTT_PROTOCOL_V31);
+	rc |= run_connect("CONNECT 3.1.1", MQTT_PROTOCOL_V311);
+	rc |= run("CONNACK",
+		[](std::span<char> buf, int id) { return mqtt_encode_connack(buf, id & 1, 0); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				bool sp;
+				uint8_t code;
+				return mqtt_decode_connack(body, &sp, &code) ? 1 + sp + code : 0;
+			});
+		},
+		[](std::span<char> buf, int id) { return MQTTSerialize_connack(U(buf), buf.size(), 0, id & 1); },
+		[](std::span<const char> pkt) {
+			unsigned char sp, code;
+			return MQTTDeserialize_connack(&sp, &code, U(pkt), pkt.size(), nullptr) ? 1 + sp + code : 0;
+		});
+	rc |= run_publish("PUBLISH qos0 64B", 0, 64);
+	rc |= run_publish("PUBLISH qos1 64B", 1, 64);
+	rc |= run_publish("PUBLISH qos2 256B", 2, 256);
+	rc |= run_ack<MQTT_PKT_PUBACK>("PUBACK", PUBACK);
+	rc |= run_ack<MQTT_PKT_PUBREC>("PUBREC", PUBREC);
+	rc |= run_ack<MQTT_PKT_PUBREL | 0x02>("PUBREL", PUBREL);
+	rc |= run_ack<MQTT_PKT_PUBCOMP>("PUBCOMP", PUBCOMP);
+	rc |= run("SUBSCRIBE 3 topics",
+		[](std::span<char> buf, int id) { return mqtt_encode_subscribe(buf, id, filters); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				uint16_t id;
+				int n = 0;
+				bool ok = mqtt_decode_subscribe(body, &id, [&](MqttTopicFilter const &f) {
+					n += f.qos + 1;
+					return true;
+				});
+				return ok ? 1 + id + n : 0;
+			});
+		},
+		[&](std::span<char> buf, int id) { return MQTTSerialize_subscribe(U(buf), buf.size(), 0, id, 3, pfilters, pqos); },
+		[](std::span<const char> pkt) {
+			unsigned char dup;
+			unsigned short id;
+			int count, qos[8];
+			MQTTString f[8];
+			return MQTTDeserialize_subscribe(&dup, &id, 8, &count, f, qos, U(pkt), pkt.size(), nullptr) ? 1 + id + count : 0;
+		});
+	rc |= run("SUBACK 3 topics",
+		[](std::span<char> buf, int id) { return mqtt_encode_suback(buf, id, granted); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				uint16_t id;
+				int n = 0;
+				bool ok = mqtt_decode_suback(body, &id, [&](uint8_t qos) {
+					n += qos;
+					return true;
+				});
+				return ok ? 1 + id + n : 0;
+			});
+		},
+		[&](std::span<char> buf, int id) { return MQTTSerialize_suback(U(buf), buf.size(), id, 3, pgranted); },
+		[](std::span<const char> pkt) {
+			unsigned short id;
+			int count, qos[8];
+			return MQTTDeserialize_suback(&id, 8, &count, qos, U(pkt), pkt.size(), nullptr) ? 1 + id + count : 0;
+		});
+	rc |= run("UNSUBSCRIBE 3",
+		[](std::span<char> buf, int id) { return mqtt_encode_unsubscribe(buf, id, topics); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				uint16_t id;
+				int n = 0;
+				bool ok = mqtt_decode_unsubscribe(body, &id, [&](std::string_view t) {
+					n += t.size();
+					return true;
+				});
+				return ok ? 1 + id + n : 0;
+			});
+		},
+		[&](std::span<char> buf, int id) { return MQTTSerialize_unsubscribe(U(buf), buf.size(), 0, id, 3, pfilters); },
+		[](std::span<const char> pkt) {
+			unsigned char dup;
+			unsigned short id;
+			int count;
+			MQTTString f[8];
+			return MQTTDeserialize_unsubscribe(&dup, &id, 8, &count, f, U(pkt), pkt.size(), nullptr) ? 1 + id + count : 0;
+		});
+	rc |= run("UNSUBACK",
+		[](std::span<char> buf, int id) { return mqtt_encode_ack(buf, MQTT_PKT_UNSUBACK, id); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t, std::span<const char> body) {
+				uint16_t id;
+				return mqtt_decode_ack(body, &id) ? 1 + id : 0;
+			});
+		},
+		[](std::span<char> buf, int id) { return MQTTSerialize_unsuback(U(buf), buf.size(), id); },
+		[](std::span<const char> pkt) {
+			unsigned short id;
+			return MQTTDeserialize_unsuback(&id, U(pkt), pkt.size(), nullptr) ? 1 + id : 0;
+		});
+	rc |= run("PINGREQ",
+		[](std::span<char> buf, int) { return mqtt_encode_empty(buf, MQTT_PKT_PINGREQ); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t header, std::span<const char>) { return (int)header; });
+		},
+		[](std::span<char> buf, int) { return MQTTSerialize_pingreq(U(buf), buf.size()); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t header, std::span<const char>) { return (int)header; });
+		});
+	rc |= run("DISCONNECT",
+		[](std::span<char> buf, int) { return mqtt_encode_empty(buf, MQTT_PKT_DISCONNECT); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t header, std::span<const char>) { return (int)header; });
+		},
+		[](std::span<char> buf, int) { return MQTTSerialize_disconnect(U(buf), buf.size()); },
+		[](std::span<const char> pkt) {
+			return decode_frame(pkt, [](uint8_t header, std::span<const char>) { return (int)header; });
+		});
+	return rc;
+}
@@ -0,0 +1,384 @@
+/*
+ * bench_decode.c - remaining length and field decoding, old unchecked
+ * reads vs. MqttCursor, and a mutation fuzzer for the inbound path
+ *
+ * 'mqttc-bench decode' times both decoders and replays the corpus in
+ * bench/corpus/decode. 'mqttc-bench decode fuzz [fuzz=N] [seed=N]
+ * [corpus=DIR]' also mutates the corpus N times through a live Mqtt;
+ * build with -fsanitize=address to have every stray read reported.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define LENGTHS (1024*1024)
+#define FRAMES 500000
+#define ROUNDS 5
+
+#define FUZZ_RUNS 100000
+#define FUZZ_MAX_INPUT 4096
+
+/*---------------------------------------
+** The decoders packet.cpp had before.
+---------------------------------------*/
+static int legacy_decode_remaining_length(char **buffer, int *count)
+{
+	int byte;
+	int val = 0, mul = 1;
+	*count = 0;
+	do {
+		byte = **buffer;
+		val += (byte & 127) * mul;
+		mul *= 128;
+		(*buffer)++;
+		(*count)++;
+	} while ((byte & 128) != 0);
+	return val;
+}
+
+static int legacy_read_int(char **pptr)
+{
+	char *ptr = *pptr;
+	int i = 256 * ((uint8_t)(*ptr)) + (uint8_t)(*(ptr + 1));
+	*pptr += 2;
+	return i;
+}
+
+/*---------------------------------------
+** Remaining length.
+---------------------------------------*/
+//small percent of one byte lengths, most of the rest two bytes, 1% bigger
+static void build_lengths(std::vector<char> *buf, uint32_t small)
+{
+	uint32_t seed = 4242;
+	for (int i = 0; i < LENGTHS; i++) {
+		uint32_t r = bench_rand(&seed);
+		int len;
+		if (r % 100 < small) {
+			len = r % 128;
+		} else if (r % 100 < 99) {
+			len = 128 + r % (16384 - 128);
+		} else {
+			len = 16384 + r % (MAX_PAYLOAD_SIZE - 16384);
+		}
+		char bytes[4];
+		int n = _encode_remaining_length(bytes, len);
+		buf->insert(buf->end(), bytes, bytes + n);
+	}
+}
+
+static long long time_lengths(std::vector<char> &buf, bool legacy, long long *sum)
+{
+	long long best = -1;
+	for (int round = 0; round < ROUNDS; round++) {
+		long long total = 0;
+		long long start = bench_nstime();
+		if (legacy) {
+			char *ptr = buf.data();
+			int count;
+			for (int i = 0; i < LENGTHS; i++) {
+				total += legacy_decode_remaining_length(&ptr, &count);
+			}
+		} else {
+			const char *ptr = buf.data();
+			const char *end = ptr + buf.size();
+			int len;
+			for (int i = 0; i < LENGTHS; i++) {
+				if (mqtt_get_remaining_length(&ptr, end, &len) <= 0) return -1;
+				total += len;
+			}
+		}
+		long long elapsed = bench_nstime() - start;
+		if (best < 0 || elapsed < best) best = elapsed;
+		*sum = total;
+	}
+	return best;
+}
+
+/*---------------------------------------
+** Whole packets: fixed header, ids, topic.
+---------------------------------------*/
+static void build_frames(std::vector<char> *stream)
+{
+	uint32_t seed = 99;
+	std::string topic = "Channel/Resource/sensor/temperature";
+	for (int i = 0; i < FRAMES; i++) {
+		uint32_t r = bench_rand(&seed);
+		char remaining_length[4];
+		if (r % 4 == 0) {
+			MqttFrame<4> ack = mqtt_ack_frame<PUBACK>(i);
+			stream->insert(stream->end(), ack.bytes, ack.bytes + ack.size());
+			continue;
+		}
+		int qos = r % 2;
+		int len = r % 300;
+		int rem = 2 + topic.size() + (qos ? 2 : 0) + len;
+		int remaining_count = _encode_remaining_length(remaining_length, rem);
+		size_t off = stream->size();
+		stream->resize(off + 1 + remaining_count + rem);
+		char *ptr = stream->data() + off;
+		_write_header(&ptr, SETQOS(PUBLISH, qos));
+		_write_remaining_length(&ptr, remaining_length, remaining_count);
+		_write_string(&ptr, topic);
+		if (qos) _write_int(&ptr, i & 0xffff);
+		memset(ptr, 'x', len);
+	}
+}
+
+static long long legacy_frames(std::vector<char> &stream, long long *sum)
+{
+	long long total = 0;
+	char *ptr = stream.data();
+	char *end = ptr + stream.size();
+	while (ptr < end) {
+		uint8_t header = *ptr++;
+		int count;
+		int len = legacy_decode_remaining_length(&ptr, &count);
+		char *body = ptr;
+		if (GETTYPE(header) == PUBLISH) {
+			int topiclen = legacy_read_int(&body);
+			total += topiclen + (uint8_t)body[0];
+			body += topiclen;
+			if (GETQOS(header)) total += legacy_read_int(&body);
+			total += ptr + len - body;
+		} else {
+			total += legacy_read_int(&body);
+		}
+		ptr += len;
+	}
+	*sum = total;
+	return 0;
+}
+
+static long long cursor_frames(std::vector<char> &stream, long long *sum)
+{
+	long long total = 0;
+	MqttCursor in(stream.data(), stream.data() + stream.size());
+	while (in.left() > 0) {
+		uint8_t header = in.read_char();
+		std::span<const char> frame = in.read_bytes(in.read_remaining_length());
+		MqttCursor body(frame.data(), frame.data() + frame.size());
+		if (GETTYPE(header) == PUBLISH) {
+			std::string_view topic = body.read_string();
+			total += topic.size() + (uint8_t)topic[0];
+			if (GETQOS(header)) total += body.read_int();
+			total += body.rest().size();
+		} else {
+			total += body.read_int();
+		}
+		if (!body.ok()) return -1;
+	}
+	if (!in.ok()) return -1;
+	*sum = total;
+	return 0;
+}
+
+static long long time_frames(std::vector<char> &stream, bool legacy, long long *sum)
+{
+	long long best = -1;
+	for (int round = 0; round < ROUNDS; round++) {
+		long long start = bench_nstime();
+		long long rc = legacy ? legacy_frames(stream, sum) : cursor_frames(stream, sum);
+		if (rc < 0) return -1;
+		long long elapsed = bench_nstime() - start;
+		if (best < 0 || elapsed < best) best = elapsed;
+	}
+	return best;
+}
+
+/*---------------------------------------
+** Fuzzing through a live Mqtt.
+---------------------------------------*/
+static long long touched;
+
+static void fuzz_on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)mqtt;
+	//read every byte, so a view past the frame shows up under ASan
+	for (char c : msg->topic) touched += c;
+	for (char c : msg->payload) touched += c;
+}
+
+static void load_corpus(const char *dir, std::vector<std::vector<char>> *corpus)
+{
+	DIR *d = opendir(dir);
+	if (!d) return;
+	struct dirent *de;
+	while ((de = readdir(d)) != nullptr) {
+		if (de->d_name[0] == '.') continue;
+		std::string path = std::string(dir) + "/" + de->d_name;
+		FILE *fp = fopen(path.c_str(), "rb");
+		if (!fp) continue;
+		std::vector<char> input;
+		char buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+			input.insert(input.end(), buf, buf + n);
+		}
+		fclose(fp);
+		if (input.size() > FUZZ_MAX_INPUT) input.resize(FUZZ_MAX_INPUT);
+		corpus->push_back(input);
+	}
+	closedir(d);
+}
+
+//feed input in pieces of random size, as a server would, then hang up
+static int fuzz_one(std::vector<char> const &input, uint32_t *seed)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->mqtt_set_msg_view_callback(fuzz_on_message);
+	mqtt->fd = sv[0];
+
+	size_t off = 0;
+	char sink[4096];
+	while (off < input.size() && mqtt->fd >= 0) {
+		size_t n = 1 + bench_rand(seed) % input.size();
+		if (n > input.size() - off) n = input.size() - off;
+		if (write(sv[1], input.data() + off, n) != (ssize_t)n) break;
+		off += n;
+		mqtt->mqtt_read(mqtt->fd, AE_READABLE);
+		while (read(sv[1], sink, sizeof(sink)) > 0) {
+			//acks sent back
+		}
+	}
+	mqtt.reset();
+	::close(sv[1]);
+	return 0;
+}
+
+static void mutate(std::vector<char> *input, std::vector<std::vector<char>> const &corpus, uint32_t *seed)
+{
+	static const uint8_t interesting[] = {0x00, 0x01, 0x7f, 0x80, 0xff, 0x02, 0x30, 0x32, 0x34};
+	int n = 1 + bench_rand(seed) % 8;
+	for (int i = 0; i < n; i++) {
+		uint32_t r = bench_rand(seed);
+		size_t at = input->empty() ? 0 : bench_rand(seed) % input->size();
+		switch (r % 7) {
+		case 0:
+			if (!input->empty()) (*input)[at] ^= 1 << (r >> 8) % 8;
+			break;
+		case 1:
+			if (!input->empty()) (*input)[at] = r >> 8;
+			break;
+		case 2:
+			if (!input->empty()) (*input)[at] = interesting[(r >> 8) % sizeof(interesting)];
+			break;
+		case 3:
+			input->insert(input->begin() + at, (char)(r >> 8));
+			break;
+		case 4:
+			if (!input->empty()) input->erase(input->begin() + at);
+			break;
+		case 5: { //truncate
+			input->resize(at);
+			break;
+		}
+		case 6: { //splice in another seed
+			std::vector<char> const &other = corpus[(r >> 8) % corpus.size()];
+			input->insert(input->begin() + at, other.begin(), other.end());
+			break;
+		}
+		}
+	}
+	if (input->size() > FUZZ_MAX_INPUT) input->resize(FUZZ_MAX_INPUT);
+}
+
+static const char *arg_value(int argc, char **argv, const char *key)
+{
+	size_t len = strlen(key);
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], key, len) && argv[i][len] == '=') return argv[i] + len + 1;
+	}
+	return nullptr;
+}
+
+static int fuzz(int argc, char **argv, bool mutating)
+{
+	const char *dir = arg_value(argc, argv, "corpus");
+	const char *runs_arg = arg_value(argc, argv, "fuzz");
+	const char *seed_arg = arg_value(argc, argv, "seed");
+	std::vector<std::vector<char>> corpus;
+	load_corpus(dir ? dir : "bench/corpus/decode", &corpus);
+	if (corpus.empty()) {
+		printf("  corpus: none found, run from the source tree or pass corpus=DIR\n");
+		return mutating ? 1 : 0;
+	}
+
+	uint32_t seed = seed_arg ? strtoul(seed_arg, nullptr, 10) : 1;
+	if (seed == 0) seed = 1;
+	uint32_t first = seed;
+	long long start = bench_nstime();
+	for (auto &input : corpus) {
+		fuzz_one(input, &seed);
+	}
+	printf("  corpus: %zu inputs replayed in %.2f ms\n", corpus.size(), (bench_nstime() - start) / 1e6);
+	if (!mutating) return 0;
+
+	long long runs = runs_arg ? atoll(runs_arg) : FUZZ_RUNS;
+	printf("  fuzz: %lld runs from seed %u\n", runs, first);
+	start = bench_nstime();
+	std::vector<char> input;
+	for (long long i = 0; i < runs; i++) {
+		input = corpus[bench_rand(&seed) % corpus.size()];
+		mutate(&input, corpus, &seed);
+		if (fuzz_one(input, &seed) < 0) {
+			printf("  fuzz: socketpair failed\n");
+			return 1;
+		}
+	}
+	long long elapsed = bench_nstime() - start;
+	printf("  fuzz: %lld runs in %.2f s, %.0f runs/s, no crash\n", runs, elapsed / 1e9, runs / (elapsed / 1e9));
+	return 0;
+}
+
+int bench_decode(int argc, char **argv)
+{
+	bool mutating = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "fuzz") || !strncmp(argv[i], "fuzz=", 5)) mutating = true;
+	}
+
+	//acks and small publishes, then a spread of sizes the predictor can't learn
+	int mixes[] = {95, 70};
+	long long legacy_sum = 0, cursor_sum = 0, legacy, cursor;
+	for (int small : mixes) {
+		std::vector<char> lengths;
+		build_lengths(&lengths, small);
+		legacy = time_lengths(lengths, true, &legacy_sum);
+		cursor = time_lengths(lengths, false, &cursor_sum);
+		if (cursor < 0 || legacy_sum != cursor_sum) {
+			printf("  remaining length: decoders disagree!\n");
+			return 1;
+		}
+		printf("  %d remaining lengths, %d%% of them one byte\n", LENGTHS, small);
+		printf("  %-18s %6.2f ns/length\n", "unchecked loop", (double)legacy / LENGTHS);
+		printf("  %-18s %6.2f ns/length\n", "checked unrolled", (double)cursor / LENGTHS);
+	}
+
+	std::vector<char> stream;
+	build_frames(&stream);
+	legacy = time_frames(stream, true, &legacy_sum);
+	cursor = time_frames(stream, false, &cursor_sum);
+	if (cursor < 0 || legacy_sum != cursor_sum) {
+		printf("  packets: decoders disagree!\n");
+		return 1;
+	}
+	printf("  %d packets, %zu bytes\n", FRAMES, stream.size());
+	printf("  %-18s %6.2f ns/packet\n", "unchecked reads", (double)legacy / FRAMES);
+	printf("  %-18s %6.2f ns/packet\n", "MqttCursor", (double)cursor / FRAMES);
+
+	return fuzz(argc, argv, mutating);
+}
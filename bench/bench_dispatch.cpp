@@ -0,0 +1,123 @@
+/*
+ * bench_dispatch.c - inbound PUBLISH to per-filter handlers, trie vs. a scan in the msg callback
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "../broker/broker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define MESSAGES 200000
+#define PAYLOAD 16
+
+struct Route {
+	std::string filter;
+	long long hits;
+};
+
+static std::vector<Route> routes;
+
+static void on_topic(Mqtt *mqtt, MqttMsgView const *msg, void *data)
+{
+	(void)mqtt;
+	(void)msg;
+	((Route *)data)->hits++;
+}
+
+/* what every subscriber does without handlers */
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	for (auto &r : routes) {
+		if (broker_topic_match(r.filter, msg->topic)) on_topic(mqtt, msg, &r);
+	}
+}
+
+/* device/<n>/<sensor>/state; half the filters exact, half '+' over the sensor */
+static void make_routes(int n)
+{
+	routes.clear();
+	for (int i = 0; i < n; i++) {
+		std::string device = "building/3/device/" + std::to_string(i / 2);
+		routes.push_back({device + ((i % 2) ? "/+/state" : "/temperature/state"), 0});
+	}
+}
+
+static void make_stream(std::vector<char> *stream, int n)
+{
+	static const char *sensors[] = {"temperature", "humidity", "power", "state"};
+	char payload[PAYLOAD];
+	memset(payload, 'x', PAYLOAD);
+	uint32_t seed = 99;
+	stream->clear();
+	for (int i = 0; i < MESSAGES; i++) {
+		uint32_t r = bench_rand(&seed);
+		std::string topic = "building/3/device/" + std::to_string(r % (n / 2 + 1)) + "/" + sensors[(r >> 16) % 4] + "/state";
+		MqttPublishFields p;
+		p.topic = topic;
+		p.payload = std::span<const char>(payload, PAYLOAD);
+		size_t off = stream->size();
+		size_t size = mqtt_packet_size(mqtt_publish_length(p));
+		stream->resize(off + size);
+		mqtt_encode_publish(std::span<char>(stream->data() + off, size), p);
+	}
+}
+
+static long long run(std::vector<char> const &stream, bool trie, long long *hits)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->fd = sv[0];
+	mqtt->mqtt_cork(true); //one write for all the SUBSCRIBEs, nobody reads them
+	for (auto &r : routes) r.hits = 0;
+	if (trie) {
+		for (auto &r : routes) mqtt->mqtt_subscribe(r.filter.c_str(), 0, on_topic, &r);
+	} else {
+		for (auto &r : routes) mqtt->mqtt_subscribe(r.filter.c_str(), 0);
+		mqtt->mqtt_set_msg_view_callback(on_message);
+	}
+	std::thread feed([&](){
+		anetWrite(sv[1], (char *)stream.data(), stream.size());
+	});
+
+	long long start = bench_nstime();
+	while (mqtt->reader.frames < MESSAGES) {
+		mqtt->mqtt_read(sv[0], 0);
+	}
+	long long elapsed = bench_nstime() - start;
+
+	feed.join();
+	close(sv[0]);
+	close(sv[1]);
+	mqtt->fd = -1;
+	*hits = 0;
+	for (auto const &r : routes) *hits += r.hits;
+	return elapsed;
+}
+
+int bench_dispatch(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int rc = 0;
+	std::vector<char> stream;
+	for (int n : {10, 100, 1000}) {
+		make_routes(n);
+		make_stream(&stream, n);
+		long long scan_hits, trie_hits;
+		long long scan = run(stream, false, &scan_hits);
+		long long trie = run(stream, true, &trie_hits);
+		printf("  %4d handlers: scan %7.1f ns/msg, trie %6.1f ns/msg, %.2f handlers/msg%s\n", n,
+			(double)scan / MESSAGES, (double)trie / MESSAGES, (double)trie_hits / MESSAGES,
+			scan_hits == trie_hits ? "" : "  MISMATCH");
+		if (scan_hits != trie_hits) rc = 1;
+	}
+	return rc;
+}
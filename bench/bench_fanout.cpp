@@ -0,0 +1,184 @@
+/*
+ * bench_fanout.c - one PUBLISH to 10k subscribers, shared encoding vs. a copy each
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "../broker/broker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define SUBSCRIBERS 10000
+#define MESSAGES 20
+#define PAYLOAD 1024
+#define FANOUT_STOP 'S' //ae reports a pipe's hangup as writable only, so say it
+
+struct FanoutResult {
+	long long received;
+	long long elapsed;
+};
+
+/* the clients run in a child: 10k connections take 20k descriptors on one host */
+struct FanoutClients {
+	aeEventLoop *el;
+	int go; //round requests from the parent, a QoS byte each, FANOUT_STOP to quit
+	int done; //FanoutResult back
+	std::vector<std::shared_ptr<Mqtt>> subs;
+	std::shared_ptr<Mqtt> pub;
+	int subacked;
+	long long received;
+	long long start;
+	MqttMsg msg;
+};
+
+static FanoutClients *clients;
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)mqtt;
+	(void)msg;
+	if (++clients->received < (long long)SUBSCRIBERS * MESSAGES) return;
+	FanoutResult r = {clients->received, bench_nstime() - clients->start};
+	anetWrite(clients->done, (char *)&r, sizeof(r));
+}
+
+static void on_go(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)clientdata;
+	(void)mask;
+	char qos;
+	if (read(fd, &qos, 1) != 1 || qos == FANOUT_STOP) {
+		aeStop(el);
+		return;
+	}
+	clients->received = 0;
+	clients->msg.qos = qos;
+	clients->start = bench_nstime();
+	for (int i = 0; i < MESSAGES; i++) clients->pub->mqtt_publish(&clients->msg);
+}
+
+static void on_pub_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)mqtt;
+	(void)data;
+	char ready = (rc == CONNACK_ACCEPT) ? 'R' : 'X';
+	anetWrite(clients->done, &ready, 1);
+	aeCreateFileEvent(clients->el, clients->go, AE_READABLE, on_go, nullptr);
+}
+
+static void on_suback(Mqtt *mqtt, void *data, int id)
+{
+	(void)mqtt;
+	(void)data;
+	(void)id;
+	if (++clients->subacked == SUBSCRIBERS) clients->pub->mqtt_connect();
+}
+
+static std::shared_ptr<Mqtt> client(int port, std::string const &clientid)
+{
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->mqtt_set_event_loop(clients->el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid(clientid);
+	mqtt->mqtt_set_keepalive(600);
+	return mqtt;
+}
+
+static void run_clients(int port, int go, int done)
+{
+	FanoutClients c;
+	clients = &c;
+	c.el = aeCreateEventLoop(SUBSCRIBERS + 1024);
+	c.go = go;
+	c.done = done;
+	c.subacked = 0;
+	c.received = 0;
+	c.msg.topic = "fan/out/data";
+	c.msg.payload.assign(PAYLOAD, 'x');
+	c.pub = client(port, "fanout-pub");
+	c.pub->mqtt_set_callback(CONNACK, on_pub_connack);
+	for (int i = 0; i < SUBSCRIBERS; i++) {
+		std::shared_ptr<Mqtt> sub = client(port, "fanout-sub" + std::to_string(i));
+		sub->mqtt_set_callback(SUBACK, on_suback);
+		sub->mqtt_set_msg_view_callback(on_message);
+		if (sub->mqtt_connect() < 0) break;
+		sub->mqtt_subscribe("fan/#", 1);
+		c.subs.push_back(sub);
+	}
+	aeMain(c.el);
+}
+
+int bench_fanout(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	Broker broker;
+	char err[ANET_ERR_LEN];
+	int port = broker.listen_tcp("127.0.0.1", 0, err);
+	if (port == ANET_ERR) {
+		printf("  can't start the broker: %s\n", err);
+		return 1;
+	}
+	int go[2], done[2];
+	if (pipe(go) != 0 || pipe(done) != 0) return 1;
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(go[1]);
+		close(done[0]);
+		run_clients(port, go[0], done[1]);
+		_exit(0);
+	}
+	close(go[0]);
+	close(done[1]);
+	broker.start();
+
+	int rc = 0;
+	char ready = 0;
+	long long start = bench_nstime();
+	if (read(done[0], &ready, 1) != 1 || ready != 'R') {
+		printf("  clients failed to connect\n");
+		rc = 1;
+	} else {
+		printf("  %d subscribers connected in %.0f ms, %d x %d byte PUBLISH per round\n",
+			SUBSCRIBERS, (bench_nstime() - start) / 1e6, MESSAGES, PAYLOAD);
+	}
+	for (int round = 0; rc == 0 && round < 4; round++) {
+		char qos = round / 2;
+		bool copy = round % 2 == 0;
+		broker.copy_fanout = copy;
+		usleep(50000); //let the last round's acks drain
+		broker.buffered_peak = (long long)broker.buffered;
+		long long peak_base = broker.buffered_peak;
+
+		struct rusage before, after;
+		getrusage(RUSAGE_SELF, &before);
+		FanoutResult r;
+		if (anetWrite(go[1], &qos, 1) != 1 || anetRead(done[0], (char *)&r, sizeof(r)) != sizeof(r)) {
+			rc = 1;
+			break;
+		}
+		getrusage(RUSAGE_SELF, &after);
+		double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e9 +
+			(after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1e3 +
+			(after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e9 +
+			(after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1e3;
+		printf("  qos%d %-7s %8lld delivered %9.0f msgs/s  broker cpu %6.0f ns/msg  peak output %7.1f MB\n",
+			qos, copy ? "copy" : "shared", r.received, r.received / (r.elapsed / 1e9), cpu / r.received,
+			(broker.buffered_peak - peak_base) / 1e6);
+	}
+	char stop = FANOUT_STOP;
+	anetWrite(go[1], &stop, 1);
+	close(go[1]);
+	waitpid(pid, nullptr, 0);
+	close(done[0]);
+	broker.stop();
+	return rc;
+}
@@ -0,0 +1,188 @@
+/*
+ * bench_flow.c - MQTT 5 Receive Maximum and Maximum Packet Size
+ */
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/reader.h"
+
+#define MESSAGES 200000
+#define WINDOW 1024
+#define BROKER_MAX_PACKET 4096
+
+struct FlowState {
+	aeEventLoop *el;
+	MqttMsg msg;
+	int sent;
+	int acked;
+	int refused; //too big for the broker
+};
+
+static void pump(Mqtt *mqtt)
+{
+	FlowState *state = (FlowState *)mqtt->userdata;
+	while (state->sent < MESSAGES && mqtt->mqtt_publish(&state->msg) >= 0) {
+		state->sent++;
+	}
+}
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	if (rc != CONNACK_ACCEPT) return;
+	FlowState *state = (FlowState *)mqtt->userdata;
+	MqttMsg big;
+	big.qos = MQTT_QOS1;
+	big.topic = state->msg.topic;
+	big.payload.assign(BROKER_MAX_PACKET, 'x');
+	if (mqtt->mqtt_publish(&big) == MQTT_ERR_PACKET_SIZE) state->refused++;
+	pump(mqtt);
+}
+
+static void on_ack(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	FlowState *state = (FlowState *)mqtt->userdata;
+	if (++state->acked == MESSAGES) {
+		aeStop(state->el);
+		return;
+	}
+	pump(mqtt);
+}
+
+static int run(FakeBroker *broker, int port, int protocol, int receive_maximum)
+{
+	FlowState state;
+	state.el = aeCreateEventLoop(64);
+	state.msg.qos = MQTT_QOS1;
+	state.msg.topic = "bench/flow";
+	state.msg.payload.assign(64, 'x');
+	state.sent = state.acked = state.refused = 0;
+	broker->receive_maximum = receive_maximum;
+	broker->max_packet_size = BROKER_MAX_PACKET;
+	broker->peak_unacked = 0;
+	broker->oversize = 0;
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->userdata = &state;
+	mqtt->mqtt_set_event_loop(state.el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid("flow");
+	mqtt->mqtt_set_protocol(protocol);
+	mqtt->mqtt_set_inflight_window(WINDOW);
+	mqtt->mqtt_set_callback(CONNACK, on_connack);
+	mqtt->mqtt_set_callback(PUBACK, on_ack);
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		return 1;
+	}
+	aeMain(state.el);
+	long long elapsed = bench_nstime() - start;
+
+	char name[48];
+	if (protocol != MQTT_PROTOCOL_V5) {
+		snprintf(name, sizeof(name), "3.1.1 window %d", WINDOW);
+	} else if (receive_maximum) {
+		snprintf(name, sizeof(name), "5, receive maximum %d", receive_maximum);
+	} else {
+		snprintf(name, sizeof(name), "5, no receive maximum");
+	}
+	long long peak = broker->peak_unacked;
+	printf("  %-24s %10.0f msgs/s  broker peak unacked %5lld  oversize refused %d, seen %lld\n",
+		name, MESSAGES / (elapsed / 1e9), peak, state.refused, (long long)broker->oversize);
+	int rc = 0;
+	if (receive_maximum && peak > receive_maximum) {
+		printf("  %-24s receive maximum overrun!\n", name);
+		rc = 1;
+	}
+	if (protocol == MQTT_PROTOCOL_V5 && (state.refused != 1 || broker->oversize != 0)) {
+		printf("  %-24s maximum packet size not honoured!\n", name);
+		rc = 1;
+	}
+	mqtt->mqtt_disconnect();
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	return rc;
+}
+
+/* inbound: 1 frame in 100 is 1MiB, read 16KiB at a time like mqtt_read */
+struct FlowTally {
+	long long frames;
+	long long bytes;
+};
+
+static void count_frame(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	(void)header;
+	(void)buffer;
+	FlowTally *t = (FlowTally *)clientdata;
+	t->frames++;
+	t->bytes += buflen;
+}
+
+static int run_reader(const char *name, std::vector<char> &stream, int maxframe)
+{
+	MqttReader reader;
+	reader.maxframe = maxframe;
+	FlowTally t = {0, 0};
+	long long start = bench_nstime();
+	for (size_t off = 0; off < stream.size(); off += 16 * 1024) {
+		size_t n = stream.size() - off < 16 * 1024 ? stream.size() - off : 16 * 1024;
+		if (reader.feed(stream.data() + off, n, count_frame, &t) != MQTT_READER_OK) {
+			printf("  %-24s malformed stream!\n", name);
+			return 1;
+		}
+	}
+	long long elapsed = bench_nstime() - start;
+	//skipped frames aren't throughput: only what reaches the application counts
+	printf("  %-24s %8.1f MB/s  frames %6lld  skipped %4lld  reassembled %4lld  %9.1f MB handed over\n",
+		name, t.bytes / (elapsed / 1e3), t.frames, reader.discarded, reader.copied, t.bytes / 1e6);
+	return 0;
+}
+
+int bench_flow(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	printf("  %d QoS1 messages of 64 bytes, in-flight window %d, broker max packet %d\n",
+		MESSAGES, WINDOW, BROKER_MAX_PACKET);
+	int rc = 0;
+	rc |= run(&broker, port, MQTT_PROTOCOL_V311, 0);
+	rc |= run(&broker, port, MQTT_PROTOCOL_V5, 0);
+	int maxes[] = {16, 64, 256};
+	for (int max : maxes) {
+		rc |= run(&broker, port, MQTT_PROTOCOL_V5, max);
+	}
+	broker.stop();
+
+	std::vector<char> stream;
+	std::vector<char> payload(1024 * 1024, 'x');
+	for (int i = 0; i < 20000; i++) {
+		MqttPublishFields p;
+		p.topic = "bench/flow";
+		p.payload = std::span<const char>(payload.data(), i % 100 == 99 ? payload.size() : 64);
+		size_t off = stream.size();
+		size_t size = mqtt_packet_size(mqtt_publish_length(p));
+		stream.resize(off + size);
+		mqtt_encode_publish(std::span<char>(stream.data() + off, size), p);
+	}
+	printf("  inbound, %.1f MB, 1 in 100 publishes 1 MiB, 16 KiB reads\n", stream.size() / 1e6);
+	rc |= run_reader("no maximum", stream, 0);
+	rc |= run_reader("max packet size 64 KiB", stream, 64 * 1024);
+	return rc;
+}
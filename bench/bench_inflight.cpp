@@ -0,0 +1,113 @@
+/*
+ * bench_inflight.c - pipelined QoS1/QoS2 publishing through the in-flight window
+ */
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define MESSAGES 200000
+
+struct InflightState {
+	aeEventLoop *el;
+	MqttMsg msg;
+	int sent;
+	int acked;
+};
+
+//publish until done or the window is full, the loop coalesces the writes
+static void pump(Mqtt *mqtt)
+{
+	InflightState *state = (InflightState *)mqtt->userdata;
+	while (state->sent < MESSAGES && mqtt->mqtt_publish(&state->msg) >= 0) {
+		state->sent++;
+	}
+}
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	if (rc == CONNACK_ACCEPT) pump(mqtt);
+}
+
+static void on_ack(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	InflightState *state = (InflightState *)mqtt->userdata;
+	if (++state->acked == MESSAGES) {
+		aeStop(state->el);
+		return;
+	}
+	pump(mqtt);
+}
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)msg;
+	InflightState *state = (InflightState *)mqtt->userdata;
+	if (state->msg.qos == MQTT_QOS0) on_ack(mqtt, nullptr, 0);
+}
+
+static int run(int port, int qos, int window)
+{
+	InflightState state;
+	state.el = aeCreateEventLoop(64);
+	state.msg.qos = qos;
+	state.msg.topic = "bench/inflight";
+	state.msg.payload.assign(64, 'x');
+	state.sent = state.acked = 0;
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->userdata = &state;
+	mqtt->mqtt_set_event_loop(state.el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid("inflight");
+	mqtt->mqtt_set_inflight_window(window);
+	mqtt->mqtt_set_callback(CONNACK, on_connack);
+	mqtt->mqtt_set_callback(PUBACK, on_ack);
+	mqtt->mqtt_set_callback(PUBCOMP, on_ack);
+	mqtt->mqtt_set_msg_view_callback(on_message);
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		return 1;
+	}
+	aeMain(state.el);
+	long long elapsed = bench_nstime() - start;
+
+	char name[32];
+	snprintf(name, sizeof(name), qos ? "qos%d window %d" : "qos0", qos, window);
+	printf("  %-18s %10.0f msgs/s  left in flight %zu\n", name, MESSAGES / (elapsed / 1e9), mqtt->inflight.size());
+	mqtt->mqtt_disconnect();
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	return 0;
+}
+
+int bench_inflight(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	printf("  %d messages of 64 bytes, completed when acked (qos0: echoed)\n", MESSAGES);
+
+	int rc = 0;
+	rc |= run(port, MQTT_QOS0, 1);
+	int windows[] = {1, 16, 64, 256, 1024};
+	for (int window : windows) {
+		rc |= run(port, MQTT_QOS1, window);
+	}
+	rc |= run(port, MQTT_QOS2, 256);
+	broker.stop();
+	return rc;
+}
@@ -0,0 +1,84 @@
+/*
+ * bench_loop.c - many Mqtt connections driven by one event loop
+ */
+#include <string.h>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define CONNECTIONS 256
+#define MESSAGES 2000
+
+struct LoopState {
+	aeEventLoop *el;
+	int connected;
+	long long received;
+	long long connected_at;
+};
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	LoopState *state = (LoopState *)mqtt->userdata;
+	if (rc != CONNACK_ACCEPT) return;
+	if (++state->connected == CONNECTIONS) state->connected_at = bench_nstime();
+
+	MqttMsg msg;
+	msg.topic = "bench/loop";
+	msg.payload.assign(64, 'x');
+	for (int i = 0; i < MESSAGES; i++) {
+		mqtt->mqtt_publish(&msg);
+	}
+}
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)msg;
+	LoopState *state = (LoopState *)mqtt->userdata;
+	if (++state->received == (long long)CONNECTIONS * MESSAGES) aeStop(state->el);
+}
+
+int bench_loop(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+
+	LoopState state = {aeCreateEventLoop(1024 * 16), 0, 0, 0};
+	std::vector<std::shared_ptr<Mqtt>> conns;
+	long long start = bench_nstime();
+	for (int i = 0; i < CONNECTIONS; i++) {
+		std::shared_ptr<Mqtt> mqtt = mqtt_new();
+		mqtt->userdata = &state;
+		mqtt->mqtt_set_event_loop(state.el);
+		mqtt->mqtt_set_server("127.0.0.1");
+		mqtt->mqtt_set_port(port);
+		mqtt->mqtt_set_clientid("bench" + std::to_string(i));
+		mqtt->mqtt_set_callback(CONNACK, on_connack);
+		mqtt->mqtt_set_msg_view_callback(on_message);
+		if (mqtt->mqtt_connect() < 0) {
+			printf("  connect failed: %s\n", mqtt->errstr);
+			break;
+		}
+		conns.push_back(mqtt);
+	}
+	aeMain(state.el);
+	long long end = bench_nstime();
+
+	printf("  %d connections on one loop (%s)\n", CONNECTIONS, aeGetApiName());
+	printf("  all connected in %.1f ms\n", (state.connected_at - start) / 1e6);
+	printf("  %lld round trips, %.0f msgs/s\n", state.received, state.received / ((end - start) / 1e9));
+
+	conns.clear();
+	aeDeleteEventLoop(state.el);
+	broker.stop();
+	return 0;
+}
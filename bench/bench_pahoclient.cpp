@@ -0,0 +1,188 @@
+/*
+ * bench_pahoclient.c - many non-blocking paho clients sharing one thread and loop
+ */
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../paho/MqttClient.h"
+
+#define CLIENTS 100
+#define MESSAGES 2000 //per client
+#define WINDOW 64
+
+struct ClientState {
+	int connacks;
+	int sent[CLIENTS];
+	int acked[CLIENTS];
+	int done;
+	long long arrived;
+	std::vector<std::unique_ptr<MqttClient>> *clients;
+};
+
+static void pump(MqttClient *client, ClientState *s, int i)
+{
+	while (s->sent[i] < MESSAGES && s->sent[i] - s->acked[i] < WINDOW) {
+		if (client->publish("bench/pahoclient", (unsigned char *)"0123456789abcdef0123456789abcdef", 32, 1) < 0)
+			return;
+		s->sent[i]++;
+	}
+}
+
+static int index_of(MqttClient *client, ClientState *s)
+{
+	for (size_t i = 0; i < s->clients->size(); i++) {
+		if ((*s->clients)[i].get() == client) return i;
+	}
+	return -1;
+}
+
+static void on_event(MqttClient *client, int type, int rc, void *clientdata)
+{
+	ClientState *s = (ClientState *)clientdata;
+	int i = index_of(client, s);
+	switch (type) {
+	case CONNACK:
+		if (rc == 0) s->connacks++;
+		break;
+	case PUBACK:
+		s->acked[i]++;
+		if (s->acked[i] == MESSAGES) s->done++;
+		pump(client, s, i);
+		break;
+	}
+}
+
+static void on_message(MqttClient *client, MQTTString *topic,
+		unsigned char *payload, int payloadlen, int qos, void *clientdata)
+{
+	(void)client;
+	(void)topic;
+	(void)payload;
+	(void)payloadlen;
+	(void)qos;
+	((ClientState *)clientdata)->arrived++;
+}
+
+static long long run_until(aeEventLoop *el, bool (*cond)(ClientState *), ClientState *s, long long ms)
+{
+	long long loops = 0;
+	long long deadline = bench_nstime() + ms * 1000000LL;
+	while (!cond(s) && bench_nstime() < deadline) {
+		aeProcessEvents(el, AE_ALL_EVENTS | AE_DONT_WAIT);
+		loops++;
+	}
+	return loops;
+}
+
+static bool all_connected(ClientState *s) { return s->connacks == CLIENTS; }
+static bool all_done(ClientState *s) { return s->done == CLIENTS; }
+
+static long long total_wakeups(std::vector<std::unique_ptr<MqttClient>> &clients)
+{
+	long long n = 0;
+	for (auto &c : clients) n += c->wakeups;
+	return n;
+}
+
+static long long total_packets(std::vector<std::unique_ptr<MqttClient>> &clients)
+{
+	long long n = 0;
+	for (auto &c : clients) n += c->packets;
+	return n;
+}
+
+/* sleep in the poll for ms, counting the loop passes that found something but the wake-up call */
+static long long idle(aeEventLoop *el, long long ms)
+{
+	long long passes = 0;
+	long long deadline = bench_nstime() + ms * 1000000LL;
+	long long id = aeCreateTimeEvent(el, ms, [](aeEventLoop *, long long, void *) { return AE_NOMORE; }, nullptr, nullptr);
+	while (bench_nstime() < deadline) {
+		if (aeProcessEvents(el, AE_ALL_EVENTS) > 0) passes++;
+	}
+	aeDeleteTimeEvent(el, id);
+	return passes - 1;
+}
+
+static int run(int port, int keepalive)
+{
+	aeEventLoop *el = aeCreateEventLoop(1024);
+	std::vector<std::unique_ptr<MqttClient>> clients;
+	ClientState s;
+	memset(&s, 0, sizeof(s));
+	s.clients = &clients;
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.keepAliveInterval = keepalive;
+	data.cleansession = 1;
+	char host[] = "127.0.0.1";
+	for (int i = 0; i < CLIENTS; i++) {
+		char id[32];
+		snprintf(id, sizeof(id), "pahoclient-%d", i);
+		data.clientID.cstring = id;
+		clients.emplace_back(new MqttClient(el));
+		clients[i]->eventproc = on_event;
+		clients[i]->msgproc = on_message;
+		clients[i]->clientdata = &s;
+		if (clients[i]->open(host, port, &data) < 0) {
+			printf("  open failed\n");
+			return 1;
+		}
+	}
+	run_until(el, all_connected, &s, 5000);
+	if (s.connacks != CLIENTS) {
+		printf("  only %d/%d clients connected\n", s.connacks, CLIENTS);
+		return 1;
+	}
+
+	int rc = 0;
+	if (keepalive == 60) {
+		long long w0 = total_wakeups(clients);
+		long long start = bench_nstime();
+		for (int i = 0; i < CLIENTS; i++) pump(clients[i].get(), &s, i);
+		run_until(el, all_done, &s, 60000);
+		long long elapsed = bench_nstime() - start;
+		long long wakeups = total_wakeups(clients) - w0;
+		printf("  %d clients, 1 thread: %10.0f msgs/s  %5.1f packets per wakeup  echoes %lld/%d\n",
+			CLIENTS, (double)CLIENTS * MESSAGES / (elapsed / 1e9),
+			(double)(total_packets(clients) - CLIENTS) / wakeups, s.arrived, CLIENTS * MESSAGES);
+		if (s.done != CLIENTS || s.arrived != CLIENTS * MESSAGES) rc = 1;
+
+		long long passes = idle(el, 1000);
+		printf("  idle 1s, keepalive 60s: %lld loop wakeups (1s SO_RCVTIMEO: %d, one per client)\n",
+			passes, CLIENTS);
+	} else {
+		long long p0 = total_packets(clients);
+		long long passes = idle(el, keepalive * 2500);
+		int connected = 0;
+		for (auto &c : clients) connected += c->getstate() == MQTT_CLIENT_CONNECTED;
+		printf("  idle %.1fs, keepalive %ds: %lld loop wakeups, %.1f PINGRESP per client, %d/%d still connected\n",
+			keepalive * 2.5, keepalive, passes, (double)(total_packets(clients) - p0) / CLIENTS,
+			connected, CLIENTS);
+		if (connected != CLIENTS) rc = 1;
+	}
+
+	for (auto &c : clients) c->disconnect();
+	for (int i = 0; i < 100; i++) aeProcessEvents(el, AE_ALL_EVENTS | AE_DONT_WAIT);
+	clients.clear();
+	aeDeleteEventLoop(el);
+	return rc;
+}
+
+int bench_pahoclient(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) return 1;
+
+	int rc = 0;
+	rc |= run(port, 60);
+	rc |= run(port, 1);
+	broker.stop();
+	return rc;
+}
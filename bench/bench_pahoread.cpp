@@ -0,0 +1,196 @@
+/*
+ * bench_pahoread.c - paho packet reads into a fixed, malloc'ed or pooled buffer
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "bench.h"
+#include "../common/codec.h"
+#include "../paho/MQTTPacket.h"
+
+#define FRAMES 100000
+#define ROUNDS 3
+#define FIXED 200 //what MqttClient::subscribe reads into
+#define RECV_MAX (16 * 1024) //the most one recv hands over
+#define MAXLEN (64 * 1024)
+
+/* the socket: recv-like partial reads out of a prepared stream */
+struct PahoStream {
+	std::vector<char> data;
+	size_t off;
+	int whole; //hand over exactly what is asked, as MQTTPacket_read needs
+	int calls;
+	int big; //packets over MAXLEN
+	long long payload; //bytes in all packets
+	long long payload_small; //in those up to MAXLEN
+};
+
+static int stream_get(unsigned char *buf, int count, void *opaque)
+{
+	PahoStream *s = (PahoStream *)opaque;
+	size_t left = s->data.size() - s->off;
+	size_t n = count;
+	if (!s->whole && n > RECV_MAX) n = RECV_MAX;
+	if (n > left) n = left;
+	if (n == 0) return -1;
+	memcpy(buf, s->data.data() + s->off, n);
+	s->off += n;
+	return n;
+}
+
+//a non-blocking socket comes up empty now and then
+static int stream_getnb(void *sck, unsigned char *buf, int count)
+{
+	PahoStream *s = (PahoStream *)sck;
+	if (++s->calls % 7 == 0) return 0;
+	return stream_get(buf, count, sck);
+}
+
+/* 90% 64 bytes, 10% up to 8KiB, 0.1% up to 1MiB */
+static void build_stream(PahoStream *s)
+{
+	uint32_t seed = 31337;
+	std::vector<char> payload(1024 * 1024, 'x');
+	s->payload = s->payload_small = 0;
+	s->big = 0;
+	for (int i = 0; i < FRAMES; i++) {
+		uint32_t r = bench_rand(&seed);
+		MqttPublishFields p;
+		size_t len = 64;
+		if (r % 1000 == 0) {
+			len = 64 * 1024 + r % (960 * 1024);
+		} else if (r % 100 < 10) {
+			len = 256 + r % 8000;
+		}
+		p.topic = "bench/pahoread";
+		p.qos = (r >> 8) & 1;
+		p.id = 1 + i % 65535;
+		p.payload = std::span<const char>(payload.data(), len);
+		size_t off = s->data.size();
+		size_t size = mqtt_packet_size(mqtt_publish_length(p.qos, p.topic.size(), len));
+		s->data.resize(off + size);
+		mqtt_encode_publish(std::span<char>(s->data.data() + off, size), p);
+		s->payload += len;
+		if (size > MAXLEN) {
+			s->big++;
+		} else {
+			s->payload_small += len;
+		}
+	}
+}
+
+struct PahoTally {
+	long long frames;
+	long long bytes;
+};
+
+static void deliver(PahoTally *t, unsigned char *buf, int len)
+{
+	unsigned char dup, retained;
+	unsigned short msgid;
+	int qos, payloadlen;
+	unsigned char *payload;
+	MQTTString topic;
+	if (MQTTDeserialize_publish(&dup, &qos, &retained, &msgid, &topic, &payload, &payloadlen, buf, len, NULL) == 1) {
+		t->frames++;
+		t->bytes += payloadlen;
+	}
+}
+
+/*
+ * mode 0: MQTTPacket_read into a fixed buffer of buflen
+ * mode 1: fixed header, then malloc/free per packet over FIXED
+ * mode 2: MQTTPacket_readbuf
+ * mode 3: MQTTPacket_readbufnb
+ * With maxlen, packets over it are expected to be skipped.
+ */
+static int run(const char *name, PahoStream *s, int mode, int buflen, int maxlen)
+{
+	long long frames = maxlen ? FRAMES - s->big : FRAMES;
+	long long payload = maxlen ? s->payload_small : s->payload;
+	std::vector<unsigned char> fixed(buflen);
+	long long best = -1;
+	PahoTally t = {0, 0};
+	long allocs0, reuses0, allocs, reuses;
+	MQTTPacketPool_stats(&allocs0, &reuses0);
+
+	for (int round = 0; round < ROUNDS; round++) {
+		t = {0, 0};
+		s->off = 0;
+		s->whole = mode == 0;
+		s->calls = 0;
+		MQTTPacketBuffer pb;
+		MQTTPacketBuffer_init(&pb, fixed.data(), buflen, maxlen);
+		MQTTTransport trp = {stream_getnb, s, 0, 0, 0, 0};
+		long long start = bench_nstime();
+		while (s->off < s->data.size()) {
+			if (mode == 0) {
+				if (MQTTPacket_read(fixed.data(), buflen, stream_get, s) != PUBLISH) break;
+				deliver(&t, fixed.data(), buflen);
+			} else if (mode == 1) {
+				unsigned char head[5];
+				int rem_len;
+				if (stream_get(head, 1, s) != 1) break;
+				int hdrlen = 1 + MQTTPacket_decode(stream_get, &rem_len, s);
+				MQTTPacket_encode(head + 1, rem_len);
+				int len = hdrlen + rem_len;
+				unsigned char *buf = len <= buflen ? fixed.data() : (unsigned char *)malloc(len);
+				memcpy(buf, head, hdrlen);
+				for (int got = hdrlen; got < len; ) {
+					got += stream_get(buf + got, len - got, s);
+				}
+				deliver(&t, buf, len);
+				if (buf != fixed.data()) free(buf);
+			} else if (mode == 2) {
+				int rc = MQTTPacket_readbuf(&pb, stream_get, s);
+				if (rc == PUBLISH) {
+					deliver(&t, pb.buf, pb.len);
+				} else if (rc != MQTTPACKET_BUFFER_TOO_SHORT) {
+					break;
+				}
+			} else {
+				int rc = MQTTPacket_readbufnb(&pb, &trp);
+				if (rc == PUBLISH) {
+					deliver(&t, pb.buf, pb.len);
+				} else if (rc != 0 && rc != MQTTPACKET_BUFFER_TOO_SHORT) {
+					break;
+				}
+			}
+		}
+		long long elapsed = bench_nstime() - start;
+		MQTTPacketBuffer_release(&pb);
+		if (best < 0 || elapsed < best) best = elapsed;
+	}
+	MQTTPacketPool_stats(&allocs, &reuses);
+	if (t.frames < frames) {
+		printf("  %-28s gave up after %lld of %lld packets\n", name, t.frames, frames);
+	} else {
+		printf("  %-28s %7.1f ns/packet  pool allocs %ld, reuses %ld\n", name,
+			(double)best / FRAMES, allocs - allocs0, reuses - reuses0);
+	}
+	if (mode > 0 && (t.frames != frames || t.bytes != payload)) {
+		printf("  %-28s lost packets!\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+int bench_pahoread(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	PahoStream s;
+	build_stream(&s);
+	printf("  %d publishes, %.1f MB: 90%% 64B, 10%% to 8KiB, 0.1%% to 1MiB\n", FRAMES, s.data.size() / 1e6);
+
+	int rc = 0;
+	rc |= run("read, 200B buffer", &s, 0, FIXED, 0);
+	rc |= run("read, 1MiB buffer", &s, 0, 1024 * 1024 + 64, 0);
+	rc |= run("malloc over 200B", &s, 1, FIXED, 0);
+	rc |= run("readbuf, 200B + pool", &s, 2, FIXED, 0);
+	rc |= run("readbufnb, 200B + pool", &s, 3, FIXED, 0);
+	rc |= run("readbuf, 64KiB max", &s, 2, FIXED, MAXLEN);
+	rc |= run("readbufnb, 64KiB max", &s, 3, FIXED, MAXLEN);
+	return rc;
+}
@@ -0,0 +1,172 @@
+/*
+ * bench_persist.c - QoS1 publishing with the session log, and recovery time
+ */
+#include <unistd.h>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/persist.h"
+
+#define MESSAGES 50000
+#define WINDOW 256
+#define RECOVER_LIVE 60000
+
+#define LOG_PATH "/tmp/mqttc-bench-persist.log"
+
+struct PersistState {
+	aeEventLoop *el;
+	MqttMsg msg;
+	int sent;
+	int acked;
+};
+
+static void pump(Mqtt *mqtt)
+{
+	PersistState *state = (PersistState *)mqtt->userdata;
+	while (state->sent < MESSAGES && mqtt->mqtt_publish(&state->msg) >= 0) {
+		state->sent++;
+	}
+}
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	if (rc == CONNACK_ACCEPT) pump(mqtt);
+}
+
+static void on_puback(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	PersistState *state = (PersistState *)mqtt->userdata;
+	if (++state->acked == MESSAGES) {
+		aeStop(state->el);
+		return;
+	}
+	pump(mqtt);
+}
+
+/* mode 0: no log, 1: log without fsync, 2: log with fsync */
+static int run(int port, int mode)
+{
+	static const char *names[] = {"off", "log, no fsync", "log, fsync"};
+	PersistState state;
+	state.el = aeCreateEventLoop(64);
+	state.msg.qos = MQTT_QOS1;
+	state.msg.topic = "bench/persist";
+	state.msg.payload.assign(64, 'x');
+	state.sent = state.acked = 0;
+
+	std::shared_ptr<MqttPersist> persist;
+	if (mode > 0) {
+		unlink(LOG_PATH);
+		persist = std::make_shared<MqttPersist>();
+		if (persist->open(LOG_PATH, MQTT_PERSIST_SEGMENT, mode == 2) != MQTT_OK) {
+			printf("  %s\n", persist->errstr);
+			return 1;
+		}
+	}
+
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->userdata = &state;
+	mqtt->mqtt_set_event_loop(state.el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid("persist");
+	mqtt->mqtt_set_cleansess(false);
+	mqtt->mqtt_set_inflight_window(WINDOW);
+	mqtt->mqtt_set_persist(persist);
+	mqtt->mqtt_set_callback(CONNACK, on_connack);
+	mqtt->mqtt_set_callback(PUBACK, on_puback);
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		return 1;
+	}
+	aeMain(state.el);
+	long long elapsed = bench_nstime() - start;
+
+	printf("  %-14s %10.0f msgs/s", names[mode], MESSAGES / (elapsed / 1e9));
+	if (persist) {
+		printf("  %6.4f syncs/msg  %lld compactions", (double)persist->syncs / MESSAGES, persist->compactions);
+	}
+	printf("\n");
+	mqtt->mqtt_disconnect();
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	unlink(LOG_PATH);
+	return 0;
+}
+
+/*
+ * A log left with RECOVER_LIVE unacknowledged messages among as many
+ * acked ones. Without fsync there is no checkpoint and every record is
+ * checksummed again, with it only the headers are walked.
+ */
+static int recover(bool fsync)
+{
+	MqttMsg msg;
+	msg.qos = MQTT_QOS1;
+	msg.topic = "bench/persist";
+	msg.payload.assign(64, 'x');
+
+	unlink(LOG_PATH);
+	MqttPersist log;
+	if (log.open(LOG_PATH, 64 * 1024 * 1024, fsync) != MQTT_OK) {
+		printf("  %s\n", log.errstr);
+		return 1;
+	}
+	for (int i = 0; i < 2 * RECOVER_LIVE; i++) {
+		msg.id = i % MQTT_INFLIGHT_MAX + 1;
+		log.log_publish(&msg);
+		if (i < RECOVER_LIVE) log.log_release(msg.id);
+	}
+	size_t size = log.size();
+	log.close();
+
+	long long start = bench_nstime();
+	std::shared_ptr<MqttPersist> persist = std::make_shared<MqttPersist>();
+	if (persist->open(LOG_PATH, 64 * 1024 * 1024, fsync) != MQTT_OK) {
+		printf("  %s\n", persist->errstr);
+		return 1;
+	}
+	long long replayed = bench_nstime();
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->mqtt_set_cleansess(false);
+	mqtt->mqtt_set_persist(persist);
+	long long restored = bench_nstime();
+
+	printf("  recover %zu KiB log, %-10s replay %.2f ms, restore %zu in flight %.2f ms\n", size / 1024,
+		fsync ? "checkpoint" : "no fsync", (replayed - start) / 1e6, mqtt->inflight.size(), (restored - replayed) / 1e6);
+	int rc = (mqtt->inflight.size() == RECOVER_LIVE) ? 0 : 1;
+	mqtt.reset();
+	persist.reset();
+	unlink(LOG_PATH);
+	return rc;
+}
+
+int bench_persist(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	printf("  %d QoS1 messages of 64 bytes, window %d\n", MESSAGES, WINDOW);
+
+	int rc = 0;
+	for (int mode = 0; mode < 3; mode++) {
+		rc |= run(port, mode);
+	}
+	broker.stop();
+	rc |= recover(false);
+	rc |= recover(true);
+	return rc;
+}
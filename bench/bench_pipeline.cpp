@@ -0,0 +1,497 @@
+/*
+ * bench_pipeline.c - time to first delivery with a pipelined connect, over a slow link
+ *
+ * The link is a proxy thread that holds every chunk for the one-way
+ * delay in each direction, and holds the client's first bytes back for
+ * the round trip a TCP handshake would have taken. A kernel on both ends
+ * that does TCP Fast Open skips that round trip; the proxy can only
+ * pretend, so the fast open row says what it would save while the client
+ * still asks for it on the real socket. 'mqttc-bench pipeline netem'
+ * talks to the broker directly instead, for a loopback slowed down with
+ * 'tc qdisc add dev lo root netem delay 20ms'.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define DELAY_MS 20 //one way
+#define ROUNDS 5
+#define EARLY_QOS1 8
+
+class DelayProxy;
+
+/* one direction of the proxied connection */
+struct DelayLeg {
+	int from = -1;
+	int to = -1;
+	long long hold = 0; //nothing leaves the sender before this
+	bool eof = false;
+	std::deque<std::pair<long long, std::vector<char>>> chunks; //due, bytes
+	MqttTimer timer;
+	DelayProxy *proxy = nullptr;
+};
+
+class DelayProxy {
+public:
+	int start(int port, int delay); //returns the proxy's port
+	void stop();
+
+	std::atomic<bool> handshake{true}; //charge a round trip before the first bytes
+	std::atomic<bool> stopping{false};
+
+	aeEventLoop *el = nullptr;
+	int listenfd = -1;
+	int port = 0;
+	int delay = 0;
+	DelayLeg up;   //client to broker
+	DelayLeg down; //broker to client
+private:
+	std::thread thread;
+};
+
+static void leg_send(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+
+static void proxy_close(DelayProxy *p)
+{
+	DelayLeg *legs[2] = {&p->up, &p->down};
+	for (DelayLeg *leg : legs) {
+		if (leg->from < 0) continue;
+		aeDeleteFileEvent(p->el, leg->from, AE_READABLE);
+		p->el->timers->cancel(&leg->timer);
+		leg->chunks.clear();
+	}
+	if (p->up.from >= 0) close(p->up.from);
+	if (p->down.from >= 0) close(p->down.from);
+	p->up = DelayLeg();
+	p->down = DelayLeg();
+}
+
+//the sender hung up: pass it on once everything before it has been delivered
+static void leg_eof(DelayLeg *leg)
+{
+	DelayProxy *p = leg->proxy;
+	shutdown(leg->to, SHUT_WR);
+	if (p->up.eof && p->down.eof) proxy_close(p);
+}
+
+static void leg_send(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	(void)timer;
+	DelayLeg *leg = (DelayLeg *)clientdata;
+	long long now = MqttTimerWheel::now();
+	while (!leg->chunks.empty() && leg->chunks.front().first <= now) {
+		std::vector<char> &data = leg->chunks.front().second;
+		anetWrite(leg->to, data.data(), data.size());
+		leg->chunks.pop_front();
+	}
+	if (!leg->chunks.empty()) {
+		wheel->add_at(&leg->timer, leg->chunks.front().first, leg_send, leg);
+	} else if (leg->eof) {
+		leg_eof(leg);
+	}
+}
+
+static void leg_read(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)mask;
+	DelayLeg *leg = (DelayLeg *)clientdata;
+	DelayProxy *p = leg->proxy;
+	char buffer[16 * 1024];
+	ssize_t n = read(fd, buffer, sizeof(buffer));
+	if (n < 0 && errno == EAGAIN) return;
+	if (n <= 0) {
+		aeDeleteFileEvent(el, fd, AE_READABLE);
+		leg->eof = true;
+		if (leg->chunks.empty()) leg_eof(leg);
+		return;
+	}
+	long long now = MqttTimerWheel::now();
+	long long due = (now > leg->hold ? now : leg->hold) + p->delay;
+	leg->chunks.emplace_back(due, std::vector<char>(buffer, buffer + n));
+	if (!leg->timer.pending()) el->timers->add_at(&leg->timer, due, leg_send, leg);
+}
+
+static void proxy_accept(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)mask;
+	DelayProxy *p = (DelayProxy *)clientdata;
+	int cfd = anetTcpAccept(nullptr, fd, nullptr, nullptr);
+	if (cfd < 0) return;
+	proxy_close(p); //one connection at a time, a new one replaces the last
+	char addr[] = "127.0.0.1";
+	int bfd = anetTcpConnect(nullptr, addr, p->port);
+	if (bfd < 0) {
+		close(cfd);
+		return;
+	}
+	anetTcpNoDelay(nullptr, cfd);
+	anetTcpNoDelay(nullptr, bfd);
+	p->up.from = p->down.to = cfd;
+	p->up.to = p->down.from = bfd;
+	p->up.proxy = p->down.proxy = p;
+	//SYN, SYN-ACK, and only then the ACK carrying the first bytes
+	p->up.hold = p->handshake ? MqttTimerWheel::now() + 2 * p->delay : 0;
+	aeCreateFileEvent(el, cfd, AE_READABLE, leg_read, &p->up);
+	aeCreateFileEvent(el, bfd, AE_READABLE, leg_read, &p->down);
+}
+
+static int proxy_stop_check(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)id;
+	DelayProxy *p = (DelayProxy *)clientdata;
+	if (p->stopping) aeStop(el);
+	return 50;
+}
+
+int DelayProxy::start(int port, int delay)
+{
+	char err[ANET_ERR_LEN];
+	char bindaddr[] = "127.0.0.1";
+	listenfd = anetTcpServer(err, 0, bindaddr);
+	if (listenfd < 0) return -1;
+	anetNonBlock(nullptr, listenfd);
+
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	getsockname(listenfd, (struct sockaddr *)&sa, &salen);
+
+	this->port = port;
+	this->delay = delay;
+	el = aeCreateEventLoop(64);
+	aeCreateFileEvent(el, listenfd, AE_READABLE, proxy_accept, this);
+	aeCreateTimeEvent(el, 50, proxy_stop_check, this, nullptr);
+	thread = std::thread([this](){
+		aeMain(el);
+	});
+	return ntohs(sa.sin_port);
+}
+
+void DelayProxy::stop()
+{
+	stopping = true;
+	thread.join();
+	proxy_close(this);
+	aeDeleteFileEvent(el, listenfd, AE_READABLE);
+	close(listenfd);
+	aeDeleteEventLoop(el);
+}
+
+enum {
+	WAIT_SUBACK,  //CONNACK, then SUBSCRIBE, SUBACK, then PUBLISH
+	WAIT_CONNACK, //CONNACK, then SUBSCRIBE and PUBLISH together
+	PIPELINED,    //all three in the first flight
+	FASTOPEN      //the same, riding in the SYN
+};
+
+static const char *mode_names[] = {
+	"wait CONNACK and SUBACK",
+	"wait CONNACK",
+	"pipelined",
+	"pipelined, fast open",
+};
+
+#define TOPIC "bench/pipeline"
+
+struct TripState {
+	aeEventLoop *el;
+	int mode;
+	long long delivered; //ns, 0 until the echo is back
+	int echoes;
+	int dups;
+	int pubacks;
+	int expected_pubacks;
+	int rollbacks;
+	uint8_t rolled_back[8];
+	bool disconnected;
+};
+
+static void trip_publish(Mqtt *mqtt, int qos)
+{
+	char const *m = "first";
+	MqttMsg msg;
+	mqtt_msg_new(&msg, 0, qos, false, false, TOPIC, m, strlen(m));
+	mqtt->mqtt_publish(&msg);
+}
+
+static int trip_stop(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)id;
+	(void)clientdata;
+	aeStop(el);
+	return AE_NOMORE;
+}
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	TripState *state = (TripState *)mqtt->userdata;
+	if (rc != CONNACK_ACCEPT) return;
+	if (state->mode == WAIT_SUBACK || state->mode == WAIT_CONNACK) {
+		mqtt->mqtt_subscribe(TOPIC, 0);
+	}
+	if (state->mode == WAIT_CONNACK) trip_publish(mqtt, 0);
+}
+
+static void on_suback(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	TripState *state = (TripState *)mqtt->userdata;
+	if (state->mode == WAIT_SUBACK) trip_publish(mqtt, 0);
+}
+
+static void on_puback(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	TripState *state = (TripState *)mqtt->userdata;
+	//give duplicates the time to show up
+	if (++state->pubacks == state->expected_pubacks) {
+		aeCreateTimeEvent(state->el, 4 * DELAY_MS, trip_stop, nullptr, nullptr);
+	}
+}
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	TripState *state = (TripState *)mqtt->userdata;
+	if (state->delivered == 0) state->delivered = bench_nstime();
+	state->echoes++;
+	if (msg->dup) state->dups++;
+	if (state->expected_pubacks == 0 && state->el) aeStop(state->el);
+}
+
+static void on_connect(Mqtt *mqtt, void *data, int connstate)
+{
+	(void)data;
+	TripState *state = (TripState *)mqtt->userdata;
+	if (connstate != MQTT_STATE_DISCONNECTED) return;
+	state->disconnected = true;
+	if (state->el) aeStop(state->el);
+}
+
+static void on_rollback(Mqtt *mqtt, uint8_t type, MqttMsg *msg)
+{
+	(void)msg;
+	TripState *state = (TripState *)mqtt->userdata;
+	if (state->rollbacks < (int)sizeof(state->rolled_back)) {
+		state->rolled_back[state->rollbacks] = type;
+	}
+	state->rollbacks++;
+}
+
+static std::shared_ptr<Mqtt> trip_client(TripState *state, int port)
+{
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->userdata = state;
+	mqtt->mqtt_set_event_loop(state->el);
+	mqtt->mqtt_set_server("127.0.0.1");
+	mqtt->mqtt_set_port(port);
+	mqtt->mqtt_set_clientid("pipeline");
+	mqtt->mqtt_set_callback(CONNECT, on_connect);
+	mqtt->mqtt_set_callback(CONNACK, on_connack);
+	mqtt->mqtt_set_callback(SUBACK, on_suback);
+	mqtt->mqtt_set_callback(PUBACK, on_puback);
+	mqtt->mqtt_set_msg_view_callback(on_message);
+	mqtt->mqtt_set_rollback_callback(on_rollback);
+	return mqtt;
+}
+
+//ms from mqtt_connect to the echo of the first publish
+static double trip(int port, int mode)
+{
+	TripState state = {};
+	state.el = aeCreateEventLoop(64);
+	state.mode = mode;
+	std::shared_ptr<Mqtt> mqtt = trip_client(&state, port);
+	mqtt->mqtt_set_pipelined(mode >= PIPELINED);
+	mqtt->mqtt_set_fastopen(mode == FASTOPEN);
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		aeDeleteEventLoop(state.el);
+		return -1;
+	}
+	if (mode >= PIPELINED) {
+		mqtt->mqtt_subscribe(TOPIC, 0);
+		trip_publish(mqtt.get(), 0);
+	}
+	aeMain(state.el);
+	mqtt->mqtt_disconnect();
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	return state.delivered ? (state.delivered - start) / 1e6 : -1;
+}
+
+//without a loop, pipelined corks CONNECT until the first read
+static double trip_blocking(int port)
+{
+	TripState state = {};
+	state.mode = PIPELINED;
+	std::shared_ptr<Mqtt> mqtt = trip_client(&state, port);
+	mqtt->mqtt_set_event_loop(nullptr);
+	mqtt->mqtt_set_pipelined(true);
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		return -1;
+	}
+	mqtt->mqtt_subscribe(TOPIC, 0);
+	trip_publish(mqtt.get(), 0);
+	while (state.delivered == 0 && mqtt->fd >= 0) {
+		mqtt->mqtt_read(mqtt->fd, 0);
+	}
+	mqtt->mqtt_disconnect();
+	return state.delivered ? (state.delivered - start) / 1e6 : -1;
+}
+
+static int by_value(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int first_delivery(const char *name, int port, int mode, double rtt)
+{
+	double ms[ROUNDS];
+	for (int i = 0; i < ROUNDS; i++) {
+		ms[i] = (mode < 0) ? trip_blocking(port) : trip(port, mode);
+		if (ms[i] < 0) {
+			printf("  %-26s FAILED\n", name);
+			return 1;
+		}
+	}
+	qsort(ms, ROUNDS, sizeof(double), by_value);
+	if (rtt > 0) {
+		printf("  %-26s first delivery %7.1f ms  (%.1f round trips)\n", name, ms[ROUNDS / 2],
+			ms[ROUNDS / 2] / rtt);
+	} else {
+		printf("  %-26s first delivery %7.1f ms\n", name, ms[ROUNDS / 2]);
+	}
+	return 0;
+}
+
+//QoS 1 publishes sent before CONNACK must not be resent when it arrives
+static int early_qos1(int port)
+{
+	TripState state = {};
+	state.el = aeCreateEventLoop(64);
+	state.mode = PIPELINED;
+	state.expected_pubacks = EARLY_QOS1;
+	std::shared_ptr<Mqtt> mqtt = trip_client(&state, port);
+	mqtt->mqtt_set_pipelined(true);
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		aeDeleteEventLoop(state.el);
+		return 1;
+	}
+	for (int i = 0; i < EARLY_QOS1; i++) trip_publish(mqtt.get(), 1);
+	aeMain(state.el);
+	mqtt->mqtt_disconnect();
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	bool ok = state.pubacks == EARLY_QOS1 && state.echoes == EARLY_QOS1 && state.dups == 0;
+	printf("  %-26s %d QoS1 sent, %d acked, %d delivered, %d resent %s\n", "early QoS1, accepted",
+		EARLY_QOS1, state.pubacks, state.echoes, state.dups, ok ? "" : "WRONG");
+	return ok ? 0 : 1;
+}
+
+//a refused CONNECT hands back everything pipelined behind it
+static int refused(FakeBroker *broker, int port)
+{
+	TripState state = {};
+	state.el = aeCreateEventLoop(64);
+	state.mode = PIPELINED;
+	std::shared_ptr<Mqtt> mqtt = trip_client(&state, port);
+	mqtt->mqtt_set_pipelined(true);
+	broker->connack_rc = CONNACK_CREDENTIALS;
+	long long dropped = broker->dropped;
+
+	long long start = bench_nstime();
+	if (mqtt->mqtt_connect() < 0) {
+		printf("  connect failed: %s\n", mqtt->errstr);
+		aeDeleteEventLoop(state.el);
+		return 1;
+	}
+	mqtt->mqtt_subscribe(TOPIC, 1);
+	trip_publish(mqtt.get(), 0);
+	trip_publish(mqtt.get(), 1);
+	trip_publish(mqtt.get(), 2);
+	aeMain(state.el);
+	double ms = (bench_nstime() - start) / 1e6;
+	broker->connack_rc = 0;
+	usleep(10000); //the broker's count lands after it read them
+
+	static const uint8_t order[] = {SUBSCRIBE, PUBLISH, PUBLISH, PUBLISH};
+	bool ok = state.disconnected && mqtt->error == ECONNREFUSED && mqtt->inflight.size() == 0
+		&& state.rollbacks == 4 && memcmp(state.rolled_back, order, sizeof(order)) == 0
+		&& state.echoes == 0 && broker->dropped - dropped == 4;
+	printf("  %-26s %d rolled back, %lld dropped by the broker, %zu in flight, in %.1f ms: %s %s\n",
+		"refused, pipelined", state.rollbacks, (long long)broker->dropped - dropped,
+		mqtt->inflight.size(), ms, mqtt->errstr, ok ? "" : "WRONG");
+	mqtt.reset();
+	aeDeleteEventLoop(state.el);
+	return ok ? 0 : 1;
+}
+
+static bool has_arg(int argc, char **argv, const char *arg)
+{
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], arg) == 0) return true;
+	}
+	return false;
+}
+
+int bench_pipeline(int argc, char **argv)
+{
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	bool netem = has_arg(argc, argv, "netem");
+	DelayProxy proxy;
+	int link = port;
+	double rtt = 0;
+	if (!netem) {
+		link = proxy.start(port, DELAY_MS);
+		if (link < 0) {
+			printf("  can't start the proxy\n");
+			broker.stop();
+			return 1;
+		}
+		rtt = 2 * DELAY_MS;
+		printf("  %d ms each way through a delay proxy, %.0f ms round trip, handshake included\n",
+			DELAY_MS, rtt);
+	} else {
+		printf("  straight to the broker, latency is whatever lo's qdisc adds\n");
+	}
+
+	int rc = 0;
+	for (int mode = WAIT_SUBACK; mode <= FASTOPEN; mode++) {
+		if (mode == FASTOPEN && !netem) proxy.handshake = false;
+		rc |= first_delivery(mode_names[mode], link, mode, rtt);
+		proxy.handshake = true;
+	}
+	rc |= first_delivery("pipelined, blocking", link, -1, rtt);
+	rc |= early_qos1(link);
+	rc |= refused(&broker, link);
+
+	if (!netem) proxy.stop();
+	broker.stop();
+	return rc;
+}
@@ -0,0 +1,153 @@
+/*
+ * bench_qos2.c - inbound QoS2 exactly-once bookkeeping
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+
+#define MESSAGES 500000
+
+struct Qos2Tally {
+	long long delivered;
+	long long released;
+};
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)msg;
+	((Qos2Tally *)mqtt->userdata)->delivered++;
+}
+
+static void on_pubrel(Mqtt *mqtt, void *data, int id)
+{
+	(void)data;
+	(void)id;
+	((Qos2Tally *)mqtt->userdata)->released++;
+}
+
+static void put_publish(std::vector<char> *stream, int qos, bool dup, int id)
+{
+	char buffer[64];
+	char *ptr = buffer;
+	std::string topic = "bench/qos2";
+	int len = 2 + topic.size() + 2 + 16;
+	char remaining_length[4];
+	int remaining_count = _encode_remaining_length(remaining_length, len);
+	_write_header(&ptr, SETDUP(SETQOS(PUBLISH, qos), dup));
+	_write_remaining_length(&ptr, remaining_length, remaining_count);
+	_write_string(&ptr, topic);
+	_write_int(&ptr, id);
+	memset(ptr, 'x', 16);
+	ptr += 16;
+	stream->insert(stream->end(), buffer, ptr);
+}
+
+static void put_pubrel(std::vector<char> *stream, int id)
+{
+	char buffer[4] = {(char)SETQOS(PUBREL, 1), 2, (char)MSB(id), (char)LSB(id)};
+	stream->insert(stream->end(), buffer, buffer + 4);
+}
+
+/*
+ * mode 0: QoS1
+ * mode 1: QoS2, PUBLISH then PUBREL
+ * mode 2: QoS2, every PUBLISH resent with DUP before its PUBREL
+ */
+static double run(int mode, Qos2Tally *tally)
+{
+	std::vector<char> stream;
+	for (int i = 0; i < MESSAGES; i++) {
+		int id = 1 + i % 65535;
+		put_publish(&stream, mode ? MQTT_QOS2 : MQTT_QOS1, false, id);
+		if (mode == 2) put_publish(&stream, MQTT_QOS2, true, id);
+		if (mode) put_pubrel(&stream, id);
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+	std::thread feed([&](){
+		anetWrite(sv[1], stream.data(), stream.size());
+	});
+	std::thread drain([&](){
+		std::vector<char> buf(1024 * 1024);
+		while (read(sv[1], buf.data(), buf.size()) > 0) {
+		}
+	});
+
+	*tally = {0, 0};
+	std::shared_ptr<Mqtt> mqtt = mqtt_new();
+	mqtt->fd = sv[0];
+	mqtt->userdata = tally;
+	mqtt->mqtt_set_msg_view_callback(on_message);
+	mqtt->mqtt_set_callback(PUBREL, on_pubrel);
+	mqtt->mqtt_cork(true); //acks go out in big writes, like they would under load
+
+	long long start = bench_nstime();
+	while ((mode ? tally->released : tally->delivered) < MESSAGES) {
+		mqtt->mqtt_read(sv[0], 0);
+	}
+	long long elapsed = bench_nstime() - start;
+	mqtt->mqtt_cork(false);
+
+	feed.join();
+	shutdown(sv[0], SHUT_WR);
+	drain.join();
+	close(sv[0]);
+	close(sv[1]);
+	mqtt->fd = -1;
+	return (double)elapsed / MESSAGES;
+}
+
+static void run_sets()
+{
+	std::vector<uint16_t> ids(1 << 20);
+	uint32_t seed = 99;
+	for (auto &id : ids) {
+		id = 1 + bench_rand(&seed) % 65535;
+	}
+
+	MqttPacketIdSet bits;
+	long long dups = 0;
+	long long start = bench_nstime();
+	for (size_t i = 0; i < ids.size(); i++) {
+		dups += bits.insert(ids[i]);
+		if (i >= 64) bits.erase(ids[i - 64]); //64 unreleased at a time
+	}
+	double bitset_ns = (double)(bench_nstime() - start) / ids.size();
+
+	std::unordered_set<uint16_t> set;
+	long long dups2 = 0;
+	start = bench_nstime();
+	for (size_t i = 0; i < ids.size(); i++) {
+		dups2 += !set.insert(ids[i]).second;
+		if (i >= 64) set.erase(ids[i - 64]);
+	}
+	double set_ns = (double)(bench_nstime() - start) / ids.size();
+
+	printf("  id set insert+erase: bitset %.1f ns, unordered_set %.1f ns (dups %lld/%lld)\n",
+		bitset_ns, set_ns, dups, dups2);
+}
+
+int bench_qos2(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	run_sets();
+
+	Qos2Tally tally;
+	double qos1 = run(0, &tally);
+	printf("  %-24s %6.1f ns/msg  delivered %lld\n", "qos1", qos1, tally.delivered);
+	double qos2 = run(1, &tally);
+	printf("  %-24s %6.1f ns/msg  delivered %lld\n", "qos2 + pubrel", qos2, tally.delivered);
+	double qos2dup = run(2, &tally);
+	printf("  %-24s %6.1f ns/msg  delivered %lld\n", "qos2 + dup + pubrel", qos2dup, tally.delivered);
+	return tally.delivered == MESSAGES ? 0 : 1;
+}
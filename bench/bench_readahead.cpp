@@ -0,0 +1,129 @@
+/*
+ * bench_readahead.c - recv calls per packet for paho reads, direct vs. read-ahead
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "../common/codec.h"
+#include "../mqttc/anet.h"
+#include "../paho/MQTTPacket.h"
+
+#define FIXED 256
+
+struct CountedSocket {
+	int fd;
+	long recvs;
+};
+
+static int counted_recv(void *sck, unsigned char *buf, int count)
+{
+	CountedSocket *s = (CountedSocket *)sck;
+	s->recvs++;
+	return recv(s->fd, buf, count, 0);
+}
+
+//what MqttClient::transport_getdata used to do: every call a recv
+static int direct_getdata(unsigned char *buf, int count, void *opaque)
+{
+	return counted_recv(opaque, buf, count);
+}
+
+static void build_stream(std::vector<char> *stream, int packets, int minlen, int maxlen)
+{
+	uint32_t seed = 2024;
+	std::vector<char> payload(maxlen, 'x');
+	for (int i = 0; i < packets; i++) {
+		MqttPublishFields p;
+		p.topic = "bench/readahead";
+		p.qos = 1;
+		p.id = 1 + i % 65535;
+		size_t len = minlen + (maxlen > minlen ? bench_rand(&seed) % (maxlen - minlen) : 0);
+		p.payload = std::span<const char>(payload.data(), len);
+		size_t off = stream->size();
+		size_t size = mqtt_packet_size(mqtt_publish_length(p.qos, p.topic.size(), len));
+		stream->resize(off + size);
+		mqtt_encode_publish(std::span<char>(stream->data() + off, size), p);
+	}
+}
+
+/*
+ * rasize 0: recv straight from MQTTPacket_readbuf
+ * otherwise through a read-ahead of rasize bytes, nb with MQTTPacket_readbufnb
+ */
+static int run(const char *name, std::vector<char> const &stream, int packets, int rasize, bool nb)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 1;
+	std::thread feed([&](){
+		anetWrite(sv[1], (char *)stream.data(), stream.size());
+	});
+
+	CountedSocket sock = {sv[0], 0};
+	std::vector<unsigned char> rabuf(rasize > 0 ? rasize : 1);
+	MQTTReadAhead ra;
+	MQTTReadAhead_init(&ra, rabuf.data(), rasize, counted_recv, &sock);
+	MQTTTransport trp = {MQTTReadAhead_getdatanb, &ra, 0, 0, 0, 0};
+	unsigned char fixed[FIXED];
+	MQTTPacketBuffer pb;
+	MQTTPacketBuffer_init(&pb, fixed, sizeof(fixed), 0);
+
+	int got = 0;
+	long long start = bench_nstime();
+	while (got < packets) {
+		int rc;
+		if (rasize == 0) {
+			rc = MQTTPacket_readbuf(&pb, direct_getdata, &sock);
+		} else if (nb) {
+			rc = MQTTPacket_readbufnb(&pb, &trp);
+			if (rc == 0) continue;
+		} else {
+			rc = MQTTPacket_readbuf(&pb, MQTTReadAhead_getdata, &ra);
+		}
+		if (rc != PUBLISH) break;
+		got++;
+	}
+	long long elapsed = bench_nstime() - start;
+	MQTTPacketBuffer_release(&pb);
+	feed.join();
+	close(sv[0]);
+	close(sv[1]);
+
+	if (got != packets) {
+		printf("  %-26s lost packets: %d/%d\n", name, got, packets);
+		return 1;
+	}
+	printf("  %-26s %6.2f recv/packet  %7.1f ns/packet\n", name,
+		(double)sock.recvs / packets, (double)elapsed / packets);
+	return 0;
+}
+
+static int run_all(std::vector<char> const &stream, int packets)
+{
+	int rc = 0;
+	rc |= run("recv per getfn call", stream, packets, 0, false);
+	rc |= run("read-ahead 4KiB", stream, packets, 4096, false);
+	rc |= run("read-ahead 4KiB, nb", stream, packets, 4096, true);
+	rc |= run("read-ahead 64KiB", stream, packets, 64 * 1024, false);
+	return rc;
+}
+
+int bench_readahead(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int rc = 0;
+	std::vector<char> small;
+	build_stream(&small, 200000, 64, 64);
+	printf("  200000 QoS1 publishes, 64 byte payloads\n");
+	rc |= run_all(small, 200000);
+
+	std::vector<char> mixed;
+	build_stream(&mixed, 20000, 512, 8192);
+	printf("  20000 QoS1 publishes, 512B to 8KiB payloads\n");
+	rc |= run_all(mixed, 20000);
+	return rc;
+}
@@ -0,0 +1,123 @@
+/*
+ * bench_reader.c - feed MqttReader randomly fragmented and coalesced streams
+ */
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/reader.h"
+
+#define FRAMES 200000
+#define ROUNDS 5
+
+struct Tally {
+	long long frames;
+	long long bytes;
+};
+
+static void count_frame(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	Tally *t = (Tally *)clientdata;
+	(void)header;
+	(void)buffer;
+	t->frames++;
+	t->bytes += buflen;
+}
+
+static void build_stream(std::vector<char> *stream, long long *body_bytes)
+{
+	uint32_t seed = 12345;
+	std::string topic = "Channel/Resource/sensor/temperature";
+	std::vector<char> payload(128 * 1024, 'x');
+
+	*body_bytes = 0;
+	for (int i = 0; i < FRAMES; i++) {
+		uint32_t r = bench_rand(&seed);
+		int len;
+		if (r % 1000 == 0) {
+			len = 20000 + r % (100 * 1024); //the odd big message
+		} else {
+			len = r % 512;
+		}
+		int qos = r % 2;
+		int rem = 2 + topic.size() + (qos ? 2 : 0) + len;
+		char remaining_length[4];
+		int remaining_count = _encode_remaining_length(remaining_length, rem);
+
+		size_t off = stream->size();
+		stream->resize(off + 1 + remaining_count + rem);
+		char *ptr = stream->data() + off;
+		_write_header(&ptr, SETQOS(PUBLISH, qos));
+		_write_remaining_length(&ptr, remaining_length, remaining_count);
+		_write_string(&ptr, topic);
+		if (qos) _write_int(&ptr, i & 0xffff);
+		memcpy(ptr, payload.data(), len);
+		*body_bytes += rem;
+	}
+}
+
+/*
+ * mode 0: one frame per feed (the old best case)
+ * mode 1: random 1..4096 byte fragments
+ * mode 2: 64KiB coalesced reads
+ */
+static int run(const char *name, std::vector<char> &stream, int mode, long long body_bytes)
+{
+	long long best = -1;
+	Tally t = {0, 0};
+	MqttReader reader;
+
+	for (int round = 0; round < ROUNDS; round++) {
+		uint32_t seed = 777;
+		t = {0, 0};
+		reader = MqttReader();
+		char *ptr = stream.data();
+		char *end = ptr + stream.size();
+		long long start = bench_nstime();
+		while (ptr < end) {
+			int n;
+			if (mode == 0) {
+				int hdrlen;
+				n = _mqtt_frame_length(ptr, end - ptr, &hdrlen);
+			} else if (mode == 1) {
+				n = 1 + bench_rand(&seed) % 4096;
+			} else {
+				n = 64 * 1024;
+			}
+			if (n > end - ptr) n = end - ptr;
+			if (reader.feed(ptr, n, count_frame, &t) != MQTT_READER_OK) {
+				printf("  %-12s malformed stream!\n", name);
+				return 1;
+			}
+			ptr += n;
+		}
+		long long elapsed = bench_nstime() - start;
+		if (best < 0 || elapsed < best) best = elapsed;
+	}
+	if (t.frames != FRAMES || t.bytes != body_bytes) {
+		printf("  %-12s lost frames: %lld/%d\n", name, t.frames, FRAMES);
+		return 1;
+	}
+	double sec = best / 1e9;
+	printf("  %-12s %10.0f frames/s %8.1f MB/s  copied %5.2f%%\n", name,
+		FRAMES / sec, stream.size() / sec / 1e6, 100.0 * reader.copied / reader.frames);
+	return 0;
+}
+
+int bench_reader(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	std::vector<char> stream;
+	long long body_bytes;
+	build_stream(&stream, &body_bytes);
+	printf("  %d frames, %zu bytes\n", FRAMES, stream.size());
+
+	int rc = 0;
+	rc |= run("aligned", stream, 0, body_bytes);
+	rc |= run("fragmented", stream, 1, body_bytes);
+	rc |= run("coalesced", stream, 2, body_bytes);
+	return rc;
+}
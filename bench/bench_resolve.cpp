@@ -0,0 +1,200 @@
+/*
+ * bench_resolve.c - connect storms through the shared DNS cache, and happy eyeballs
+ */
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/mqtt.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/resolve.h"
+
+#define CONNECTIONS 200
+#define DNS_LATENCY_US 5000 //a nearby recursive resolver
+
+struct StormState {
+	aeEventLoop *el;
+	int connacks;
+	int expected;
+};
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	StormState *state = (StormState *)mqtt->userdata;
+	if (rc == CONNACK_ACCEPT && ++state->connacks == state->expected) aeStop(state->el);
+}
+
+static void add_addr(MqttAddrList *addrs, const char *ip)
+{
+	MqttAddr a = {};
+	a.sin.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &a.sin.sin_addr);
+	a.len = sizeof(a.sin);
+	addrs->push_back(a);
+}
+
+/*
+ * broker.bench is the broker, dead.bench lists an address that never
+ * answers first and refused.bench one that refuses, both before it.
+ */
+static int bench_lookup(const char *host, MqttAddrList *addrs)
+{
+	usleep(DNS_LATENCY_US);
+	if (strcmp(host, "dead.bench") == 0) {
+		add_addr(addrs, "127.0.0.2");
+	} else if (strcmp(host, "refused.bench") == 0) {
+		add_addr(addrs, "127.0.0.3");
+	} else if (strcmp(host, "broker.bench") != 0) {
+		return EAI_NONAME;
+	}
+	add_addr(addrs, "127.0.0.1");
+	return 0;
+}
+
+/*
+ * mode 0: resolve on the loop thread before every connect, as mqtt_connect
+ * used to; mode 1: through the resolver
+ */
+static int storm(const char *name, int port, int mode, int clients)
+{
+	MqttResolver &resolver = MqttResolver::shared();
+	StormState state = {aeCreateEventLoop(1024 * 16), 0, clients};
+	std::vector<std::shared_ptr<Mqtt>> conns;
+	long long lookups = resolver.lookups;
+
+	long long start = bench_nstime();
+	for (int i = 0; i < clients; i++) {
+		std::shared_ptr<Mqtt> mqtt = mqtt_new();
+		mqtt->userdata = &state;
+		mqtt->mqtt_set_event_loop(state.el);
+		if (mode == 0) {
+			MqttAddrList addrs;
+			bench_lookup("broker.bench", &addrs);
+			lookups--; //not the resolver's
+			char ip[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &addrs[0].sin.sin_addr, ip, sizeof(ip));
+			mqtt->mqtt_set_server(ip);
+		} else {
+			mqtt->mqtt_set_server("broker.bench");
+		}
+		mqtt->mqtt_set_port(port);
+		mqtt->mqtt_set_clientid("storm" + std::to_string(i));
+		mqtt->mqtt_set_callback(CONNACK, on_connack);
+		if (mqtt->mqtt_connect() < 0) {
+			printf("  connect failed: %s\n", mqtt->errstr);
+			return 1;
+		}
+		conns.push_back(mqtt);
+	}
+	long long issued = bench_nstime();
+	aeMain(state.el);
+	long long end = bench_nstime();
+
+	printf("  %-22s loop busy issuing %7.1f ms  all CONNACKed %7.1f ms  getaddrinfo %lld\n", name,
+		(issued - start) / 1e6, (end - start) / 1e6,
+		mode == 0 ? (long long)clients : (long long)resolver.lookups - lookups);
+	for (auto &mqtt : conns) mqtt->mqtt_disconnect();
+	conns.clear();
+	aeDeleteEventLoop(state.el);
+	return state.connacks == clients ? 0 : 1;
+}
+
+/* a listener whose accept queue is full: SYNs to it are dropped */
+static int blackhole(int port, std::vector<int> *fds)
+{
+	char err[ANET_ERR_LEN];
+	char addr[] = "127.0.0.2";
+	int fd = anetTcpServer(err, port, addr);
+	if (fd < 0) return -1;
+	listen(fd, 0);
+	fds->push_back(fd);
+	for (int i = 0; i < 4; i++) {
+		struct sockaddr_in sa = {};
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+		inet_pton(AF_INET, addr, &sa.sin_addr);
+		int s = anetTcpNonBlockConnectAddr(err, (struct sockaddr *)&sa, sizeof(sa));
+		if (s >= 0) fds->push_back(s);
+	}
+	usleep(10000);
+	return 0;
+}
+
+static int eyeballs(const char *host, int port, bool loop)
+{
+	long long start = bench_nstime();
+	int connected;
+	if (loop) {
+		StormState state = {aeCreateEventLoop(64), 0, 1};
+		std::shared_ptr<Mqtt> mqtt = mqtt_new();
+		mqtt->userdata = &state;
+		mqtt->mqtt_set_event_loop(state.el);
+		mqtt->mqtt_set_server(host);
+		mqtt->mqtt_set_port(port);
+		mqtt->mqtt_set_clientid("eyeballs");
+		mqtt->mqtt_set_callback(CONNACK, on_connack);
+		if (mqtt->mqtt_connect() < 0) {
+			printf("  connect failed: %s\n", mqtt->errstr);
+			return 1;
+		}
+		aeMain(state.el);
+		connected = state.connacks;
+		mqtt->mqtt_disconnect();
+		mqtt.reset();
+		aeDeleteEventLoop(state.el);
+	} else {
+		char err[ANET_ERR_LEN];
+		int fd = MqttConnector::connect(host, port, MQTT_CONNECT_ATTEMPT_DELAY, err);
+		connected = fd >= 0;
+		if (fd >= 0) close(fd);
+	}
+	printf("  %-14s %-8s %s in %6.1f ms\n", host, loop ? "loop" : "blocking",
+		connected ? "connected" : "FAILED", (bench_nstime() - start) / 1e6);
+	return connected ? 0 : 1;
+}
+
+int bench_resolve(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	MqttResolver &resolver = MqttResolver::shared();
+	resolver.set_lookup(bench_lookup);
+	resolver.flush();
+
+	int rc = 0;
+	printf("  %d connections, %d us per DNS lookup\n", CONNECTIONS, DNS_LATENCY_US);
+	rc |= storm("lookup per connect", port, 0, CONNECTIONS);
+	rc |= storm("resolver, cold cache", port, 1, CONNECTIONS);
+	rc |= storm("resolver, warm cache", port, 1, CONNECTIONS);
+	printf("  resolver: %lld hits, %lld misses, %lld lookups shared\n",
+		(long long)resolver.hits, (long long)resolver.misses, (long long)resolver.coalesced);
+
+	//the first address of each name is bad, the second is the broker
+	std::vector<int> holes;
+	if (blackhole(port, &holes) == 0) {
+		rc |= eyeballs("dead.bench", port, true);
+		rc |= eyeballs("dead.bench", port, false);
+	}
+	rc |= eyeballs("refused.bench", port, true);
+	rc |= eyeballs("refused.bench", port, false);
+	for (int fd : holes) close(fd);
+
+	resolver.set_lookup(nullptr);
+	resolver.flush();
+	broker.stop();
+	return rc;
+}
@@ -0,0 +1,158 @@
+/*
+ * bench_retain.c - retained store at 2M topics: wildcard lookups vs. a scan, snapshot save and reload
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "../broker/broker.h"
+#include "../common/retain.h"
+
+#define RETAINED 2000000
+#define LOOKUPS 100000
+#define SCANNED 5 //filters checked against the linear scan, it's slow
+#define SNAPSHOT_PATH "/tmp/mqttc-bench-retain.snap"
+
+static const char *metrics[] = {"temperature", "humidity", "pressure", "power", "state", "battery", "rssi", "co2"};
+
+/* site/<n>/line/<n>/cell/<n>/device/<n>/<metric>, every i a topic of its own */
+static std::string topic(uint32_t i)
+{
+	return "site/" + std::to_string(i / 200000) + "/line/" + std::to_string(i / 8000 % 25) +
+		"/cell/" + std::to_string(i / 800 % 10) + "/device/" + std::to_string(i / 8 % 100) +
+		"/" + metrics[i % 8];
+}
+
+static std::string payload(uint32_t i, uint32_t *seed)
+{
+	char buf[64];
+	int n = snprintf(buf, sizeof(buf), "{\"v\":%u,\"seq\":%u}", bench_rand(seed) % 100000, i);
+	return std::string(buf, n);
+}
+
+struct Found {
+	long long count = 0;
+	long long bytes = 0;
+};
+
+static Found lookup(MqttRetainStore const &store, std::string_view filter)
+{
+	Found f;
+	store.match(filter, [&](MqttRetained const &msg) {
+		f.count++;
+		f.bytes += msg.payload.size();
+	});
+	return f;
+}
+
+static int compare(MqttRetainStore const &store, std::vector<std::string> const &all, const char *filter)
+{
+	long long start = bench_nstime();
+	Found f = lookup(store, filter);
+	long long indexed = bench_nstime() - start;
+	start = bench_nstime();
+	long long scanned = 0;
+	for (auto const &t : all) scanned += broker_topic_match(filter, t);
+	long long scan = bench_nstime() - start;
+	printf("  %-46s %7lld found %10.1f us   scan %8.1f ms\n", filter, f.count, indexed / 1e3, scan / 1e6);
+	return f.count == scanned ? 0 : 1;
+}
+
+int bench_retain(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int rc = 0;
+	uint32_t seed = 4242;
+	std::vector<std::string> topics;
+	std::vector<std::string> payloads;
+	topics.reserve(RETAINED);
+	payloads.reserve(RETAINED);
+	for (uint32_t i = 0; i < RETAINED; i++) {
+		topics.push_back(topic(i));
+		payloads.push_back(payload(i, &seed));
+	}
+
+	MqttRetainStore store;
+	long long start = bench_nstime();
+	for (uint32_t i = 0; i < RETAINED; i++) store.set(topics[i], payloads[i], i % 2);
+	long long elapsed = bench_nstime() - start;
+	printf("  %d retained, %zu nodes, %.0f MB: %.0f sets/s\n", RETAINED, store.nodes(),
+		store.memory() / 1e6, RETAINED / (elapsed / 1e9));
+
+	start = bench_nstime();
+	MqttRetained msg;
+	long long hits = 0;
+	for (uint32_t i = 0; i < LOOKUPS; i++) {
+		uint32_t at = bench_rand(&seed) % RETAINED;
+		hits += store.get(topics[at], &msg) && msg.payload == payloads[at];
+	}
+	elapsed = bench_nstime() - start;
+	printf("  exact get %10.0f lookups/s\n", LOOKUPS / (elapsed / 1e9));
+	if (hits != LOOKUPS) rc = 1;
+
+	/* the same size, rewritten in place */
+	start = bench_nstime();
+	for (uint32_t i = 0; i < RETAINED; i += 2) {
+		std::string &p = payloads[i];
+		p[p.size() - 2] = '0' + (i / 2) % 10;
+		store.set(topics[i], p, 1);
+	}
+	elapsed = bench_nstime() - start;
+	printf("  update    %10.0f sets/s, arena %.0f MB\n", RETAINED / 2 / (elapsed / 1e9), store.memory() / 1e6);
+
+	const char *filters[SCANNED] = {
+		"site/3/#",
+		"site/3/line/7/#",
+		"site/+/line/7/cell/3/device/42/temperature",
+		"site/1/line/+/cell/+/device/7/+",
+		"#",
+	};
+	for (const char *f : filters) rc |= compare(store, topics, f);
+
+	unlink(SNAPSHOT_PATH);
+	start = bench_nstime();
+	if (store.save(SNAPSHOT_PATH) != 0) {
+		printf("  %s\n", store.errstr);
+		return 1;
+	}
+	elapsed = bench_nstime() - start;
+	struct stat st;
+	stat(SNAPSHOT_PATH, &st);
+	printf("  snapshot saved in %.0f ms, %.0f MB\n", elapsed / 1e6, st.st_size / 1e6);
+
+	MqttRetainStore reloaded;
+	start = bench_nstime();
+	if (reloaded.load(SNAPSHOT_PATH) != 0) {
+		printf("  %s\n", reloaded.errstr);
+		return 1;
+	}
+	elapsed = bench_nstime() - start;
+	Found before = lookup(store, "#");
+	Found after = lookup(reloaded, "#");
+	printf("  reloaded %zu retained in %.0f ms\n", reloaded.size(), elapsed / 1e6);
+	if (after.count != before.count || after.bytes != before.bytes || reloaded.size() != RETAINED) rc = 1;
+
+	/* what replaying them would cost instead */
+	MqttRetainStore replayed;
+	start = bench_nstime();
+	reloaded.match("#", [&](MqttRetained const &m) {
+		replayed.set(m.topic, m.payload, m.qos);
+	});
+	elapsed = bench_nstime() - start;
+	printf("  replaying them instead %.0f ms\n", elapsed / 1e6);
+
+	/* half go away: pruned, and the arenas compact behind them */
+	start = bench_nstime();
+	for (uint32_t i = 0; i < RETAINED; i += 2) reloaded.set(topics[i], "", 0);
+	elapsed = bench_nstime() - start;
+	printf("  removed half %10.0f removes/s, %zu left, %zu nodes, %.0f MB\n",
+		RETAINED / 2 / (elapsed / 1e9), reloaded.size(), reloaded.nodes(), reloaded.memory() / 1e6);
+	if (reloaded.size() != RETAINED / 2 || lookup(reloaded, "#").count != RETAINED / 2) rc = 1;
+	unlink(SNAPSHOT_PATH);
+	if (rc) printf("  retained lookups disagree!\n");
+	return rc;
+}
@@ -0,0 +1,95 @@
+/*
+ * bench_shard.c - one application thread publishing through a shard pool
+ */
+#include <unistd.h>
+#include <vector>
+
+#include "bench.h"
+#include "fakebroker.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/shard.h"
+
+#define CONNECTIONS 64
+#define MESSAGES 5000
+
+struct ShardState {
+	std::atomic<int> connected{0};
+	std::atomic<long long> received{0};
+};
+
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	ShardState *state = (ShardState *)mqtt->userdata;
+	if (rc == CONNACK_ACCEPT) state->connected++;
+}
+
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
+{
+	(void)msg;
+	ShardState *state = (ShardState *)mqtt->userdata;
+	state->received.fetch_add(1, std::memory_order_relaxed);
+}
+
+static int run(int nshards, int port)
+{
+	ShardState state;
+	MqttShardPool pool;
+	if (pool.start(nshards) != MQTT_OK) {
+		printf("  can't start %d shards\n", nshards);
+		return 1;
+	}
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < CONNECTIONS; i++) {
+		std::shared_ptr<Mqtt> mqtt = mqtt_new();
+		mqtt->userdata = &state;
+		mqtt->mqtt_set_server("127.0.0.1");
+		mqtt->mqtt_set_port(port);
+		mqtt->mqtt_set_clientid("shard" + std::to_string(i));
+		mqtt->mqtt_set_callback(CONNACK, on_connack);
+		mqtt->mqtt_set_msg_view_callback(on_message);
+		ids.push_back(mqtt->clientid);
+		pool.mqtt_add(mqtt);
+	}
+	while (state.connected < CONNECTIONS) usleep(1000);
+
+	long long total = (long long)CONNECTIONS * MESSAGES;
+	long long start = bench_nstime();
+	for (int i = 0; i < MESSAGES; i++) {
+		for (auto &id : ids) {
+			MqttMsg msg;
+			msg.topic = "bench/shard";
+			msg.payload.assign(64, 'x');
+			pool.mqtt_publish(id, std::move(msg));
+		}
+	}
+	long long posted = bench_nstime();
+	while (state.received.load(std::memory_order_relaxed) < total) usleep(100);
+	long long end = bench_nstime();
+
+	printf("  %d shard%s  post %5.0f ns/msg  %9.0f round trips/s\n", nshards, nshards > 1 ? "s" : " ",
+		(double)(posted - start) / total, total / ((end - start) / 1e9));
+	pool.stop();
+	return 0;
+}
+
+int bench_shard(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	FakeBroker broker;
+	int port = broker.start();
+	if (port < 0) {
+		printf("  can't start the broker\n");
+		return 1;
+	}
+	printf("  %d connections, %d QoS0 messages each, one publishing thread\n", CONNECTIONS, MESSAGES);
+
+	int rc = 0;
+	for (int n = 1; n <= 4; n *= 2) {
+		rc |= run(n, port);
+	}
+	broker.stop();
+	return rc;
+}
@@ -0,0 +1,145 @@
+/*
+ * bench_timer.c - timing wheel vs. an ordered map of deadlines
+ */
+#include <map>
+#include <vector>
+
+#include "bench.h"
+#include "../mqttc/timer.h"
+
+#define ROUNDS 3
+
+struct WheelConn {
+	MqttTimer timer;
+	long long *fired;
+};
+
+struct MapConn {
+	std::multimap<long long, MapConn *>::iterator it;
+	bool armed;
+};
+
+static void wheel_fire(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	(void)wheel;
+	(void)timer;
+	WheelConn *conn = (WheelConn *)clientdata;
+	(*conn->fired)++;
+}
+
+struct Result {
+	double arm, rearm, cancel, fire; //ns per timer
+	long long fired;
+};
+
+static Result run_wheel(int n)
+{
+	Result best = {1e18, 1e18, 1e18, 1e18, 0};
+	for (int round = 0; round < ROUNDS; round++) {
+		uint32_t seed = 42;
+		long long fired = 0;
+		MqttTimerWheel wheel;
+		std::vector<WheelConn> conns(n);
+		long long t0 = MqttTimerWheel::now();
+
+		long long start = bench_nstime();
+		for (auto &c : conns) {
+			c.fired = &fired;
+			wheel.add_at(&c.timer, t0 + bench_rand(&seed) % 120000, wheel_fire, &c);
+		}
+		long long armed = bench_nstime();
+		for (auto &c : conns) {
+			wheel.add_at(&c.timer, t0 + bench_rand(&seed) % 120000, wheel_fire, &c);
+		}
+		long long rearmed = bench_nstime();
+		for (auto &c : conns) {
+			wheel.cancel(&c.timer);
+		}
+		long long cancelled = bench_nstime();
+
+		for (auto &c : conns) {
+			wheel.add_at(&c.timer, t0 + bench_rand(&seed) % 10000, wheel_fire, &c);
+		}
+		long long firestart = bench_nstime();
+		for (long long ms = 0; ms <= 10000; ms++) {
+			wheel.advance(t0 + ms);
+		}
+		long long end = bench_nstime();
+
+		best.arm = std::min(best.arm, (double)(armed - start) / n);
+		best.rearm = std::min(best.rearm, (double)(rearmed - armed) / n);
+		best.cancel = std::min(best.cancel, (double)(cancelled - rearmed) / n);
+		best.fire = std::min(best.fire, (double)(end - firestart) / n);
+		best.fired = fired;
+	}
+	return best;
+}
+
+static Result run_map(int n)
+{
+	Result best = {1e18, 1e18, 1e18, 1e18, 0};
+	for (int round = 0; round < ROUNDS; round++) {
+		uint32_t seed = 42;
+		long long fired = 0;
+		std::multimap<long long, MapConn *> timers;
+		std::vector<MapConn> conns(n);
+
+		long long start = bench_nstime();
+		for (auto &c : conns) {
+			c.it = timers.emplace(bench_rand(&seed) % 120000, &c);
+		}
+		long long armed = bench_nstime();
+		for (auto &c : conns) {
+			timers.erase(c.it);
+			c.it = timers.emplace(bench_rand(&seed) % 120000, &c);
+		}
+		long long rearmed = bench_nstime();
+		for (auto &c : conns) {
+			timers.erase(c.it);
+		}
+		long long cancelled = bench_nstime();
+
+		for (auto &c : conns) {
+			c.it = timers.emplace(bench_rand(&seed) % 10000, &c);
+		}
+		long long firestart = bench_nstime();
+		for (long long ms = 0; ms <= 10000; ms++) {
+			while (!timers.empty() && timers.begin()->first <= ms) {
+				timers.erase(timers.begin());
+				fired++;
+			}
+		}
+		long long end = bench_nstime();
+
+		best.arm = std::min(best.arm, (double)(armed - start) / n);
+		best.rearm = std::min(best.rearm, (double)(rearmed - armed) / n);
+		best.cancel = std::min(best.cancel, (double)(cancelled - rearmed) / n);
+		best.fire = std::min(best.fire, (double)(end - firestart) / n);
+		best.fired = fired;
+	}
+	return best;
+}
+
+static int report(const char *name, int n, Result r)
+{
+	printf("  %-6s %7d  arm %6.1f  rearm %6.1f  cancel %6.1f  fire %6.1f ns/timer\n",
+		name, n, r.arm, r.rearm, r.cancel, r.fire);
+	if (r.fired != n) {
+		printf("  %-6s fired %lld of %d!\n", name, r.fired, n);
+		return 1;
+	}
+	return 0;
+}
+
+int bench_timer(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	int rc = 0;
+	printf("  deadlines up to 120s, fire pass advances 10s of 1ms ticks\n");
+	for (int n = 10000; n <= 1000000; n *= 10) {
+		rc |= report("wheel", n, run_wheel(n));
+		rc |= report("map", n, run_map(n));
+	}
+	return rc;
+}
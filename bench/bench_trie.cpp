@@ -0,0 +1,145 @@
+/*
+ * bench_trie.c - MqttTopicTrie at 1M subscriptions, vs. scanning every filter
+ */
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "../broker/broker.h"
+#include "../common/topictrie.h"
+
+#define SUBSCRIPTIONS 1000000
+#define TOPICS 1000000
+#define SCANNED 20 //topics checked against the linear scan, it's slow
+#define READERS 4
+#define CHURN 200000
+
+typedef MqttTopicTrie<uint32_t, uint8_t> Trie;
+
+static const char *metrics[] = {"temperature", "humidity", "pressure", "power", "state", "battery", "rssi", "co2"};
+
+/* site/<n>/line/<n>/cell/<n>/device/<n>/<metric>, 9 levels like a plant's telemetry */
+static std::string topic(uint32_t *seed)
+{
+	uint32_t r = bench_rand(seed);
+	uint32_t q = bench_rand(seed);
+	return "site/" + std::to_string(r % 50) + "/line/" + std::to_string((r >> 8) % 20) +
+		"/cell/" + std::to_string((r >> 16) % 10) + "/device/" + std::to_string(q % 100) +
+		"/" + metrics[(q >> 8) % 8];
+}
+
+/* mostly exact, 8% with a '+' level, 2% a whole device or cell with '#' */
+static std::string filter(uint32_t *seed)
+{
+	std::string t = topic(seed);
+	uint32_t r = bench_rand(seed) % 100;
+	if (r >= 10) return t;
+	std::vector<std::string> levels;
+	size_t pos = 0;
+	for (;;) {
+		size_t end = t.find('/', pos);
+		levels.push_back(t.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+		if (end == std::string::npos) break;
+		pos = end + 1;
+	}
+	uint32_t at = bench_rand(seed) % levels.size();
+	if (r < 8) {
+		levels[at] = "+";
+	} else {
+		at = 6 + at % 3;
+		levels.resize(at + 1);
+		levels[at] = "#";
+	}
+	std::string f = levels[0];
+	for (size_t i = 1; i < levels.size(); i++) f += "/" + levels[i];
+	return f;
+}
+
+int bench_trie(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	uint32_t seed = 2024;
+	std::vector<std::string> filters(SUBSCRIPTIONS);
+	for (auto &f : filters) f = filter(&seed);
+	std::vector<std::string> topics(TOPICS);
+	for (auto &t : topics) t = topic(&seed);
+
+	Trie trie;
+	long long start = bench_nstime();
+	for (uint32_t i = 0; i < SUBSCRIPTIONS; i++) trie.subscribe(filters[i], i, 0);
+	long long elapsed = bench_nstime() - start;
+	printf("  %zu subscriptions in %.0f ms, %.0f subscribe/s\n", trie.size(), elapsed / 1e6,
+		SUBSCRIPTIONS / (elapsed / 1e9));
+	printf("  %zu nodes, %.1f MB, %.0f bytes/subscription\n", trie.nodes(), trie.memory() / 1e6,
+		(double)trie.memory() / trie.size());
+
+	long long matched = 0;
+	start = bench_nstime();
+	for (auto const &t : topics) {
+		trie.match(t, [&](uint32_t, uint8_t) { matched++; });
+	}
+	elapsed = bench_nstime() - start;
+	printf("  trie   %8.0f ns/match, %.1f subscribers/topic\n", (double)elapsed / TOPICS, (double)matched / TOPICS);
+
+	int rc = 0;
+	long long scanned = 0;
+	start = bench_nstime();
+	for (int i = 0; i < SCANNED; i++) {
+		long long n = 0, m = 0;
+		for (auto const &f : filters) n += broker_topic_match(f, topics[i]);
+		trie.match(topics[i], [&](uint32_t, uint8_t) { m++; });
+		if (n != m) {
+			printf("  %s: %lld filters match, the trie found %lld\n", topics[i].c_str(), n, m);
+			rc = 1;
+		}
+		scanned += n;
+	}
+	elapsed = bench_nstime() - start;
+	printf("  scan   %8.0f ns/match\n", (double)elapsed / SCANNED);
+
+	/* readers matching flat out while the writer churns; one filter is never touched */
+	trie.subscribe("site/0/line/0/#", SUBSCRIPTIONS, 1);
+	std::atomic<bool> done{false};
+	std::atomic<long long> reads{0}, misses{0};
+	std::vector<std::thread> readers;
+	for (int r = 0; r < READERS; r++) {
+		readers.emplace_back([&, r]() {
+			Trie::Reader reader(trie);
+			long long n = 0, missed = 0;
+			size_t i = r * 7919;
+			while (!done.load(std::memory_order_relaxed)) {
+				bool seen = false;
+				reader.match(topics[i++ % TOPICS], [&](uint32_t, uint8_t) {});
+				reader.match("site/0/line/0/cell/1/device/2/rssi", [&](uint32_t key, uint8_t) {
+					seen |= key == SUBSCRIPTIONS;
+				});
+				missed += !seen;
+				n += 2;
+			}
+			reads += n;
+			misses += missed;
+		});
+	}
+	start = bench_nstime();
+	for (uint32_t i = 0; i < CHURN; i++) {
+		uint32_t k = bench_rand(&seed) % SUBSCRIPTIONS;
+		trie.unsubscribe(filters[k], k);
+		trie.subscribe(filters[k], k, 0);
+	}
+	elapsed = bench_nstime() - start;
+	done = true;
+	for (auto &t : readers) t.join();
+	printf("  churn  %d readers: %.0f matches/s, writer %.0f unsubscribe+subscribe/s, %lld missed\n",
+		READERS, reads / (elapsed / 1e9), CHURN / (elapsed / 1e9), (long long)misses);
+	if (misses) rc = 1;
+
+	start = bench_nstime();
+	trie.unsubscribe("site/0/line/0/#", SUBSCRIPTIONS);
+	for (uint32_t i = 0; i < SUBSCRIPTIONS; i++) trie.unsubscribe(filters[i], i);
+	elapsed = bench_nstime() - start;
+	printf("  all unsubscribed in %.0f ms, %zu nodes left\n", elapsed / 1e6, trie.nodes());
+	if (trie.size() != 0 || trie.nodes() != 1) rc = 1;
+	return rc;
+}
@@ -0,0 +1,260 @@
+/*
+ * fakebroker.c - just enough of a broker to benchmark mqttc against
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "fakebroker.h"
+#include "../mqttc/anet.h"
+#include "../mqttc/packet.h"
+#include "../mqttc/reader.h"
+
+struct FakeConn {
+	int fd;
+	aeEventLoop *el;
+	FakeBroker *broker;
+	int version = MQTT_PROTOCOL_V311;
+	MqttReader reader;
+	std::vector<char> out;
+
+	/* publishes not acked before the current read ends, on any
+	 * connection; MQTT 5 with a receive maximum also holds the acks
+	 * back until then */
+	bool holdacks = false;
+	std::vector<char> acks;
+	int unacked = 0;
+	int releasing = 0;
+
+	/* CONNECT refused: the rest is dropped, hang up once CONNACK is out */
+	bool refused = false;
+};
+
+static void conn_close(FakeConn *c)
+{
+	aeDeleteFileEvent(c->el, c->fd, AE_READABLE | AE_WRITABLE);
+	close(c->fd);
+	delete c;
+}
+
+static void conn_write_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)mask;
+	FakeConn *c = (FakeConn *)clientdata;
+	ssize_t n = write(fd, c->out.data(), c->out.size());
+	if (n < 0) {
+		if (errno != EAGAIN) conn_close(c);
+		return;
+	}
+	c->out.erase(c->out.begin(), c->out.begin() + n);
+	if (c->out.empty()) {
+		if (c->refused) {
+			conn_close(c);
+			return;
+		}
+		aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	}
+}
+
+static void conn_send(FakeConn *c, const char *buf, int len)
+{
+	if (c->out.empty()) aeCreateFileEvent(c->el, c->fd, AE_WRITABLE, conn_write_proc, c);
+	c->out.insert(c->out.end(), buf, buf + len);
+}
+
+//PUBACK and PUBCOMP give a publish back to the client's quota
+static void conn_ack(FakeConn *c, const char *ack, bool release)
+{
+	if (release) c->releasing++;
+	if (!c->holdacks) {
+		conn_send(c, ack, 4);
+		return;
+	}
+	c->acks.insert(c->acks.end(), ack, ack + 4);
+}
+
+static void conn_flush_acks(FakeConn *c)
+{
+	if (!c->acks.empty()) {
+		conn_send(c, c->acks.data(), c->acks.size());
+		c->acks.clear();
+	}
+	c->unacked -= c->releasing;
+	c->releasing = 0;
+}
+
+static void conn_connect(FakeConn *c, char *buffer, int buflen)
+{
+	MqttConnectFields connect;
+	if (mqtt_decode_connect(std::span<const char>(buffer, buflen), &connect)) {
+		c->version = connect.version;
+	}
+	int rc = c->broker->connack_rc;
+	if (rc != 0) {
+		char connack[16];
+		size_t n = (c->version == MQTT_PROTOCOL_V5)
+			? mqtt_encode_connack(connack, false, rc, std::span<const char>())
+			: mqtt_encode_connack(connack, false, rc);
+		conn_send(c, connack, n);
+		c->refused = true;
+		return;
+	}
+	if (c->version != MQTT_PROTOCOL_V5) {
+		char connack[4] = {(char)CONNACK, 2, 0, 0};
+		conn_send(c, connack, 4);
+		return;
+	}
+	char props[3 + 5];
+	char *ptr = props;
+	int receive_maximum = c->broker->receive_maximum;
+	uint32_t max_packet_size = c->broker->max_packet_size;
+	if (receive_maximum > 0) {
+		ptr = mqtt_put_property_int(ptr, MQTT_PROP_RECEIVE_MAXIMUM, receive_maximum);
+		c->holdacks = true;
+	}
+	if (max_packet_size > 0) {
+		ptr = mqtt_put_property_int32(ptr, MQTT_PROP_MAXIMUM_PACKET_SIZE, max_packet_size);
+		c->reader.maxframe = max_packet_size;
+	}
+	char connack[16];
+	size_t n = mqtt_encode_connack(connack, false, 0, std::span<const char>(props, ptr - props));
+	conn_send(c, connack, n);
+}
+
+static void conn_frame(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	FakeConn *c = (FakeConn *)clientdata;
+	if (c->refused) {
+		c->broker->dropped++;
+		return;
+	}
+	switch (GETTYPE(header)) {
+	case CONNECT:
+		conn_connect(c, buffer, buflen);
+		break;
+	case PUBLISH: {
+		char head[5];
+		char *ptr = head;
+		char remaining_length[4];
+		int remaining_count = _encode_remaining_length(remaining_length, buflen);
+		_write_header(&ptr, header);
+		_write_remaining_length(&ptr, remaining_length, remaining_count);
+		if (GETQOS(header) > 0 && buflen >= 2) {
+			int topiclen = (uint8_t)buffer[0] * 256 + (uint8_t)buffer[1];
+			if (2 + topiclen + 2 <= buflen) {
+				char type = (GETQOS(header) == 1) ? PUBACK : PUBREC;
+				char ack[4] = {type, 2, buffer[2 + topiclen], buffer[3 + topiclen]};
+				if (++c->unacked > c->broker->peak_unacked) {
+					c->broker->peak_unacked = c->unacked;
+				}
+				conn_ack(c, ack, type == PUBACK);
+			}
+		}
+		conn_send(c, head, ptr - head);
+		conn_send(c, buffer, buflen);
+		break;
+	}
+	case PUBREL: {
+		if (buflen < 2) break;
+		char pubcomp[4] = {(char)PUBCOMP, 2, buffer[0], buffer[1]};
+		conn_ack(c, pubcomp, true);
+		break;
+	}
+	case SUBSCRIBE: {
+		if (buflen < 2) break;
+		char suback[5] = {(char)SUBACK, 3, buffer[0], buffer[1], 0};
+		conn_send(c, suback, 5);
+		break;
+	}
+	case PINGREQ: {
+		char pingresp[2] = {(char)PINGRESP, 0};
+		conn_send(c, pingresp, 2);
+		break;
+	}
+	}
+}
+
+static void conn_read_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)mask;
+	FakeConn *c = (FakeConn *)clientdata;
+	char buffer[1024 * 16];
+	ssize_t n = read(fd, buffer, sizeof(buffer));
+	if (n < 0 && errno == EAGAIN) return;
+	long long discarded = c->reader.discarded;
+	if (n <= 0 || c->reader.feed(buffer, n, conn_frame, c) != MQTT_READER_OK) {
+		conn_close(c);
+		return;
+	}
+	c->broker->oversize += c->reader.discarded - discarded;
+	conn_flush_acks(c);
+}
+
+static void accept_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)mask;
+	int cfd = anetTcpAccept(nullptr, fd, nullptr, nullptr);
+	if (cfd < 0) return;
+	anetNonBlock(nullptr, cfd);
+	anetTcpNoDelay(nullptr, cfd);
+	FakeConn *c = new FakeConn;
+	c->fd = cfd;
+	c->el = el;
+	c->broker = (FakeBroker *)clientdata;
+	if (aeCreateFileEvent(el, cfd, AE_READABLE, conn_read_proc, c) == AE_ERR) {
+		close(cfd);
+		delete c;
+	}
+}
+
+static int stop_check(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)id;
+	FakeBroker *broker = (FakeBroker *)clientdata;
+	if (broker->stopping) aeStop(el);
+	return 50;
+}
+
+int FakeBroker::start()
+{
+	char err[ANET_ERR_LEN];
+	char bindaddr[] = "127.0.0.1";
+	listenfd = anetTcpServer(err, 0, bindaddr);
+	if (listenfd < 0) return -1;
+	anetNonBlock(nullptr, listenfd);
+	//fast open clients, where net.ipv4.tcp_fastopen lets servers take them
+	int qlen = 64;
+	setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	getsockname(listenfd, (struct sockaddr *)&sa, &salen);
+
+	el = aeCreateEventLoop(1024 * 16);
+	aeCreateFileEvent(el, listenfd, AE_READABLE, accept_proc, this);
+	aeCreateTimeEvent(el, 50, stop_check, this, nullptr);
+	thread = std::thread([this](){
+		aeMain(el);
+	});
+	return ntohs(sa.sin_port);
+}
+
+void FakeBroker::stop()
+{
+	stopping = true;
+	thread.join();
+	aeDeleteFileEvent(el, listenfd, AE_READABLE);
+	close(listenfd);
+	for (int fd = 0; fd <= el->maxfd; fd++) {
+		if (el->events[fd].mask != AE_NONE) {
+			conn_close((FakeConn *)el->events[fd].clientData);
+		}
+	}
+	aeDeleteEventLoop(el);
+}
@@ -0,0 +1,52 @@
+/*
+ * fakebroker.h - just enough of a broker to benchmark mqttc against
+ *
+ * Runs its own event loop on a thread. Answers CONNECT, SUBSCRIBE and
+ * PINGREQ, acks QoS1 and QoS2 (PUBREC, PUBCOMP) and echoes every PUBLISH
+ * back to its sender.
+ *
+ * MQTT 5 clients get receive_maximum and max_packet_size in CONNACK when
+ * those are set. Their acks are then held until everything read at once
+ * has been handled, the way a loaded broker would answer, and the most
+ * publishes ever left unacknowledged is recorded to check the client.
+ *
+ * A nonzero connack_rc refuses every CONNECT with that code: what the
+ * client pipelined behind it is counted in dropped, not answered, and
+ * the connection is closed once CONNACK is out.
+ */
+#ifndef __FAKEBROKER_H
+#define __FAKEBROKER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+
+#include "../mqttc/ae.h"
+
+class FakeBroker {
+public:
+	int start(); //returns the loopback port
+	void stop();
+
+	aeEventLoop *el = nullptr;
+	int listenfd = -1;
+	std::atomic<bool> stopping{false};
+
+	/* MQTT 5 limits, 0 for none; set while no client is connected */
+	std::atomic<int> receive_maximum{0};
+	std::atomic<uint32_t> max_packet_size{0};
+
+	/* CONNACK return code, 0 accepts */
+	std::atomic<int> connack_rc{0};
+
+	/* statistics, MQTT 5 clients only */
+	std::atomic<long long> peak_unacked{0};
+	std::atomic<long long> oversize{0};
+
+	/* packets that followed a refused CONNECT */
+	std::atomic<long long> dropped{0};
+private:
+	std::thread thread;
+};
+
+#endif /* __FAKEBROKER_H */
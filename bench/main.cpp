@@ -0,0 +1,63 @@
+/*
+ * main.c - mqttc benchmark driver
+ */
+#include <string.h>
+
+#include "bench.h"
+
+struct Bench {
+	const char *name;
+	int (*proc)(int argc, char **argv);
+	const char *desc;
+};
+
+static Bench benches[] = {
+	{"reader", bench_reader, "frame reassembly over fragmented and coalesced streams"},
+	{"writev", bench_writev, "PUBLISH send, copy vs. iovec, 16B to 16MiB payloads"},
+	{"batch", bench_batch, "QoS0 burst, one write per message vs. corked output buffer"},
+	{"loop", bench_loop, "256 connections publishing through one event loop"},
+	{"shard", bench_shard, "one thread publishing through 1, 2 and 4 shard event loops"},
+	{"timer", bench_timer, "timing wheel arm/cancel/fire vs. an ordered map, 10k to 1M timers"},
+	{"inflight", bench_inflight, "pipelined QoS1/QoS2 throughput by in-flight window size vs. QoS0"},
+	{"qos2", bench_qos2, "inbound QoS2 dedup: per-message cost and duplicate suppression"},
+	{"persist", bench_persist, "QoS1 throughput with the session log, syncs per message and recovery time"},
+	{"decode", bench_decode, "remaining length and field decoding, unchecked vs. MqttCursor; 'decode fuzz' fuzzes"},
+	{"encode", bench_encode, "fixed-shape packets, _write_* vs. compile-time builders"},
+	{"codec", bench_codec, "encode and decode ns/packet for every packet type, codec and paho API"},
+	{"alias", bench_alias, "MQTT 5 topic aliases: wire bytes/msg saved, inbound resolution cost"},
+	{"flow", bench_flow, "MQTT 5 receive maximum send quota and maximum packet size, both directions"},
+	{"pahoread", bench_pahoread, "paho packet reads: fixed buffer vs. malloc per packet vs. pooled buffers"},
+	{"readahead", bench_readahead, "recv calls per paho packet, byte-at-a-time getfn vs. read-ahead buffer"},
+	{"pahoclient", bench_pahoclient, "non-blocking paho clients sharing one event loop, throughput and idle wakeups"},
+	{"resolve", bench_resolve, "connect storms with slow DNS through the shared resolver, happy eyeballs failover"},
+	{"pipeline", bench_pipeline, "time to first delivery over a slow link, CONNACK round trips vs. pipelined connect"},
+	{"broker", bench_broker, "mqtt-hello-broker on loopback: QoS0 and QoS1 pairs, wildcard fan-out msgs/s"},
+	{"trie", bench_trie, "wildcard topic trie at 1M subscriptions: match ns vs. a linear scan, concurrent readers"},
+	{"dispatch", bench_dispatch, "inbound PUBLISH to 10 to 1000 per-filter handlers, topic trie vs. scanning in the msg callback"},
+	{"fanout", bench_fanout, "PUBLISH to 10k subscribers through the broker, encode-once shared buffers vs. a copy each: CPU and memory"},
+	{"retain", bench_retain, "retained store at 2M topics: wildcard lookups vs. a scan, snapshot save and reload"},
+};
+
+int main(int argc, char **argv)
+{
+	int n = sizeof(benches) / sizeof(benches[0]);
+	int rc = 0;
+
+	if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		printf("usage: %s [name...]\n", argv[0]);
+		for (int i = 0; i < n; i++) {
+			printf("  %-12s %s\n", benches[i].name, benches[i].desc);
+		}
+		return 0;
+	}
+	for (int i = 0; i < n; i++) {
+		bool selected = (argc < 2);
+		for (int j = 1; j < argc; j++) {
+			if (!strcmp(argv[j], benches[i].name)) selected = true;
+		}
+		if (!selected) continue;
+		printf("== %s: %s\n", benches[i].name, benches[i].desc);
+		if (benches[i].proc(argc, argv) != 0) rc = 1;
+	}
+	return rc;
+}
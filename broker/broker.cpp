@@ -0,0 +1,806 @@
+/*
+ * broker.c - mqtt-hello-broker, a local broker to benchmark against
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <new>
+
+#include "../mqttc/anet.h"
+#include "../paho/MQTTPacket.h"
+#include "broker.h"
+
+#define MAX_ACCEPTS_PER_CALL 1000
+
+bool broker_topic_match(std::string_view filter, std::string_view topic)
+{
+	size_t f = 0, t = 0;
+	/* wildcards at the first level don't match $SYS and the like */
+	if (!topic.empty() && topic[0] == '$' && !filter.empty() &&
+		(filter[0] == '+' || filter[0] == '#')) {
+		return false;
+	}
+	for (;;) {
+		size_t fe = filter.find('/', f);
+		if (fe == std::string_view::npos) fe = filter.size();
+		std::string_view level = filter.substr(f, fe - f);
+		if (level == "#") return true; //the parent level too: "a/#" matches "a"
+		if (t == std::string_view::npos) return false;
+		size_t te = topic.find('/', t);
+		if (te == std::string_view::npos) te = topic.size();
+		if (level != "+" && level != topic.substr(t, te - t)) return false;
+		if (fe == filter.size()) return te == topic.size();
+		f = fe + 1;
+		t = (te == topic.size()) ? std::string_view::npos : te + 1;
+	}
+}
+
+bool broker_filter_valid(std::string_view filter)
+{
+	if (filter.empty()) return false;
+	for (size_t i = 0; i < filter.size(); i++) {
+		char ch = filter[i];
+		if (ch != '+' && ch != '#') continue;
+		if (i > 0 && filter[i - 1] != '/') return false;
+		if (ch == '#' && i + 1 != filter.size()) return false;
+		if (ch == '+' && i + 1 < filter.size() && filter[i + 1] != '/') return false;
+	}
+	return true;
+}
+
+static bool _broker_wildcard(std::string_view filter)
+{
+	return filter.find_first_of("+#") != std::string_view::npos;
+}
+
+static std::string_view _broker_view(MQTTString const &s)
+{
+	return std::string_view(s.lenstring.data, s.lenstring.len);
+}
+
+Broker::Broker()
+{
+	el = aeCreateEventLoop(BROKER_SETSIZE);
+	aeCreateTimeEvent(el, 50, _broker_stop_check, this, nullptr);
+}
+
+Broker::~Broker()
+{
+	stop();
+	for (int fd = 0; fd <= el->maxfd; fd++) {
+		aeFileEvent *fe = &el->events[fd];
+		if (fe->mask != AE_NONE && fe->rfileProc == _broker_read_proc) {
+			_broker_close((BrokerConn *)fe->clientData, true);
+		}
+	}
+	for (int fd : listeners) {
+		aeDeleteFileEvent(el, fd, AE_READABLE);
+		close(fd);
+	}
+	if (!retain_path.empty()) _broker_retain_save(true);
+	aeDeleteEventLoop(el);
+}
+
+int Broker::listen_tcp(const char *bindaddr, int port, char *err)
+{
+	std::string addr = bindaddr ? bindaddr : "";
+	int fd = anetTcpServer(err, port, bindaddr ? addr.data() : nullptr);
+	if (fd == ANET_ERR) return ANET_ERR;
+	anetNonBlock(nullptr, fd);
+	if (aeCreateFileEvent(el, fd, AE_READABLE, _broker_accept_tcp_proc, this) == AE_ERR) {
+		snprintf(err, ANET_ERR_LEN, "too many open files");
+		close(fd);
+		return ANET_ERR;
+	}
+	listeners.push_back(fd);
+
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	getsockname(fd, (struct sockaddr *)&sa, &salen);
+	if (sa.ss_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)&sa)->sin6_port);
+	return ntohs(((struct sockaddr_in *)&sa)->sin_port);
+}
+
+int Broker::listen_unix(const char *path, char *err)
+{
+	std::string p = path;
+	unlink(path);
+	int fd = anetUnixServer(err, p.data(), 0700);
+	if (fd == ANET_ERR) return ANET_ERR;
+	anetNonBlock(nullptr, fd);
+	if (aeCreateFileEvent(el, fd, AE_READABLE, _broker_accept_unix_proc, this) == AE_ERR) {
+		snprintf(err, ANET_ERR_LEN, "too many open files");
+		close(fd);
+		return ANET_ERR;
+	}
+	listeners.push_back(fd);
+	return ANET_OK;
+}
+
+int Broker::retain_snapshot(const char *path, int interval, char *err)
+{
+	if (access(path, F_OK) == 0 && retain.load(path) != 0) {
+		snprintf(err, ANET_ERR_LEN, "%s", retain.errstr);
+		return ANET_ERR;
+	}
+	retain_path = path;
+	retain_interval = interval;
+	retain_saved = retain.changes;
+	aeCreateTimeEvent(el, interval, _broker_retain_cron, this, nullptr);
+	return ANET_OK;
+}
+
+void Broker::run()
+{
+	aeMain(el);
+}
+
+void Broker::start()
+{
+	thread = std::thread([this](){
+		run();
+	});
+}
+
+void Broker::stop()
+{
+	stopping = true;
+	if (thread.joinable()) thread.join();
+}
+
+int Broker::_broker_stop_check(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)id;
+	Broker *b = (Broker *)clientdata;
+	if (b->stopping) aeStop(el);
+	return 50;
+}
+
+int Broker::_broker_retain_cron(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)el;
+	(void)id;
+	Broker *b = (Broker *)clientdata;
+	b->_broker_retain_save(false);
+	return b->retain_interval;
+}
+
+/*
+ * The child writes the snapshot from its copy-on-write image of the
+ * store, so the loop only pays for the fork. One at a time; wait is
+ * for the last one, written right here.
+ */
+void Broker::_broker_retain_save(bool wait)
+{
+	if (retain_child > 0) {
+		int status;
+		pid_t pid = waitpid(retain_child, &status, wait ? 0 : WNOHANG);
+		if (pid == 0) return; //still writing
+		if (pid == retain_child && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			retain_saved = retain_saving;
+			snapshots++;
+		}
+		retain_child = -1;
+	}
+	if (retain.changes == retain_saved) return;
+	if (wait) {
+		if (retain.save(retain_path.c_str()) != 0) {
+			fprintf(stderr, "retained snapshot: %s\n", retain.errstr);
+			return;
+		}
+		retain_saved = retain.changes;
+		snapshots++;
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (retain.save(retain_path.c_str()) != 0) {
+			fprintf(stderr, "retained snapshot: %s\n", retain.errstr);
+			_exit(1);
+		}
+		_exit(0);
+	}
+	if (pid < 0) return; //next time
+	retain_child = pid;
+	retain_saving = retain.changes;
+}
+
+void Broker::_broker_accept_tcp_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)mask;
+	Broker *b = (Broker *)clientdata;
+	for (int i = 0; i < MAX_ACCEPTS_PER_CALL; i++) {
+		int cfd = anetTcpAccept(nullptr, fd, nullptr, nullptr);
+		if (cfd == ANET_ERR) return;
+		b->_broker_accept(cfd, true);
+	}
+}
+
+void Broker::_broker_accept_unix_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)mask;
+	Broker *b = (Broker *)clientdata;
+	for (int i = 0; i < MAX_ACCEPTS_PER_CALL; i++) {
+		int cfd = anetUnixAccept(nullptr, fd);
+		if (cfd == ANET_ERR) return;
+		b->_broker_accept(cfd, false);
+	}
+}
+
+void Broker::_broker_accept(int fd, bool tcp)
+{
+	anetNonBlock(nullptr, fd);
+	if (tcp) anetTcpNoDelay(nullptr, fd);
+	BrokerConn *c = new BrokerConn;
+	c->fd = fd;
+	c->broker = this;
+	c->last_read = MqttTimerWheel::now();
+	if (aeCreateFileEvent(el, fd, AE_READABLE, _broker_read_proc, c) == AE_ERR) {
+		close(fd);
+		delete c;
+		return;
+	}
+	connections++;
+}
+
+/*
+ * A connection closed while its own frames are being handled (bad
+ * packet, DISCONNECT) is only marked; _broker_read_proc frees it once
+ * MqttReader::feed is done with the buffer.
+ */
+void Broker::_broker_close(BrokerConn *c, bool graceful)
+{
+	if (c->fd < 0) return;
+	if (c == reading) closed = true;
+
+	auto it = clients.find(c->clientid);
+	if (c->connected && it != clients.end() && it->second == c) clients.erase(it);
+	for (auto const &filter : c->filters) subscriptions.unsubscribe(filter, c);
+	c->filters.clear();
+	el->timers->cancel(&c->keepalive_timer);
+
+	aeDeleteFileEvent(el, c->fd, AE_READABLE | AE_WRITABLE);
+	close(c->fd);
+	c->fd = -1;
+	connections--;
+	_broker_clear_output(c);
+
+	if (!graceful && c->connected && c->will) {
+		if (c->will_retain) retain.set(c->will_topic, c->will_msg, c->will_qos);
+		_broker_route(c->will_topic, c->will_msg.data(), c->will_msg.size(), c->will_qos);
+	}
+	if (c != reading) delete c;
+}
+
+void Broker::_broker_read_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)mask;
+	BrokerConn *c = (BrokerConn *)clientdata;
+	Broker *b = c->broker;
+	char buffer[BROKER_READ_SIZE];
+	ssize_t n = read(fd, buffer, sizeof(buffer));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (n <= 0) {
+		b->_broker_close(c, false);
+		return;
+	}
+	c->last_read = MqttTimerWheel::now();
+
+	b->reading = c;
+	b->closed = false;
+	int rc = c->reader.feed(buffer, n, _broker_frame_proc, c);
+	b->reading = nullptr;
+	if (b->closed) {
+		delete c;
+		return;
+	}
+	if (rc != MQTT_READER_OK) b->_broker_close(c, false);
+}
+
+void Broker::_broker_write_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)fd;
+	(void)mask;
+	BrokerConn *c = (BrokerConn *)clientdata;
+	c->broker->_broker_flush(c);
+}
+
+void Broker::_broker_flush(BrokerConn *c)
+{
+	while (c->head < c->segments.size()) {
+		struct iovec iov[BROKER_IOV_MAX];
+		int n = 0;
+		for (size_t i = c->head; i < c->segments.size() && n < BROKER_IOV_MAX; i++, n++) {
+			BrokerSegment const &seg = c->segments[i];
+			size_t skip = (i == c->head) ? c->sent : 0;
+			char *base = seg.packet ? seg.packet->data() : c->out.data();
+			iov[n].iov_base = base + seg.off + skip;
+			iov[n].iov_len = seg.len - skip;
+		}
+		struct msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t written = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) {
+				_broker_trim_output(c);
+				return;
+			}
+			_broker_close(c, false);
+			return;
+		}
+		c->queued -= written;
+		while (written > 0) {
+			BrokerSegment &seg = c->segments[c->head];
+			size_t left = seg.len - c->sent;
+			if ((size_t)written < left) {
+				c->sent += written;
+				break;
+			}
+			written -= left;
+			if (seg.packet) _broker_packet_release(seg.packet);
+			seg.packet = nullptr;
+			c->head++;
+			c->sent = 0;
+		}
+	}
+	_broker_clear_output(c);
+	aeDeleteFileEvent(el, c->fd, AE_WRITABLE);
+}
+
+/* drop whatever is left, shared packets released */
+void Broker::_broker_clear_output(BrokerConn *c)
+{
+	for (size_t i = c->head; i < c->segments.size(); i++) {
+		if (c->segments[i].packet) _broker_packet_release(c->segments[i].packet);
+	}
+	_broker_buffered(-(long long)(c->out.size() + c->segments.size() * sizeof(BrokerSegment)));
+	c->out.clear();
+	c->segments.clear();
+	c->head = 0;
+	c->sent = 0;
+	c->queued = 0;
+}
+
+/*
+ * A slow reader never drains its output, so what it has been sent is
+ * dropped from the front once it is half of out or of segments; the
+ * erase moves no more than it frees, and the offsets stay far from
+ * wrapping. The head segment loses its sent bytes when it is in out.
+ */
+void Broker::_broker_trim_output(BrokerConn *c)
+{
+	size_t cut = c->out.size();
+	for (size_t i = c->head; i < c->segments.size(); i++) {
+		if (!c->segments[i].packet) {
+			cut = c->segments[i].off + (i == c->head ? c->sent : 0);
+			break;
+		}
+	}
+	long long freed = 0;
+	if (cut > 0 && cut * 2 >= c->out.size()) {
+		for (size_t i = c->head; i < c->segments.size(); i++) {
+			BrokerSegment &seg = c->segments[i];
+			if (seg.packet) continue;
+			if (i == c->head) {
+				seg.len -= c->sent;
+				seg.off += c->sent;
+				c->sent = 0;
+			}
+			seg.off -= cut;
+		}
+		c->out.erase(c->out.begin(), c->out.begin() + cut);
+		freed += cut;
+	}
+	if (c->head > 0 && c->head * 2 >= c->segments.size()) {
+		c->segments.erase(c->segments.begin(), c->segments.begin() + c->head);
+		freed += c->head * sizeof(BrokerSegment);
+		c->head = 0;
+	}
+	_broker_buffered(-freed);
+}
+
+/* only the loop thread writes these, no need for a locked add */
+void Broker::_broker_buffered(long long delta)
+{
+	long long now = buffered.load(std::memory_order_relaxed) + delta;
+	buffered.store(now, std::memory_order_relaxed);
+	if (now > buffered_peak.load(std::memory_order_relaxed)) {
+		buffered_peak.store(now, std::memory_order_relaxed);
+	}
+}
+
+/*
+ * Output is queued and written when the socket is writable, so a
+ * PUBLISH fanned out to many subscribers costs a segment each rather
+ * than a syscall each; the loop flushes a whole batch with one writev.
+ * false when the connection can't take len more bytes.
+ */
+bool Broker::_broker_queue(BrokerConn *c, size_t len)
+{
+	if (c->fd < 0 || c->overflow) return false;
+	if (c->queued + len > BROKER_OUTPUT_LIMIT) {
+		/* can't close here, the caller may be routing; the read
+		 * side sees the shutdown and closes it, will and all */
+		c->overflow = true;
+		_broker_clear_output(c);
+		aeDeleteFileEvent(el, c->fd, AE_WRITABLE);
+		shutdown(c->fd, SHUT_RDWR);
+		dropped++;
+		return false;
+	}
+	if (c->queued == 0) aeCreateFileEvent(el, c->fd, AE_WRITABLE, _broker_write_proc, c);
+	c->queued += len;
+	return true;
+}
+
+void Broker::_broker_send(BrokerConn *c, const char *buf, size_t len)
+{
+	if (!_broker_queue(c, len)) return;
+	size_t off = c->out.size();
+	c->out.insert(c->out.end(), buf, buf + len);
+	long long grown = len;
+	if (!c->segments.empty() && !c->segments.back().packet) {
+		c->segments.back().len += len; //still contiguous in out
+	} else {
+		c->segments.push_back({nullptr, (uint32_t)off, (uint32_t)len});
+		grown += sizeof(BrokerSegment);
+	}
+	_broker_buffered(grown);
+}
+
+void Broker::_broker_send_shared(BrokerConn *c, BrokerPacket *packet, uint32_t off, uint32_t len)
+{
+	if (!_broker_queue(c, len)) return;
+	packet->refs++;
+	c->segments.push_back({packet, off, len});
+	_broker_buffered(sizeof(BrokerSegment));
+}
+
+BrokerPacket *Broker::_broker_packet_new(size_t len)
+{
+	BrokerPacket *packet = (BrokerPacket *)malloc(sizeof(BrokerPacket) + len);
+	if (!packet) throw std::bad_alloc();
+	packet->refs = 1; //the creator's, dropped once it's queued everywhere
+	packet->len = len;
+	_broker_buffered(sizeof(BrokerPacket) + len);
+	return packet;
+}
+
+void Broker::_broker_packet_release(BrokerPacket *packet)
+{
+	if (--packet->refs > 0) return;
+	_broker_buffered(-(long long)(sizeof(BrokerPacket) + packet->len));
+	free(packet);
+}
+
+void Broker::_broker_keepalive(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	BrokerConn *c = (BrokerConn *)clientdata;
+	long long limit = c->keepalive * 1500LL;
+	long long idle = MqttTimerWheel::now() - c->last_read;
+	if (idle >= limit) {
+		c->broker->_broker_close(c, false);
+		return;
+	}
+	wheel->add(timer, limit - idle, _broker_keepalive, c);
+}
+
+void Broker::_broker_frame_proc(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	BrokerConn *c = (BrokerConn *)clientdata;
+	Broker *b = c->broker;
+	if (b->closed) return;
+	if (!b->_broker_handle_packet(c, header, buffer, buflen)) b->_broker_close(c, false);
+}
+
+bool Broker::_broker_handle_packet(BrokerConn *c, uint8_t header, char *buffer, int buflen)
+{
+	/* paho's deserializers want the fixed header too, which is right before */
+	int len = MQTTPacket_len(buflen);
+	unsigned char *packet = (unsigned char *)buffer - (len - buflen);
+	int type = header >> 4;
+
+	if (!c->connected) return type == CONNECT && _broker_handle_connect(c, packet, len);
+
+	switch (type) {
+	case PUBLISH:
+		return _broker_handle_publish(c, packet, len);
+	case PUBACK:
+		return true;
+	case PUBREL: {
+		unsigned char ack[4];
+		if (buflen < 2) return false;
+		uint16_t id = ((uint8_t)buffer[0] << 8) | (uint8_t)buffer[1];
+		c->qos2_unreleased.erase(id);
+		int n = MQTTSerialize_ack(ack, sizeof(ack), PUBCOMP, 0, id);
+		_broker_send(c, (char *)ack, n);
+		return true;
+	}
+	case SUBSCRIBE:
+		return _broker_handle_subscribe(c, packet, len);
+	case UNSUBSCRIBE:
+		return _broker_handle_unsubscribe(c, packet, len);
+	case PINGREQ: {
+		char pingresp[2] = {(char)(PINGRESP << 4), 0};
+		_broker_send(c, pingresp, 2);
+		return true;
+	}
+	case DISCONNECT:
+		_broker_close(c, true);
+		return true;
+	}
+	return false; //a second CONNECT, or server to client packets
+}
+
+bool Broker::_broker_handle_connect(BrokerConn *c, unsigned char *packet, int len)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	if (MQTTDeserialize_connect(&data, packet, len, nullptr) != 1) return false;
+
+	unsigned char connack[4];
+	int rc = 0;
+	std::string clientid(_broker_view(data.clientID));
+	if (data.MQTTVersion != 3 && data.MQTTVersion != 4) {
+		rc = 1; //unacceptable protocol version
+	} else if (clientid.empty()) {
+		if (!data.cleansession) {
+			rc = 2; //identifier rejected: no session to come back to
+		} else {
+			static uint64_t generated = 0;
+			clientid = "broker-" + std::to_string(++generated);
+		}
+	}
+	if (rc != 0) {
+		/* the first bytes out on this socket, they fit */
+		int n = MQTTSerialize_connack(connack, sizeof(connack), rc, 0);
+		if (send(c->fd, connack, n, MSG_NOSIGNAL) < 0) return false;
+		return false;
+	}
+
+	/* session takeover */
+	auto it = clients.find(clientid);
+	if (it != clients.end()) _broker_close(it->second, false);
+
+	c->clientid = std::move(clientid);
+	c->connected = true;
+	clients[c->clientid] = c;
+	if (data.willFlag) {
+		c->will = true;
+		c->will_retain = data.will.retained;
+		c->will_qos = data.will.qos > 1 ? 1 : data.will.qos;
+		c->will_topic = _broker_view(data.will.topicName);
+		c->will_msg = _broker_view(data.will.message);
+	}
+	c->keepalive = data.keepAliveInterval;
+	if (c->keepalive > 0) {
+		el->timers->add(&c->keepalive_timer, c->keepalive * 1500LL, _broker_keepalive, c);
+	}
+
+	int n = MQTTSerialize_connack(connack, sizeof(connack), 0, 0);
+	_broker_send(c, (char *)connack, n);
+	return true;
+}
+
+bool Broker::_broker_handle_publish(BrokerConn *c, unsigned char *packet, int len)
+{
+	unsigned char dup, retained;
+	int qos, payloadlen;
+	unsigned short id;
+	MQTTString topic;
+	unsigned char *payload;
+	if (MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadlen, packet, len, nullptr) != 1) {
+		return false;
+	}
+	std::string_view name = _broker_view(topic);
+	if (name.empty() || _broker_wildcard(name)) return false;
+
+	if (qos > 0) {
+		unsigned char ack[4];
+		int n = MQTTSerialize_ack(ack, sizeof(ack), qos == 1 ? PUBACK : PUBREC, 0, id);
+		_broker_send(c, (char *)ack, n);
+		//routed the first time, until PUBREL frees the id
+		if (qos == 2 && c->qos2_unreleased.insert(id)) return true;
+	}
+	published++;
+	/* an empty retained payload clears the topic, and is routed like any other */
+	if (retained) retain.set(name, std::string_view((char *)payload, payloadlen), qos > 1 ? 1 : qos);
+	_broker_route(name, (char *)payload, payloadlen, qos > 1 ? 1 : qos);
+	return true;
+}
+
+bool Broker::_broker_handle_subscribe(BrokerConn *c, unsigned char *packet, int len)
+{
+	unsigned char dup;
+	unsigned short id;
+	int count;
+	MQTTString filters[BROKER_MAX_FILTERS];
+	int qoss[BROKER_MAX_FILTERS];
+	if (MQTTDeserialize_subscribe(&dup, &id, BROKER_MAX_FILTERS, &count, filters, qoss, packet, len, nullptr) != 1 ||
+		count == 0) {
+		return false;
+	}
+	int granted[BROKER_MAX_FILTERS];
+	for (int i = 0; i < count; i++) {
+		std::string_view filter = _broker_view(filters[i]);
+		if (!broker_filter_valid(filter) || qoss[i] < 0 || qoss[i] > 2) {
+			granted[i] = 0x80;
+			continue;
+		}
+		granted[i] = qoss[i] > 1 ? 1 : qoss[i];
+		_broker_subscribe(c, filter, granted[i]);
+	}
+	unsigned char suback[5 + BROKER_MAX_FILTERS];
+	int n = MQTTSerialize_suback(suback, sizeof(suback), id, count, granted);
+	_broker_send(c, (char *)suback, n);
+	for (int i = 0; i < count; i++) {
+		if (granted[i] != 0x80) _broker_send_retained(c, _broker_view(filters[i]), granted[i]);
+	}
+	return true;
+}
+
+bool Broker::_broker_handle_unsubscribe(BrokerConn *c, unsigned char *packet, int len)
+{
+	unsigned char dup;
+	unsigned short id;
+	int count;
+	MQTTString filters[BROKER_MAX_FILTERS];
+	if (MQTTDeserialize_unsubscribe(&dup, &id, BROKER_MAX_FILTERS, &count, filters, packet, len, nullptr) != 1) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) _broker_unsubscribe(c, _broker_view(filters[i]));
+	unsigned char unsuback[4];
+	int n = MQTTSerialize_unsuback(unsuback, sizeof(unsuback), id);
+	_broker_send(c, (char *)unsuback, n);
+	return true;
+}
+
+void Broker::_broker_subscribe(BrokerConn *c, std::string_view filter, uint8_t qos)
+{
+	//false when it only replaced the QoS
+	if (subscriptions.subscribe(filter, c, qos)) c->filters.emplace_back(filter);
+}
+
+void Broker::_broker_unsubscribe(BrokerConn *c, std::string_view filter)
+{
+	if (!subscriptions.unsubscribe(filter, c)) return;
+	for (size_t i = 0; i < c->filters.size(); i++) {
+		if (c->filters[i] != filter) continue;
+		c->filters[i] = std::move(c->filters.back());
+		c->filters.pop_back();
+		return;
+	}
+}
+
+/*
+ * A client whose filters overlap gets one copy, at the highest QoS it
+ * was granted among them. The PUBLISH is encoded once per QoS; when it
+ * goes to several subscribers and is big enough it's a shared packet
+ * queued to each without copying. At QoS 1 the packet id is the
+ * subscriber's own, so it goes out as three segments: up to the id,
+ * the id from out, and the rest.
+ */
+void Broker::_broker_route(std::string_view topic, const char *payload, int payloadlen, int qos)
+{
+	uint64_t mark = ++stamp;
+	targets.clear();
+	subscriptions.match(topic, [&](BrokerConn *t, uint8_t q) {
+		if (t->mark != mark) {
+			t->mark = mark;
+			t->mark_qos = q;
+			targets.push_back(t);
+		} else if (q > t->mark_qos) {
+			t->mark_qos = q;
+		}
+	});
+	if (targets.empty()) return;
+
+	MQTTString name = MQTTString_initializer;
+	name.lenstring.data = (char *)topic.data();
+	name.lenstring.len = topic.size();
+	int rem = 2 + topic.size() + payloadlen;
+	int len[2] = {MQTTPacket_len(rem), MQTTPacket_len(rem + 2)};
+	int idpos = len[1] - (rem + 2) + 2 + topic.size();
+	/* a segment and a reference cost more than copying a small packet */
+	bool share = !copy_fanout.load(std::memory_order_relaxed) && targets.size() > 1 &&
+		len[0] >= BROKER_SHARE_MIN;
+	BrokerPacket *shared[2] = {nullptr, nullptr};
+	char *data[2] = {nullptr, nullptr};
+	if (!share) packet.resize(len[0] + len[1]);
+	for (BrokerConn *t : targets) {
+		int q = t->mark_qos < qos ? t->mark_qos : qos;
+		if (!data[q]) {
+			if (share) {
+				shared[q] = _broker_packet_new(len[q]);
+				data[q] = shared[q]->data();
+			} else {
+				data[q] = packet.data() + (q ? len[0] : 0);
+			}
+			MQTTSerialize_publish((unsigned char *)data[q], len[q], 0, q, 0, 1,
+				name, (unsigned char *)payload, payloadlen);
+		}
+		if (q == 0) {
+			if (share) {
+				_broker_send_shared(t, shared[0], 0, len[0]);
+			} else {
+				_broker_send(t, data[0], len[0]);
+			}
+		} else {
+			if (t->next_id == 0) t->next_id = 1;
+			uint16_t id = t->next_id++;
+			char idbytes[2] = {(char)(id >> 8), (char)(id & 0xff)};
+			if (share) {
+				_broker_send_shared(t, shared[1], 0, idpos);
+				_broker_send(t, idbytes, 2);
+				_broker_send_shared(t, shared[1], idpos + 2, len[1] - idpos - 2);
+			} else {
+				memcpy(data[1] + idpos, idbytes, 2);
+				_broker_send(t, data[1], len[1]);
+			}
+		}
+		delivered++;
+	}
+	for (BrokerPacket *packet : shared) {
+		if (packet) _broker_packet_release(packet);
+	}
+}
+
+/* after the SUBACK, what's retained under filter, flagged retained */
+void Broker::_broker_send_retained(BrokerConn *c, std::string_view filter, int qos)
+{
+	retain.match(filter, [&](MqttRetained const &msg) {
+		int q = msg.qos < qos ? msg.qos : qos;
+		MQTTString name = MQTTString_initializer;
+		name.lenstring.data = (char *)msg.topic.data();
+		name.lenstring.len = msg.topic.size();
+		int len = MQTTPacket_len(2 + msg.topic.size() + (q ? 2 : 0) + msg.payload.size());
+		uint16_t id = 0;
+		if (q) {
+			if (c->next_id == 0) c->next_id = 1;
+			id = c->next_id++;
+		}
+		packet.resize(len);
+		MQTTSerialize_publish((unsigned char *)packet.data(), len, 0, q, 1, id, name,
+			(unsigned char *)msg.payload.data(), msg.payload.size());
+		_broker_send(c, packet.data(), len);
+		delivered++;
+	});
+}
@@ -0,0 +1,225 @@
+/*
+ * broker.h - mqtt-hello-broker, a local broker to benchmark against
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_BROKER_H
+#define __MQTT_BROKER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/retain.h"
+#include "../common/topictrie.h"
+#include "../mqttc/ae.h"
+#include "../mqttc/inflight.h"
+#include "../mqttc/reader.h"
+#include "../mqttc/timer.h"
+
+#define BROKER_PORT 1883
+#define BROKER_SETSIZE (1024*16) //connections, listeners included
+#define BROKER_READ_SIZE (1024*64)
+#define BROKER_MAX_FILTERS 64 //per SUBSCRIBE or UNSUBSCRIBE
+#define BROKER_OUTPUT_LIMIT (1024*1024*64) //a subscriber this far behind is dropped
+
+#define BROKER_IOV_MAX 64 //segments per writev
+#define BROKER_SHARE_MIN 256 //smaller PUBLISH packets are copied to each subscriber
+#define BROKER_RETAIN_INTERVAL 10000 //ms between retained snapshots, while they change
+
+class Broker;
+
+/*
+ * A PUBLISH encoded once for all its subscribers. Immutable once
+ * queued; every segment referring to it holds a reference. Only the
+ * loop thread touches it, so the count is a plain integer.
+ */
+struct BrokerPacket {
+	uint32_t refs;
+	uint32_t len;
+	char *data() { return (char *)(this + 1); }
+};
+
+/* a stretch of output: in a shared packet, or in the connection's out when packet is null */
+struct BrokerSegment {
+	BrokerPacket *packet;
+	uint32_t off;
+	uint32_t len;
+};
+
+/* one client connection */
+struct BrokerConn {
+	int fd = -1;
+	Broker *broker = nullptr;
+	MqttReader reader;
+	bool connected = false; //CONNECT accepted
+	std::string clientid;
+	std::vector<std::string> filters; //subscribed
+
+	/* keep alive: closed after 1.5 periods without a packet */
+	int keepalive = 0;
+	long long last_read = 0;
+	MqttTimer keepalive_timer;
+
+	/* will, published unless the client says DISCONNECT */
+	bool will = false;
+	bool will_retain = false;
+	uint8_t will_qos = 0;
+	std::string will_topic;
+	std::string will_msg;
+
+	/* output, written from the loop when the socket is writable: small
+	 * packets are copied into out, PUBLISH bodies are shared */
+	std::vector<char> out;
+	std::vector<BrokerSegment> segments;
+	size_t head = 0; //segments written whole
+	size_t sent = 0; //and bytes of the next one
+	size_t queued = 0; //bytes left to write
+	bool overflow = false; //over BROKER_OUTPUT_LIMIT, shut down
+	uint16_t next_id = 1; //outbound QoS 1
+	MqttPacketIdSet qos2_unreleased; //inbound QoS 2 routed, PUBREL not seen yet
+
+	/* routing scratch: last publish this connection matched, and at what QoS */
+	uint64_t mark = 0;
+	uint8_t mark_qos = 0;
+};
+
+/*
+ * Single-threaded MQTT 3.1/3.1.1 broker on the ae event loop (epoll on
+ * Linux), for local tests and benchmarks, with paho's server side
+ * codecs behind it. CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at QoS 0
+ * and 1, PINGREQ and DISCONNECT are handled, plus wills and keep alive.
+ * A QoS 2 publish is answered PUBREC/PUBCOMP and delivered at QoS 1,
+ * once: a resend before its PUBREL only gets the PUBREC again.
+ * Retained messages go to every later SUBSCRIBE they match; given a
+ * snapshot file they are reloaded from it at start and saved to it
+ * periodically by a forked child, the loop carrying on meanwhile.
+ * There are no persistent sessions or authentication, and outbound
+ * QoS 1 publishes aren't retransmitted: over TCP they only get lost
+ * with the connection.
+ */
+class Broker {
+public:
+	Broker();
+	~Broker();
+	Broker(Broker const &) = delete;
+	Broker &operator=(Broker const &) = delete;
+
+	/* return the port or ANET_OK, ANET_ERR with err set */
+	int listen_tcp(const char *bindaddr, int port, char *err);
+	int listen_unix(const char *path, char *err);
+	/* load retained messages from path if it exists, and save them there
+	 * every interval ms they changed and when the broker goes; ANET_OK,
+	 * ANET_ERR with err set when path can't be loaded */
+	int retain_snapshot(const char *path, int interval, char *err);
+
+	void run(); //on this thread, until stop
+	void start(); //on a thread of its own
+	void stop(); //from any thread
+
+	aeEventLoop *el;
+	std::atomic<bool> stopping{false};
+
+	/* statistics */
+	std::atomic<long long> connections{0}; //open now
+	std::atomic<long long> published{0}; //PUBLISH received
+	std::atomic<long long> delivered{0}; //PUBLISH sent
+	std::atomic<long long> dropped{0}; //connections closed for falling behind
+	std::atomic<long long> buffered{0}; //bytes held for output
+	std::atomic<long long> buffered_peak{0};
+	std::atomic<long long> snapshots{0}; //retained snapshots written
+
+	/* a copy of every PUBLISH per subscriber instead of sharing one,
+	 * for comparison */
+	std::atomic<bool> copy_fanout{false};
+private:
+	static void _broker_accept_tcp_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _broker_accept_unix_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _broker_read_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _broker_write_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _broker_keepalive(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	static void _broker_frame_proc(void *clientdata, uint8_t header, char *buffer, int buflen);
+	static int _broker_stop_check(aeEventLoop *el, long long id, void *clientdata);
+	static int _broker_retain_cron(aeEventLoop *el, long long id, void *clientdata);
+
+	void _broker_accept(int fd, bool tcp);
+	void _broker_close(BrokerConn *c, bool graceful);
+	bool _broker_queue(BrokerConn *c, size_t len);
+	void _broker_send(BrokerConn *c, const char *buf, size_t len);
+	void _broker_send_shared(BrokerConn *c, BrokerPacket *packet, uint32_t off, uint32_t len);
+	void _broker_flush(BrokerConn *c);
+	void _broker_clear_output(BrokerConn *c);
+	void _broker_trim_output(BrokerConn *c);
+	BrokerPacket *_broker_packet_new(size_t len);
+	void _broker_packet_release(BrokerPacket *packet);
+	void _broker_buffered(long long delta);
+	bool _broker_handle_packet(BrokerConn *c, uint8_t header, char *buffer, int buflen);
+	bool _broker_handle_connect(BrokerConn *c, unsigned char *packet, int len);
+	bool _broker_handle_publish(BrokerConn *c, unsigned char *packet, int len);
+	bool _broker_handle_subscribe(BrokerConn *c, unsigned char *packet, int len);
+	bool _broker_handle_unsubscribe(BrokerConn *c, unsigned char *packet, int len);
+	void _broker_subscribe(BrokerConn *c, std::string_view filter, uint8_t qos);
+	void _broker_unsubscribe(BrokerConn *c, std::string_view filter);
+	void _broker_route(std::string_view topic, const char *payload, int payloadlen, int qos);
+	void _broker_send_retained(BrokerConn *c, std::string_view filter, int qos);
+	void _broker_retain_save(bool wait);
+
+	std::vector<int> listeners;
+	std::unordered_map<std::string, BrokerConn *> clients; //by client id
+
+	MqttTopicTrie<BrokerConn *, uint8_t> subscriptions; //QoS granted
+
+	MqttRetainStore retain;
+	std::string retain_path; //snapshot, none when empty
+	int retain_interval = BROKER_RETAIN_INTERVAL;
+	pid_t retain_child = -1; //writing a snapshot
+	uint64_t retain_saving = 0; //retain.changes the child is writing
+	uint64_t retain_saved = 0; //and the last snapshot on disk
+
+	/* routing scratch */
+	uint64_t stamp = 0;
+	std::vector<BrokerConn *> targets;
+	std::vector<char> packet; //PUBLISH encoded for copying
+	BrokerConn *reading = nullptr; //whose frames are being handled
+	bool closed = false; //and it was closed meanwhile
+
+	std::thread thread;
+};
+
+/* one filter against one topic, '$' topics excepted from leading wildcards */
+bool broker_topic_match(std::string_view filter, std::string_view topic);
+
+/* a filter with '+' and '#' only as whole levels, '#' only last */
+bool broker_filter_valid(std::string_view filter);
+
+#endif /* __MQTT_BROKER_H */
@@ -0,0 +1,117 @@
+/*
+ * main.c - mqtt-hello-broker command line
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../mqttc/anet.h"
+#include "broker.h"
+
+static Broker *broker;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	broker->stopping = true;
+}
+
+static int report(aeEventLoop *el, long long id, void *clientdata)
+{
+	(void)el;
+	(void)id;
+	(void)clientdata;
+	static long long published, delivered;
+	long long p = broker->published, d = broker->delivered;
+	printf("%lld clients, %lld in/s, %lld out/s\n", (long long)broker->connections,
+		p - published, d - delivered);
+	fflush(stdout);
+	published = p;
+	delivered = d;
+	return 1000;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: mqtt-hello-broker [-b bindaddr] [-p port] [-s unixsocket] [-r retained.snap] [-i seconds] [-v]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *bindaddr = nullptr;
+	const char *unixpath = nullptr;
+	const char *snapshot = nullptr;
+	int interval = BROKER_RETAIN_INTERVAL;
+	int port = BROKER_PORT;
+	bool verbose = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:s:r:i:v")) != -1) {
+		switch (opt) {
+		case 'b': bindaddr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 's': unixpath = optarg; break;
+		case 'r': snapshot = optarg; break;
+		case 'i': interval = atoi(optarg) * 1000; break;
+		case 'v': verbose = true; break;
+		default: usage();
+		}
+	}
+
+	broker = new Broker;
+	char err[ANET_ERR_LEN];
+	if (broker->listen_tcp(bindaddr, port, err) == ANET_ERR) {
+		fprintf(stderr, "listen on port %d: %s\n", port, err);
+		return 1;
+	}
+	if (unixpath && broker->listen_unix(unixpath, err) == ANET_ERR) {
+		fprintf(stderr, "listen on %s: %s\n", unixpath, err);
+		return 1;
+	}
+	if (snapshot && broker->retain_snapshot(snapshot, interval > 0 ? interval : BROKER_RETAIN_INTERVAL, err) == ANET_ERR) {
+		fprintf(stderr, "retained messages: %s\n", err);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (verbose) aeCreateTimeEvent(broker->el, 1000, report, nullptr, nullptr);
+
+	printf("mqtt-hello-broker on port %d\n", port);
+	fflush(stdout);
+	broker->run();
+
+	printf("%lld published, %lld delivered, %lld dropped\n", (long long)broker->published,
+		(long long)broker->delivered, (long long)broker->dropped);
+	if (unixpath) unlink(unixpath);
+	delete broker;
+	return 0;
+}
@@ -0,0 +1,923 @@
+/*
+ * codec.h - header-only mqtt 3.1, 3.1.1 and 5 packet codec
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_CODEC_H
+#define __MQTT_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <span>
+#include <string_view>
+
+/*
+ * One wire format for mqttc and paho. Encoders write into a caller's
+ * span and return the bytes written, or 0 when the packet doesn't fit;
+ * every size is computed up front, so nothing here allocates. Decoders
+ * read a frame body in place and return false on a short or malformed
+ * packet; strings, payloads and MQTT 5 properties come back as views
+ * into the frame. Packets whose layout changed in MQTT 5 take the
+ * protocol version, defaulting to 3.1.1.
+ *
+ * The type names carry a prefix because mqttc's packet.h and paho's
+ * MQTTPacket.h both define bare CONNECT, PUBLISH, ... of their own.
+ */
+
+/* fixed header type nibble, in place */
+enum {
+	MQTT_PKT_CONNECT = 0x10,
+	MQTT_PKT_CONNACK = 0x20,
+	MQTT_PKT_PUBLISH = 0x30,
+	MQTT_PKT_PUBACK = 0x40,
+	MQTT_PKT_PUBREC = 0x50,
+	MQTT_PKT_PUBREL = 0x60,
+	MQTT_PKT_PUBCOMP = 0x70,
+	MQTT_PKT_SUBSCRIBE = 0x80,
+	MQTT_PKT_SUBACK = 0x90,
+	MQTT_PKT_UNSUBSCRIBE = 0xA0,
+	MQTT_PKT_UNSUBACK = 0xB0,
+	MQTT_PKT_PINGREQ = 0xC0,
+	MQTT_PKT_PINGRESP = 0xD0,
+	MQTT_PKT_DISCONNECT = 0xE0
+};
+
+#define MQTT_PROTOCOL_V31 3		//"MQIsdp"
+#define MQTT_PROTOCOL_V311 4	//"MQTT"
+#define MQTT_PROTOCOL_V5 5		//"MQTT", with properties
+
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
+/* MQTT 5 property identifiers */
+enum {
+	MQTT_PROP_PAYLOAD_FORMAT = 0x01,
+	MQTT_PROP_MESSAGE_EXPIRY = 0x02,
+	MQTT_PROP_CONTENT_TYPE = 0x03,
+	MQTT_PROP_RESPONSE_TOPIC = 0x08,
+	MQTT_PROP_CORRELATION_DATA = 0x09,
+	MQTT_PROP_SUBSCRIPTION_ID = 0x0B,
+	MQTT_PROP_SESSION_EXPIRY = 0x11,
+	MQTT_PROP_ASSIGNED_CLIENTID = 0x12,
+	MQTT_PROP_SERVER_KEEPALIVE = 0x13,
+	MQTT_PROP_AUTH_METHOD = 0x15,
+	MQTT_PROP_AUTH_DATA = 0x16,
+	MQTT_PROP_REQUEST_PROBLEM_INFO = 0x17,
+	MQTT_PROP_WILL_DELAY = 0x18,
+	MQTT_PROP_REQUEST_RESPONSE_INFO = 0x19,
+	MQTT_PROP_RESPONSE_INFO = 0x1A,
+	MQTT_PROP_SERVER_REFERENCE = 0x1C,
+	MQTT_PROP_REASON_STRING = 0x1F,
+	MQTT_PROP_RECEIVE_MAXIMUM = 0x21,
+	MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+	MQTT_PROP_TOPIC_ALIAS = 0x23,
+	MQTT_PROP_MAXIMUM_QOS = 0x24,
+	MQTT_PROP_RETAIN_AVAILABLE = 0x25,
+	MQTT_PROP_USER_PROPERTY = 0x26,
+	MQTT_PROP_MAXIMUM_PACKET_SIZE = 0x27,
+	MQTT_PROP_WILDCARD_SUB_AVAILABLE = 0x28,
+	MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE = 0x29,
+	MQTT_PROP_SHARED_SUB_AVAILABLE = 0x2A
+};
+
+/* MQTT 5 reason codes: below 0x80 is success, from it up a failure */
+enum {
+	MQTT_RC_SUCCESS = 0x00,
+	MQTT_RC_FAILURE = 0x80
+};
+
+/*---------------------------------------
+** Primitives.
+---------------------------------------*/
+/* bytes the remaining length takes for a variable part of len bytes */
+constexpr int mqtt_remaining_length_size(size_t len)
+{
+	return len < 128 ? 1 : len < 16384 ? 2 : len < 2097152 ? 3 : 4;
+}
+
+/* whole packet size for a given remaining length */
+constexpr size_t mqtt_packet_size(size_t remaining)
+{
+	return 1 + mqtt_remaining_length_size(remaining) + remaining;
+}
+
+constexpr char *mqtt_put_remaining_length(char *ptr, size_t len)
+{
+	if (len < 128) {
+		*ptr++ = len;
+		return ptr;
+	}
+	do {
+		char d = len % 128;
+		len /= 128;
+		if (len > 0) d |= 0x80;
+		*ptr++ = d;
+	} while (len > 0);
+	return ptr;
+}
+
+constexpr char *mqtt_put_char(char *ptr, uint8_t c)
+{
+	*ptr = c;
+	return ptr + 1;
+}
+
+constexpr char *mqtt_put_int(char *ptr, uint16_t i)
+{
+	ptr[0] = i >> 8;
+	ptr[1] = i;
+	return ptr + 2;
+}
+
+inline char *mqtt_put_bytes(char *ptr, const void *data, size_t len)
+{
+	if (len) memcpy(ptr, data, len);
+	return ptr + len;
+}
+
+/* two byte length, then the bytes */
+inline char *mqtt_put_string(char *ptr, std::string_view s)
+{
+	return mqtt_put_bytes(mqtt_put_int(ptr, s.size()), s.data(), s.size());
+}
+
+/*
+ * Decode the remaining length at *pptr without reading past end. Returns
+ * the number of bytes it took and advances *pptr, 0 if end comes first,
+ * -1 if it runs over 4 bytes. A one byte length, what acks and small
+ * publishes have, costs one test beyond the loop it replaces; away from
+ * the end of the buffer one bounds check covers the other three widths.
+ */
+static inline int mqtt_get_remaining_length(const char **pptr, const char *end, int *length)
+{
+	const uint8_t *p = (const uint8_t *)*pptr;
+	ptrdiff_t n = end - *pptr;
+	if (n > 0 && p[0] < 128) {
+		*length = p[0];
+		*pptr += 1;
+		return 1;
+	}
+	if (n >= 4) {
+		int val = p[0] & 127;
+		val |= (p[1] & 127) << 7;
+		if (p[1] < 128) {
+			*length = val;
+			*pptr += 2;
+			return 2;
+		}
+		val |= (p[2] & 127) << 14;
+		if (p[2] < 128) {
+			*length = val;
+			*pptr += 3;
+			return 3;
+		}
+		val |= (p[3] & 127) << 21;
+		if (p[3] < 128) {
+			*length = val;
+			*pptr += 4;
+			return 4;
+		}
+		return -1;
+	}
+	//the last few bytes of a buffer
+	int val = 0;
+	for (int i = 0; i < n; i++) {
+		val |= (p[i] & 127) << (7 * i);
+		if (p[i] < 128) {
+			*length = val;
+			*pptr += i + 1;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Bounds-checked reader over [ptr, end). A read that doesn't fit fails
+ * the cursor and returns zero or an empty view, as do all reads after it,
+ * so a packet is decoded straight through and ok() checked once.
+ */
+class MqttCursor {
+public:
+	MqttCursor(const char *begin, const char *end) : ptr(begin), end(end) {}
+	explicit MqttCursor(std::span<const char> buf) : ptr(buf.data()), end(buf.data() + buf.size()) {}
+
+	bool ok() const { return !failed; }
+	size_t left() const { return end - ptr; }
+
+	uint8_t read_char()
+	{
+		if (ptr >= end) return fail();
+		return (uint8_t)*ptr++;
+	}
+
+	int read_int()
+	{
+		if (end - ptr < 2) return fail();
+		int i = ((uint8_t)ptr[0] << 8) | (uint8_t)ptr[1];
+		ptr += 2;
+		return i;
+	}
+
+	int read_remaining_length()
+	{
+		int length = 0;
+		if (mqtt_get_remaining_length(&ptr, end, &length) <= 0) return fail();
+		return length;
+	}
+
+	std::span<const char> read_bytes(size_t len)
+	{
+		if (left() < len) {
+			fail();
+			return {};
+		}
+		std::span<const char> bytes(ptr, len);
+		ptr += len;
+		return bytes;
+	}
+
+	std::string_view read_string()
+	{
+		std::span<const char> s = read_bytes(read_int());
+		return std::string_view(s.data(), s.size());
+	}
+
+	std::span<const char> rest()
+	{
+		return read_bytes(left());
+	}
+
+	/* MQTT 5: a variable byte length, then that many bytes of properties */
+	std::span<const char> read_properties()
+	{
+		return read_bytes(read_remaining_length());
+	}
+private:
+	int fail()
+	{
+		failed = true;
+		ptr = end;
+		return 0;
+	}
+
+	const char *ptr;
+	const char *end;
+	bool failed = false;
+};
+
+/*---------------------------------------
+** MQTT 5 properties.
+---------------------------------------*/
+/*
+ * One decoded property. Integers of every width land in value; strings
+ * and binary data in str, and a user property's value in str2.
+ */
+struct MqttProperty {
+	uint8_t id = 0;
+	uint32_t value = 0;
+	std::string_view str;
+	std::string_view str2;
+};
+
+/*
+ * Walk a property block, handing each property to f, which returns
+ * false to stop. An unknown identifier is malformed: its length can't
+ * be known, so nothing after it can be read either.
+ */
+template <typename F>
+inline bool mqtt_decode_properties(std::span<const char> props, F f)
+{
+	MqttCursor in(props);
+	while (in.ok() && in.left() > 0) {
+		MqttProperty prop;
+		prop.id = in.read_char();
+		switch (prop.id) {
+		case MQTT_PROP_PAYLOAD_FORMAT:
+		case MQTT_PROP_REQUEST_PROBLEM_INFO:
+		case MQTT_PROP_REQUEST_RESPONSE_INFO:
+		case MQTT_PROP_MAXIMUM_QOS:
+		case MQTT_PROP_RETAIN_AVAILABLE:
+		case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+		case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+		case MQTT_PROP_SHARED_SUB_AVAILABLE:
+			prop.value = in.read_char();
+			break;
+		case MQTT_PROP_SERVER_KEEPALIVE:
+		case MQTT_PROP_RECEIVE_MAXIMUM:
+		case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+		case MQTT_PROP_TOPIC_ALIAS:
+			prop.value = in.read_int();
+			break;
+		case MQTT_PROP_MESSAGE_EXPIRY:
+		case MQTT_PROP_SESSION_EXPIRY:
+		case MQTT_PROP_WILL_DELAY:
+		case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+			prop.value = (uint32_t)in.read_int() << 16;
+			prop.value |= in.read_int();
+			break;
+		case MQTT_PROP_SUBSCRIPTION_ID:
+			prop.value = in.read_remaining_length();
+			break;
+		case MQTT_PROP_CONTENT_TYPE:
+		case MQTT_PROP_RESPONSE_TOPIC:
+		case MQTT_PROP_CORRELATION_DATA:
+		case MQTT_PROP_ASSIGNED_CLIENTID:
+		case MQTT_PROP_AUTH_METHOD:
+		case MQTT_PROP_AUTH_DATA:
+		case MQTT_PROP_RESPONSE_INFO:
+		case MQTT_PROP_SERVER_REFERENCE:
+		case MQTT_PROP_REASON_STRING:
+			prop.str = in.read_string();
+			break;
+		case MQTT_PROP_USER_PROPERTY:
+			prop.str = in.read_string();
+			prop.str2 = in.read_string();
+			break;
+		default:
+			return false;
+		}
+		if (!in.ok() || !f(prop)) return false;
+	}
+	return in.ok();
+}
+
+/* a property block of len bytes with its length in front */
+constexpr size_t mqtt_properties_size(size_t len)
+{
+	return mqtt_remaining_length_size(len) + len;
+}
+
+inline char *mqtt_put_properties(char *ptr, std::span<const char> props)
+{
+	ptr = mqtt_put_remaining_length(ptr, props.size());
+	return mqtt_put_bytes(ptr, props.data(), props.size());
+}
+
+/* single properties, for building a block: 2, 3, 5 and 3 + len bytes */
+constexpr char *mqtt_put_property_char(char *ptr, uint8_t id, uint8_t value)
+{
+	return mqtt_put_char(mqtt_put_char(ptr, id), value);
+}
+
+constexpr char *mqtt_put_property_int(char *ptr, uint8_t id, uint16_t value)
+{
+	return mqtt_put_int(mqtt_put_char(ptr, id), value);
+}
+
+constexpr char *mqtt_put_property_int32(char *ptr, uint8_t id, uint32_t value)
+{
+	ptr = mqtt_put_char(ptr, id);
+	ptr = mqtt_put_int(ptr, value >> 16);
+	return mqtt_put_int(ptr, value);
+}
+
+inline char *mqtt_put_property_string(char *ptr, uint8_t id, std::string_view value)
+{
+	return mqtt_put_string(mqtt_put_char(ptr, id), value);
+}
+
+/*---------------------------------------
+** Packet fields.
+---------------------------------------*/
+struct MqttConnectFields {
+	int version = MQTT_PROTOCOL_V311;
+	bool cleansess = true;
+	uint16_t keepalive = 60;
+	std::string_view clientid;
+	bool will = false;
+	uint8_t willqos = 0;
+	bool willretain = false;
+	std::string_view willtopic;
+	std::string_view willmsg;
+	bool has_username = false;
+	std::string_view username;
+	bool has_password = false;
+	std::string_view password;
+	/* MQTT 5 property blocks, without their length */
+	std::span<const char> properties;
+	std::span<const char> willproperties;
+};
+
+struct MqttPublishFields {
+	uint8_t qos = 0;
+	bool retain = false;
+	bool dup = false;
+	uint16_t id = 0;
+	std::string_view topic;
+	std::span<const char> payload;
+	std::span<const char> properties; //MQTT 5
+};
+
+struct MqttTopicFilter {
+	std::string_view topic;
+	uint8_t qos = 0;
+};
+
+/*---------------------------------------
+** Fixed-shape packets.
+---------------------------------------*/
+/* a packet whose size is known at compile time */
+template <size_t N>
+struct MqttFrame {
+	char bytes[N];
+
+	constexpr char *data() { return bytes; }
+	static constexpr size_t size() { return N; }
+};
+
+/* PINGREQ, PINGRESP, DISCONNECT: no variable part at all */
+template <uint8_t Header>
+constexpr MqttFrame<2> mqtt_empty_frame()
+{
+	return {{(char)Header, 0}};
+}
+
+/* PUBACK, PUBREC, PUBREL (with its QoS 1 bit), PUBCOMP, UNSUBACK */
+template <uint8_t Header>
+constexpr MqttFrame<4> mqtt_ack_frame(uint16_t id)
+{
+	return {{(char)Header, 2, (char)(id >> 8), (char)id}};
+}
+
+static_assert(mqtt_ack_frame<MQTT_PKT_PUBACK>(0x1234).bytes[2] == 0x12);
+
+/* fixed header, topic and packet id of a PUBLISH: all that precedes the payload */
+#define MQTT_PUBLISH_HEAD_MAX (1 + 4 + 2 + 2)
+
+/*
+ * QoS is a template argument, so the packet id is compiled in or out and
+ * a publish head is a few stores and the topic memcpy. buffer needs
+ * MQTT_PUBLISH_HEAD_MAX + topic.size() bytes. Returns the end of the head.
+ */
+template <int Qos>
+inline char *mqtt_put_publish_head(char *ptr, std::string_view topic, uint16_t id,
+	size_t payloadlen, bool retain, bool dup)
+{
+	constexpr size_t idlen = Qos > 0 ? 2 : 0;
+	*ptr++ = MQTT_PKT_PUBLISH | (Qos << 1) | (dup << 3) | retain;
+	ptr = mqtt_put_remaining_length(ptr, 2 + topic.size() + idlen + payloadlen);
+	ptr = mqtt_put_string(ptr, topic);
+	if constexpr (Qos > 0) {
+		ptr = mqtt_put_int(ptr, id);
+	}
+	return ptr;
+}
+
+/*
+ * MQTT 5: the property block follows the packet id. buffer needs
+ * MQTT_PUBLISH_HEAD_MAX + topic.size() + mqtt_properties_size(props.size()).
+ */
+template <int Qos>
+inline char *mqtt_put_publish_head(char *ptr, std::string_view topic, uint16_t id,
+	size_t payloadlen, bool retain, bool dup, std::span<const char> props)
+{
+	constexpr size_t idlen = Qos > 0 ? 2 : 0;
+	*ptr++ = MQTT_PKT_PUBLISH | (Qos << 1) | (dup << 3) | retain;
+	ptr = mqtt_put_remaining_length(ptr,
+		2 + topic.size() + idlen + mqtt_properties_size(props.size()) + payloadlen);
+	ptr = mqtt_put_string(ptr, topic);
+	if constexpr (Qos > 0) {
+		ptr = mqtt_put_int(ptr, id);
+	}
+	return mqtt_put_properties(ptr, props);
+}
+
+/* MQTT 5 subscribes and unsubscribes carry an empty property block */
+constexpr size_t _mqtt_empty_properties_size(int version)
+{
+	return version == MQTT_PROTOCOL_V5 ? 1 : 0;
+}
+
+/* one topic filter; buffer needs mqtt_subscribe_size(topic.size()) bytes */
+constexpr size_t mqtt_subscribe_size(size_t topiclen, int version = MQTT_PROTOCOL_V311)
+{
+	return mqtt_packet_size(2 + _mqtt_empty_properties_size(version) + 2 + topiclen + 1);
+}
+
+inline char *mqtt_put_subscribe(char *ptr, uint16_t id, std::string_view topic, uint8_t qos,
+	int version = MQTT_PROTOCOL_V311)
+{
+	size_t propslen = _mqtt_empty_properties_size(version);
+	*ptr++ = MQTT_PKT_SUBSCRIBE | 0x02;
+	ptr = mqtt_put_remaining_length(ptr, 2 + propslen + 2 + topic.size() + 1);
+	ptr = mqtt_put_int(ptr, id);
+	if (propslen) *ptr++ = 0;
+	ptr = mqtt_put_string(ptr, topic);
+	*ptr++ = qos;
+	return ptr;
+}
+
+constexpr size_t mqtt_unsubscribe_size(size_t topiclen, int version = MQTT_PROTOCOL_V311)
+{
+	return mqtt_packet_size(2 + _mqtt_empty_properties_size(version) + 2 + topiclen);
+}
+
+inline char *mqtt_put_unsubscribe(char *ptr, uint16_t id, std::string_view topic,
+	int version = MQTT_PROTOCOL_V311)
+{
+	size_t propslen = _mqtt_empty_properties_size(version);
+	*ptr++ = MQTT_PKT_UNSUBSCRIBE | 0x02;
+	ptr = mqtt_put_remaining_length(ptr, 2 + propslen + 2 + topic.size());
+	ptr = mqtt_put_int(ptr, id);
+	if (propslen) *ptr++ = 0;
+	return mqtt_put_string(ptr, topic);
+}
+
+/*---------------------------------------
+** Remaining lengths.
+---------------------------------------*/
+constexpr size_t mqtt_connect_length(MqttConnectFields const &c)
+{
+	bool v5 = c.version == MQTT_PROTOCOL_V5;
+	size_t len = (c.version == MQTT_PROTOCOL_V31 ? 2 + 6 : 2 + 4) + 1 + 1 + 2;
+	if (v5) len += mqtt_properties_size(c.properties.size());
+	len += 2 + c.clientid.size();
+	if (c.will) {
+		len += 2 + c.willtopic.size() + 2 + c.willmsg.size();
+		if (v5) len += mqtt_properties_size(c.willproperties.size());
+	}
+	if (c.has_username) len += 2 + c.username.size();
+	if (c.has_password) len += 2 + c.password.size();
+	return len;
+}
+
+constexpr size_t mqtt_publish_length(int qos, size_t topiclen, size_t payloadlen)
+{
+	return 2 + topiclen + (qos > 0 ? 2 : 0) + payloadlen;
+}
+
+constexpr size_t mqtt_publish_length(MqttPublishFields const &p, int version = MQTT_PROTOCOL_V311)
+{
+	size_t len = mqtt_publish_length(p.qos, p.topic.size(), p.payload.size());
+	if (version == MQTT_PROTOCOL_V5) len += mqtt_properties_size(p.properties.size());
+	return len;
+}
+
+/*
+ * Packets with a list take the count and a function from index to
+ * element, so callers encode straight out of whatever array they hold.
+ */
+template <typename F>
+constexpr size_t mqtt_subscribe_length(size_t count, F filter, int version = MQTT_PROTOCOL_V311)
+{
+	size_t len = 2 + _mqtt_empty_properties_size(version);
+	for (size_t i = 0; i < count; i++) len += 2 + filter(i).topic.size() + 1;
+	return len;
+}
+
+template <typename F>
+constexpr size_t mqtt_unsubscribe_length(size_t count, F topic, int version = MQTT_PROTOCOL_V311)
+{
+	size_t len = 2 + _mqtt_empty_properties_size(version);
+	for (size_t i = 0; i < count; i++) len += 2 + topic(i).size();
+	return len;
+}
+
+/*---------------------------------------
+** Encoders.
+---------------------------------------*/
+/* header and remaining length, or nullptr if the packet won't fit */
+inline char *mqtt_put_fixed_header(std::span<char> buf, uint8_t header, size_t remaining)
+{
+	if (remaining > MQTT_MAX_REMAINING_LENGTH || buf.size() < mqtt_packet_size(remaining)) {
+		return nullptr;
+	}
+	char *ptr = buf.data();
+	*ptr++ = header;
+	return mqtt_put_remaining_length(ptr, remaining);
+}
+
+inline size_t mqtt_encode_connect(std::span<char> buf, MqttConnectFields const &c)
+{
+	char *ptr = mqtt_put_fixed_header(buf, MQTT_PKT_CONNECT, mqtt_connect_length(c));
+	if (!ptr) return 0;
+	bool v5 = c.version == MQTT_PROTOCOL_V5;
+	if (c.version == MQTT_PROTOCOL_V31) {
+		ptr = mqtt_put_string(ptr, "MQIsdp");
+	} else {
+		ptr = mqtt_put_string(ptr, "MQTT");
+	}
+	ptr = mqtt_put_char(ptr, c.version);
+	uint8_t flags = (c.cleansess << 1) | (c.has_username << 7) | (c.has_password << 6);
+	if (c.will) flags |= 0x04 | (c.willqos << 3) | (c.willretain << 5);
+	ptr = mqtt_put_char(ptr, flags);
+	ptr = mqtt_put_int(ptr, c.keepalive);
+	if (v5) ptr = mqtt_put_properties(ptr, c.properties);
+	ptr = mqtt_put_string(ptr, c.clientid);
+	if (c.will) {
+		if (v5) ptr = mqtt_put_properties(ptr, c.willproperties);
+		ptr = mqtt_put_string(ptr, c.willtopic);
+		ptr = mqtt_put_string(ptr, c.willmsg);
+	}
+	if (c.has_username) ptr = mqtt_put_string(ptr, c.username);
+	if (c.has_password) ptr = mqtt_put_string(ptr, c.password);
+	return ptr - buf.data();
+}
+
+inline size_t mqtt_encode_connack(std::span<char> buf, bool sessionpresent, uint8_t rc)
+{
+	if (buf.size() < 4) return 0;
+	char *ptr = buf.data();
+	ptr[0] = MQTT_PKT_CONNACK;
+	ptr[1] = 2;
+	ptr[2] = sessionpresent;
+	ptr[3] = rc;
+	return 4;
+}
+
+/* MQTT 5: the property block follows the reason code */
+inline size_t mqtt_encode_connack(std::span<char> buf, bool sessionpresent, uint8_t rc,
+	std::span<const char> props)
+{
+	char *ptr = mqtt_put_fixed_header(buf, MQTT_PKT_CONNACK, 2 + mqtt_properties_size(props.size()));
+	if (!ptr) return 0;
+	ptr = mqtt_put_char(ptr, sessionpresent);
+	ptr = mqtt_put_char(ptr, rc);
+	ptr = mqtt_put_properties(ptr, props);
+	return ptr - buf.data();
+}
+
+inline size_t mqtt_encode_publish(std::span<char> buf, MqttPublishFields const &p,
+	int version = MQTT_PROTOCOL_V311)
+{
+	uint8_t header = MQTT_PKT_PUBLISH | (p.qos << 1) | (p.dup << 3) | p.retain;
+	char *ptr = mqtt_put_fixed_header(buf, header, mqtt_publish_length(p, version));
+	if (!ptr) return 0;
+	ptr = mqtt_put_string(ptr, p.topic);
+	if (p.qos > 0) ptr = mqtt_put_int(ptr, p.id);
+	if (version == MQTT_PROTOCOL_V5) ptr = mqtt_put_properties(ptr, p.properties);
+	ptr = mqtt_put_bytes(ptr, p.payload.data(), p.payload.size());
+	return ptr - buf.data();
+}
+
+/* PUBACK, PUBREC, PUBREL, PUBCOMP, UNSUBACK with the header byte complete */
+inline size_t mqtt_encode_ack(std::span<char> buf, uint8_t header, uint16_t id)
+{
+	if (buf.size() < 4) return 0;
+	char *ptr = buf.data();
+	ptr[0] = header;
+	ptr[1] = 2;
+	mqtt_put_int(ptr + 2, id);
+	return 4;
+}
+
+/* PINGREQ, PINGRESP, DISCONNECT */
+inline size_t mqtt_encode_empty(std::span<char> buf, uint8_t header)
+{
+	if (buf.size() < 2) return 0;
+	buf[0] = header;
+	buf[1] = 0;
+	return 2;
+}
+
+/* filter(i) returns the i-th MqttTopicFilter */
+template <typename F>
+inline size_t mqtt_encode_subscribe(std::span<char> buf, uint16_t id, size_t count, F filter,
+	bool dup = false, int version = MQTT_PROTOCOL_V311)
+{
+	char *ptr = mqtt_put_fixed_header(buf, MQTT_PKT_SUBSCRIBE | 0x02 | (dup << 3),
+		mqtt_subscribe_length(count, filter, version));
+	if (!ptr) return 0;
+	ptr = mqtt_put_int(ptr, id);
+	if (version == MQTT_PROTOCOL_V5) *ptr++ = 0;
+	for (size_t i = 0; i < count; i++) {
+		MqttTopicFilter f = filter(i);
+		ptr = mqtt_put_string(ptr, f.topic);
+		ptr = mqtt_put_char(ptr, f.qos);
+	}
+	return ptr - buf.data();
+}
+
+inline size_t mqtt_encode_subscribe(std::span<char> buf, uint16_t id, std::span<const MqttTopicFilter> filters,
+	int version = MQTT_PROTOCOL_V311)
+{
+	return mqtt_encode_subscribe(buf, id, filters.size(), [&](size_t i) { return filters[i]; }, false, version);
+}
+
+/* qos(i) returns the i-th granted QoS or failure code */
+template <typename F>
+inline size_t mqtt_encode_suback(std::span<char> buf, uint16_t id, size_t count, F qos,
+	int version = MQTT_PROTOCOL_V311)
+{
+	size_t propslen = _mqtt_empty_properties_size(version);
+	char *ptr = mqtt_put_fixed_header(buf, MQTT_PKT_SUBACK, 2 + propslen + count);
+	if (!ptr) return 0;
+	ptr = mqtt_put_int(ptr, id);
+	if (propslen) *ptr++ = 0;
+	for (size_t i = 0; i < count; i++) ptr = mqtt_put_char(ptr, qos(i));
+	return ptr - buf.data();
+}
+
+inline size_t mqtt_encode_suback(std::span<char> buf, uint16_t id, std::span<const uint8_t> granted,
+	int version = MQTT_PROTOCOL_V311)
+{
+	return mqtt_encode_suback(buf, id, granted.size(), [&](size_t i) { return granted[i]; }, version);
+}
+
+/* topic(i) returns the i-th topic filter as a string_view */
+template <typename F>
+inline size_t mqtt_encode_unsubscribe(std::span<char> buf, uint16_t id, size_t count, F topic,
+	bool dup = false, int version = MQTT_PROTOCOL_V311)
+{
+	char *ptr = mqtt_put_fixed_header(buf, MQTT_PKT_UNSUBSCRIBE | 0x02 | (dup << 3),
+		mqtt_unsubscribe_length(count, topic, version));
+	if (!ptr) return 0;
+	ptr = mqtt_put_int(ptr, id);
+	if (version == MQTT_PROTOCOL_V5) *ptr++ = 0;
+	for (size_t i = 0; i < count; i++) ptr = mqtt_put_string(ptr, topic(i));
+	return ptr - buf.data();
+}
+
+inline size_t mqtt_encode_unsubscribe(std::span<char> buf, uint16_t id, std::span<const std::string_view> topics,
+	int version = MQTT_PROTOCOL_V311)
+{
+	return mqtt_encode_unsubscribe(buf, id, topics.size(), [&](size_t i) { return topics[i]; }, false, version);
+}
+
+/*---------------------------------------
+** Decoders.
+---------------------------------------*/
+/*
+ * Split the frame at the start of buf into its header byte and body.
+ * Returns the frame size, 0 if buf holds only part of it, -1 if the
+ * remaining length is malformed.
+ */
+inline int mqtt_decode_frame(std::span<const char> buf, uint8_t *header, std::span<const char> *body)
+{
+	if (buf.size() < 2) return 0;
+	const char *ptr = buf.data() + 1;
+	const char *end = buf.data() + buf.size();
+	int len;
+	int n = mqtt_get_remaining_length(&ptr, end, &len);
+	if (n <= 0) return n;
+	if (end - ptr < len) return 0;
+	*header = (uint8_t)buf[0];
+	*body = std::span<const char>(ptr, len);
+	return 1 + n + len;
+}
+
+inline bool mqtt_decode_connect(std::span<const char> body, MqttConnectFields *c)
+{
+	MqttCursor in(body);
+	std::string_view protocol = in.read_string();
+	c->version = in.read_char();
+	if (!in.ok()) return false;
+	//don't guess at the layout of a protocol we don't know
+	if (!((c->version == MQTT_PROTOCOL_V311 || c->version == MQTT_PROTOCOL_V5) && protocol == "MQTT") &&
+		!(c->version == MQTT_PROTOCOL_V31 && protocol == "MQIsdp")) {
+		return false;
+	}
+	bool v5 = c->version == MQTT_PROTOCOL_V5;
+	uint8_t flags = in.read_char();
+	c->cleansess = (flags >> 1) & 1;
+	c->will = (flags >> 2) & 1;
+	c->willqos = (flags >> 3) & 3;
+	c->willretain = (flags >> 5) & 1;
+	c->has_password = (flags >> 6) & 1;
+	c->has_username = (flags >> 7) & 1;
+	c->keepalive = in.read_int();
+	if (v5) c->properties = in.read_properties();
+	c->clientid = in.read_string();
+	if (c->will) {
+		if (v5) c->willproperties = in.read_properties();
+		c->willtopic = in.read_string();
+		c->willmsg = in.read_string();
+	}
+	if (c->has_password && !c->has_username) return false;
+	if (c->has_username) c->username = in.read_string();
+	if (c->has_password) c->password = in.read_string();
+	return in.ok();
+}
+
+/* a 3.1.1 CONNACK is two bytes exactly, so anything after them is MQTT 5 properties */
+inline bool mqtt_decode_connack(std::span<const char> body, bool *sessionpresent, uint8_t *rc,
+	std::span<const char> *props = nullptr)
+{
+	MqttCursor in(body);
+	*sessionpresent = in.read_char() & 1;
+	*rc = in.read_char();
+	std::span<const char> p;
+	if (in.ok() && in.left() > 0) p = in.read_properties();
+	if (props) *props = p;
+	return in.ok();
+}
+
+inline bool mqtt_decode_publish(uint8_t header, std::span<const char> body, MqttPublishFields *p,
+	int version = MQTT_PROTOCOL_V311)
+{
+	MqttCursor in(body);
+	p->qos = (header >> 1) & 3;
+	p->retain = header & 1;
+	p->dup = (header >> 3) & 1;
+	if (p->qos == 3) return false;
+	p->topic = in.read_string();
+	p->id = p->qos > 0 ? in.read_int() : 0;
+	if (version == MQTT_PROTOCOL_V5) p->properties = in.read_properties();
+	p->payload = in.rest();
+	return in.ok();
+}
+
+/*
+ * The packet id that is all of a 3.1.1 PUBACK, PUBREC, PUBREL, PUBCOMP
+ * and UNSUBACK. MQTT 5 may follow it with a reason code and properties,
+ * both left out when the code is success and there are none.
+ */
+inline bool mqtt_decode_ack(std::span<const char> body, uint16_t *id, uint8_t *rc = nullptr,
+	std::span<const char> *props = nullptr)
+{
+	MqttCursor in(body);
+	*id = in.read_int();
+	uint8_t code = MQTT_RC_SUCCESS;
+	std::span<const char> p;
+	if (in.ok() && in.left() > 0) code = in.read_char();
+	if (in.ok() && in.left() > 0) p = in.read_properties();
+	if (rc) *rc = code;
+	if (props) *props = p;
+	return in.ok();
+}
+
+/* an MQTT 5 DISCONNECT's reason code and properties, an empty one is success */
+inline bool mqtt_decode_disconnect(std::span<const char> body, uint8_t *rc,
+	std::span<const char> *props = nullptr)
+{
+	MqttCursor in(body);
+	*rc = MQTT_RC_SUCCESS;
+	std::span<const char> p;
+	if (in.left() > 0) *rc = in.read_char();
+	if (in.ok() && in.left() > 0) p = in.read_properties();
+	if (props) *props = p;
+	return in.ok();
+}
+
+/*
+ * The list decoders hand each element to f as it is read; f returns
+ * false to give up, say when the caller's array is full, and the
+ * decode then fails.
+ */
+template <typename F>
+inline bool mqtt_decode_subscribe(std::span<const char> body, uint16_t *id, F f, int version = MQTT_PROTOCOL_V311)
+{
+	MqttCursor in(body);
+	*id = in.read_int();
+	if (version == MQTT_PROTOCOL_V5) in.read_properties();
+	while (in.ok() && in.left() > 0) {
+		MqttTopicFilter filter;
+		filter.topic = in.read_string();
+		filter.qos = in.read_char();
+		if (!in.ok() || !f(filter)) return false;
+	}
+	return in.ok();
+}
+
+template <typename F>
+inline bool mqtt_decode_suback(std::span<const char> body, uint16_t *id, F f, int version = MQTT_PROTOCOL_V311)
+{
+	MqttCursor in(body);
+	*id = in.read_int();
+	if (version == MQTT_PROTOCOL_V5) in.read_properties();
+	while (in.ok() && in.left() > 0) {
+		if (!f(in.read_char())) return false;
+	}
+	return in.ok();
+}
+
+template <typename F>
+inline bool mqtt_decode_unsubscribe(std::span<const char> body, uint16_t *id, F f, int version = MQTT_PROTOCOL_V311)
+{
+	MqttCursor in(body);
+	*id = in.read_int();
+	if (version == MQTT_PROTOCOL_V5) in.read_properties();
+	while (in.ok() && in.left() > 0) {
+		std::string_view topic = in.read_string();
+		if (!in.ok() || !f(topic)) return false;
+	}
+	return in.ok();
+}
+
+#endif /* __MQTT_CODEC_H */
@@ -0,0 +1,540 @@
+/*
+ * retain.c - retained message store with a wildcard index and snapshots
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+
+#include "../mqttc/config.h"
+#include "retain.h"
+
+#define RETAIN_MAGIC "MQTTRET1"
+
+#define ALIGN8(N) (((N) + 7) & ~(size_t)7)
+
+/*
+ * The snapshot: this header, then nodes, table, names and arena, each
+ * 8-byte aligned, host endian.
+ */
+struct MqttRetainHeader {
+	char magic[8];
+	uint64_t nodes;
+	uint64_t table;
+	uint64_t names;
+	uint64_t arena;
+	uint64_t free_nodes;
+	uint64_t nodes_live;
+	uint64_t table_used;
+	uint64_t table_removed;
+	uint64_t names_garbage;
+	uint64_t arena_garbage;
+	uint64_t values;
+};
+
+MqttRetainStore::MqttRetainStore()
+{
+	clear();
+}
+
+void MqttRetainStore::clear()
+{
+	trie.assign(1, Node{NONE, NONE, NONE, NONE, 0, 0, 0, 0, NO_VALUE});
+	table.assign(16, 0);
+	names.clear();
+	arena.clear();
+	free_nodes = NONE;
+	nodes_live = 1;
+	table_used = table_removed = 0;
+	names_garbage = arena_garbage = 0;
+	values = 0;
+	changes++;
+}
+
+size_t MqttRetainStore::memory() const
+{
+	return trie.capacity() * sizeof(Node) + table.capacity() * sizeof(uint32_t) +
+		names.capacity() + arena.capacity();
+}
+
+/* FNV-1a: a snapshot's table is laid out by it, so it can't vary between builds */
+uint32_t MqttRetainStore::level_hash(std::string_view level)
+{
+	uint32_t h = 2166136261u;
+	for (char ch : level) {
+		h ^= (uint8_t)ch;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+size_t MqttRetainStore::slot_of(uint32_t parent, uint32_t hash, size_t mask)
+{
+	uint64_t x = (uint64_t)parent << 32 | hash;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x & mask;
+}
+
+uint32_t MqttRetainStore::find(uint32_t parent, std::string_view level, uint32_t hash) const
+{
+	size_t mask = table.size() - 1;
+	for (size_t i = slot_of(parent, hash, mask);; i = (i + 1) & mask) {
+		uint32_t n = table[i];
+		if (n == 0) return NONE;
+		if (n == TOMBSTONE) continue;
+		Node const &nd = trie[n];
+		if (nd.parent == parent && nd.hash == hash && name(nd) == level) return n;
+	}
+}
+
+uint32_t MqttRetainStore::lookup(std::string_view topic) const
+{
+	uint32_t n = 0;
+	size_t pos = 0;
+	for (;;) {
+		size_t end = topic.find('/', pos);
+		if (end == std::string_view::npos) end = topic.size();
+		std::string_view level = topic.substr(pos, end - pos);
+		n = find(n, level, level_hash(level));
+		if (n == NONE || end == topic.size()) return n;
+		pos = end + 1;
+	}
+}
+
+bool MqttRetainStore::get(std::string_view topic, MqttRetained *msg) const
+{
+	uint32_t n = lookup(topic);
+	if (n == NONE || trie[n].value == NO_VALUE) return false;
+	*msg = message(trie[n]);
+	return true;
+}
+
+void MqttRetainStore::set(std::string_view topic, std::string_view payload, uint8_t qos)
+{
+	if (payload.empty()) {
+		remove(topic);
+		return;
+	}
+	if (topic.size() > UINT16_MAX) return; //not a topic MQTT can carry
+	uint32_t n = 0;
+	size_t pos = 0;
+	for (;;) {
+		size_t end = topic.find('/', pos);
+		if (end == std::string_view::npos) end = topic.size();
+		n = child(n, topic.substr(pos, end - pos));
+		if (end == topic.size()) break;
+		pos = end + 1;
+	}
+
+	size_t size = record_size(topic.size(), payload.size());
+	Node &nd = trie[n];
+	if (nd.value != NO_VALUE) {
+		Record *old = (Record *)(arena.data() + nd.value);
+		if (record_size(old->topiclen, old->payloadlen) != size) drop_value(nd);
+	}
+	if (nd.value == NO_VALUE) {
+		nd.value = arena.size();
+		arena.resize(arena.size() + size);
+		values++;
+	}
+	/* a value the same size as the last one, the usual sensor update, is rewritten in place */
+	Record *r = (Record *)(arena.data() + nd.value);
+	r->payloadlen = payload.size();
+	r->topiclen = topic.size();
+	r->qos = qos;
+	r->reserved = 0;
+	char *body = (char *)(r + 1);
+	memcpy(body, topic.data(), topic.size());
+	memcpy(body + topic.size(), payload.data(), payload.size());
+	changes++;
+	if (arena_garbage > MQTT_RETAIN_COMPACT_MIN && arena_garbage * 2 > arena.size()) compact_arena();
+}
+
+bool MqttRetainStore::remove(std::string_view topic)
+{
+	uint32_t n = lookup(topic);
+	if (n == NONE || trie[n].value == NO_VALUE) return false;
+	drop_value(trie[n]);
+	prune(n);
+	changes++;
+	if (arena_garbage > MQTT_RETAIN_COMPACT_MIN && arena_garbage * 2 > arena.size()) compact_arena();
+	if (names_garbage > MQTT_RETAIN_COMPACT_MIN && names_garbage * 2 > names.size()) compact_names();
+	return true;
+}
+
+void MqttRetainStore::drop_value(Node &nd)
+{
+	Record *r = (Record *)(arena.data() + nd.value);
+	arena_garbage += record_size(r->topiclen, r->payloadlen);
+	nd.value = NO_VALUE;
+	values--;
+}
+
+uint32_t MqttRetainStore::child(uint32_t parent, std::string_view level)
+{
+	uint32_t hash = level_hash(level);
+	uint32_t c = find(parent, level, hash);
+	if (c != NONE) return c;
+
+	c = alloc_node();
+	Node &nd = trie[c];
+	nd.parent = parent;
+	nd.child = NONE;
+	nd.prev = NONE;
+	nd.next = trie[parent].child;
+	nd.hash = hash;
+	nd.name = names.size();
+	nd.namelen = level.size();
+	nd.value = NO_VALUE;
+	names.insert(names.end(), level.begin(), level.end());
+	if (nd.next != NONE) trie[nd.next].prev = c;
+	trie[parent].child = c;
+	insert_slot(c);
+	return c;
+}
+
+uint32_t MqttRetainStore::alloc_node()
+{
+	uint32_t n;
+	if (free_nodes != NONE) {
+		n = free_nodes;
+		free_nodes = trie[n].next;
+	} else {
+		if (trie.size() >= TOMBSTONE) throw std::bad_alloc();
+		n = trie.size();
+		trie.emplace_back();
+	}
+	nodes_live++;
+	return n;
+}
+
+/* drop trie left with nothing under them, bottom up */
+void MqttRetainStore::prune(uint32_t n)
+{
+	while (n != 0) {
+		Node &nd = trie[n];
+		if (nd.value != NO_VALUE || nd.child != NONE) return;
+		uint32_t parent = nd.parent;
+		if (nd.prev != NONE) {
+			trie[nd.prev].next = nd.next;
+		} else {
+			trie[parent].child = nd.next;
+		}
+		if (nd.next != NONE) trie[nd.next].prev = nd.prev;
+		remove_slot(n);
+		names_garbage += nd.namelen;
+		nd.parent = TOMBSTONE; //marks it free
+		nd.namelen = 0;
+		nd.next = free_nodes;
+		free_nodes = n;
+		nodes_live--;
+		n = parent;
+	}
+}
+
+void MqttRetainStore::insert_slot(uint32_t n)
+{
+	if ((table_used + table_removed + 1) * 2 > table.size()) {
+		size_t slots = 16;
+		while (slots < (table_used + 1) * 4) slots <<= 1;
+		rehash(slots);
+	}
+	size_t mask = table.size() - 1;
+	size_t i = slot_of(trie[n].parent, trie[n].hash, mask);
+	while (table[i] != 0 && table[i] != TOMBSTONE) i = (i + 1) & mask;
+	if (table[i] == TOMBSTONE) table_removed--;
+	table[i] = n;
+	table_used++;
+}
+
+void MqttRetainStore::remove_slot(uint32_t n)
+{
+	size_t mask = table.size() - 1;
+	size_t i = slot_of(trie[n].parent, trie[n].hash, mask);
+	while (table[i] != n) i = (i + 1) & mask;
+	table[i] = TOMBSTONE;
+	table_used--;
+	table_removed++;
+}
+
+void MqttRetainStore::rehash(size_t slots)
+{
+	std::vector<uint32_t> old;
+	old.swap(table);
+	table.assign(slots, 0);
+	size_t mask = slots - 1;
+	for (uint32_t n : old) {
+		if (n == 0 || n == TOMBSTONE) continue;
+		size_t i = slot_of(trie[n].parent, trie[n].hash, mask);
+		while (table[i] != 0) i = (i + 1) & mask;
+		table[i] = n;
+	}
+	table_removed = 0;
+}
+
+void MqttRetainStore::compact_names()
+{
+	std::vector<char> live;
+	live.reserve(names.size() - names_garbage);
+	for (Node &nd : trie) {
+		if (nd.parent == TOMBSTONE) continue;
+		const char *s = names.data() + nd.name;
+		nd.name = live.size();
+		live.insert(live.end(), s, s + nd.namelen);
+	}
+	names.swap(live);
+	names_garbage = 0;
+}
+
+void MqttRetainStore::compact_arena()
+{
+	std::vector<char> live;
+	live.reserve(arena.size() - arena_garbage);
+	for (Node &nd : trie) {
+		if (nd.parent == TOMBSTONE || nd.value == NO_VALUE) continue;
+		Record const *r = (Record const *)(arena.data() + nd.value);
+		size_t size = record_size(r->topiclen, r->payloadlen);
+		nd.value = live.size();
+		live.insert(live.end(), (const char *)r, (const char *)r + size);
+	}
+	arena.swap(live);
+	arena_garbage = 0;
+}
+
+/*---------------------------------------
+** Snapshots.
+---------------------------------------*/
+static int _retain_fsync_dir(const char *path)
+{
+	char copy[PATH_MAX];
+	snprintf(copy, sizeof(copy), "%s", path);
+	int dfd = ::open(dirname(copy), O_RDONLY);
+	if (dfd < 0) return -1;
+	int rc = fsync(dfd);
+	::close(dfd);
+	return rc;
+}
+
+/*
+ * Written to path.tmp through a shared mapping, synced and renamed over
+ * path, so a crash leaves the previous snapshot.
+ */
+int MqttRetainStore::save(const char *path)
+{
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		snprintf(errstr, sizeof(errstr), "save %s: %s", path, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	MqttRetainHeader h;
+	memcpy(h.magic, RETAIN_MAGIC, 8);
+	h.nodes = trie.size();
+	h.table = table.size();
+	h.names = names.size();
+	h.arena = arena.size();
+	h.free_nodes = free_nodes;
+	h.nodes_live = nodes_live;
+	h.table_used = table_used;
+	h.table_removed = table_removed;
+	h.names_garbage = names_garbage;
+	h.arena_garbage = arena_garbage;
+	h.values = values;
+
+	struct {
+		const void *data;
+		size_t len;
+	} sections[] = {
+		{&h, sizeof(h)},
+		{trie.data(), trie.size() * sizeof(Node)},
+		{table.data(), table.size() * sizeof(uint32_t)},
+		{names.data(), names.size()},
+		{arena.data(), arena.size()},
+	};
+	size_t total = 0;
+	for (auto const &s : sections) total += ALIGN8(s.len);
+
+	int fd = ::open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	void *map = MAP_FAILED;
+	if (fd < 0 || ftruncate(fd, total) < 0 ||
+		(map = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		snprintf(errstr, sizeof(errstr), "save %.200s: %s", tmp, strerror(errno));
+		if (fd >= 0) ::close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	size_t at = 0;
+	for (auto const &s : sections) {
+		if (s.len) memcpy((char *)map + at, s.data, s.len);
+		at += ALIGN8(s.len);
+	}
+	munmap(map, total);
+	if (aof_fsync(fd) < 0 || rename(tmp, path) < 0) {
+		snprintf(errstr, sizeof(errstr), "save %s: %s", path, strerror(errno));
+		::close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	::close(fd);
+	_retain_fsync_dir(path);
+	return 0;
+}
+
+int MqttRetainStore::load(const char *path)
+{
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		snprintf(errstr, sizeof(errstr), "open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		snprintf(errstr, sizeof(errstr), "stat %s: %s", path, strerror(errno));
+		::close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE; //read ahead in one go, it's all copied out next
+#endif
+	void *map = size >= sizeof(MqttRetainHeader) ? mmap(nullptr, size, PROT_READ, flags, fd, 0) : MAP_FAILED;
+	::close(fd);
+	if (map == MAP_FAILED) {
+		snprintf(errstr, sizeof(errstr), "%s is not a retained snapshot", path);
+		return -1;
+	}
+
+	MqttRetainHeader h;
+	memcpy(&h, map, sizeof(h));
+	size_t want = ALIGN8(sizeof(h));
+	bool ok = memcmp(h.magic, RETAIN_MAGIC, 8) == 0 && h.nodes > 0 && h.nodes < TOMBSTONE &&
+		h.table >= 16 && (h.table & (h.table - 1)) == 0 && h.table < ((uint64_t)1 << 40) &&
+		h.names < ((uint64_t)1 << 32) && h.arena < ((uint64_t)1 << 48);
+	if (ok) {
+		want += ALIGN8(h.nodes * sizeof(Node)) + ALIGN8(h.table * sizeof(uint32_t)) +
+			ALIGN8(h.names) + ALIGN8(h.arena);
+		ok = want == size;
+	}
+
+	MqttRetainStore loaded;
+	if (ok) {
+		const char *at = (const char *)map + ALIGN8(sizeof(h));
+		loaded.trie.assign((Node const *)at, (Node const *)at + h.nodes);
+		at += ALIGN8(h.nodes * sizeof(Node));
+		loaded.table.assign((uint32_t const *)at, (uint32_t const *)at + h.table);
+		at += ALIGN8(h.table * sizeof(uint32_t));
+		loaded.names.assign(at, at + h.names);
+		at += ALIGN8(h.names);
+		loaded.arena.assign(at, at + h.arena);
+		loaded.free_nodes = h.free_nodes;
+		loaded.nodes_live = h.nodes_live;
+		loaded.table_used = h.table_used;
+		loaded.table_removed = h.table_removed;
+		loaded.names_garbage = h.names_garbage;
+		loaded.arena_garbage = h.arena_garbage;
+		loaded.values = h.values;
+		ok = loaded.valid();
+	}
+	munmap(map, size);
+	if (!ok) {
+		snprintf(errstr, sizeof(errstr), "%s is not a retained snapshot or is damaged", path);
+		return -1;
+	}
+	trie.swap(loaded.trie);
+	table.swap(loaded.table);
+	names.swap(loaded.names);
+	arena.swap(loaded.arena);
+	free_nodes = loaded.free_nodes;
+	nodes_live = loaded.nodes_live;
+	table_used = loaded.table_used;
+	table_removed = loaded.table_removed;
+	names_garbage = loaded.names_garbage;
+	arena_garbage = loaded.arena_garbage;
+	values = loaded.values;
+	changes++;
+	return 0;
+}
+
+/*
+ * Everything a walk follows stays in bounds, and the child and sibling
+ * links agree with each other, so a damaged file can't send a lookup
+ * out of the arrays or round in circles.
+ */
+bool MqttRetainStore::valid() const
+{
+	size_t count = trie.size();
+	Node const &root = trie[0];
+	if (root.parent != NONE || root.next != NONE || root.prev != NONE || root.value != NO_VALUE) return false;
+	size_t live = 0, valued = 0;
+	for (size_t i = 0; i < count; i++) {
+		Node const &nd = trie[i];
+		if (nd.parent == TOMBSTONE) continue;
+		live++;
+		if (nd.parent >= count || nd.child >= count || nd.next >= count || nd.prev >= count) return false;
+		if ((uint64_t)nd.name + nd.namelen > names.size()) return false;
+		if (nd.child != NONE && (trie[nd.child].parent != i || trie[nd.child].prev != NONE)) return false;
+		if (nd.next != NONE && (trie[nd.next].parent != nd.parent || trie[nd.next].prev != i)) return false;
+		if (nd.prev != NONE && (trie[nd.prev].parent != nd.parent || trie[nd.prev].next != i)) return false;
+		if (i != 0 && nd.prev == NONE && trie[nd.parent].child != i) return false;
+		if (nd.value == NO_VALUE) continue;
+		if (nd.value % 8 != 0 || nd.value + sizeof(Record) > arena.size()) return false;
+		Record const *r = (Record const *)(arena.data() + nd.value);
+		if (nd.value + record_size(r->topiclen, r->payloadlen) > arena.size()) return false;
+		valued++;
+	}
+	if (live != nodes_live || valued != values) return false;
+
+	/* the free list holds exactly the free trie, once each */
+	size_t unused = 0;
+	for (uint32_t n = free_nodes; n != NONE; n = trie[n].next) {
+		if (n >= count || trie[n].parent != TOMBSTONE || ++unused > count - live) return false;
+	}
+	if (unused != count - live) return false;
+
+	/* and every probe ends at an empty slot */
+	size_t used = 0, removed = 0;
+	for (uint32_t n : table) {
+		if (n == TOMBSTONE) {
+			removed++;
+		} else if (n != 0) {
+			if (n >= count || trie[n].parent == TOMBSTONE) return false;
+			used++;
+		}
+	}
+	return used == table_used && removed == table_removed && used + removed < table.size();
+}
@@ -0,0 +1,222 @@
+/*
+ * retain.h - retained message store with a wildcard index and snapshots
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_RETAIN_H
+#define __MQTT_RETAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+#include <vector>
+
+#define MQTT_RETAIN_COMPACT_MIN (1024*1024) //garbage worth compacting an arena for
+
+/* a retained message, its views valid until the store next changes */
+struct MqttRetained {
+	std::string_view topic;
+	std::string_view payload;
+	uint8_t qos;
+};
+
+/*
+ * Retained messages by topic, for brokers and bridges.
+ *
+ * The index is a trie with one node per topic level. A node's exact
+ * children are found through one open addressed table keyed by (node,
+ * level), and are also linked as siblings, so a SUBSCRIBE's filter is
+ * walked level by level: an exact level is one probe, '+' runs over the
+ * children of the trie reached so far and '#' over their subtrees.
+ * "site/#" touches the site subtree and nothing else, however many
+ * retained topics there are.
+ *
+ * Level names and messages live in two arenas, appended to and
+ * compacted once more than half of one is garbage. Nodes, table and
+ * arenas are flat arrays of indices and offsets, so a snapshot is
+ * those arrays written through a mapping, and loading one is a copy
+ * back plus a bounds check, with no replay.
+ *
+ * Not thread safe. A snapshot can be written from a forked child while
+ * the parent carries on; save() doesn't allocate for that reason.
+ */
+class MqttRetainStore {
+public:
+	MqttRetainStore();
+
+	/* retain payload for topic; an empty payload removes it, as in MQTT */
+	void set(std::string_view topic, std::string_view payload, uint8_t qos);
+	/* false when nothing was retained for topic */
+	bool remove(std::string_view topic);
+	bool get(std::string_view topic, MqttRetained *msg) const;
+	void clear();
+
+	/* fn(MqttRetained const &) for every retained message filter matches */
+	template <typename F>
+	void match(std::string_view filter, F &&fn) const
+	{
+		std::string_view levels[MQTT_RETAIN_MAX_DEPTH];
+		int depth = 0;
+		size_t pos = 0;
+		for (;;) {
+			size_t end = filter.find('/', pos);
+			if (end == std::string_view::npos) end = filter.size();
+			if (depth == MQTT_RETAIN_MAX_DEPTH) return;
+			levels[depth++] = filter.substr(pos, end - pos);
+			if (end == filter.size()) break;
+			pos = end + 1;
+		}
+		walk(0, levels, 0, depth, fn);
+	}
+
+	/* 0, or -1 with errstr set; the file is replaced whole or not at all */
+	int save(const char *path);
+	/* replaces the contents; 0, -1 with errstr set when it's missing or damaged */
+	int load(const char *path);
+
+	size_t size() const { return values; }
+	size_t nodes() const { return nodes_live; }
+	size_t memory() const;
+	uint64_t changes = 0; //bumped by every set and remove, for deciding when to save
+	char errstr[256] = {};
+private:
+	static constexpr int MQTT_RETAIN_MAX_DEPTH = 128; //levels in a filter
+	static constexpr uint32_t NONE = 0; //the root is nobody's child or sibling
+	static constexpr uint32_t TOMBSTONE = ~0u;
+	static constexpr uint64_t NO_VALUE = ~0ULL;
+
+	struct Node {
+		uint32_t parent;
+		uint32_t child; //first
+		uint32_t next; //siblings; next links the free list too
+		uint32_t prev;
+		uint32_t hash; //of the level name
+		uint32_t name; //offset in names
+		uint32_t namelen;
+		uint32_t reserved;
+		uint64_t value; //offset of its Record in arena, or NO_VALUE
+	};
+
+	/* in the arena, followed by the topic and the payload, 8-byte aligned */
+	struct Record {
+		uint32_t payloadlen;
+		uint16_t topiclen;
+		uint8_t qos;
+		uint8_t reserved;
+	};
+
+	static size_t record_size(size_t topiclen, size_t payloadlen)
+	{
+		return (sizeof(Record) + topiclen + payloadlen + 7) & ~(size_t)7;
+	}
+
+	MqttRetained message(Node const &nd) const
+	{
+		Record const *r = (Record const *)(arena.data() + nd.value);
+		const char *topic = (const char *)(r + 1);
+		return {std::string_view(topic, r->topiclen), std::string_view(topic + r->topiclen, r->payloadlen), r->qos};
+	}
+
+	std::string_view name(Node const &nd) const
+	{
+		return std::string_view(names.data() + nd.name, nd.namelen);
+	}
+
+	/* levels [level, depth) of the filter from n */
+	template <typename F>
+	void walk(uint32_t n, std::string_view const *levels, int level, int depth, F &fn) const
+	{
+		if (level == depth) {
+			if (trie[n].value != NO_VALUE) fn(message(trie[n]));
+			return;
+		}
+		std::string_view l = levels[level];
+		/* wildcards at the first level don't match $SYS and the like */
+		bool system = (n == 0);
+		if (l == "#") {
+			if (n != 0 && trie[n].value != NO_VALUE) fn(message(trie[n])); //"a/#" matches "a" too
+			for (uint32_t c = trie[n].child; c != NONE; c = trie[c].next) {
+				if (system && trie[c].namelen > 0 && names[trie[c].name] == '$') continue;
+				subtree(c, fn);
+			}
+		} else if (l == "+") {
+			for (uint32_t c = trie[n].child; c != NONE; c = trie[c].next) {
+				if (system && trie[c].namelen > 0 && names[trie[c].name] == '$') continue;
+				walk(c, levels, level + 1, depth, fn);
+			}
+		} else {
+			uint32_t c = find(n, l, level_hash(l));
+			if (c != NONE) walk(c, levels, level + 1, depth, fn);
+		}
+	}
+
+	/* every value under and at n, without a stack: down, across, then back up */
+	template <typename F>
+	void subtree(uint32_t top, F &fn) const
+	{
+		uint32_t n = top;
+		for (;;) {
+			if (trie[n].value != NO_VALUE) fn(message(trie[n]));
+			if (trie[n].child != NONE) {
+				n = trie[n].child;
+				continue;
+			}
+			while (n != top && trie[n].next == NONE) n = trie[n].parent;
+			if (n == top) return;
+			n = trie[n].next;
+		}
+	}
+
+	static uint32_t level_hash(std::string_view level);
+	static size_t slot_of(uint32_t parent, uint32_t hash, size_t mask);
+	uint32_t find(uint32_t parent, std::string_view level, uint32_t hash) const;
+	uint32_t lookup(std::string_view topic) const;
+	uint32_t child(uint32_t parent, std::string_view level);
+	uint32_t alloc_node();
+	void insert_slot(uint32_t n);
+	void remove_slot(uint32_t n);
+	void rehash(size_t slots);
+	void drop_value(Node &nd);
+	void prune(uint32_t n);
+	void compact_names();
+	void compact_arena();
+	bool valid() const;
+
+	std::vector<Node> trie; //nodes, the root first
+	std::vector<uint32_t> table; //exact children by (parent, level), 0 empty
+	std::vector<char> names;
+	std::vector<char> arena;
+	uint32_t free_nodes = NONE;
+	size_t nodes_live = 1;
+	size_t table_used = 0, table_removed = 0;
+	size_t names_garbage = 0, arena_garbage = 0;
+	size_t values = 0;
+};
+
+#endif /* __MQTT_RETAIN_H */
@@ -0,0 +1,740 @@
+/*
+ * topictrie.h - wildcard topic trie for subscription matching
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_TOPICTRIE_H
+#define __MQTT_TOPICTRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#define MQTT_TRIE_MAX_DEPTH 64 //levels in a filter
+#define MQTT_TRIE_READERS 64 //Readers at once, more fall back to the lock
+#define MQTT_TRIE_CHUNK_MIN 64 //nodes in the first chunk, each next one twice that
+#define MQTT_TRIE_CHUNKS 26 //so up to 4G nodes
+
+/*
+ * Subscriptions keyed by topic filter, one trie level per topic level.
+ *
+ * Level strings are interned once into 32-bit tokens, and a node's
+ * exact children are found through one open addressed table keyed by
+ * (node, token), so a lookup is a hash and a probe instead of a string
+ * compare per child. '+' and '#' children have slots of their own in
+ * the node. Nodes sit in chunks doubling in size and are referred to by
+ * index; a node is 40 bytes and never moves, and an empty trie is a
+ * few KB.
+ *
+ * Matching a topic costs O(depth) lookups plus whatever the wildcards
+ * branch into, however many subscriptions there are.
+ *
+ * Writers (subscribe, unsubscribe) serialize on a mutex. Readers don't
+ * lock: everything they walk is either published with a release store
+ * and never changed afterwards (subscriber arrays, tables, tokens) or
+ * appended to in place behind a release-stored count. Replaced or
+ * removed pieces are retired, and freed once every Reader that could
+ * have seen them has left (epoch based reclamation). Use a Reader on
+ * threads other than the writer's; match() on the trie itself is for
+ * callers that don't write concurrently.
+ *
+ * Key identifies a subscriber: subscribing the same key to the same
+ * filter again replaces its Value. Both must be trivially copyable and
+ * Key comparable. Filters are expected to be valid already ('+' and '#'
+ * whole levels, '#' last); the match callback must not subscribe or
+ * unsubscribe.
+ */
+template <typename Key, typename Value>
+class MqttTopicTrie {
+	static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+		"subscriber arrays are copied with memcpy");
+public:
+	struct Entry {
+		Key key;
+		Value value;
+	};
+
+	MqttTopicTrie()
+	{
+		edges.store(edges_new(16));
+		tokens.store(tokens_new(16));
+		alloc_node(0, nullptr, EXACT); //the root
+	}
+
+	~MqttTopicTrie()
+	{
+		for (auto &r : limbo) release(r);
+		for (uint32_t i = 0; i < nodes_allocated; i++) free(node(i)->subs.load());
+		EdgeTable *e = edges.load();
+		delete[] e->slots;
+		delete e;
+		TokenTable *t = tokens.load();
+		for (size_t i = 0; i <= t->mask; i++) {
+			Token *token = t->slots[i].load();
+			if (token && token != TOMBSTONE) free(token);
+		}
+		delete[] t->slots;
+		delete t;
+		for (auto &chunk : chunks) delete[] chunk.load();
+	}
+
+	MqttTopicTrie(MqttTopicTrie const &) = delete;
+	MqttTopicTrie &operator=(MqttTopicTrie const &) = delete;
+
+	/* true for a new subscription, false when it replaced one or the filter is too deep */
+	bool subscribe(std::string_view filter, Key const &key, Value const &value)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (depth_of(filter) > MQTT_TRIE_MAX_DEPTH) return false;
+		uint32_t n = 0;
+		for_each_level(filter, [&](std::string_view level) {
+			n = child(n, level, true);
+		});
+		Node *nd = node(n);
+		Subs *s = nd->subs.load(std::memory_order_relaxed);
+		uint32_t count = s ? s->count.load(std::memory_order_relaxed) : 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (!(s->items()[i].key == key)) continue;
+			Subs *copy = subs_new(s->capacity);
+			memcpy(copy->items(), s->items(), count * sizeof(Entry));
+			copy->items()[i].value = value;
+			copy->count.store(count, std::memory_order_relaxed);
+			nd->subs.store(copy, std::memory_order_release);
+			retire(s, SUBS);
+			return false;
+		}
+		if (s && count < s->capacity) {
+			s->items()[count] = Entry{key, value};
+			s->count.store(count + 1, std::memory_order_release);
+		} else {
+			Subs *grown = subs_new(count ? count * 2 : 1);
+			if (count) memcpy(grown->items(), s->items(), count * sizeof(Entry));
+			grown->items()[count] = Entry{key, value};
+			grown->count.store(count + 1, std::memory_order_relaxed);
+			nd->subs.store(grown, std::memory_order_release);
+			if (s) retire(s, SUBS);
+		}
+		subscriptions++;
+		return true;
+	}
+
+	/* false when key wasn't subscribed to filter */
+	bool unsubscribe(std::string_view filter, Key const &key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint32_t n = 0;
+		bool found = true;
+		for_each_level(filter, [&](std::string_view level) {
+			if (found) n = child(n, level, false);
+			found = n != NONE;
+		});
+		if (!found) return false;
+		Node *nd = node(n);
+		Subs *s = nd->subs.load(std::memory_order_relaxed);
+		uint32_t count = s ? s->count.load(std::memory_order_relaxed) : 0;
+		uint32_t i = 0;
+		while (i < count && !(s->items()[i].key == key)) i++;
+		if (i == count) return false;
+
+		Subs *rest = nullptr;
+		if (count > 1) {
+			rest = subs_new(count - 1);
+			memcpy(rest->items(), s->items(), i * sizeof(Entry));
+			memcpy(rest->items() + i, s->items() + i + 1, (count - i - 1) * sizeof(Entry));
+			rest->count.store(count - 1, std::memory_order_relaxed);
+		}
+		nd->subs.store(rest, std::memory_order_release);
+		retire(s, SUBS);
+		subscriptions--;
+		prune(n);
+		return true;
+	}
+
+	/* drop every subscription to filter, returns how many there were */
+	size_t erase(std::string_view filter)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint32_t n = 0;
+		bool found = true;
+		for_each_level(filter, [&](std::string_view level) {
+			if (found) n = child(n, level, false);
+			found = n != NONE;
+		});
+		if (!found) return 0;
+		Node *nd = node(n);
+		Subs *s = nd->subs.load(std::memory_order_relaxed);
+		if (!s) return 0;
+		size_t count = s->count.load(std::memory_order_relaxed);
+		nd->subs.store(nullptr, std::memory_order_release);
+		retire(s, SUBS);
+		subscriptions -= count;
+		prune(n);
+		return count;
+	}
+
+	/* fn(key, value) for every subscription whose filter matches topic */
+	template <typename F>
+	void match(std::string_view topic, F &&fn) const
+	{
+		uint32_t levels[MQTT_TRIE_MAX_DEPTH];
+		int depth = 0;
+		bool deeper = false; //than any filter without '#' can be
+		size_t pos = 0;
+		for (;;) {
+			size_t end = topic.find('/', pos);
+			if (end == std::string_view::npos) end = topic.size();
+			if (depth == MQTT_TRIE_MAX_DEPTH) {
+				deeper = true;
+				break;
+			}
+			levels[depth++] = lookup(topic.substr(pos, end - pos));
+			if (end == topic.size()) break;
+			pos = end + 1;
+		}
+		/* wildcards at the first level don't match $SYS and the like */
+		bool system = !topic.empty() && topic[0] == '$';
+
+		struct Frame {
+			uint32_t node;
+			int level;
+		};
+		Frame stack[2 * MQTT_TRIE_MAX_DEPTH + 2];
+		int top = 0;
+		stack[top++] = {0, 0};
+		while (top > 0) {
+			Frame f = stack[--top];
+			Node *nd = node(f.node);
+			bool wild = !(system && f.level == 0);
+			if (wild) {
+				uint32_t h = nd->hash.load(std::memory_order_acquire);
+				if (h != NONE) visit(node(h), fn); //"a/#" matches "a" too
+			}
+			if (f.level == depth) {
+				if (!deeper) visit(nd, fn);
+				continue;
+			}
+			if (wild) {
+				uint32_t p = nd->plus.load(std::memory_order_acquire);
+				if (p != NONE) stack[top++] = {p, f.level + 1};
+			}
+			if (levels[f.level] != NONE) {
+				uint32_t c = edge(f.node, levels[f.level]);
+				if (c != NONE) stack[top++] = {c, f.level + 1};
+			}
+		}
+	}
+
+	/* a reading thread's claim on the trie */
+	class Reader {
+	public:
+		explicit Reader(MqttTopicTrie &trie) : trie(trie)
+		{
+			for (int i = 0; i < MQTT_TRIE_READERS; i++) {
+				bool expected = false;
+				if (trie.readers[i].used.compare_exchange_strong(expected, true)) {
+					slot = i;
+					break;
+				}
+			}
+		}
+
+		~Reader()
+		{
+			if (slot >= 0) trie.readers[slot].used.store(false, std::memory_order_release);
+		}
+
+		Reader(Reader const &) = delete;
+		Reader &operator=(Reader const &) = delete;
+
+		template <typename F>
+		void match(std::string_view topic, F &&fn)
+		{
+			if (slot < 0) {
+				std::lock_guard<std::mutex> lock(trie.mutex);
+				trie.match(topic, fn);
+				return;
+			}
+			/* the epoch has to be announced before the writer moves past it */
+			auto &epoch = trie.readers[slot].epoch;
+			uint64_t e;
+			do {
+				e = trie.epoch.load(std::memory_order_seq_cst);
+				epoch.store(e, std::memory_order_seq_cst);
+			} while (trie.epoch.load(std::memory_order_seq_cst) != e);
+			trie.match(topic, fn);
+			epoch.store(0, std::memory_order_release);
+		}
+	private:
+		MqttTopicTrie &trie;
+		int slot = -1;
+	};
+
+	size_t size() const { return subscriptions; }
+	size_t nodes() const { return nodes_live; }
+	size_t memory() const { return bytes; } //allocated for the trie, roughly
+private:
+	static constexpr uint32_t NONE = 0; //the root is nobody's child
+	enum { EXACT, PLUS, HASH };
+	enum { SUBS, EDGES, TOKENS, TOKEN, NODE };
+
+	/* an interned level string */
+	struct Token {
+		size_t hash;
+		uint32_t id;
+		uint32_t refs; //edges using it
+		uint32_t len;
+		char *str() { return (char *)(this + 1); }
+	};
+	static inline Token *const TOMBSTONE = (Token *)1;
+
+	struct TokenTable {
+		size_t mask;
+		std::atomic<Token *> *slots;
+	};
+
+	struct Edge {
+		std::atomic<uint64_t> key; //parent << 32 | token id
+		std::atomic<uint32_t> child;
+	};
+	static constexpr uint64_t EDGE_REMOVED = ~0ULL;
+
+	struct EdgeTable {
+		size_t mask;
+		Edge *slots;
+	};
+
+	/* grows in place behind count, anything else makes a new copy */
+	struct alignas(alignof(Entry) > 8 ? alignof(Entry) : 8) Subs {
+		std::atomic<uint32_t> count;
+		uint32_t capacity;
+		Entry *items() { return (Entry *)(this + 1); }
+	};
+
+	struct Node {
+		std::atomic<uint32_t> plus{NONE};
+		std::atomic<uint32_t> hash{NONE};
+		std::atomic<Subs *> subs{nullptr};
+		/* writer side */
+		Token *token = nullptr;
+		uint32_t parent = 0;
+		uint32_t children = 0;
+		uint8_t kind = EXACT;
+	};
+
+	struct Retired {
+		uint64_t epoch;
+		int kind;
+		void *ptr;
+		uint32_t index;
+	};
+
+	struct alignas(64) ReaderSlot {
+		std::atomic<uint64_t> epoch{0}; //0 when not reading
+		std::atomic<bool> used{false};
+	};
+
+	template <typename F>
+	static void for_each_level(std::string_view s, F f)
+	{
+		size_t pos = 0;
+		for (;;) {
+			size_t end = s.find('/', pos);
+			if (end == std::string_view::npos) end = s.size();
+			f(s.substr(pos, end - pos));
+			if (end == s.size()) return;
+			pos = end + 1;
+		}
+	}
+
+	static int depth_of(std::string_view s)
+	{
+		int n = 1;
+		for (char ch : s) n += ch == '/';
+		return n;
+	}
+
+	static uint64_t mix(uint64_t x)
+	{
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	static int chunk_of(uint32_t i)
+	{
+		return std::bit_width(i / MQTT_TRIE_CHUNK_MIN + 1) - 1;
+	}
+
+	static uint32_t chunk_base(int c)
+	{
+		return MQTT_TRIE_CHUNK_MIN * ((1u << c) - 1);
+	}
+
+	Node *node(uint32_t i) const
+	{
+		int c = chunk_of(i);
+		return &chunks[c].load(std::memory_order_acquire)[i - chunk_base(c)];
+	}
+
+	template <typename F>
+	static void visit(Node *nd, F &fn)
+	{
+		Subs *s = nd->subs.load(std::memory_order_acquire);
+		if (!s) return;
+		uint32_t count = s->count.load(std::memory_order_acquire);
+		Entry *items = s->items();
+		for (uint32_t i = 0; i < count; i++) fn(items[i].key, items[i].value);
+	}
+
+	/* the token id of a level, NONE if no filter has it */
+	uint32_t lookup(std::string_view level) const
+	{
+		Token *t = find_token(level, std::hash<std::string_view>()(level));
+		return t ? t->id : NONE;
+	}
+
+	Token *find_token(std::string_view level, size_t h) const
+	{
+		TokenTable *table = tokens.load(std::memory_order_acquire);
+		for (size_t i = h & table->mask;; i = (i + 1) & table->mask) {
+			Token *t = table->slots[i].load(std::memory_order_acquire);
+			if (!t) return nullptr;
+			if (t != TOMBSTONE && t->hash == h && t->len == level.size() &&
+				memcmp(t->str(), level.data(), level.size()) == 0) {
+				return t;
+			}
+		}
+	}
+
+	uint32_t edge(uint32_t parent, uint32_t token) const
+	{
+		uint64_t key = (uint64_t)parent << 32 | token;
+		EdgeTable *table = edges.load(std::memory_order_acquire);
+		for (size_t i = mix(key) & table->mask;; i = (i + 1) & table->mask) {
+			uint64_t k = table->slots[i].key.load(std::memory_order_acquire);
+			if (k == key) return table->slots[i].child.load(std::memory_order_relaxed);
+			if (k == 0) return NONE;
+		}
+	}
+
+	/*---------------------------------------
+	** Writer side, under the mutex.
+	---------------------------------------*/
+	uint32_t child(uint32_t n, std::string_view level, bool create)
+	{
+		Node *nd = node(n);
+		if (level == "+" || level == "#") {
+			std::atomic<uint32_t> &slot = (level == "+") ? nd->plus : nd->hash;
+			uint32_t c = slot.load(std::memory_order_relaxed);
+			if (c != NONE || !create) return c;
+			c = alloc_node(n, nullptr, level == "+" ? PLUS : HASH);
+			slot.store(c, std::memory_order_release);
+			nd->children++;
+			return c;
+		}
+		size_t h = std::hash<std::string_view>()(level);
+		Token *t = find_token(level, h);
+		if (t) {
+			uint32_t c = edge(n, t->id);
+			if (c != NONE || !create) return c;
+		} else if (!create) {
+			return NONE;
+		} else {
+			t = intern(level, h);
+		}
+		uint32_t c = alloc_node(n, t, EXACT);
+		insert_edge((uint64_t)n << 32 | t->id, c);
+		t->refs++;
+		nd->children++;
+		return c;
+	}
+
+	/* drop nodes left with nothing under them, bottom up */
+	void prune(uint32_t n)
+	{
+		while (n != 0) {
+			Node *nd = node(n);
+			if (nd->children > 0 || nd->subs.load(std::memory_order_relaxed)) return;
+			uint32_t parent = nd->parent;
+			Node *pn = node(parent);
+			if (nd->kind == PLUS) {
+				pn->plus.store(NONE, std::memory_order_release);
+			} else if (nd->kind == HASH) {
+				pn->hash.store(NONE, std::memory_order_release);
+			} else {
+				remove_edge((uint64_t)parent << 32 | nd->token->id);
+				if (--nd->token->refs == 0) remove_token(nd->token);
+			}
+			pn->children--;
+			nodes_live--;
+			retire(nullptr, NODE, n);
+			n = parent;
+		}
+	}
+
+	uint32_t alloc_node(uint32_t parent, Token *token, int kind)
+	{
+		uint32_t i;
+		if (!free_nodes.empty()) {
+			i = free_nodes.back();
+			free_nodes.pop_back();
+		} else {
+			i = nodes_allocated;
+			int c = chunk_of(i);
+			if (c >= MQTT_TRIE_CHUNKS) throw std::bad_alloc();
+			nodes_allocated++;
+			if (!chunks[c].load(std::memory_order_relaxed)) {
+				size_t n = (size_t)MQTT_TRIE_CHUNK_MIN << c;
+				chunks[c].store(new Node[n], std::memory_order_release);
+				bytes += n * sizeof(Node);
+			}
+		}
+		nodes_live++;
+		Node *nd = node(i);
+		nd->plus.store(NONE, std::memory_order_relaxed);
+		nd->hash.store(NONE, std::memory_order_relaxed);
+		nd->subs.store(nullptr, std::memory_order_relaxed);
+		nd->token = token;
+		nd->parent = parent;
+		nd->children = 0;
+		nd->kind = kind;
+		return i;
+	}
+
+	Subs *subs_new(uint32_t capacity)
+	{
+		Subs *s = (Subs *)malloc(sizeof(Subs) + capacity * sizeof(Entry));
+		if (!s) throw std::bad_alloc();
+		new (&s->count) std::atomic<uint32_t>(0);
+		s->capacity = capacity;
+		bytes += sizeof(Subs) + capacity * sizeof(Entry);
+		return s;
+	}
+
+	Token *intern(std::string_view level, size_t h)
+	{
+		TokenTable *table = tokens.load(std::memory_order_relaxed);
+		if ((tokens_used + tokens_removed + 1) * 2 > table->mask + 1) {
+			table = rehash_tokens();
+		}
+		Token *t = (Token *)malloc(sizeof(Token) + level.size());
+		if (!t) throw std::bad_alloc();
+		t->hash = h;
+		t->id = ++last_token; //never reused, readers may still hold an old one
+		t->refs = 0;
+		t->len = level.size();
+		memcpy(t->str(), level.data(), level.size());
+		bytes += sizeof(Token) + level.size();
+		size_t i = h & table->mask;
+		while (table->slots[i].load(std::memory_order_relaxed)) i = (i + 1) & table->mask;
+		table->slots[i].store(t, std::memory_order_release);
+		tokens_used++;
+		return t;
+	}
+
+	void remove_token(Token *t)
+	{
+		TokenTable *table = tokens.load(std::memory_order_relaxed);
+		size_t i = t->hash & table->mask;
+		while (table->slots[i].load(std::memory_order_relaxed) != t) i = (i + 1) & table->mask;
+		table->slots[i].store(TOMBSTONE, std::memory_order_release);
+		tokens_used--;
+		tokens_removed++;
+		bytes -= sizeof(Token) + t->len;
+		retire(t, TOKEN);
+	}
+
+	/* a fresh table, published whole; tombstones go away here */
+	TokenTable *rehash_tokens()
+	{
+		TokenTable *old = tokens.load(std::memory_order_relaxed);
+		size_t n = 16;
+		while (n < (tokens_used + 1) * 4) n <<= 1;
+		TokenTable *table = tokens_new(n);
+		for (size_t i = 0; i <= old->mask; i++) {
+			Token *t = old->slots[i].load(std::memory_order_relaxed);
+			if (!t || t == TOMBSTONE) continue;
+			size_t j = t->hash & table->mask;
+			while (table->slots[j].load(std::memory_order_relaxed)) j = (j + 1) & table->mask;
+			table->slots[j].store(t, std::memory_order_relaxed);
+		}
+		tokens_removed = 0;
+		tokens.store(table, std::memory_order_release);
+		bytes -= (old->mask + 1) * sizeof(std::atomic<Token *>);
+		retire(old, TOKENS);
+		return table;
+	}
+
+	TokenTable *tokens_new(size_t n)
+	{
+		TokenTable *table = new TokenTable;
+		table->mask = n - 1;
+		table->slots = new std::atomic<Token *>[n]();
+		bytes += n * sizeof(std::atomic<Token *>);
+		return table;
+	}
+
+	void insert_edge(uint64_t key, uint32_t child)
+	{
+		EdgeTable *table = edges.load(std::memory_order_relaxed);
+		if ((edges_used + edges_removed + 1) * 2 > table->mask + 1) {
+			table = rehash_edges();
+		}
+		size_t i = mix(key) & table->mask;
+		while (table->slots[i].key.load(std::memory_order_relaxed)) i = (i + 1) & table->mask;
+		table->slots[i].child.store(child, std::memory_order_relaxed);
+		table->slots[i].key.store(key, std::memory_order_release);
+		edges_used++;
+	}
+
+	/* the slot is only reused by a rehash, so a reader never sees its key with another child */
+	void remove_edge(uint64_t key)
+	{
+		EdgeTable *table = edges.load(std::memory_order_relaxed);
+		size_t i = mix(key) & table->mask;
+		while (table->slots[i].key.load(std::memory_order_relaxed) != key) i = (i + 1) & table->mask;
+		table->slots[i].key.store(EDGE_REMOVED, std::memory_order_release);
+		edges_used--;
+		edges_removed++;
+	}
+
+	EdgeTable *rehash_edges()
+	{
+		EdgeTable *old = edges.load(std::memory_order_relaxed);
+		size_t n = 16;
+		while (n < (edges_used + 1) * 4) n <<= 1;
+		EdgeTable *table = edges_new(n);
+		for (size_t i = 0; i <= old->mask; i++) {
+			uint64_t key = old->slots[i].key.load(std::memory_order_relaxed);
+			if (key == 0 || key == EDGE_REMOVED) continue;
+			size_t j = mix(key) & table->mask;
+			while (table->slots[j].key.load(std::memory_order_relaxed)) j = (j + 1) & table->mask;
+			table->slots[j].child.store(old->slots[i].child.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			table->slots[j].key.store(key, std::memory_order_relaxed);
+		}
+		edges_removed = 0;
+		edges.store(table, std::memory_order_release);
+		bytes -= (old->mask + 1) * sizeof(Edge);
+		retire(old, EDGES);
+		return table;
+	}
+
+	EdgeTable *edges_new(size_t n)
+	{
+		EdgeTable *table = new EdgeTable;
+		table->mask = n - 1;
+		table->slots = new Edge[n]();
+		bytes += n * sizeof(Edge);
+		return table;
+	}
+
+	/*---------------------------------------
+	** Epochs.
+	---------------------------------------*/
+	/*
+	 * Something unlinked at epoch e can only be reached by a Reader that
+	 * entered at e or before; once all Readers are past e or idle it goes.
+	 */
+	void retire(void *ptr, int kind, uint32_t index = 0)
+	{
+		if (kind == SUBS) bytes -= sizeof(Subs) + ((Subs *)ptr)->capacity * sizeof(Entry);
+		limbo.push_back({epoch.fetch_add(1, std::memory_order_seq_cst), kind, ptr, index});
+		if (limbo.size() >= 64) collect();
+	}
+
+	void collect()
+	{
+		uint64_t oldest = UINT64_MAX;
+		for (auto const &r : readers) {
+			uint64_t e = r.epoch.load(std::memory_order_seq_cst);
+			if (e != 0 && e < oldest) oldest = e;
+		}
+		size_t kept = 0;
+		for (auto &r : limbo) {
+			if (r.epoch < oldest) {
+				release(r);
+			} else {
+				limbo[kept++] = r;
+			}
+		}
+		limbo.resize(kept);
+	}
+
+	void release(Retired const &r)
+	{
+		switch (r.kind) {
+		case SUBS:
+		case TOKEN:
+			free(r.ptr);
+			break;
+		case EDGES:
+			delete[] ((EdgeTable *)r.ptr)->slots;
+			delete (EdgeTable *)r.ptr;
+			break;
+		case TOKENS:
+			delete[] ((TokenTable *)r.ptr)->slots;
+			delete (TokenTable *)r.ptr;
+			break;
+		case NODE:
+			free_nodes.push_back(r.index);
+			break;
+		}
+	}
+
+	std::atomic<Node *> chunks[MQTT_TRIE_CHUNKS] = {};
+	std::atomic<EdgeTable *> edges{nullptr};
+	std::atomic<TokenTable *> tokens{nullptr};
+
+	std::mutex mutex;
+	uint32_t nodes_allocated = 0;
+	size_t nodes_live = 0;
+	std::vector<uint32_t> free_nodes;
+	size_t edges_used = 0, edges_removed = 0;
+	size_t tokens_used = 0, tokens_removed = 0;
+	uint32_t last_token = 0;
+	size_t subscriptions = 0;
+	size_t bytes = 0;
+
+	std::atomic<uint64_t> epoch{1};
+	ReaderSlot readers[MQTT_TRIE_READERS];
+	std::vector<Retired> limbo;
+};
+
+#endif /* __MQTT_TOPICTRIE_H */
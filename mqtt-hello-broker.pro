@@ -0,0 +1,30 @@
+TEMPLATE = app
+TARGET = mqtt-hello-broker
+CONFIG += console c++2a
+
+DESTDIR = $$PWD/_bin
+
+HEADERS += \
+	broker/broker.h \
+	common/codec.h \
+	common/retain.h \
+	common/topictrie.h \
+	mqttc/ae.h \
+	mqttc/anet.h \
+	mqttc/config.h \
+	mqttc/reader.h \
+	mqttc/timer.h \
+	paho/MQTTConnect.h \
+	paho/MQTTPacket.h \
+	paho/MQTTPublish.h \
+	paho/MQTTSubscribe.h \
+	paho/MQTTUnsubscribe.h
+SOURCES += \
+	broker/broker.cpp \
+	broker/main.cpp \
+	common/retain.cpp \
+	mqttc/ae.cpp \
+	mqttc/anet.cpp \
+	mqttc/reader.cpp \
+	mqttc/timer.cpp \
+	paho/MQTTCodec.cpp
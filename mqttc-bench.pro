@@ -0,0 +1,72 @@
+TEMPLATE = app
+TARGET = mqttc-bench
+CONFIG += console c++2a
+DESTDIR = $$PWD/_bin
+
+
+HEADERS += \
+	common/codec.h \
+	common/retain.h \
+	common/topictrie.h \
+	bench/bench.h \
+	bench/fakebroker.h \
+	broker/broker.h \
+	mqttc/ae.h \
+	mqttc/alias.h \
+	mqttc/anet.h \
+	mqttc/config.h \
+	mqttc/inflight.h \
+	mqttc/mqtt.h \
+	mqttc/packet.h \
+	mqttc/persist.h \
+	mqttc/reader.h \
+	mqttc/resolve.h \
+	mqttc/shard.h \
+	mqttc/timer.h \
+	paho/MQTTPacket.h \
+	paho/MQTTPacketBuffer.h \
+	paho/MQTTReadAhead.h \
+	paho/MqttClient.h
+
+SOURCES += \
+	bench/main.cpp \
+	bench/bench_reader.cpp \
+	bench/bench_writev.cpp \
+	bench/bench_batch.cpp \
+	bench/bench_loop.cpp \
+	bench/bench_shard.cpp \
+	bench/bench_timer.cpp \
+	bench/bench_inflight.cpp \
+	bench/bench_qos2.cpp \
+	bench/bench_persist.cpp \
+	bench/bench_decode.cpp \
+	bench/bench_encode.cpp \
+	bench/bench_codec.cpp \
+	bench/bench_alias.cpp \
+	bench/bench_flow.cpp \
+	bench/bench_pahoread.cpp \
+	bench/bench_readahead.cpp \
+	bench/bench_pahoclient.cpp \
+	bench/bench_resolve.cpp \
+	bench/bench_pipeline.cpp \
+	bench/bench_broker.cpp \
+	bench/bench_trie.cpp \
+	bench/bench_dispatch.cpp \
+	bench/bench_fanout.cpp \
+	bench/bench_retain.cpp \
+	bench/fakebroker.cpp \
+	broker/broker.cpp \
+	common/retain.cpp \
+	mqttc/ae.cpp \
+	mqttc/anet.cpp \
+	mqttc/mqtt.cpp \
+	mqttc/persist.cpp \
+	mqttc/reader.cpp \
+	mqttc/resolve.cpp \
+	mqttc/shard.cpp \
+	mqttc/timer.cpp \
+	paho/MQTTCodec.cpp \
+	paho/MQTTPacket.c \
+	paho/MQTTPacketBuffer.c \
+	paho/MQTTReadAhead.c \
+	paho/MqttClient.cpp
@@ -1,21 +1,34 @@
 
 TEMPLATE = app
 TARGET = mqttc-publish
-CONFIG += console
+CONFIG += console c++2a
 DESTDIR = $$PWD/_bin
 
 
 HEADERS += \
+	common/codec.h \
+	common/topictrie.h \
+	mqttc/ae.h \
+	mqttc/alias.h \
 	mqttc/anet.h \
 	mqttc/client.h \
 	mqttc/config.h \
+	mqttc/inflight.h \
 	mqttc/mqtt.h \
 	mqttc/packet.h \
+	mqttc/persist.h \
+	mqttc/reader.h \
+	mqttc/resolve.h \
+	mqttc/timer.h \
 	mqttserver.h
 
 SOURCES += \
+	mqttc/ae.cpp \
     mqttc/anet.cpp \
 	mqttc/client.cpp \
 	mqttc/mqtt.cpp \
-    mqttc/packet.cpp \
+	mqttc/persist.cpp \
+	mqttc/reader.cpp \
+	mqttc/resolve.cpp \
+	mqttc/timer.cpp \
     mqttc/publish.cpp
@@ -1,20 +1,33 @@
 
 TEMPLATE = app
 TARGET = mqttc-subscribe
-CONFIG += console
+CONFIG += console c++2a
 DESTDIR = $$PWD/_bin
 
 
 HEADERS += \
+	common/codec.h \
+	common/topictrie.h \
+	mqttc/ae.h \
+	mqttc/alias.h \
 	mqttc/anet.h \
 	mqttc/config.h \
+	mqttc/inflight.h \
 	mqttc/mqtt.h \
 	mqttc/packet.h \
-	mqttc/client.h
+	mqttc/persist.h \
+	mqttc/reader.h \
+	mqttc/resolve.h \
+	mqttc/client.h \
+	mqttc/timer.h
 
 SOURCES += \
+	mqttc/ae.cpp \
 	mqttc/anet.cpp \
 	mqttc/client.cpp \
 	mqttc/mqtt.cpp \
-	mqttc/packet.cpp \
-	mqttc/subscribe.cpp
+	mqttc/persist.cpp \
+	mqttc/reader.cpp \
+	mqttc/resolve.cpp \
+	mqttc/subscribe.cpp \
+	mqttc/timer.cpp
@@ -0,0 +1,325 @@
+/* A simple event-driven programming library. Originally I wrote this code
+ * for the Jim's event-loop (Jim is a Tcl interpreter) but later translated
+ * it in form of a library for easy reuse.
+ *
+ * Copyright (c) 2006-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "ae.h"
+#include "config.h"
+
+/* Include the best multiplexing layer supported by this system.
+ * The following should be ordered by performances, descending. */
+#ifdef HAVE_EPOLL
+#include "ae_epoll.cpp"
+#else
+	#ifdef HAVE_KQUEUE
+	#include "ae_kqueue.cpp"
+	#else
+	#include "ae_select.cpp"
+	#endif
+#endif
+
+aeEventLoop *aeCreateEventLoop(int setsize)
+{
+	aeEventLoop *eventLoop;
+	int i;
+
+	if ((eventLoop = (aeEventLoop *)calloc(1, sizeof(*eventLoop))) == NULL) goto err;
+	eventLoop->events = (aeFileEvent *)malloc(sizeof(aeFileEvent) * setsize);
+	eventLoop->fired = (aeFiredEvent *)malloc(sizeof(aeFiredEvent) * setsize);
+	if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
+	eventLoop->setsize = setsize;
+	eventLoop->timers = new MqttTimerWheel();
+	eventLoop->timeEvents = new std::unordered_map<long long, aeTimeEvent *>();
+	eventLoop->timeEventNextId = 0;
+	eventLoop->stop = 0;
+	eventLoop->maxfd = -1;
+	eventLoop->beforesleep = NULL;
+	if (aeApiCreate(eventLoop) == -1) goto err;
+	/* Events with mask == AE_NONE are not set. So let's initialize the
+	 * vector with it. */
+	for (i = 0; i < setsize; i++)
+		eventLoop->events[i].mask = AE_NONE;
+	return eventLoop;
+
+err:
+	if (eventLoop) {
+		delete eventLoop->timers;
+		delete eventLoop->timeEvents;
+		free(eventLoop->events);
+		free(eventLoop->fired);
+		free(eventLoop);
+	}
+	return NULL;
+}
+
+void aeDeleteEventLoop(aeEventLoop *eventLoop)
+{
+	while (!eventLoop->timeEvents->empty())
+		aeDeleteTimeEvent(eventLoop, eventLoop->timeEvents->begin()->first);
+	delete eventLoop->timers;
+	delete eventLoop->timeEvents;
+	aeApiFree(eventLoop);
+	free(eventLoop->events);
+	free(eventLoop->fired);
+	free(eventLoop);
+}
+
+void aeStop(aeEventLoop *eventLoop)
+{
+	eventLoop->stop = 1;
+}
+
+int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
+		aeFileProc *proc, void *clientData)
+{
+	if (fd >= eventLoop->setsize) {
+		errno = ERANGE;
+		return AE_ERR;
+	}
+	aeFileEvent *fe = &eventLoop->events[fd];
+
+	if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+		return AE_ERR;
+	fe->mask |= mask;
+	if (mask & AE_READABLE) fe->rfileProc = proc;
+	if (mask & AE_WRITABLE) fe->wfileProc = proc;
+	fe->clientData = clientData;
+	if (fd > eventLoop->maxfd)
+		eventLoop->maxfd = fd;
+	return AE_OK;
+}
+
+void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	if (fd >= eventLoop->setsize) return;
+	aeFileEvent *fe = &eventLoop->events[fd];
+
+	if (fe->mask == AE_NONE) return;
+	fe->mask = fe->mask & (~mask);
+	if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
+		/* Update the max fd */
+		int j;
+
+		for (j = eventLoop->maxfd-1; j >= 0; j--)
+			if (eventLoop->events[j].mask != AE_NONE) break;
+		eventLoop->maxfd = j;
+	}
+	aeApiDelEvent(eventLoop, fd, mask);
+}
+
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd)
+{
+	if (fd >= eventLoop->setsize) return 0;
+	aeFileEvent *fe = &eventLoop->events[fd];
+
+	return fe->mask;
+}
+
+static void aeTimeEventProc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientData)
+{
+	aeTimeEvent *te = (aeTimeEvent *)clientData;
+	aeEventLoop *eventLoop = te->eventLoop;
+	long long id = te->id;
+	AE_NOTUSED(timer);
+
+	int retval = te->timeProc(eventLoop, id, te->clientData);
+	/* the handler may have deleted its own event */
+	if (eventLoop->timeEvents->find(id) == eventLoop->timeEvents->end())
+		return;
+	if (retval != AE_NOMORE) {
+		wheel->add(&te->timer, retval, aeTimeEventProc, te);
+	} else {
+		aeDeleteTimeEvent(eventLoop, id);
+	}
+}
+
+/* Time events live in a timing wheel, so creating and deleting one is
+ * O(1) however many there are. */
+long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+		aeTimeProc *proc, void *clientData,
+		aeEventFinalizerProc *finalizerProc)
+{
+	long long id = eventLoop->timeEventNextId++;
+	aeTimeEvent *te = new aeTimeEvent;
+
+	te->id = id;
+	te->timeProc = proc;
+	te->finalizerProc = finalizerProc;
+	te->clientData = clientData;
+	te->eventLoop = eventLoop;
+	(*eventLoop->timeEvents)[id] = te;
+	eventLoop->timers->add(&te->timer, milliseconds, aeTimeEventProc, te);
+	return id;
+}
+
+int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
+{
+	auto it = eventLoop->timeEvents->find(id);
+	if (it == eventLoop->timeEvents->end())
+		return AE_ERR; /* NO event with the specified ID found */
+	aeTimeEvent *te = it->second;
+	eventLoop->timeEvents->erase(it);
+	eventLoop->timers->cancel(&te->timer);
+	if (te->finalizerProc)
+		te->finalizerProc(eventLoop, te->clientData);
+	delete te;
+	return AE_OK;
+}
+
+/* Process every pending time event, then every pending file event
+ * (that may be registered by time event callbacks just processed).
+ * Without special flags the function sleeps until some file event
+ * fires, or when the next time event occurs (if any).
+ *
+ * If flags is 0, the function does nothing and returns.
+ * if flags has AE_ALL_EVENTS set, all the kind of events are processed.
+ * if flags has AE_FILE_EVENTS set, file events are processed.
+ * if flags has AE_TIME_EVENTS set, time events are processed.
+ * if flags has AE_DONT_WAIT set the function returns ASAP until all
+ * the events that's possible to process without to wait are processed.
+ *
+ * The function returns the number of events processed. */
+int aeProcessEvents(aeEventLoop *eventLoop, int flags)
+{
+	int processed = 0, numevents;
+
+	/* Nothing to do? return ASAP */
+	if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
+
+	/* Note that we want call select() even if there are no
+	 * file events to process as long as we want to process time
+	 * events, in order to sleep until the next time event is ready
+	 * to fire. */
+	if (eventLoop->maxfd != -1 ||
+		((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
+		int j;
+		long long wait = -1;
+		struct timeval tv, *tvp;
+
+		if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
+			wait = eventLoop->timers->next_timeout(MqttTimerWheel::now());
+		if (wait >= 0) {
+			/* Sleep no longer than until the nearest timer may fire. */
+			tvp = &tv;
+			tvp->tv_sec = wait / 1000;
+			tvp->tv_usec = (wait % 1000) * 1000;
+		} else {
+			/* If we have to check for events but need to return
+			 * ASAP because of AE_DONT_WAIT we need to set the timeout
+			 * to zero */
+			if (flags & AE_DONT_WAIT) {
+				tv.tv_sec = tv.tv_usec = 0;
+				tvp = &tv;
+			} else {
+				/* Otherwise we can block */
+				tvp = NULL; /* wait forever */
+			}
+		}
+
+		numevents = aeApiPoll(eventLoop, tvp);
+		for (j = 0; j < numevents; j++) {
+			aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
+			int mask = eventLoop->fired[j].mask;
+			int fd = eventLoop->fired[j].fd;
+			int rfired = 0;
+
+			/* note the fe->mask & mask & ... code: maybe an already processed
+			 * event removed an element that fired and we still didn't
+			 * processed, so we check if the event is still valid. */
+			if (fe->mask & mask & AE_READABLE) {
+				rfired = 1;
+				fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+			}
+			if (fe->mask & mask & AE_WRITABLE) {
+				if (!rfired || fe->wfileProc != fe->rfileProc)
+					fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+			}
+			processed++;
+		}
+	}
+	/* Check time events */
+	if (flags & AE_TIME_EVENTS)
+		processed += eventLoop->timers->advance(MqttTimerWheel::now());
+
+	return processed; /* return the number of processed file/time events */
+}
+
+/* Wait for milliseconds until the given file descriptor becomes
+ * writable/readable/exception */
+int aeWait(int fd, int mask, long long milliseconds)
+{
+	struct pollfd pfd;
+	int retmask = 0, retval;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = fd;
+	if (mask & AE_READABLE) pfd.events |= POLLIN;
+	if (mask & AE_WRITABLE) pfd.events |= POLLOUT;
+
+	if ((retval = poll(&pfd, 1, milliseconds))== 1) {
+		if (pfd.revents & POLLIN) retmask |= AE_READABLE;
+		if (pfd.revents & POLLOUT) retmask |= AE_WRITABLE;
+		if (pfd.revents & POLLERR) retmask |= AE_WRITABLE;
+		if (pfd.revents & POLLHUP) retmask |= AE_WRITABLE;
+		return retmask;
+	} else {
+		return retval;
+	}
+}
+
+void aeMain(aeEventLoop *eventLoop)
+{
+	eventLoop->stop = 0;
+	while (!eventLoop->stop) {
+		if (eventLoop->beforesleep != NULL)
+			eventLoop->beforesleep(eventLoop);
+		aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+	}
+}
+
+const char *aeGetApiName(void)
+{
+	return aeApiName();
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep)
+{
+	eventLoop->beforesleep = beforesleep;
+}
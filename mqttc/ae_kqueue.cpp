@@ -0,0 +1,136 @@
+/* Kqueue(2)-based ae.c module
+ *
+ * Copyright (C) 2009 Harish Mallipeddi - harish.mallipeddi@gmail.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ */
+
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+typedef struct aeApiState {
+	int kqfd;
+	struct kevent *events;
+} aeApiState;
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+	aeApiState *state = (aeApiState *)malloc(sizeof(aeApiState));
+
+	if (!state) return -1;
+	state->events = (struct kevent *)malloc(sizeof(struct kevent)*eventLoop->setsize);
+	if (!state->events) {
+		free(state);
+		return -1;
+	}
+	state->kqfd = kqueue();
+	if (state->kqfd == -1) {
+		free(state->events);
+		free(state);
+		return -1;
+	}
+	eventLoop->apidata = state;
+	return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+	aeApiState *state = (aeApiState *)eventLoop->apidata;
+
+	close(state->kqfd);
+	free(state->events);
+	free(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = (aeApiState *)eventLoop->apidata;
+	struct kevent ke;
+
+	if (mask & AE_READABLE) {
+		EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+		if (kevent(state->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+	}
+	if (mask & AE_WRITABLE) {
+		EV_SET(&ke, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+		if (kevent(state->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+	}
+	return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = (aeApiState *)eventLoop->apidata;
+	struct kevent ke;
+
+	if (mask & AE_READABLE) {
+		EV_SET(&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(state->kqfd, &ke, 1, NULL, 0, NULL);
+	}
+	if (mask & AE_WRITABLE) {
+		EV_SET(&ke, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(state->kqfd, &ke, 1, NULL, 0, NULL);
+	}
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	aeApiState *state = (aeApiState *)eventLoop->apidata;
+	int retval, numevents = 0;
+
+	if (tvp != NULL) {
+		struct timespec timeout;
+		timeout.tv_sec = tvp->tv_sec;
+		timeout.tv_nsec = tvp->tv_usec * 1000;
+		retval = kevent(state->kqfd, NULL, 0, state->events, eventLoop->setsize,
+				&timeout);
+	} else {
+		retval = kevent(state->kqfd, NULL, 0, state->events, eventLoop->setsize,
+				NULL);
+	}
+
+	if (retval > 0) {
+		int j;
+
+		numevents = retval;
+		for(j = 0; j < numevents; j++) {
+			int mask = 0;
+			struct kevent *e = state->events+j;
+
+			if (e->filter == EVFILT_READ) mask |= AE_READABLE;
+			if (e->filter == EVFILT_WRITE) mask |= AE_WRITABLE;
+			eventLoop->fired[j].fd = e->ident;
+			eventLoop->fired[j].mask = mask;
+		}
+	}
+	return numevents;
+}
+
+static const char *aeApiName(void)
+{
+	return "kqueue";
+}
@@ -0,0 +1,164 @@
+/*
+ * alias.h - mqtt 5 topic alias maps, outbound and inbound
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_ALIAS_H
+#define __MQTT_ALIAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* a topic this short costs as much as its alias property */
+#define MQTT_ALIAS_MIN_TOPIC 4
+
+/*
+ * Outbound aliases. The broker says in CONNACK how many it will hold
+ * (Topic Alias Maximum), and every topic published gets one, the least
+ * recently used going first once they run out. The first PUBLISH of a
+ * topic carries its name and alias, later ones the alias and an empty
+ * topic. Aliases only live as long as the connection.
+ */
+class MqttTopicAliasCache {
+public:
+	/* a new connection; 0 turns aliasing off */
+	void reset(int max)
+	{
+		index.clear();
+		entries.assign(max > 0 ? max + 1 : 0, Entry());
+		if (!entries.empty()) entries[0].prev = entries[0].next = 0;
+		used = 0;
+	}
+
+	int capacity() const { return entries.empty() ? 0 : entries.size() - 1; }
+
+	/*
+	 * The alias to send topic with, 0 for none. *known says the broker
+	 * already maps it, so the topic itself can be left out.
+	 */
+	uint16_t lookup(std::string_view topic, bool *known)
+	{
+		*known = false;
+		if (entries.empty() || topic.size() < MQTT_ALIAS_MIN_TOPIC) return 0;
+		auto it = index.find(topic);
+		if (it != index.end()) {
+			uint16_t alias = it->second;
+			unlink(alias);
+			link_front(alias);
+			hits++;
+			*known = true;
+			return alias;
+		}
+		uint16_t alias;
+		if (used < entries.size() - 1) {
+			alias = ++used;
+			entries[alias].topic.assign(topic);
+			index.emplace(entries[alias].topic, alias);
+		} else {
+			//reuse the least recently used alias, and its index node
+			alias = entries[0].prev;
+			unlink(alias);
+			auto node = index.extract(entries[alias].topic);
+			entries[alias].topic.assign(topic);
+			node.key() = entries[alias].topic;
+			index.insert(std::move(node));
+		}
+		link_front(alias);
+		misses++;
+		return alias;
+	}
+
+	long long hits = 0;
+	long long misses = 0;
+private:
+	/* entries[alias], entries[0] heads the recency list */
+	struct Entry {
+		std::string topic;
+		uint16_t prev = 0;
+		uint16_t next = 0;
+	};
+
+	void unlink(uint16_t alias)
+	{
+		Entry &e = entries[alias];
+		entries[e.prev].next = e.next;
+		entries[e.next].prev = e.prev;
+	}
+
+	void link_front(uint16_t alias)
+	{
+		Entry &e = entries[alias];
+		e.prev = 0;
+		e.next = entries[0].next;
+		entries[e.next].prev = alias;
+		entries[0].next = alias;
+	}
+
+	std::vector<Entry> entries;
+	std::unordered_map<std::string_view, uint16_t> index; //views of entries' topics
+	size_t used = 0;
+};
+
+/*
+ * Inbound aliases, up to the Topic Alias Maximum we sent in CONNECT.
+ * A PUBLISH with a topic and an alias sets it, one with only the alias
+ * is resolved here.
+ */
+class MqttTopicAliasTable {
+public:
+	void reset(int max)
+	{
+		topics.resize(max > 0 ? max + 1 : 0);
+		for (std::string &topic : topics) topic.clear();
+	}
+
+	int capacity() const { return topics.empty() ? 0 : topics.size() - 1; }
+
+	/* false if alias is out of range */
+	bool set(uint16_t alias, std::string_view topic)
+	{
+		if (alias == 0 || alias >= topics.size()) return false;
+		topics[alias].assign(topic);
+		return true;
+	}
+
+	/* nullptr unless alias was set on this connection */
+	std::string const *get(uint16_t alias) const
+	{
+		if (alias == 0 || alias >= topics.size() || topics[alias].empty()) return nullptr;
+		return &topics[alias];
+	}
+private:
+	std::vector<std::string> topics;
+};
+
+#endif /* __MQTT_ALIAS_H */
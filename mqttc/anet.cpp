@@ -45,6 +45,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -54,9 +55,14 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static void anetSetError(char *err, const char *fmt, ...)
 {
 	va_list ap;
@@ -86,6 +92,22 @@ int anetNonBlock(char *err, int fd)
 	return ANET_OK;
 }
 
+int anetBlock(char *err, int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		anetSetError(err, "fcntl(F_GETFL): %s", strerror(errno));
+		return ANET_ERR;
+	}
+	if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		anetSetError(err, "fcntl(F_SETFL,~O_NONBLOCK): %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
 int anetTcpNoDelay(char *err, int fd)
 {
 	int yes = 1;
@@ -198,6 +220,49 @@ int anetTcpNonBlockConnect(char *err, char *addr, int port)
 	return anetTcpGenericConnect(err, addr, port, ANET_CONNECT_NONBLOCK);
 }
 
+#define ANET_CONNECT_FASTOPEN 2
+static int anetTcpGenericConnectAddr(char *err, const struct sockaddr *sa, socklen_t salen, int flags)
+{
+	int s;
+
+	s = anetCreateSocket(err, sa->sa_family);
+	if (s == ANET_ERR) return ANET_ERR;
+	if (anetNonBlock(err, s) != ANET_OK) {
+		close(s);
+		return ANET_ERR;
+	}
+#ifdef TCP_FASTOPEN_CONNECT
+	if (flags & ANET_CONNECT_FASTOPEN) {
+		int on = 1;
+		/* not fatal: the kernel may not have it, it's a plain connect then */
+		setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+	}
+#endif
+	if (connect(s, sa, salen) == -1 && errno != EINPROGRESS) {
+		anetSetError(err, "connect: %s", strerror(errno));
+		close(s);
+		return ANET_ERR;
+	}
+	return s;
+}
+
+/* Start connecting to an already resolved address, IPv4 or IPv6. The
+ * connect is usually still in progress: the socket turns writable when it
+ * is done and SO_ERROR tells how it went. */
+int anetTcpNonBlockConnectAddr(char *err, const struct sockaddr *sa, socklen_t salen)
+{
+	return anetTcpGenericConnectAddr(err, sa, salen, ANET_CONNECT_NONE);
+}
+
+/* The same with TCP Fast Open. Once the kernel holds a cookie for the
+ * server, connect returns at once and the SYN waits for the first write,
+ * which it carries; until then this is an ordinary connect that asks for
+ * a cookie. */
+int anetTcpFastOpenConnectAddr(char *err, const struct sockaddr *sa, socklen_t salen)
+{
+	return anetTcpGenericConnectAddr(err, sa, salen, ANET_CONNECT_FASTOPEN);
+}
+
 int anetUnixGenericConnect(char *err, char *path, int flags)
 {
 	int s;
@@ -261,6 +326,29 @@ int anetWrite(int fd, char *buf, int count)
 	return totlen;
 }
 
+/* Like writev(2) but make sure every iovec is written before to return
+ * (unless error is encountered). The iovec array is consumed in place. */
+int anetWritev(int fd, struct iovec *iov, int iovcnt)
+{
+	int nwritten, totlen = 0;
+	while (iovcnt > 0) {
+		nwritten = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (nwritten == 0) return totlen;
+		if (nwritten == -1) return -1;
+		totlen += nwritten;
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return totlen;
+}
+
 static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len)
 {
 	if (bind(s,sa,len) == -1) {
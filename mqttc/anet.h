@@ -31,7 +31,9 @@
 #ifndef __ANET_H
 #define __ANET_H
 
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #define ANET_OK 0
 #define ANET_ERR -1
@@ -43,6 +45,8 @@
 
 int anetTcpConnect(char *err, char *addr, int port);
 int anetTcpNonBlockConnect(char *err, char *addr, int port);
+int anetTcpNonBlockConnectAddr(char *err, const struct sockaddr *sa, socklen_t salen);
+int anetTcpFastOpenConnectAddr(char *err, const struct sockaddr *sa, socklen_t salen);
 int anetUnixConnect(char *err, char *path);
 int anetUnixNonBlockConnect(char *err, char *path);
 int anetRead(int fd, char *buf, int count);
@@ -52,7 +56,9 @@ int anetUnixServer(char *err, char *path, mode_t perm);
 int anetTcpAccept(char *err, int serversock, char *ip, int *port);
 int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
+int anetWritev(int fd, struct iovec *iov, int iovcnt);
 int anetNonBlock(char *err, int fd);
+int anetBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
 int anetPeerToString(int fd, char *ip, int *port);
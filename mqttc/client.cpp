@@ -168,11 +168,11 @@ static void on_disconnect(Mqtt *mqtt, void *data, int id)
 	//	printf("disconnect\n");
 }
 
-static void on_message(Mqtt *mqtt, MqttMsg *msg)
+static void on_message(Mqtt *mqtt, MqttMsgView const *msg)
 {
 	_NOTUSED(mqtt);
-	//	printf("received message: topic=%s, payload=%s\n", msg->topic, msg->payload);
-	puts(msg->payload.data());
+	//	printf("received message: topic=%.*s\n", (int)msg->topic.size(), msg->topic.data());
+	printf("%.*s\n", (int)msg->payload.size(), msg->payload.data());
 }
 
 void Client::set_callbacks()
@@ -199,7 +199,7 @@ void Client::set_callbacks()
 		type = (i << 4) & 0xf0;
 		this->mqtt->mqtt_set_callback(type, callbacks[i]);
 	}
-	this->mqtt->mqtt_set_msg_callback(on_message);
+	this->mqtt->mqtt_set_msg_view_callback(on_message);
 }
 
 static int setargs(char *args, char **argv)
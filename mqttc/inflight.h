@@ -0,0 +1,154 @@
+/*
+ * inflight.h - outbound QoS 1/2 packet ids awaiting acknowledgement
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_INFLIGHT_H
+#define __MQTT_INFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#define MQTT_INFLIGHT_MAX 65535
+
+/*
+ * Slots live in a dense array indexed by packet id masked to a power of
+ * two at least the window size, so a lookup is one index and nothing is
+ * allocated once the slots exist. Slot needs a uint16_t id, 0 when free;
+ * whatever else it holds is left alone on release so buffers get reused.
+ * An id whose slot is still busy has to be skipped when allocating.
+ */
+template <typename Slot>
+class MqttInflight {
+public:
+	/* only while nothing is in flight; minslots makes room for ids
+	 * that must not share a slot, such as a restored session's */
+	bool resize(int window, size_t minslots = 1)
+	{
+		if (count > 0 || window < 1 || window > MQTT_INFLIGHT_MAX) return false;
+		size_t n = 1;
+		while (n < (size_t)window || n < minslots) n <<= 1;
+		limit = window;
+		if (n != slots.size()) {
+			std::vector<Slot>(n).swap(slots);
+		}
+		return true;
+	}
+
+	int window() const { return limit; }
+	size_t capacity() const { return slots.size(); }
+	size_t size() const { return count; }
+	bool full() const { return count >= (size_t)limit; }
+
+	/* true when id can be handed out without clashing with a busy slot */
+	bool available(uint16_t id) const
+	{
+		return id != 0 && (slots.empty() || slots[id & (slots.size() - 1)].id == 0);
+	}
+
+	/* the slot holding id, or nullptr */
+	Slot *find(uint16_t id)
+	{
+		if (slots.empty() || id == 0) return nullptr;
+		Slot *slot = &slots[id & (slots.size() - 1)];
+		return slot->id == id ? slot : nullptr;
+	}
+
+	/* claim the slot of id, nullptr if it is busy or the window is full */
+	Slot *acquire(uint16_t id)
+	{
+		if (full() || !available(id)) return nullptr;
+		Slot *slot = &slots[id & (slots.size() - 1)];
+		slot->id = id;
+		count++;
+		return slot;
+	}
+
+	void release(Slot *slot)
+	{
+		if (!slot->id) return;
+		slot->id = 0;
+		count--;
+	}
+
+	/* busy slots, starting after the id that was handed out last */
+	template <typename F>
+	void each(uint16_t last, F f)
+	{
+		size_t n = slots.size();
+		for (size_t i = 1; i <= n; i++) {
+			Slot *slot = &slots[(last + i) & (n - 1)];
+			if (slot->id) f(slot);
+		}
+	}
+private:
+	std::vector<Slot> slots;
+	int limit = 0;
+	size_t count = 0;
+};
+
+/*
+ * One bit per packet id, for inbound QoS 2 messages received but not yet
+ * released. The 8KiB of bits are only allocated once a QoS 2 message
+ * arrives.
+ */
+class MqttPacketIdSet {
+public:
+	bool test(uint16_t id) const
+	{
+		return bits && (bits[id >> 6] >> (id & 63)) & 1;
+	}
+
+	/* returns whether id was already there */
+	bool insert(uint16_t id)
+	{
+		if (!bits) bits.reset(new uint64_t[WORDS]());
+		uint64_t mask = 1ULL << (id & 63);
+		bool had = bits[id >> 6] & mask;
+		bits[id >> 6] |= mask;
+		return had;
+	}
+
+	void erase(uint16_t id)
+	{
+		if (bits) bits[id >> 6] &= ~(1ULL << (id & 63));
+	}
+
+	void clear()
+	{
+		if (bits) memset(bits.get(), 0, WORDS * sizeof(uint64_t));
+	}
+private:
+	enum { WORDS = 65536 / 64 };
+	std::unique_ptr<uint64_t[]> bits;
+};
+
+#endif /* __MQTT_INFLIGHT_H */
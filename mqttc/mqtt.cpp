@@ -42,20 +42,32 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 
+#include "ae.h"
 #include "anet.h"
 #include "packet.h"
 #include "mqtt.h"
+#include "persist.h"
 
 #define MAX_RETRIES 3
 
-#define KEEPALIVE 100
+#define RETRY_INTERVAL 20
+
+#define INFLIGHT_WINDOW 64
 
-//#define KEEPALIVE_TIMEOUT (KEEPALIVE * 2)
+#define KEEPALIVE 100
 
 #define MQTT_NOTUSED(V) ((void) V)
 
 #define MQTT_BUFFER_SIZE (1024*16)
 
+/* packets up to this size are cheaper to copy than to gather */
+#define MQTT_SMALL_PACKET 512
+
+/* a corked connection flushes once this much output is pending */
+#define MQTT_OBUF_THRESHOLD (1024*64)
+
+static void _mqtt_set_error(char *err, const char *fmt, ...);
+
 /*
  * Why Buffer? May be used on resource limited os?
  */
@@ -66,9 +78,12 @@ std::shared_ptr<Mqtt> mqtt_new()
 	mqtt->cleansess = true;
 	mqtt->port = 1883;
 	mqtt->retries = MAX_RETRIES;
+	mqtt->retry_interval = RETRY_INTERVAL;
+	mqtt->inflight.resize(INFLIGHT_WINDOW);
 	mqtt->error = 0;
 	mqtt->msgid = 1;
 	mqtt->keepalive = KEEPALIVE;
+	mqtt->obuf_threshold = MQTT_OBUF_THRESHOLD;
 	for (int i = 0; i < 16; i++) {
 		mqtt->callbacks[i] = nullptr;
 	}
@@ -110,11 +125,111 @@ void Mqtt::mqtt_set_retries(int retries)
 	this->retries = retries;
 }
 
+//only connections driven by an event loop retry
+void Mqtt::mqtt_set_retry_interval(int interval)
+{
+	this->retry_interval = interval;
+}
+
+//at most window QoS 1/2 publishes unacknowledged, only while none are
+int Mqtt::mqtt_set_inflight_window(int window)
+{
+	return this->inflight.resize(window) ? MQTT_OK : MQTT_ERR;
+}
+
+/*
+ * Log the session to persist, which must be open, and pick up whatever it
+ * holds from the last run: those publishes are resent on the next CONNACK.
+ * Only useful without a clean session. MQTT_ERR when they can't all be
+ * restored, with the log left as it was.
+ */
+int Mqtt::mqtt_set_persist(std::shared_ptr<MqttPersist> const &persist)
+{
+	this->persist = persist;
+	if (!persist) return MQTT_OK;
+	std::vector<MqttPersistMsg> msgs = persist->outbound();
+	//the ids are whatever the last run had, so the table grows until none share a slot
+	size_t slots = 1;
+	for (bool clash = true; clash; ) {
+		slots <<= 1;
+		MqttPacketIdSet taken;
+		clash = false;
+		for (MqttPersistMsg &m : msgs) {
+			if (taken.insert(m.msg.id & (slots - 1))) {
+				clash = true;
+				break;
+			}
+		}
+	}
+	int window = this->inflight.window() < (int)msgs.size() ? (int)msgs.size() : this->inflight.window();
+	if (!msgs.empty() && (window > this->inflight.window() || slots > this->inflight.capacity()) &&
+		!this->inflight.resize(window, slots)) {
+		_mqtt_set_error(this->errstr, "persist: %zu messages restored while in flight", msgs.size());
+		this->persist.reset();
+		return MQTT_ERR;
+	}
+	for (MqttPersistMsg &m : msgs) {
+		MqttInflightSlot *slot = this->inflight.acquire(m.msg.id);
+		if (!slot) {
+			//left in the log for the next try
+			_mqtt_set_error(this->errstr, "persist: can't restore message %d", m.msg.id);
+			for (MqttPersistMsg &r : msgs) {
+				if (&r == &m) break;
+				this->inflight.release(this->inflight.find(r.msg.id));
+			}
+			this->persist.reset();
+			return MQTT_ERR;
+		}
+		slot->state = m.state;
+		slot->attempts = 0;
+		slot->mqtt = this;
+		slot->msg.id = m.msg.id;
+		slot->msg.qos = m.msg.qos;
+		slot->msg.retain = m.msg.retain;
+		slot->msg.dup = m.msg.dup;
+		slot->msg.topic.assign(m.msg.topic);
+		slot->msg.payload.assign(m.msg.payload.begin(), m.msg.payload.end());
+		this->msgid = m.msg.id % MQTT_INFLIGHT_MAX + 1; //oldest first, so the newest wins
+	}
+	persist->inbound([this](uint16_t id) {
+		this->qos2_unreleased.insert(id);
+	});
+	return MQTT_OK;
+}
+
 void Mqtt::mqtt_set_cleansess(bool cleansess)
 {
 	this->cleansess = cleansess;
 }
 
+int Mqtt::mqtt_set_protocol(int version)
+{
+	if (version != MQTT_PROTOCOL_V31 && version != MQTT_PROTOCOL_V311 && version != MQTT_PROTOCOL_V5) {
+		return MQTT_ERR;
+	}
+	this->protocol = version;
+	return MQTT_OK;
+}
+
+//0 refuses inbound topic aliases
+void Mqtt::mqtt_set_topic_alias_maximum(int maximum)
+{
+	this->topic_alias_maximum = maximum < 0 ? 0 : maximum > UINT16_MAX ? UINT16_MAX : maximum;
+}
+
+//0 lets the broker have as many QoS 1/2 publishes unacknowledged as it likes
+void Mqtt::mqtt_set_receive_maximum(int maximum)
+{
+	this->receive_maximum = maximum < 0 ? 0 : maximum > UINT16_MAX ? UINT16_MAX : maximum;
+}
+
+//inbound packets over size are skipped unread, 0 for no limit
+void Mqtt::mqtt_set_max_packet_size(int size)
+{
+	this->max_packet_size = size < 0 ? 0 : size;
+	this->reader.maxframe = this->max_packet_size;
+}
+
 void Mqtt::mqtt_set_will(std::shared_ptr<MqttWill> const &will)
 {
 	this->will = will;
@@ -130,6 +245,31 @@ void Mqtt::mqtt_set_keepalive(int keepalive)
 	this->keepalive = keepalive;
 }
 
+void Mqtt::mqtt_set_flush_threshold(size_t threshold)
+{
+	this->obuf_threshold = threshold;
+}
+
+void Mqtt::mqtt_set_pipelined(bool pipelined)
+{
+	this->pipelined = pipelined;
+}
+
+void Mqtt::mqtt_set_fastopen(bool fastopen)
+{
+	this->fastopen = fastopen;
+}
+
+void Mqtt::mqtt_set_rollback_callback(MqttRollbackCallback callback)
+{
+	this->rollbackcallback = callback;
+}
+
+void Mqtt::mqtt_set_undelivered_callback(MqttUndeliveredCallback callback)
+{
+	this->undeliveredcallback = callback;
+}
+
 void Mqtt::mqtt_set_callback(uint8_t type, MqttCallback callback)
 {
 	if (type < 0) return;
@@ -158,10 +298,41 @@ void Mqtt::mqtt_set_msg_callback(MqttMsgCallback callback)
 	this->msgcallback = callback;
 }
 
-static void _mqtt_msg_callback(Mqtt *mqtt, MqttMsg *msg)
+#define MQTT_DISPATCH_INLINE 16
+
+/* handlers are collected before any runs: one may well (un)subscribe */
+static bool _mqtt_dispatch(Mqtt *mqtt, MqttMsgView const *view)
+{
+	struct Match {
+		Mqtt::MqttTopicHandler handler;
+		void *data;
+	};
+	Match matches[MQTT_DISPATCH_INLINE];
+	std::vector<Match> more;
+	int n = 0;
+	mqtt->handlers->match(view->topic, [&](Mqtt::MqttTopicHandler handler, void *data) {
+		if (n < MQTT_DISPATCH_INLINE) {
+			matches[n++] = {handler, data};
+		} else {
+			more.push_back({handler, data});
+		}
+	});
+	for (int i = 0; i < n; i++) matches[i].handler(mqtt, view, matches[i].data);
+	for (auto const &m : more) m.handler(mqtt, view, m.data);
+	return n > 0;
+}
+
+static void _mqtt_msg_callback(Mqtt *mqtt, MqttMsgView const *view)
 {
+	if (mqtt->handlers && mqtt->handlers->size() > 0 && _mqtt_dispatch(mqtt, view)) return;
+	if (mqtt->msgviewcallback) {
+		mqtt->msgviewcallback(mqtt, view);
+	}
 	if (mqtt->msgcallback) {
-		mqtt->msgcallback(mqtt, msg);
+		MqttMsg msg;
+		mqtt_msg_detach(&msg, view);
+		msg.payload.push_back(0); //legacy consumers expect a terminated payload
+		mqtt->msgcallback(mqtt, &msg);
 	}
 }
 
@@ -170,6 +341,16 @@ void Mqtt::mqtt_clear_msg_callback()
 	this->msgcallback = nullptr;
 }
 
+void Mqtt::mqtt_set_msg_view_callback(MqttMsgViewCallback callback)
+{
+	this->msgviewcallback = callback;
+}
+
+void Mqtt::mqtt_clear_msg_view_callback()
+{
+	this->msgviewcallback = nullptr;
+}
+
 static void _mqtt_set_error(char *err, const char *fmt, ...)
 {
 	va_list ap;
@@ -179,83 +360,244 @@ static void _mqtt_set_error(char *err, const char *fmt, ...)
 	va_end(ap);
 }
 
-void Mqtt::_mqtt_send_connect()
+/*--------------------------------------
+** Output buffer.
+--------------------------------------*/
+void Mqtt::_mqtt_write(char *buffer, int len)
 {
-	int len = 0;
-	char *ptr, *buffer = nullptr;
-
-	uint8_t header = CONNECT;
-	uint8_t flags = 0;
-
-	int remaining_count = 0;
-	char remaining_length[4];
+	if (this->el) {
+		struct iovec iov = {buffer, (size_t)len};
+		_mqtt_queue(&iov, 1);
+		return;
+	}
+	if (!this->corked) {
+		_mqtt_persist_sync();
+		anetWrite(this->fd, buffer, len);
+		return;
+	}
+	this->obuf.insert(this->obuf.end(), buffer, buffer + len);
+	if (this->obuf.size() >= this->obuf_threshold) {
+		mqtt_flush();
+	}
+}
 
-	//header
-	header = SETQOS(header, MQTT_QOS1);
-	
-	//flags
-	flags = FLAG_CLEANSESS(flags, this->cleansess);
-	flags = FLAG_WILL(flags, (this->will) ? 1 : 0);
-	if (this->will) {
-		flags = FLAG_WILLQOS(flags, this->will->qos);
-		flags = FLAG_WILLRETAIN(flags, this->will->retain);
+void Mqtt::_mqtt_writev(struct iovec *iov, int iovcnt)
+{
+	if (this->el) {
+		_mqtt_queue(iov, iovcnt);
+		return;
+	}
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
 	}
-	if (!this->username.empty()) flags = FLAG_USERNAME(flags, 1);
-	if (!this->password.empty()) flags = FLAG_PASSWD(flags, 1);
+	if (!this->corked) {
+		_mqtt_persist_sync();
+		anetWritev(this->fd, iov, iovcnt);
+		return;
+	}
+	if (this->obuf.size() + len < this->obuf_threshold) {
+		for (int i = 0; i < iovcnt; i++) {
+			char *base = (char *)iov[i].iov_base;
+			this->obuf.insert(this->obuf.end(), base, base + iov[i].iov_len);
+		}
+		return;
+	}
+	//too big to buffer: send what is pending and this packet in one go
+	struct iovec *all = (struct iovec *)alloca((iovcnt + 1) * sizeof(struct iovec));
+	all[0] = {this->obuf.data(), this->obuf.size()};
+	memcpy(all + 1, iov, iovcnt * sizeof(struct iovec));
+	_mqtt_persist_sync();
+	anetWritev(this->fd, all, iovcnt + 1);
+	this->obuf.clear();
+}
 
-	//length
-	if (!this->clientid.empty()) {
-		len = 12 + 2 + this->clientid.size();
+/*
+ * With an event loop the socket is non-blocking: output is queued in obuf
+ * and written from the loop when the socket is writable, which also
+ * coalesces everything sent during one loop iteration. A big packet is
+ * tried right away when nothing is queued ahead of it.
+ */
+void Mqtt::_mqtt_queue(struct iovec *iov, int iovcnt)
+{
+	if (this->fd < 0) {
+		//still resolving or connecting
+		if (!this->connector.active()) return;
+		for (int i = 0; i < iovcnt; i++) {
+			char *base = (char *)iov[i].iov_base;
+			this->obuf.insert(this->obuf.end(), base, base + iov[i].iov_len);
+		}
+		return;
 	}
-	if (this->will) {
-		len += 2 + this->will->topic.size();
-		len += 2 + this->will->msg.size();
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	bool armed = aeGetFileEvents(this->el, this->fd) & AE_WRITABLE;
+	if (!armed && this->obuf.empty() && len >= MQTT_SMALL_PACKET) {
+		_mqtt_persist_sync();
+		ssize_t n = writev(this->fd, iov, iovcnt);
+		if (n < 0) {
+			//EINPROGRESS: a fast open connect without a cookie hasn't finished
+			if (errno != EAGAIN && errno != EINTR && errno != EINPROGRESS) return; //the read side will notice
+			n = 0;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
-	if (!this->username.empty()) {
-		len += 2 + this->username.size();
+	for (int i = 0; i < iovcnt; i++) {
+		char *base = (char *)iov[i].iov_base;
+		this->obuf.insert(this->obuf.end(), base, base + iov[i].iov_len);
 	}
-	if (!this->password.empty()) {
-		len += 2 + this->password.size();
+	if (!armed && !this->obuf.empty()) {
+		aeCreateFileEvent(this->el, this->fd, AE_WRITABLE, _mqtt_write_proc, this);
 	}
-	
-	remaining_count = _encode_remaining_length(remaining_length, len);
+}
 
-	ptr = buffer = (char *)alloca(1 + remaining_count + len);
-	
-	_write_header(&ptr, header);
-	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_string_len(&ptr, PROTOCOL_MAGIC, 6);
-	_write_char(&ptr, MQTT_PROTO_MAJOR);
-	_write_char(&ptr, flags);
-	_write_int(&ptr, this->keepalive);
-	_write_string(&ptr, this->clientid);
+void Mqtt::_mqtt_write_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	MQTT_NOTUSED(el);
+	MQTT_NOTUSED(fd);
+	MQTT_NOTUSED(mask);
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	mqtt->mqtt_flush();
+}
 
-	if (this->will) {
-		_write_string(&ptr, this->will->topic);
-		_write_string(&ptr, this->will->msg);
+int Mqtt::_mqtt_flush_nonblock()
+{
+	_mqtt_persist_sync();
+	ssize_t n = write(this->fd, this->obuf.data(), this->obuf.size());
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR || errno == EINPROGRESS) return 0;
+		//EPIPE, ECONNRESET: gone like a failed read, or the loop spins on AE_WRITABLE
+		this->error = errno;
+		_mqtt_set_error(this->errstr, "socket error: %d.", errno);
+		_mqtt_handle_close();
+		return -1;
 	}
-	if (!this->username.empty()) {
-		_write_string(&ptr, this->username);
+	this->obuf.erase(this->obuf.begin(), this->obuf.begin() + n);
+	if (this->obuf.empty()) {
+		aeDeleteFileEvent(this->el, this->fd, AE_WRITABLE);
 	}
-	if (!this->password.empty()) {
-		_write_string(&ptr, this->password);
+	return n;
+}
+
+int Mqtt::mqtt_flush()
+{
+	if (this->obuf.empty() || this->fd < 0) return 0;
+	if (this->el) return _mqtt_flush_nonblock();
+	_mqtt_persist_sync();
+	int n = anetWrite(this->fd, this->obuf.data(), this->obuf.size());
+	this->obuf.clear();
+	return n;
+}
+
+/*
+ * Whatever was logged must be on disk before the broker can see the
+ * packets it describes. Logged as they are queued, committed once as
+ * they leave, so a batch or a loop iteration costs one sync.
+ */
+void Mqtt::_mqtt_persist_sync()
+{
+	if (this->persist && this->persist->sync() != MQTT_OK) {
+		_mqtt_set_error(this->errstr, "%s", this->persist->errstr);
 	}
+}
 
-	anetWrite(this->fd, buffer, ptr - buffer);
+void Mqtt::mqtt_cork(bool cork)
+{
+	this->corked = cork;
+	if (!cork) mqtt_flush();
+}
+
+void Mqtt::_mqtt_send_connect()
+{
+	MqttConnectFields c;
+	c.version = this->protocol;
+	c.cleansess = this->cleansess;
+	c.keepalive = this->keepalive;
+	c.clientid = this->clientid;
+	if (this->will) {
+		c.will = true;
+		c.willqos = this->will->qos;
+		c.willretain = this->will->retain;
+		c.willtopic = this->will->topic;
+		c.willmsg = this->will->msg;
+	}
+	c.has_username = !this->username.empty();
+	c.username = this->username;
+	c.has_password = !this->password.empty();
+	c.password = this->password;
+
+	//aliases and limits never outlive a connection, the broker's come with CONNACK
+	this->aliases_out.reset(0);
+	this->aliases_in.reset(0);
+	this->send_quota = MQTT_INFLIGHT_MAX;
+	this->send_max_packet_size = 0;
+	char props[5 + 3 + 3 + 5];
+	if (this->protocol == MQTT_PROTOCOL_V5) {
+		char *ptr = props;
+		//3.1.1 semantics: a session that isn't clean never expires
+		if (!this->cleansess) ptr = mqtt_put_property_int32(ptr, MQTT_PROP_SESSION_EXPIRY, UINT32_MAX);
+		if (this->topic_alias_maximum > 0) {
+			ptr = mqtt_put_property_int(ptr, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, this->topic_alias_maximum);
+		}
+		if (this->receive_maximum > 0) {
+			ptr = mqtt_put_property_int(ptr, MQTT_PROP_RECEIVE_MAXIMUM, this->receive_maximum);
+		}
+		if (this->max_packet_size > 0) {
+			ptr = mqtt_put_property_int32(ptr, MQTT_PROP_MAXIMUM_PACKET_SIZE, this->max_packet_size);
+		}
+		c.properties = std::span<const char>(props, ptr - props);
+		this->aliases_in.reset(this->topic_alias_maximum);
+	}
+
+	size_t size = mqtt_packet_size(mqtt_connect_length(c));
+	char *buffer = (char *)alloca(size);
+	_mqtt_write(buffer, mqtt_encode_connect(std::span<char>(buffer, size), c));
 }
 
 int Mqtt::mqtt_connect()
 {
-	char server[1024] = {0};
-	if (anetResolve(this->errstr, this->server.c_str(), server) != ANET_OK) {
-		return -1;
+	int fd = -1;
+	if (!this->el) {
+		fd = MqttConnector::connect(this->server, this->port, MQTT_CONNECT_ATTEMPT_DELAY, this->errstr,
+			this->fastopen);
+		if (fd < 0) {
+			return fd;
+		}
+		//acks and pings are tiny, don't let Nagle hold them back
+		anetTcpNoDelay(nullptr, fd);
+		this->fd = fd;
 	}
-	int fd = anetTcpConnect(this->errstr, server, this->port);
-	if (fd < 0) {
-		return fd;
+	this->reader.reset();
+	this->obuf.clear();
+	_mqtt_early_done();
+	if (this->cleansess) {
+		//a clean session drops what the last one left unacknowledged
+		if (this->persist) this->persist->reset();
+		_mqtt_inflight_clear();
+		this->qos2_unreleased.clear();
+	}
+	if (this->el) {
+		//CONNECT is queued now and goes out once a socket is connected
+		this->connector.fastopen = this->fastopen;
+		if (this->connector.start(this->el, this->server, this->port, _mqtt_connected, this, this->errstr) != ANET_OK) {
+			return -1;
+		}
+		fd = 0;
+	} else if (this->pipelined && !this->corked) {
+		//CONNECT leaves with whatever is sent before the first read
+		this->corked = true;
+		this->connect_corked = true;
 	}
-	this->fd = fd;
-	//	aeCreateFileEvent(mqtt->el, fd, AE_READABLE, (aeFileProc *)_mqtt_read, (void *)mqtt);
 	_mqtt_send_connect();
 	mqtt_set_state(MQTT_STATE_CONNECTING);
 	_mqtt_callback(CONNECT, nullptr, MQTT_STATE_CONNECTING);
@@ -263,176 +605,415 @@ int Mqtt::mqtt_connect()
 	return fd;
 }
 
-void Mqtt::_mqtt_send_publish(MqttMsg *msg)
+void Mqtt::_mqtt_connected(void *clientdata, int fd, int err)
 {
-	int len = 0;
-	char *ptr, *buffer;
-	char remaining_length[4];
-	int remaining_count;
-
-	uint8_t header = PUBLISH;
-	header = SETRETAIN(header, msg->retain);
-	header = SETQOS(header, msg->qos);
-	header = SETDUP(header, msg->dup);
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	aeEventLoop *el = mqtt->el;
 
-	len += 2 + msg->topic.size();
+	if (fd < 0) {
+		mqtt->error = err;
+		_mqtt_set_error(mqtt->errstr, "%s: %s", err < 0 ? "can't resolve" : "connect",
+			mqtt_connect_strerror(err));
+		mqtt->_mqtt_handle_close();
+		return;
+	}
+	anetTcpNoDelay(nullptr, fd);
+	mqtt->fd = fd;
+	aeCreateFileEvent(el, fd, AE_READABLE, _mqtt_read_proc, mqtt);
+	if (!mqtt->obuf.empty()) {
+		aeCreateFileEvent(el, fd, AE_WRITABLE, _mqtt_write_proc, mqtt);
+	}
+	if (mqtt->keepalive > 0) {
+		el->timers->add(&mqtt->keepalive_timer, mqtt->keepalive * 1000, _mqtt_keepalive, mqtt);
+	}
+}
 
-	if (msg->qos > MQTT_QOS0) len += 2; //msgid
+static char *_mqtt_publish_head(char *ptr, MqttMsg const *msg)
+{
+	size_t payloadlen = msg->payload.size();
+	switch (msg->qos) {
+	case MQTT_QOS0:
+		return mqtt_put_publish_head<MQTT_QOS0>(ptr, msg->topic, 0, payloadlen, msg->retain, msg->dup);
+	case MQTT_QOS1:
+		return mqtt_put_publish_head<MQTT_QOS1>(ptr, msg->topic, msg->id, payloadlen, msg->retain, msg->dup);
+	default:
+		return mqtt_put_publish_head<MQTT_QOS2>(ptr, msg->topic, msg->id, payloadlen, msg->retain, msg->dup);
+	}
+}
 
-	len += msg->payload.size();
-	
-	remaining_count = _encode_remaining_length(remaining_length, len);
-	
-	ptr = buffer = (char *)alloca(1 + remaining_count + len);
+//MQTT 5: topic may be empty when an alias in props stands for it
+static char *_mqtt_publish_head(char *ptr, MqttMsg const *msg, std::string_view topic,
+	std::span<const char> props)
+{
+	size_t payloadlen = msg->payload.size();
+	switch (msg->qos) {
+	case MQTT_QOS0:
+		return mqtt_put_publish_head<MQTT_QOS0>(ptr, topic, 0, payloadlen, msg->retain, msg->dup, props);
+	case MQTT_QOS1:
+		return mqtt_put_publish_head<MQTT_QOS1>(ptr, topic, msg->id, payloadlen, msg->retain, msg->dup, props);
+	default:
+		return mqtt_put_publish_head<MQTT_QOS2>(ptr, topic, msg->id, payloadlen, msg->retain, msg->dup, props);
+	}
+}
 
-	_write_header(&ptr, header);
-	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_string(&ptr, msg->topic);
-	if (msg->qos > MQTT_QOS0) {
-		_write_int(&ptr, msg->id);
+void Mqtt::_mqtt_send_publish(MqttMsg *msg)
+{
+	size_t headmax = MQTT_PUBLISH_HEAD_MAX + msg->topic.size();
+	size_t payloadlen = msg->payload.size();
+	bool v5 = this->protocol == MQTT_PROTOCOL_V5;
+	std::string_view topic = msg->topic;
+	char props[3];
+	size_t propslen = 0;
+
+	if (v5) {
+		//a topic the broker already maps goes as its alias alone
+		bool known;
+		uint16_t alias = this->aliases_out.lookup(topic, &known);
+		if (alias) {
+			mqtt_put_property_int(props, MQTT_PROP_TOPIC_ALIAS, alias);
+			propslen = sizeof(props);
+			if (known) topic = std::string_view();
+		}
+		headmax += mqtt_properties_size(propslen);
 	}
-	if (!msg->payload.empty()) {
-		_write_payload(&ptr, msg->payload);
+
+	if (headmax + payloadlen <= MQTT_SMALL_PACKET) {
+		char buffer[MQTT_SMALL_PACKET];
+		char *ptr = v5 ? _mqtt_publish_head(buffer, msg, topic, std::span<const char>(props, propslen))
+			: _mqtt_publish_head(buffer, msg);
+		if (payloadlen > 0) {
+			memcpy(ptr, msg->payload.data(), payloadlen);
+		}
+		_mqtt_write(buffer, ptr + payloadlen - buffer);
+		return;
 	}
-	anetWrite(this->fd, buffer, ptr-buffer);
+
+	//everything ahead of the payload is built here, the payload is sent from msg
+	char *head = (char *)alloca(headmax);
+	char *ptr = v5 ? _mqtt_publish_head(head, msg, topic, std::span<const char>(props, propslen))
+		: _mqtt_publish_head(head, msg);
+	struct iovec iov[2] = {
+		{head, (size_t)(ptr - head)},
+		{msg->payload.data(), payloadlen}
+	};
+	_mqtt_writev(iov, payloadlen > 0 ? 2 : 1);
+}
+
+/*
+ * The most a PUBLISH of msg can take on the wire. With an alias the
+ * topic may be left out, but whether it is isn't known until it's sent.
+ */
+size_t Mqtt::_mqtt_publish_size(MqttMsg const *msg)
+{
+	size_t len = mqtt_publish_length(msg->qos, msg->topic.size(), msg->payload.size());
+	if (this->protocol == MQTT_PROTOCOL_V5) len += mqtt_properties_size(3);
+	return mqtt_packet_size(len);
 }
 
 //PUBLISH
 int Mqtt::mqtt_publish(MqttMsg *msg)
 {
-	if (msg->id == 0) {
-		msg->id = this->msgid++;
+	if (this->send_max_packet_size && _mqtt_publish_size(msg) > this->send_max_packet_size) {
+		return MQTT_ERR_PACKET_SIZE;
+	}
+	if (msg->qos == MQTT_QOS0) {
+		_mqtt_send_publish(msg);
+		_mqtt_early(PUBLISH, msg);
+		_mqtt_callback(PUBLISH, msg, msg->id);
+		return msg->id;
+	}
+	if (this->inflight.full() || (int)this->inflight.size() >= this->send_quota) {
+		return MQTT_ERR_INFLIGHT;
+	}
+	MqttInflightSlot *slot = this->inflight.acquire(_mqtt_next_id(true));
+	msg->id = slot->id;
+	slot->state = (msg->qos == MQTT_QOS1) ? PUBACK : PUBREC;
+	slot->attempts = 0;
+	slot->mqtt = this;
+	slot->msg = *msg; //reuses the buffers the slot had last time
+	if (this->persist && this->persist->log_publish(msg) != MQTT_OK) {
+		//not durable, so not sent either
+		_mqtt_set_error(this->errstr, "%s", this->persist->errstr);
+		this->inflight.release(slot);
+		return MQTT_ERR;
 	}
 	_mqtt_send_publish(msg);
+	_mqtt_inflight_arm(slot);
+	_mqtt_early(PUBLISH, msg);
 	_mqtt_callback(PUBLISH, msg, msg->id);
 	return msg->id;
 }
 
-void Mqtt::_mqtt_send_ack(int type, int msgid)
+/*--------------------------------------
+** In-flight window.
+--------------------------------------*/
+//packet ids run 1..65535, and may not be reused while still in flight
+int Mqtt::_mqtt_next_id(bool slot)
+{
+	for (int i = 0; i < MQTT_INFLIGHT_MAX; i++) {
+		int id = this->msgid;
+		this->msgid = this->msgid % MQTT_INFLIGHT_MAX + 1;
+		if (slot ? this->inflight.available(id) : !this->inflight.find(id)) {
+			return id;
+		}
+	}
+	return 0;
+}
+
+//only connections driven by an event loop have retransmit timers
+void Mqtt::_mqtt_inflight_arm(MqttInflightSlot *slot)
+{
+	if (this->el && this->retry_interval > 0 && this->retries > 0) {
+		this->el->timers->add(&slot->timer, this->retry_interval * 1000, _mqtt_retry, slot);
+	}
+}
+
+void Mqtt::_mqtt_inflight_send(MqttInflightSlot *slot)
+{
+	if (slot->state == PUBCOMP) {
+		mqtt_pubrel(slot->id);
+		return;
+	}
+	slot->msg.dup = true;
+	_mqtt_send_publish(&slot->msg);
+}
+
+//give up on an unacknowledged QoS 1/2 publish, MQTT_ERR when it isn't in flight
+int Mqtt::mqtt_cancel(int msgid)
+{
+	MqttInflightSlot *slot = this->inflight.find(msgid);
+	if (!slot) return MQTT_ERR;
+	_mqtt_inflight_release(slot);
+	return MQTT_OK;
+}
+
+void Mqtt::_mqtt_inflight_release(MqttInflightSlot *slot)
+{
+	if (this->el) this->el->timers->cancel(&slot->timer);
+	if (this->persist) this->persist->log_release(slot->id);
+	this->inflight.release(slot);
+}
+
+void Mqtt::_mqtt_retry(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	MqttInflightSlot *slot = (MqttInflightSlot *)clientdata;
+	Mqtt *mqtt = slot->mqtt;
+	if (slot->attempts++ >= mqtt->retries) {
+		//kept: it goes out again on the next connection, or with mqtt_cancel from the callback
+		_mqtt_set_error(mqtt->errstr, "publish %d: no ack after %d retries", slot->id, mqtt->retries);
+		if (mqtt->undeliveredcallback) mqtt->undeliveredcallback(mqtt, &slot->msg, MQTT_ERR_NOACK);
+		return;
+	}
+	mqtt->_mqtt_inflight_send(slot);
+	wheel->add(timer, mqtt->retry_interval * 1000, _mqtt_retry, slot);
+}
+
+/*
+ * A resumed session gets everything unacknowledged again, oldest first.
+ * No more than the broker's send quota go out now, the rest follow when
+ * their retry timers fire. Publishes pipelined behind CONNECT are on
+ * their way already and only count against the quota.
+ */
+void Mqtt::_mqtt_inflight_resend()
+{
+	uint16_t last = (this->msgid == 1) ? MQTT_INFLIGHT_MAX : this->msgid - 1;
+	int quota = this->send_quota;
+	this->inflight.each(last, [this, &quota](MqttInflightSlot *slot) {
+		if (this->early_ids.test(slot->id)) {
+			quota--;
+			return;
+		}
+		slot->attempts = 0;
+		if (quota > 0) {
+			_mqtt_inflight_send(slot);
+			quota--;
+		}
+		_mqtt_inflight_arm(slot);
+	});
+}
+
+void Mqtt::_mqtt_inflight_disarm()
+{
+	if (!this->el) return;
+	this->inflight.each(0, [this](MqttInflightSlot *slot) {
+		this->el->timers->cancel(&slot->timer);
+	});
+}
+
+void Mqtt::_mqtt_inflight_clear()
+{
+	this->inflight.each(0, [this](MqttInflightSlot *slot) {
+		_mqtt_inflight_release(slot);
+	});
+}
+
+//PUBLISH many, coalesced into as few writes as the threshold allows
+int Mqtt::mqtt_publish_batch(std::span<MqttMsg> msgs)
+{
+	bool corked = this->corked;
+	this->corked = true;
+	int n = 0;
+	for (MqttMsg &msg : msgs) {
+		if (mqtt_publish(&msg) < 0) break; //window full or too big
+		n++;
+	}
+	this->corked = corked;
+	if (!corked) mqtt_flush();
+	return n;
+}
+
+template <uint8_t Type>
+void Mqtt::_mqtt_send_ack(int msgid)
 {
-	char buffer[4] = {type, 2, MSB(msgid), LSB(msgid)};
-	anetWrite(this->fd, buffer, 4);
+	MqttFrame<4> ack = mqtt_ack_frame<Type>(msgid);
+	_mqtt_write(ack.data(), ack.size());
 }
 
 //PUBACK for QOS_1, QOS_2
 void Mqtt::mqtt_puback(int msgid)
 {
-	_mqtt_send_ack(PUBACK, msgid);
+	_mqtt_send_ack<PUBACK>(msgid);
 }
 
 //PUBREC for QOS_2
 void Mqtt::mqtt_pubrec(int msgid)
 {
-	_mqtt_send_ack(PUBREC, msgid);
+	_mqtt_send_ack<PUBREC>(msgid);
 }
 
 //PUBREL for QOS_2
 void Mqtt::mqtt_pubrel(int msgid)
 {
-	_mqtt_send_ack(PUBREL, msgid);
+	_mqtt_send_ack<SETQOS(PUBREL, MQTT_QOS1)>(msgid);
 }
 
 //PUBCOMP for QOS_2
 void Mqtt::mqtt_pubcomp(int msgid)
 {
-	_mqtt_send_ack(PUBCOMP, msgid);
+	_mqtt_send_ack<PUBCOMP>(msgid);
 }
 
-static void _mqtt_send_subscribe(Mqtt *mqtt, int msgid, const char *topic, uint8_t qos)
+void Mqtt::_mqtt_send_subscribe(int msgid, const char *topic, uint8_t qos)
 {
-
-	int len = 0;
-	char *ptr, *buffer;
-
-	int remaining_count;
-	char remaining_length[4];
-
-	uint8_t header = SETQOS(SUBSCRIBE, MQTT_QOS1);
-
-	len += 2; //msgid
-	len += 2 + strlen(topic) + 1; //topic and qos
-
-	remaining_count = _encode_remaining_length(remaining_length, len);
-	ptr = buffer = (char *)alloca(1 + remaining_count + len);
-	
-	_write_header(&ptr, header);
-	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_int(&ptr, msgid);
-	_write_string(&ptr, topic);
-	_write_char(&ptr, qos);
-
-	anetWrite(mqtt->fd, buffer, ptr-buffer);
+	std::string_view filter(topic);
+	char *buffer = (char *)alloca(mqtt_subscribe_size(filter.size(), this->protocol));
+	char *ptr = mqtt_put_subscribe(buffer, msgid, filter, qos, this->protocol);
+	_mqtt_write(buffer, ptr - buffer);
 }
 
 //SUBSCRIBE
 int Mqtt::mqtt_subscribe(const char *topic, unsigned char qos)
 {
-	int msgid = this->msgid++;
-	_mqtt_send_subscribe(this, msgid, topic, qos);
+	int msgid = _mqtt_next_id(false);
+	_mqtt_send_subscribe(msgid, topic, qos);
+	if (this->state == MQTT_STATE_CONNECTING) {
+		MqttMsg msg;
+		mqtt_msg_new(&msg, msgid, qos, false, false, topic, nullptr, 0);
+		_mqtt_early(SUBSCRIBE, &msg);
+	}
 	_mqtt_callback(SUBSCRIBE, (void *)topic, msgid);
 	return msgid;
 }
 
-void Mqtt::_mqtt_send_unsubscribe(int msgid, std::string const &topic)
+/*
+ * SUBSCRIBE with a handler for what the filter matches. Handlers live
+ * in a topic trie, so dispatch costs O(topic depth) however many there
+ * are. Subscribing the same handler to a filter again replaces data.
+ */
+int Mqtt::mqtt_subscribe(const char *topic, unsigned char qos, MqttTopicHandler handler, void *data)
 {
-	int len = 0;
-	char *ptr, *buffer;
-	
-	int remaining_count;
-	char remaining_length[4];
-
-	uint8_t header = SETQOS(UNSUBSCRIBE, MQTT_QOS1);
-	
-	len += 2; //msgid
-	len += 2 + topic.size(); //topic
+	if (!this->handlers) this->handlers = std::make_unique<MqttTopicTrie<MqttTopicHandler, void *>>();
+	this->handlers->subscribe(topic, handler, data);
+	return mqtt_subscribe(topic, qos);
+}
 
-	remaining_count = _encode_remaining_length(remaining_length, len);
-	ptr = buffer = (char *)alloca(1 + remaining_count + len);
-	
-	_write_header(&ptr, header);
-	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_int(&ptr, msgid);
-	_write_string(&ptr, topic);
+//keeps the subscription, messages the filter matched go elsewhere
+void Mqtt::mqtt_remove_handler(const char *topic, MqttTopicHandler handler)
+{
+	if (this->handlers) this->handlers->unsubscribe(topic, handler);
+}
 
-	anetWrite(this->fd, buffer, ptr-buffer);
+void Mqtt::_mqtt_send_unsubscribe(int msgid, std::string const &topic)
+{
+	char *buffer = (char *)alloca(mqtt_unsubscribe_size(topic.size(), this->protocol));
+	char *ptr = mqtt_put_unsubscribe(buffer, msgid, topic, this->protocol);
+	_mqtt_write(buffer, ptr - buffer);
 }
 
 //UNSUBSCRIBE
 int Mqtt::mqtt_unsubscribe(std::string const &topic)
 {
-	int msgid = this->msgid++;
+	int msgid = _mqtt_next_id(false);
+	if (this->handlers) this->handlers->erase(topic);
 	_mqtt_send_unsubscribe(msgid, topic);
+	if (this->state == MQTT_STATE_CONNECTING) {
+		MqttMsg msg;
+		mqtt_msg_new(&msg, msgid, 0, false, false, topic, nullptr, 0);
+		_mqtt_early(UNSUBSCRIBE, &msg);
+	}
 	_mqtt_callback(UNSUBSCRIBE, (void *)topic.c_str(), msgid);
 	return msgid;
 }
 
 void Mqtt::_mqtt_send_ping()
 {
-	char buffer[2] = {(char)PINGREQ, 0};
-	anetWrite(this->fd, buffer, 2);
+	MqttFrame<2> ping = mqtt_empty_frame<PINGREQ>();
+	_mqtt_write(ping.data(), ping.size());
 }
 
 //PINGREQ
 void Mqtt::mqtt_ping()
 {
 	_mqtt_send_ping();
+	if (this->el && this->keepalive > 0 && !this->keepalive_timeout_timer.pending()) {
+		this->el->timers->add(&this->keepalive_timeout_timer, this->keepalive * 1500,
+			_mqtt_keepalive_timeout, this);
+	}
 	_mqtt_callback(PINGREQ, nullptr, 0);
 }
 
-static void _mqtt_send_disconnect(Mqtt *mqtt)
+void Mqtt::_mqtt_send_disconnect()
 {
-	char buffer[2] = {(char)DISCONNECT, 0};
-	anetWrite(mqtt->fd, buffer, 2);
+	MqttFrame<2> disconnect = mqtt_empty_frame<DISCONNECT>();
+	_mqtt_write(disconnect.data(), disconnect.size());
+	mqtt_flush();
 }
 
 //DISCONNECT
 void Mqtt::mqtt_disconnect()
 {
-	_mqtt_send_disconnect(this);
-	if (this->fd > 0) {
+	if (this->fd >= 0) {
+		_mqtt_send_disconnect();
+		if (this->fd < 0) return; //the flush found it gone and closed it
+	}
+	_mqtt_handle_close();
+}
+
+void Mqtt::_mqtt_close_socket()
+{
+	this->connector.cancel();
+	if (this->el) {
+		if (this->fd >= 0) {
+			aeDeleteFileEvent(this->el, this->fd, AE_READABLE | AE_WRITABLE);
+		}
+		this->el->timers->cancel(&this->keepalive_timer);
+		this->el->timers->cancel(&this->keepalive_timeout_timer);
+	}
+	_mqtt_inflight_disarm();
+	if (this->fd >= 0) {
 		::close(this->fd);
 		this->fd = -1;
 	}
+	this->reader.reset();
+	this->obuf.clear();
+	//QoS 1/2 publishes sent early stay in flight for the next connection
+	_mqtt_early_done();
+}
+
+//the connection is gone, whether we hung up or the peer did
+void Mqtt::_mqtt_handle_close()
+{
+	_mqtt_close_socket();
 	mqtt_set_state(MQTT_STATE_DISCONNECTED);
 	_mqtt_callback(CONNECT, nullptr, MQTT_STATE_DISCONNECTED);
 }
@@ -443,22 +1024,76 @@ static void _mqtt_sleep(struct aeEventLoop *evtloop)
 	//what to do?
 }
 
+void Mqtt::mqtt_set_event_loop(aeEventLoop *el)
+{
+	this->el = el;
+}
+
 void Mqtt::close()
 {
+	_mqtt_close_socket();
 	this->will.reset();
 }
 
-int Mqtt::_mqtt_keepalive(long long id, void *clientdata)
+void Mqtt::_mqtt_keepalive(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	mqtt->mqtt_ping();
+	wheel->add(timer, mqtt->keepalive * 1000, _mqtt_keepalive, mqtt);
+}
+
+//no PINGRESP within 1.5 keepalive periods: the connection is dead
+void Mqtt::_mqtt_keepalive_timeout(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
 {
-	//	assert(el);
-	MQTT_NOTUSED(id);
+	MQTT_NOTUSED(wheel);
+	MQTT_NOTUSED(timer);
 	Mqtt *mqtt = (Mqtt *)clientdata;
-	mqtt->_mqtt_send_ping();
-	mqtt->_mqtt_callback(PINGREQ, nullptr, 0);
-	//FIXME: TIMEOUT
-	//mqtt->keepalive->timeoutid = aeCreateTimeEvent(el,
-	//   period*2, mqtt_keepalive_timeout, mqtt, nullptr);
-	return mqtt->keepalive*1000;
+	mqtt->error = ETIMEDOUT;
+	_mqtt_set_error(mqtt->errstr, "keepalive timeout: no PINGRESP in %d ms", mqtt->keepalive * 1500);
+	mqtt->_mqtt_handle_close();
+}
+
+/*--------------------------------------
+** Pipelined connect.
+--------------------------------------*/
+void Mqtt::_mqtt_early(uint8_t type, MqttMsg const *msg)
+{
+	if (this->state != MQTT_STATE_CONNECTING) return;
+	this->early.emplace_back();
+	this->early.back().type = type;
+	this->early.back().msg = *msg;
+	if (type == PUBLISH && msg->qos > MQTT_QOS0) this->early_ids.insert(msg->id);
+}
+
+//CONNACK came, or the connection went before it
+void Mqtt::_mqtt_early_done()
+{
+	this->early.clear();
+	this->early_ids.clear();
+	if (this->connect_corked) {
+		this->connect_corked = false;
+		mqtt_cork(false);
+	}
+}
+
+/*
+ * A refused CONNECT: the broker dropped everything behind it. Early
+ * QoS 1/2 publishes give their slots back, then every early packet is
+ * handed to the rollback callback, oldest first. The socket is closed
+ * by then: a QoS 1/2 publish made again from the callback waits in
+ * flight for the next connection.
+ */
+void Mqtt::_mqtt_rollback(std::vector<MqttEarlyPacket> &early)
+{
+	for (MqttEarlyPacket &p : early) {
+		if (p.type == PUBLISH && p.msg.qos > MQTT_QOS0) {
+			MqttInflightSlot *slot = this->inflight.find(p.msg.id);
+			if (slot) _mqtt_inflight_release(slot);
+		}
+	}
+	for (MqttEarlyPacket &p : early) {
+		if (this->rollbackcallback) this->rollbackcallback(this, p.type, &p.msg);
+	}
 }
 
 /*--------------------------------------
@@ -466,27 +1101,122 @@ int Mqtt::_mqtt_keepalive(long long id, void *clientdata)
 --------------------------------------*/
 void Mqtt::_mqtt_handle_connack(int rc)
 {
+	if (rc == CONNACK_ACCEPT) {
+		//ahead of anything the callback publishes
+		_mqtt_inflight_resend();
+		_mqtt_early_done();
+	} else {
+		//closed before anyone hears of it, so the callbacks may reconnect
+		std::vector<MqttEarlyPacket> early;
+		early.swap(this->early);
+		this->error = ECONNREFUSED;
+		_mqtt_set_error(this->errstr, "connection refused: CONNACK %d", rc);
+		_mqtt_close_socket();
+		mqtt_set_state(MQTT_STATE_DISCONNECTED);
+		_mqtt_rollback(early);
+	}
 	_mqtt_callback(CONNACK, nullptr, rc);
 	if (rc == CONNACK_ACCEPT) {
 		mqtt_set_state(MQTT_STATE_CONNECTED);
 		_mqtt_callback(CONNECT, nullptr, MQTT_STATE_CONNECTED);
+	} else if (this->state == MQTT_STATE_DISCONNECTED) {
+		_mqtt_callback(CONNECT, nullptr, MQTT_STATE_DISCONNECTED);
 	}
 }
 
-void Mqtt::_mqtt_handle_publish(MqttMsg *msg)
+/*
+ * MQTT 5 CONNACK properties: what the broker allows this connection.
+ * Those we don't act on are skipped.
+ */
+bool Mqtt::_mqtt_handle_connack_properties(std::span<const char> props)
+{
+	return mqtt_decode_properties(props, [this](MqttProperty const &prop) {
+		switch (prop.id) {
+		case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+			this->aliases_out.reset(prop.value);
+			break;
+		case MQTT_PROP_RECEIVE_MAXIMUM:
+			if (prop.value == 0) return false;
+			this->send_quota = prop.value;
+			break;
+		case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+			if (prop.value == 0) return false;
+			this->send_max_packet_size = prop.value;
+			break;
+		}
+		return true;
+	});
+}
+
+/*
+ * QoS 2 is delivered on the first PUBLISH and the id remembered until
+ * PUBREL, so a resent PUBLISH in between only gets its PUBREC again.
+ */
+void Mqtt::_mqtt_handle_publish(MqttMsgView const *msg)
 {
 	if (msg->qos == MQTT_QOS1) {
 		mqtt_puback(msg->id);
 	} else if (msg->qos == MQTT_QOS2) {
+		bool dup = this->qos2_unreleased.insert(msg->id);
+		if (!dup && this->persist) this->persist->log_received(msg->id);
 		mqtt_pubrec(msg->id);
+		if (dup) return;
 	}
 	_mqtt_msg_callback(this, msg);
 }
 
-void Mqtt::_mqtt_handle_puback(int type, int msgid)
+//an MQTT 5 reason string, if the properties carry one
+static std::string_view _mqtt_reason_string(std::span<const char> props)
+{
+	std::string_view reason;
+	mqtt_decode_properties(props, [&](MqttProperty const &prop) {
+		if (prop.id == MQTT_PROP_REASON_STRING) reason = prop.str;
+		return true;
+	});
+	return reason;
+}
+
+/*
+ * A PUBACK or PUBREC with a failure reason code is the broker's final
+ * word on that publish: no PUBREL follows, the slot is freed and the
+ * undelivered callback told instead of the ack callback.
+ */
+void Mqtt::_mqtt_handle_puback(int type, int msgid, uint8_t rc, std::span<const char> props)
 {
-	if (type == PUBREL) {
+	MqttInflightSlot *slot = this->inflight.find(msgid);
+	if (rc >= MQTT_RC_FAILURE) {
+		std::string_view reason = _mqtt_reason_string(props);
+		_mqtt_set_error(this->errstr, "%s %d: reason 0x%02x%s%.*s", mqtt_msg_name(type), msgid, rc,
+			reason.empty() ? "" : ", ", (int)reason.size(), reason.data());
+		if (type == PUBACK || type == PUBREC) {
+			if (!slot || slot->state != type) return;
+			MqttMsg msg = slot->msg;
+			_mqtt_inflight_release(slot);
+			if (this->undeliveredcallback) this->undeliveredcallback(this, &msg, rc);
+			return;
+		}
+	}
+	switch (type) {
+	case PUBACK:
+	case PUBCOMP:
+		if (slot && slot->state == type) {
+			_mqtt_inflight_release(slot);
+		}
+		break;
+	case PUBREC:
+		if (slot && slot->state == PUBREC) {
+			slot->state = PUBCOMP;
+			slot->attempts = 0;
+			if (this->persist) this->persist->log_pubrel(msgid);
+			_mqtt_inflight_arm(slot);
+		}
+		mqtt_pubrel(msgid);
+		break;
+	case PUBREL:
+		this->qos2_unreleased.erase(msgid);
+		if (this->persist) this->persist->log_released(msgid);
 		mqtt_pubcomp(msgid);
+		break;
 	}
 	_mqtt_callback(type, nullptr, msgid);
 }
@@ -502,41 +1232,77 @@ void Mqtt::_mqtt_handle_unsuback(int msgid)
 	_mqtt_callback(UNSUBACK, nullptr, msgid);
 }
 
+//an MQTT 5 broker hangs up with its reason, say 0x8E session taken over
+void Mqtt::_mqtt_handle_disconnect(uint8_t rc, std::span<const char> props)
+{
+	std::string_view reason = _mqtt_reason_string(props);
+	_mqtt_set_error(this->errstr, "disconnected by server: reason 0x%02x%s%.*s", rc,
+		reason.empty() ? "" : ", ", (int)reason.size(), reason.data());
+	_mqtt_handle_close();
+}
+
 void Mqtt::_mqtt_handle_pingresp()
 {
+	if (this->el) this->el->timers->cancel(&this->keepalive_timeout_timer);
 	_mqtt_callback(PINGRESP, nullptr, 0);
 }
 
 void Mqtt::_mqtt_handle_publish(uint8_t header, char *buffer, int buflen)
 {
-	std::vector<char> payload;
-	int qos = GETQOS(header);
-	bool retain = GETRETAIN(header);
-	bool dup = GETDUP(header);
-	std::string topic = _read_string_len(&buffer);
-	int payloadlen = buflen;
-	payloadlen -= 2;
-	payloadlen -= topic.size();
-	if (qos > 0) {
-		msgid = _read_int(&buffer);
-		payloadlen -= 2;
-	}
-	payload.resize(payloadlen + 1);
-	memcpy(payload.data(), buffer, payloadlen);
-	payload[payloadlen] = 0;
-	MqttMsg msg;
-	mqtt_msg_new(&msg, msgid, qos, retain, dup, topic, payload.data(), payload.size());
+	MqttPublishFields p;
+	if (!mqtt_decode_publish(header, std::span<const char>(buffer, buflen), &p, this->protocol)) {
+		_mqtt_set_error(this->errstr, "badpacket: publish too short, len=%d", buflen);
+		return;
+	}
+	if (this->protocol == MQTT_PROTOCOL_V5 && !p.properties.empty()) {
+		//an alias with a topic (re)defines it, without one stands for it
+		uint32_t alias = 0;
+		if (!mqtt_decode_properties(p.properties, [&](MqttProperty const &prop) {
+			if (prop.id == MQTT_PROP_TOPIC_ALIAS) alias = prop.value;
+			return true;
+		})) {
+			_mqtt_set_error(this->errstr, "badpacket: publish properties, len=%d", buflen);
+			return;
+		}
+		if (alias && !p.topic.empty()) {
+			if (!this->aliases_in.set(alias, p.topic)) {
+				_mqtt_set_error(this->errstr, "badpacket: topic alias %u over maximum %d",
+					alias, this->aliases_in.capacity());
+				return;
+			}
+		} else if (alias) {
+			std::string const *topic = this->aliases_in.get(alias);
+			if (!topic) {
+				_mqtt_set_error(this->errstr, "badpacket: unknown topic alias %u", alias);
+				return;
+			}
+			p.topic = *topic;
+		}
+	}
+	MqttMsgView msg;
+	msg.qos = p.qos;
+	msg.retain = p.retain;
+	msg.dup = p.dup;
+	msg.id = p.id;
+	msg.topic = p.topic;
+	msg.payload = p.payload;
 	this->_mqtt_handle_publish(&msg);
 }
 
 void Mqtt::_mqtt_handle_packet(uint8_t header, char *buffer, int buflen)
 {
-	int qos, msgid = 0;
+	bool sessionpresent;
+	uint8_t rc;
+	uint16_t msgid;
+	int qos = -1;
 	uint8_t type = GETTYPE(header);
+	std::span<const char> body(buffer, buflen);
+	std::span<const char> props;
 	switch (type) {
 	case CONNACK:
-		_read_char(&buffer);
-		_mqtt_handle_connack(_read_char(&buffer));
+		if (!mqtt_decode_connack(body, &sessionpresent, &rc, &props)) goto bad;
+		if (!_mqtt_handle_connack_properties(props)) goto bad;
+		_mqtt_handle_connack(rc);
 		break;
 	case PUBLISH:
 		_mqtt_handle_publish(header, buffer, buflen);
@@ -545,41 +1311,56 @@ void Mqtt::_mqtt_handle_packet(uint8_t header, char *buffer, int buflen)
 	case PUBREC:
 	case PUBREL:
 	case PUBCOMP:
-		msgid = _read_int(&buffer);
-		_mqtt_handle_puback(type, msgid);
+		if (!mqtt_decode_ack(body, &msgid, &rc, &props)) goto bad;
+		_mqtt_handle_puback(type, msgid, rc, props);
 		break;
 	case SUBACK:
-		msgid = _read_int(&buffer);
-		qos = _read_char(&buffer);
+		//mqttc subscribes one filter at a time
+		if (!mqtt_decode_suback(body, &msgid, [&](uint8_t granted) {
+			if (qos < 0) qos = granted;
+			return true;
+		}, this->protocol) || qos < 0) goto bad;
 		_mqtt_handle_suback(msgid, qos);
 		break;
 	case UNSUBACK:
-		msgid = _read_int(&buffer);
+		if (!mqtt_decode_ack(body, &msgid)) goto bad;
 		_mqtt_handle_unsuback(msgid);
 		break;
 	case PINGRESP:
 		_mqtt_handle_pingresp();
 		break;
+	case DISCONNECT:
+		if (!mqtt_decode_disconnect(body, &rc, &props)) goto bad;
+		_mqtt_handle_disconnect(rc, props);
+		break;
 	default:
 		_mqtt_set_error(this->errstr, "badheader: %d", type);
 	}
+	return;
+bad:
+	_mqtt_set_error(this->errstr, "badpacket: %s too short, len=%d", mqtt_msg_name(type), buflen);
+}
+
+void Mqtt::_mqtt_reader_proc(void *clientdata, uint8_t header, char *buffer, int buflen)
+{
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	if (mqtt->fd < 0) return; //closed by an earlier packet of this read
+	mqtt->_mqtt_handle_packet(header, buffer, buflen);
 }
 
 void Mqtt::_mqtt_reader_feed(char *buffer, int len)
 {
-	uint8_t header;
-	char *ptr = buffer;
-	int remaining_length;
-	int remaining_count;
-	
-	header = _read_header(&ptr);
-	
-	remaining_length = _decode_remaining_length(&ptr, &remaining_count);
-	if (1 + remaining_count+remaining_length != len) {
-		_mqtt_set_error(this->errstr, "badpacket: remaing_length=%d, remaing_count=%d, len=%d", remaining_length, remaining_count, len);
+	long long discarded = this->reader.discarded;
+	if (this->reader.feed(buffer, len, _mqtt_reader_proc, this) != MQTT_READER_OK) {
+		//the stream can't be resynchronized after a bad length
+		_mqtt_set_error(this->errstr, "badpacket: malformed remaining length");
+		mqtt_disconnect();
 		return;
 	}
-	_mqtt_handle_packet(header, ptr, remaining_length);
+	if (this->reader.discarded != discarded) {
+		_mqtt_set_error(this->errstr, "badpacket: %lld packets over %d bytes skipped",
+			this->reader.discarded - discarded, this->max_packet_size);
+	}
 }
 
 void Mqtt::mqtt_read(int fd, int mask)
@@ -589,6 +1370,10 @@ void Mqtt::mqtt_read(int fd, int mask)
 
 	MQTT_NOTUSED(mask);
 
+	//whatever is corked must go out before we wait for the answer
+	mqtt_flush();
+	if (this->fd < 0) return; //closed by a failed flush
+
 	nread = read(fd, buffer, MQTT_BUFFER_SIZE);
 	if (nread < 0) {
 		if (errno == EAGAIN) {
@@ -596,14 +1381,22 @@ void Mqtt::mqtt_read(int fd, int mask)
 		} else {
 			this->error = errno;
 			_mqtt_set_error(this->errstr, "socket error: %d.", errno);
+			_mqtt_handle_close();
 		}
 	} else if (nread == 0) {
-		mqtt_disconnect();
+		_mqtt_handle_close();
 	} else {
 		_mqtt_reader_feed(buffer, nread);
 	}
 }
 
+void Mqtt::_mqtt_read_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	MQTT_NOTUSED(el);
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	mqtt->mqtt_read(fd, mask);
+}
+
 std::shared_ptr<MqttWill> mqtt_will_new(std::string const &topic, std::string const &msg, bool retain, uint8_t qos)
 {
 	std::shared_ptr<MqttWill> will = std::make_shared<MqttWill>();
@@ -625,6 +1418,17 @@ void mqtt_msg_new(MqttMsg *msg, int msgid, int qos, bool retain, bool dup, std::
 	msg->payload.assign(ptr, ptr + len);
 }
 
+void mqtt_msg_detach(MqttMsg *msg, MqttMsgView const *view)
+{
+	msg->id = view->id;
+	msg->qos = view->qos;
+	msg->retain = view->retain;
+	msg->dup = view->dup;
+	msg->topic.assign(view->topic);
+	msg->payload.reserve(view->payload.size() + 1);
+	msg->payload.assign(view->payload.begin(), view->payload.end());
+}
+
 static const char *msg_names[] = {
 	"RESERVED",
 	"CONNECT",
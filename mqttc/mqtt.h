@@ -38,8 +38,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <memory>
+#include <span>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include "../common/topictrie.h"
+#include "ae.h"
+#include "alias.h"
+#include "inflight.h"
+#include "reader.h"
+#include "resolve.h"
+#include "timer.h"
+
 #define MQTT_OK 0
 #define MQTT_ERR -1
 
@@ -48,7 +59,12 @@
 
 #define MQTT_PROTOCOL_VERSION "MQTT/3.1"
 
+#define MQTT_TOPIC_ALIAS_MAXIMUM 64 //inbound aliases we offer an MQTT 5 broker
+
 #define MQTT_ERR_SOCKET (-5)
+#define MQTT_ERR_INFLIGHT (-6) //window full, wait for an ack
+#define MQTT_ERR_PACKET_SIZE (-7) //over the broker's Maximum Packet Size
+#define MQTT_ERR_NOACK (-8) //retries ran out, still in flight
 
 /*
  * MQTT QOS
@@ -101,6 +117,47 @@ struct MqttMsg {
 	std::vector<char> payload;
 };
 
+/*
+ * MQTT Message view
+ *
+ * Non-owning: topic and payload point into the receive buffer and are only
+ * valid during the message callback. Use mqtt_msg_detach to keep one.
+ */
+struct MqttMsgView {
+	uint16_t id = 0;
+	uint8_t qos = 0;
+	bool retain = false;
+	bool dup = false;
+	std::string_view topic;
+	std::span<const char> payload;
+};
+
+class Mqtt;
+class MqttPersist;
+
+/*
+ * MQTT QoS 1/2 publish kept until it is acknowledged. state is the
+ * packet awaited: PUBACK, or PUBREC and then PUBCOMP.
+ */
+struct MqttInflightSlot {
+	uint16_t id = 0;
+	uint8_t state = 0;
+	int attempts = 0;
+	MqttTimer timer; //retransmit
+	Mqtt *mqtt = nullptr;
+	MqttMsg msg;
+};
+
+/*
+ * MQTT packet sent behind CONNECT before CONNACK came back: a PUBLISH,
+ * or a SUBSCRIBE or UNSUBSCRIBE with the filter in topic (and the QoS
+ * asked for in qos). id is its packet id.
+ */
+struct MqttEarlyPacket {
+	uint8_t type = 0;
+	MqttMsg msg;
+};
+
 class Mqtt {
 public:
 	Mqtt()
@@ -116,11 +173,15 @@ public:
 
 	typedef void (*MqttCallback)(Mqtt *mqtt, void *data, int id);
 	typedef void (*MqttMsgCallback)(Mqtt *mqtt, MqttMsg *message);
+	typedef void (*MqttMsgViewCallback)(Mqtt *mqtt, MqttMsgView const *message);
+	typedef void (*MqttRollbackCallback)(Mqtt *mqtt, uint8_t type, MqttMsg *message);
+	typedef void (*MqttUndeliveredCallback)(Mqtt *mqtt, MqttMsg const *message, int reason);
+	typedef void (*MqttTopicHandler)(Mqtt *mqtt, MqttMsgView const *message, void *data);
 
 	int fd = -1; //socket
 	uint8_t state = 0;
 	int error = 0;
-	char errstr[1024];
+	char errstr[1024] = {};
 	std::string server;
 	std::string username;
 	std::string password;
@@ -130,42 +191,139 @@ public:
 	int msgid = 0;
 	bool cleansess = false;
 
+	/* protocol level sent in CONNECT: 3 (3.1), 4 (3.1.1) or 5 */
+	int protocol = MQTT_PROTO_MAJOR;
+
+	/* MQTT 5 topic aliases, valid for one connection: ours are capped
+	 * by the broker's CONNACK, the broker's by topic_alias_maximum */
+	int topic_alias_maximum = MQTT_TOPIC_ALIAS_MAXIMUM;
+	MqttTopicAliasCache aliases_out;
+	MqttTopicAliasTable aliases_in;
+
+	/* MQTT 5 flow control. What we ask of the broker: at most
+	 * receive_maximum unacknowledged QoS 1/2 publishes (0 leaves it at
+	 * 65535) and no packet over max_packet_size bytes, which also caps
+	 * what the reader buffers with any protocol (0 for no limit). What
+	 * the broker asks of us comes with CONNACK: QoS 1/2 publishes wait
+	 * for an ack once send_quota are unacknowledged, and bigger packets
+	 * than send_max_packet_size are refused. */
+	int receive_maximum = 0;
+	int max_packet_size = 0;
+	int send_quota = MQTT_INFLIGHT_MAX;
+	uint32_t send_max_packet_size = 0;
+
     /* keep alive */
 	unsigned int keepalive = 0;
-	long long keepalive_timer = 0;
-	long long keepalive_timeout_timer = 0;
+	MqttTimer keepalive_timer; //next PINGREQ
+	MqttTimer keepalive_timeout_timer; //PINGRESP overdue
+
+	/* unacknowledged publishes, resent with DUP every retry_interval
+	 * seconds and after reconnecting. Once retries resends went
+	 * unanswered the undelivered callback hears of it (MQTT_ERR_NOACK)
+	 * and the publish stays in flight, unresent until the next
+	 * connection: it only goes with its ack, a clean session or
+	 * mqtt_cancel. An MQTT 5 broker may also refuse one with a PUBACK
+	 * or PUBREC reason code from 0x80 up: that ends it, and the
+	 * callback gets the broker's code as the reason. */
+	unsigned int retry_interval = 0;
+	MqttInflight<MqttInflightSlot> inflight;
+	MqttUndeliveredCallback undeliveredcallback = nullptr;
+
+	/* inbound QoS 2 ids delivered but not released by PUBREL yet */
+	MqttPacketIdSet qos2_unreleased;
+
+	/* optional log of the two above, see mqtt_set_persist */
+	std::shared_ptr<MqttPersist> persist;
 
 	std::shared_ptr<MqttWill> will;
 	MqttCallback callbacks[16];
 	MqttMsgCallback msgcallback = nullptr;
+	MqttMsgViewCallback msgviewcallback = nullptr;
+
+	/* handlers by filter, see mqtt_subscribe; a message none of them
+	 * takes goes to the msg callbacks. Created with the first one. */
+	std::unique_ptr<MqttTopicTrie<MqttTopicHandler, void *>> handlers;
+
 	bool shutdown_asap = false;
 	int connack = 0;
 
 	void *userdata = nullptr;
 
+	aeEventLoop *el = nullptr; //optional, see mqtt_set_event_loop
+
+	/* with a loop, resolves the server off the loop and races its
+	 * addresses; output is queued in obuf meanwhile */
+	MqttConnector connector;
+
+	MqttReader reader;
+
+	/* pipelined connect: nothing waits for CONNACK. Publishes and
+	 * (un)subscribes made while connecting follow CONNECT in the same
+	 * flight and are remembered until CONNACK. Accepted, a resumed
+	 * session doesn't resend what already went out; refused, the broker
+	 * dropped them, so QoS 1/2 slots are released and every one is
+	 * handed to the rollback callback. Without a loop, pipelined corks
+	 * CONNECT until the next mqtt_read or mqtt_flush so it shares a
+	 * write with what follows; with one that happens anyway. The
+	 * broker's receive maximum isn't known yet, so early QoS 1/2
+	 * publishes should stay within what it's known to allow. */
+	bool pipelined = false;
+	bool fastopen = false; //TCP Fast Open: the first flight rides in the SYN
+	bool connect_corked = false;
+	std::vector<MqttEarlyPacket> early;
+	MqttPacketIdSet early_ids; //QoS 1/2 among them
+	MqttRollbackCallback rollbackcallback = nullptr;
+
+	/* output buffer, filled while corked */
+	std::vector<char> obuf;
+	size_t obuf_threshold = 0;
+	bool corked = false;
+
 	void mqtt_read(int fd, int mask);
 
+	void mqtt_set_event_loop(aeEventLoop *el);
+
 	void mqtt_set_clientid(const std::string &clientid);
 	void mqtt_set_username(const std::string &username);
 	void mqtt_set_passwd(const std::string &passwd);
 	void mqtt_set_server(const std::string &server);
 	void mqtt_set_port(int port);
 	void mqtt_set_retries(int retries);
+	void mqtt_set_retry_interval(int interval);
+	int mqtt_set_inflight_window(int window);
 	void mqtt_set_cleansess(bool cleansess);
+	int mqtt_set_protocol(int version);
+	void mqtt_set_topic_alias_maximum(int maximum);
+	void mqtt_set_receive_maximum(int maximum);
+	void mqtt_set_max_packet_size(int size);
+	int mqtt_set_persist(const std::shared_ptr<MqttPersist> &persist);
 	void mqtt_set_will(const std::shared_ptr<MqttWill> &will);
 	void mqtt_clear_will();
 	void mqtt_set_keepalive(int keepalive);
+	void mqtt_set_flush_threshold(size_t threshold);
+	void mqtt_set_pipelined(bool pipelined);
+	void mqtt_set_fastopen(bool fastopen);
+	void mqtt_set_rollback_callback(MqttRollbackCallback callback);
+	void mqtt_set_undelivered_callback(MqttUndeliveredCallback callback);
 	void mqtt_set_callback(uint8_t type, MqttCallback callback);
 	void mqtt_clear_callback(uint8_t type);
 	void mqtt_set_msg_callback(MqttMsgCallback callback);
 	void mqtt_clear_msg_callback();
+	void mqtt_set_msg_view_callback(MqttMsgViewCallback callback);
+	void mqtt_clear_msg_view_callback();
 	int mqtt_connect();
 	int mqtt_publish(MqttMsg *msg);
+	int mqtt_publish_batch(std::span<MqttMsg> msgs);
+	int mqtt_cancel(int msgid);
+	void mqtt_cork(bool cork);
+	int mqtt_flush();
 	void mqtt_puback(int msgid);
 	void mqtt_pubrec(int msgid);
 	void mqtt_pubrel(int msgid);
 	void mqtt_pubcomp(int msgid);
 	int mqtt_subscribe(const char *topic, unsigned char qos);
+	int mqtt_subscribe(const char *topic, unsigned char qos, MqttTopicHandler handler, void *data = nullptr);
+	void mqtt_remove_handler(const char *topic, MqttTopicHandler handler);
 	int mqtt_unsubscribe(const std::string &topic);
 	void mqtt_ping();
 	void mqtt_disconnect();
@@ -173,20 +331,48 @@ public:
 	void mqtt_set_state(int state);
 	static const char *mqtt_msg_name(uint8_t type);
 private:
-	static int _mqtt_keepalive(long long id, void *clientdata);
-	void _mqtt_handle_publish(MqttMsg *msg);
+	static void _mqtt_keepalive(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	static void _mqtt_keepalive_timeout(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	static void _mqtt_retry(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	int _mqtt_next_id(bool slot);
+	void _mqtt_inflight_arm(MqttInflightSlot *slot);
+	void _mqtt_inflight_send(MqttInflightSlot *slot);
+	void _mqtt_inflight_release(MqttInflightSlot *slot);
+	void _mqtt_inflight_resend();
+	void _mqtt_inflight_disarm();
+	void _mqtt_inflight_clear();
+	void _mqtt_persist_sync();
+	void _mqtt_early(uint8_t type, MqttMsg const *msg);
+	void _mqtt_early_done();
+	void _mqtt_rollback(std::vector<MqttEarlyPacket> &early);
+	static void _mqtt_read_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _mqtt_write_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _mqtt_connected(void *clientdata, int fd, int err);
+	void _mqtt_queue(struct iovec *iov, int iovcnt);
+	int _mqtt_flush_nonblock();
+	void _mqtt_close_socket();
+	void _mqtt_handle_close();
+	void _mqtt_handle_publish(MqttMsgView const *msg);
 	void _mqtt_handle_packet(uint8_t header, char *buffer, int buflen);
+	static void _mqtt_reader_proc(void *clientdata, uint8_t header, char *buffer, int buflen);
 	void _mqtt_reader_feed(char *buffer, int len);
-	void _mqtt_handle_puback(int type, int msgid);
+	void _mqtt_handle_puback(int type, int msgid, uint8_t rc, std::span<const char> props);
+	void _mqtt_handle_disconnect(uint8_t rc, std::span<const char> props);
 	void _mqtt_handle_suback(int msgid, int qos);
 	void _mqtt_handle_unsuback(int msgid);
 	void _mqtt_handle_pingresp();
+	void _mqtt_write(char *buffer, int len);
+	void _mqtt_writev(struct iovec *iov, int iovcnt);
+	size_t _mqtt_publish_size(MqttMsg const *msg);
 	void _mqtt_send_publish(MqttMsg *msg);
-	void _mqtt_send_ack(int type, int msgid);
+	void _mqtt_send_subscribe(int msgid, const char *topic, uint8_t qos);
+	void _mqtt_send_disconnect();
+	template <uint8_t Type> void _mqtt_send_ack(int msgid);
 	void _mqtt_send_connect();
 	void _mqtt_callback(int type, void *data, int id);
 	void _mqtt_send_ping();
 	void _mqtt_handle_connack(int rc);
+	bool _mqtt_handle_connack_properties(std::span<const char> props);
 	void _mqtt_send_unsubscribe(int msgid, const std::string &topic);
 	void _mqtt_handle_publish(uint8_t header, char *buffer, int buflen);
 };
@@ -200,6 +386,9 @@ std::shared_ptr<MqttWill> mqtt_will_new(const std::string &topic, const std::str
 //Message create and release
 void mqtt_msg_new(MqttMsg *msg, int msgid, int qos, bool retain, bool dup, const std::string &topic, char const *ptr, size_t len);
 
+//Copy a message view into an owned message
+void mqtt_msg_detach(MqttMsg *msg, MqttMsgView const *view);
+
 
 
 #endif /* __MQTT_H__ */
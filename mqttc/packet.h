@@ -34,10 +34,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include <string>
+#include <string_view>
 #include <vector>
 
-#define PROTOCOL_MAGIC "MQIsdp"
+#include "../common/codec.h"
 
 #define CONNECT 0x10
 #define CONNACK 0x20
@@ -71,35 +71,50 @@
 #define SETRETAIN(HDR, R)	(HDR | (R))
 #define GETRETAIN(HDR)		(HDR & 0x01)
 
+#define MAX_PAYLOAD_SIZE MQTT_MAX_REMAINING_LENGTH
+
 /*
-|----------------------------------------------------------------------------------
-|     7    |    6     |      5     |  4   3  |     2    |       1      |     0    |
-| username | password | willretain | willqos | willflag | cleansession | reserved |
-|----------------------------------------------------------------------------------
-*/
-#define FLAG_CLEANSESS(F, C)	(F | ((C) << 1))
-#define FLAG_WILL(F, W)			(F | ((W) << 2))	
-#define FLAG_WILLQOS(F, Q)		(F | ((Q) << 3))
-#define FLAG_WILLRETAIN(F, R) 	(F | ((R) << 5))
-#define FLAG_PASSWD(F, P)		(F | ((P) << 6))
-#define FLAG_USERNAME(F, U)		(F | ((U) << 7))
+ * The wire format itself lives in the shared codec; these are the char**
+ * writers mqttc has always used, on top of its primitives.
+ */
+static inline int _encode_remaining_length(char *buffer, int length)
+{
+	return mqtt_put_remaining_length(buffer, length) - buffer;
+}
 
-#define MAX_PAYLOAD_SIZE 268435455
+static inline void _write_header(char **pptr, uint8_t header)
+{
+	*pptr = mqtt_put_char(*pptr, header);
+}
 
-int _encode_remaining_length(char *buf, int length);
-int _decode_remaining_length(char **buf, int *count);
-void _write_header(char **pptr, uint8_t header);
-uint8_t _read_header(char **pptr);
-void _write_remaining_length(char **ptr, char *bytes, int count);
-void _write_char(char **pptr, char c);
-char _read_char(char** pptr);
-void _write_int(char **pptr, int i);
-int _read_int(char** pptr);
-void _write_string(char **pptr, std::string const &string);
-std::string _read_string(char **pptr);
-void _write_string_len(char **pptr, const char *string, int len);
-std::string _read_string_len(char **pptr);
-void _write_payload(char **pptr, const std::vector<char> &payload);
+static inline void _write_remaining_length(char **pptr, char *bytes, int count)
+{
+	*pptr = mqtt_put_bytes(*pptr, bytes, count);
+}
 
-#endif /* __MQTT_PACKET_H */
+static inline void _write_char(char **pptr, char c)
+{
+	*pptr = mqtt_put_char(*pptr, c);
+}
+
+static inline void _write_int(char **pptr, int i)
+{
+	*pptr = mqtt_put_int(*pptr, i);
+}
 
+static inline void _write_string(char **pptr, std::string_view string)
+{
+	*pptr = mqtt_put_string(*pptr, string);
+}
+
+static inline void _write_string_len(char **pptr, const char *string, int len)
+{
+	*pptr = mqtt_put_string(*pptr, std::string_view(string, len));
+}
+
+static inline void _write_payload(char **pptr, std::vector<char> const &payload)
+{
+	*pptr = mqtt_put_bytes(*pptr, payload.data(), payload.size());
+}
+
+#endif /* __MQTT_PACKET_H */
@@ -0,0 +1,458 @@
+/*
+ * persist.c - session state in a memory-mapped append-only log
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "packet.h"
+#include "persist.h"
+
+#define LOG_MAGIC "MQTTLOG1"
+#define LOG_HEADER 16 //magic, checkpoint, reserved
+#define LOG_CHECKPOINT 8
+
+#define ALIGN8(N) (((N) + 7) & ~(size_t)7)
+
+/* record types */
+#define LOG_PUBLISH  1 //outbound message, waits for PUBACK or PUBREC
+#define LOG_PUBREL   2 //outbound QoS 2, waits for PUBCOMP
+#define LOG_RELEASE  3 //outbound done
+#define LOG_RECEIVED 4 //inbound QoS 2 delivered
+#define LOG_RELEASED 5 //inbound QoS 2 released
+
+/*
+ * Records are 8-byte aligned and host endian. len is written last and a
+ * checksum covers the rest, so a torn tail is recognised on replay.
+ */
+struct MqttLogRecord {
+	uint32_t len; //whole record with padding, 0 ends the log
+	uint32_t sum; //FNV-1a of everything after this field
+	uint8_t type;
+	uint8_t flags; //qos | retain << 2 | dup << 3
+	uint16_t id;
+	uint16_t topiclen;
+	uint16_t reserved;
+	uint32_t payloadlen;
+	uint32_t reserved2;
+};
+
+static uint32_t _log_sum(const char *buf, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)buf[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t _log_record_size(size_t topiclen, size_t payloadlen)
+{
+	return ALIGN8(sizeof(MqttLogRecord) + topiclen + payloadlen);
+}
+
+/* write one record at ptr, which has room for it */
+static size_t _log_put(char *ptr, uint8_t type, uint8_t flags, uint16_t id,
+	std::string_view topic, std::span<const char> payload)
+{
+	size_t len = _log_record_size(topic.size(), payload.size());
+	MqttLogRecord *rec = (MqttLogRecord *)ptr;
+	rec->type = type;
+	rec->flags = flags;
+	rec->id = id;
+	rec->topiclen = topic.size();
+	rec->reserved = 0;
+	rec->payloadlen = payload.size();
+	rec->reserved2 = 0;
+	char *body = ptr + sizeof(MqttLogRecord);
+	memcpy(body, topic.data(), topic.size());
+	if (!payload.empty()) memcpy(body + topic.size(), payload.data(), payload.size());
+	size_t used = sizeof(MqttLogRecord) + topic.size() + payload.size();
+	memset(ptr + used, 0, len - used);
+	rec->sum = _log_sum(ptr + 8, len - 8);
+	rec->len = len;
+	return len;
+}
+
+//the records an outbound message keeps alive: its publish, and its PUBREL once sent
+static size_t _log_live_size(const char *map, uint32_t offset, uint8_t state)
+{
+	size_t size = ((MqttLogRecord *)(map + offset))->len;
+	return state == PUBCOMP ? size + sizeof(MqttLogRecord) : size;
+}
+
+static int _log_fsync_dir(const char *path)
+{
+	std::string copy(path);
+	int dfd = ::open(dirname(copy.data()), O_RDONLY);
+	if (dfd < 0) return -1;
+	int rc = fsync(dfd);
+	::close(dfd);
+	return rc;
+}
+
+static char *_log_map(int fd, size_t size)
+{
+	void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return map == MAP_FAILED ? nullptr : (char *)map;
+}
+
+MqttPersist::~MqttPersist()
+{
+	close();
+}
+
+int MqttPersist::open(const char *path, size_t segsize, bool fsync)
+{
+	struct stat st;
+	close();
+	this->path = path;
+	this->segsize = ALIGN8(segsize < 4096 ? 4096 : segsize);
+	this->dosync = fsync;
+
+	this->fd = ::open(path, O_RDWR | O_CREAT, 0644);
+	if (this->fd < 0 || fstat(this->fd, &st) < 0) {
+		snprintf(this->errstr, sizeof(this->errstr), "open %s: %s", path, strerror(errno));
+		close();
+		return MQTT_ERR;
+	}
+	bool fresh = (st.st_size == 0);
+	this->mapsize = fresh ? this->segsize : st.st_size;
+	if ((fresh && ftruncate(this->fd, this->mapsize) < 0) ||
+		(this->map = _log_map(this->fd, this->mapsize)) == nullptr) {
+		snprintf(this->errstr, sizeof(this->errstr), "map %s: %s", path, strerror(errno));
+		close();
+		return MQTT_ERR;
+	}
+	if (fresh) {
+		memcpy(this->map, LOG_MAGIC, 8);
+	} else if (this->mapsize < LOG_HEADER || memcmp(this->map, LOG_MAGIC, 8) != 0) {
+		snprintf(this->errstr, sizeof(this->errstr), "%s is not a session log", path);
+		close();
+		return MQTT_ERR;
+	}
+	return replay();
+}
+
+void MqttPersist::close()
+{
+	if (this->map) {
+		sync();
+		munmap(this->map, this->mapsize);
+		this->map = nullptr;
+	}
+	if (this->fd >= 0) {
+		::close(this->fd);
+		this->fd = -1;
+	}
+	this->live.clear();
+	this->livebytes = 0;
+	this->received.clear();
+	this->nreceived = 0;
+	this->tail = this->synced = 0;
+}
+
+/*
+ * One pass over the mapping, straight from the page cache: records are
+ * applied to the live index and stay where they are. Only those past the
+ * checkpoint are checksummed, the rest were synced whole.
+ */
+int MqttPersist::replay()
+{
+	size_t at = LOG_HEADER;
+	size_t checked = *(uint32_t *)(this->map + LOG_CHECKPOINT);
+	if (checked % 8 || checked > this->mapsize) checked = 0;
+	while (at + sizeof(MqttLogRecord) <= this->mapsize) {
+		MqttLogRecord *rec = (MqttLogRecord *)(this->map + at);
+		if (rec->len == 0) break;
+		if (rec->len < sizeof(MqttLogRecord) || rec->len % 8 || rec->len > this->mapsize - at ||
+			sizeof(MqttLogRecord) + rec->topiclen + rec->payloadlen > rec->len ||
+			(at >= checked && _log_sum(this->map + at + 8, rec->len - 8) != rec->sum)) {
+			//torn write: drop it so later appends can't run into its remains
+			memset(this->map + at, 0, this->mapsize - at);
+			break;
+		}
+		switch (rec->type) {
+		case LOG_PUBLISH: {
+			auto it = this->live.find(rec->id);
+			if (it != this->live.end()) {
+				this->livebytes -= _log_live_size(this->map, it->second.offset, it->second.state);
+			}
+			this->live[rec->id] = {(uint32_t)at, (uint8_t)(((rec->flags & 3) == MQTT_QOS1) ? PUBACK : PUBREC)};
+			this->livebytes += rec->len;
+			break;
+		}
+		case LOG_PUBREL: {
+			auto it = this->live.find(rec->id);
+			if (it != this->live.end() && it->second.state != PUBCOMP) {
+				it->second.state = PUBCOMP;
+				this->livebytes += sizeof(MqttLogRecord);
+			}
+			break;
+		}
+		case LOG_RELEASE: {
+			auto it = this->live.find(rec->id);
+			if (it != this->live.end()) {
+				this->livebytes -= _log_live_size(this->map, it->second.offset, it->second.state);
+				this->live.erase(it);
+			}
+			break;
+		}
+		case LOG_RECEIVED:
+			if (!this->received.insert(rec->id)) this->nreceived++;
+			break;
+		case LOG_RELEASED:
+			if (this->received.test(rec->id)) {
+				this->received.erase(rec->id);
+				this->nreceived--;
+			}
+			break;
+		}
+		at += rec->len;
+	}
+	this->tail = this->synced = at;
+	//a checkpoint past a dropped tail would vouch for whatever is appended there next
+	if (checked > at) checkpoint(at);
+	return MQTT_OK;
+}
+
+void MqttPersist::checkpoint(size_t offset)
+{
+	*(uint32_t *)(this->map + LOG_CHECKPOINT) = offset;
+}
+
+//enough of the log is dead for a compaction to pay
+bool MqttPersist::wasteful() const
+{
+	size_t used = this->tail - LOG_HEADER;
+	size_t garbage = used - live_size();
+	return garbage >= MQTT_PERSIST_GARBAGE_MIN && garbage * 100 >= used * MQTT_PERSIST_GARBAGE_RATIO;
+}
+
+int MqttPersist::append(uint8_t type, uint8_t flags, uint16_t id, std::string_view topic, std::span<const char> payload)
+{
+	if (!this->map) {
+		snprintf(this->errstr, sizeof(this->errstr), "session log not open");
+		return MQTT_ERR;
+	}
+	size_t len = _log_record_size(topic.size(), payload.size());
+	if ((this->tail + len > this->mapsize || wasteful()) && compact(len) != MQTT_OK) {
+		return MQTT_ERR;
+	}
+	this->tail += _log_put(this->map + this->tail, type, flags, id, topic, payload);
+	return MQTT_OK;
+}
+
+int MqttPersist::sync()
+{
+	if (!dirty()) return MQTT_OK;
+	if (this->dosync && aof_fsync(this->fd) < 0) {
+		snprintf(this->errstr, sizeof(this->errstr), "sync %s: %s", this->path.c_str(), strerror(errno));
+		return MQTT_ERR;
+	}
+	//without fsync nothing is known to be on disk, so everything stays checked
+	if (this->dosync) checkpoint(this->tail);
+	this->synced = this->tail;
+	this->syncs++;
+	return MQTT_OK;
+}
+
+size_t MqttPersist::live_size() const
+{
+	return this->livebytes + this->nreceived * sizeof(MqttLogRecord);
+}
+
+/*
+ * Write the live state into a fresh segment next to the log and rename
+ * it over the log once it is on disk, so a crash leaves one or the other.
+ */
+int MqttPersist::compact(size_t extra)
+{
+	if (!this->map) return MQTT_ERR;
+	size_t need = LOG_HEADER + live_size() + extra;
+	size_t size = this->segsize;
+	while (size < 2 * need) size *= 2;
+
+	std::string tmp = this->path + ".tmp";
+	int nfd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	char *nmap = nullptr;
+	if (nfd < 0 || ftruncate(nfd, size) < 0 || (nmap = _log_map(nfd, size)) == nullptr) {
+		snprintf(this->errstr, sizeof(this->errstr), "compact %s: %s", tmp.c_str(), strerror(errno));
+		if (nfd >= 0) ::close(nfd);
+		unlink(tmp.c_str());
+		return MQTT_ERR;
+	}
+	memcpy(nmap, LOG_MAGIC, 8);
+
+	std::vector<std::pair<uint32_t, uint16_t>> order;
+	order.reserve(this->live.size());
+	for (auto &it : this->live) {
+		order.push_back({it.second.offset, it.first});
+	}
+	std::sort(order.begin(), order.end());
+
+	size_t at = LOG_HEADER;
+	for (auto &o : order) {
+		MqttLogRecord *rec = (MqttLogRecord *)(this->map + o.first);
+		memcpy(nmap + at, rec, rec->len);
+		Live &l = this->live[o.second];
+		l.offset = at;
+		at += rec->len;
+		if (l.state == PUBCOMP) {
+			at += _log_put(nmap + at, LOG_PUBREL, 0, o.second, {}, {});
+		}
+	}
+	inbound([&](uint16_t id) {
+		at += _log_put(nmap + at, LOG_RECEIVED, 0, id, {}, {});
+	});
+	//the segment is synced before the rename makes it the log
+	if (this->dosync) *(uint32_t *)(nmap + LOG_CHECKPOINT) = at;
+
+	if (this->dosync && aof_fsync(nfd) < 0) {
+		snprintf(this->errstr, sizeof(this->errstr), "compact %s: %s", tmp.c_str(), strerror(errno));
+		munmap(nmap, size);
+		::close(nfd);
+		unlink(tmp.c_str());
+		return MQTT_ERR;
+	}
+	if (rename(tmp.c_str(), this->path.c_str()) < 0) {
+		snprintf(this->errstr, sizeof(this->errstr), "compact %s: %s", this->path.c_str(), strerror(errno));
+		munmap(nmap, size);
+		::close(nfd);
+		unlink(tmp.c_str());
+		return MQTT_ERR;
+	}
+	if (this->dosync) _log_fsync_dir(this->path.c_str());
+
+	munmap(this->map, this->mapsize);
+	::close(this->fd);
+	this->fd = nfd;
+	this->map = nmap;
+	this->mapsize = size;
+	this->tail = this->synced = at;
+	this->compactions++;
+	return MQTT_OK;
+}
+
+int MqttPersist::log_publish(MqttMsg const *msg)
+{
+	uint8_t flags = msg->qos | (msg->retain << 2) | (msg->dup << 3);
+	if (append(LOG_PUBLISH, flags, msg->id, msg->topic, msg->payload) != MQTT_OK) {
+		return MQTT_ERR;
+	}
+	//a compaction moves everything, the new record is always last
+	size_t len = _log_record_size(msg->topic.size(), msg->payload.size());
+	auto it = this->live.find(msg->id);
+	if (it != this->live.end()) {
+		this->livebytes -= _log_live_size(this->map, it->second.offset, it->second.state);
+	}
+	this->live[msg->id] = {(uint32_t)(this->tail - len), (uint8_t)(msg->qos == MQTT_QOS1 ? PUBACK : PUBREC)};
+	this->livebytes += len;
+	return MQTT_OK;
+}
+
+int MqttPersist::log_pubrel(uint16_t id)
+{
+	auto it = this->live.find(id);
+	if (it == this->live.end() || it->second.state == PUBCOMP) return MQTT_OK;
+	if (append(LOG_PUBREL, 0, id, {}, {}) != MQTT_OK) return MQTT_ERR;
+	this->live[id].state = PUBCOMP;
+	this->livebytes += sizeof(MqttLogRecord);
+	return MQTT_OK;
+}
+
+int MqttPersist::log_release(uint16_t id)
+{
+	if (this->live.find(id) == this->live.end()) return MQTT_OK;
+	if (append(LOG_RELEASE, 0, id, {}, {}) != MQTT_OK) return MQTT_ERR;
+	//looked up again, the append may have compacted
+	auto it = this->live.find(id);
+	this->livebytes -= _log_live_size(this->map, it->second.offset, it->second.state);
+	this->live.erase(it);
+	return MQTT_OK;
+}
+
+int MqttPersist::log_received(uint16_t id)
+{
+	if (this->received.test(id)) return MQTT_OK;
+	if (append(LOG_RECEIVED, 0, id, {}, {}) != MQTT_OK) return MQTT_ERR;
+	this->received.insert(id);
+	this->nreceived++;
+	return MQTT_OK;
+}
+
+int MqttPersist::log_released(uint16_t id)
+{
+	if (!this->received.test(id)) return MQTT_OK;
+	if (append(LOG_RELEASED, 0, id, {}, {}) != MQTT_OK) return MQTT_ERR;
+	this->received.erase(id);
+	this->nreceived--;
+	return MQTT_OK;
+}
+
+int MqttPersist::reset()
+{
+	this->live.clear();
+	this->livebytes = 0;
+	this->received.clear();
+	this->nreceived = 0;
+	return compact();
+}
+
+std::vector<MqttPersistMsg> MqttPersist::outbound()
+{
+	std::vector<MqttPersistMsg> msgs;
+	msgs.reserve(this->live.size());
+	for (auto &it : this->live) {
+		MqttLogRecord *rec = (MqttLogRecord *)(this->map + it.second.offset);
+		const char *body = (const char *)(rec + 1);
+		MqttPersistMsg m;
+		m.state = it.second.state;
+		m.msg.id = rec->id;
+		m.msg.qos = rec->flags & 3;
+		m.msg.retain = (rec->flags >> 2) & 1;
+		m.msg.dup = (rec->flags >> 3) & 1;
+		m.msg.topic = std::string_view(body, rec->topiclen);
+		m.msg.payload = std::span<const char>(body + rec->topiclen, rec->payloadlen);
+		msgs.push_back(m);
+	}
+	std::sort(msgs.begin(), msgs.end(), [](MqttPersistMsg const &a, MqttPersistMsg const &b) {
+		return a.msg.topic.data() < b.msg.topic.data();
+	});
+	return msgs;
+}
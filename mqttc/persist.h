@@ -0,0 +1,137 @@
+/*
+ * persist.h - session state in a memory-mapped append-only log
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_PERSIST_H
+#define __MQTT_PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "inflight.h"
+#include "mqtt.h"
+
+#define MQTT_PERSIST_SEGMENT (1024*1024*4)
+#define MQTT_PERSIST_GARBAGE_MIN (1024*1024) //dead bytes before compacting is worth it
+#define MQTT_PERSIST_GARBAGE_RATIO 50 //percent of the log dead that compacts it
+
+/*
+ * An outbound message found in the log. state is the packet it waits
+ * for: PUBACK, PUBREC or PUBCOMP. The view points into the mapping and
+ * is valid until the next append.
+ */
+struct MqttPersistMsg {
+	uint8_t state;
+	MqttMsgView msg;
+};
+
+/*
+ * The log is one preallocated segment file mapped shared. Records are
+ * appended with memcpy, and aof_fsync commits every record appended
+ * since the last sync at once, so many publishes share one sync. Once
+ * MQTT_PERSIST_GARBAGE_RATIO percent of the log is dead, or a record
+ * doesn't fit, the live state is written to a fresh segment which
+ * replaces the old one, twice as large if the live state needs it.
+ *
+ * The header keeps a checkpoint: the end of the records known to be on
+ * disk, moved by every fsync and set by compaction. Recovery still walks
+ * the record headers to rebuild the live index, but checksums only what
+ * follows the checkpoint, where a torn write can be.
+ */
+class MqttPersist {
+public:
+	~MqttPersist();
+
+	int open(const char *path, size_t segsize = MQTT_PERSIST_SEGMENT, bool fsync = true);
+	void close();
+	bool opened() const { return map != nullptr; }
+
+	/* outbound QoS 1/2 */
+	int log_publish(MqttMsg const *msg);
+	int log_pubrel(uint16_t id);
+	int log_release(uint16_t id);
+
+	/* inbound QoS 2 */
+	int log_received(uint16_t id);
+	int log_released(uint16_t id);
+
+	/* forget everything, for a clean session */
+	int reset();
+
+	/* commit appended records, a no-op when nothing is pending */
+	int sync();
+	bool dirty() const { return synced < tail; }
+
+	int compact(size_t extra = 0);
+
+	/* live state after open, outbound oldest first */
+	std::vector<MqttPersistMsg> outbound();
+	template <typename F>
+	void inbound(F f) const
+	{
+		for (int id = 1; id <= MQTT_INFLIGHT_MAX; id++) {
+			if (received.test(id)) f((uint16_t)id);
+		}
+	}
+
+	size_t size() const { return tail; }
+	size_t capacity() const { return mapsize; }
+	long long syncs = 0;
+	long long compactions = 0;
+	char errstr[256] = {};
+private:
+	struct Live {
+		uint32_t offset; //of its publish record
+		uint8_t state;
+	};
+
+	int append(uint8_t type, uint8_t flags, uint16_t id, std::string_view topic, std::span<const char> payload);
+	int replay();
+	size_t live_size() const;
+	bool wasteful() const;
+	void checkpoint(size_t offset);
+
+	std::string path;
+	int fd = -1;
+	bool dosync = true;
+	char *map = nullptr;
+	size_t mapsize = 0;
+	size_t segsize = 0;
+	size_t tail = 0;   //end of valid records
+	size_t synced = 0; //tail at the last sync
+	std::unordered_map<uint16_t, Live> live;
+	size_t livebytes = 0; //of the records live needs
+	MqttPacketIdSet received;
+	size_t nreceived = 0;
+};
+
+#endif /* __MQTT_PERSIST_H */
@@ -18,21 +18,27 @@ int main()
 	client.mqtt->mqtt_set_username(MQTT_USERNAME);
 
 	client.set_callbacks();
-	
+
+	//no need to wait for CONNACK: the PUBLISH goes out with CONNECT
+	client.mqtt->mqtt_set_pipelined(true);
 	if (client.mqtt->mqtt_connect() < 0) {
 		printf("mqttc connect failed.\n");
 		exit(-1);
 	}
 
-	while (client.mqtt->connack == 0) {
-		client.mqtt->mqtt_read(client.mqtt->fd, 0);
-	}
-
 	char const *m = "Hello, world";
 	MqttMsg msg;
 	mqtt_msg_new(&msg, 0, 0, false, false, MQTT_TOPIC, m, strlen(m));
 	client.mqtt->mqtt_publish(&msg);
 
+	while (client.mqtt->connack == 0 && client.mqtt->fd >= 0) {
+		client.mqtt->mqtt_read(client.mqtt->fd, 0);
+	}
+	if (client.mqtt->state != MQTT_STATE_CONNECTED) {
+		printf("mqttc publish failed. %s\n", client.mqtt->errstr);
+		exit(-1);
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,157 @@
+/*
+ * reader.c - incremental mqtt frame reassembler
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "packet.h"
+#include "reader.h"
+
+#define MAX_HEADER_SIZE 5 //type byte + up to 4 length bytes
+
+/* don't keep a huge buffer around after one big message went by */
+#define PENDING_KEEP_SIZE (1024*64)
+
+int _mqtt_frame_length(const char *buffer, int len, int *hdrlen)
+{
+	const char *ptr = buffer + 1;
+	int val;
+	if (len < 2) return 0;
+	int n = mqtt_get_remaining_length(&ptr, buffer + len, &val);
+	if (n <= 0) return n < 0 ? MQTT_READER_ERR : 0;
+	*hdrlen = 1 + n;
+	return 1 + n + val;
+}
+
+void MqttReader::reset()
+{
+	if (pending.capacity() > PENDING_KEEP_SIZE) {
+		std::vector<char>().swap(pending);
+	} else {
+		pending.clear();
+	}
+	framelen = -1;
+	hdrlen = 0;
+	skip = 0;
+	generation++;
+}
+
+/*
+ * proc may reset the reader (a disconnect, or a reconnect from a
+ * callback): the rest of buffer then belongs to the old stream, so feed
+ * returns as soon as the generation moves.
+ */
+int MqttReader::feed(char *buffer, int len, MqttFrameProc *proc, void *clientdata)
+{
+	char *ptr = buffer;
+	char *end = buffer + len;
+	unsigned gen = generation;
+
+	/* the rest of a frame over maxframe */
+	if (skip > 0) {
+		int take = (end - ptr < skip) ? (int)(end - ptr) : skip;
+		skip -= take;
+		ptr += take;
+	}
+
+	/* finish the frame left over from the previous read */
+	if (!pending.empty()) {
+		while (framelen < 0 && ptr < end) {
+			pending.push_back(*ptr++);
+			framelen = _mqtt_frame_length(pending.data(), pending.size(), &hdrlen);
+			if (framelen == MQTT_READER_ERR) {
+				reset();
+				return MQTT_READER_ERR;
+			}
+			if (framelen == 0) framelen = -1;
+		}
+		if (framelen < 0) return MQTT_READER_OK;
+
+		if (maxframe > 0 && framelen > maxframe) {
+			int left = framelen - (int)pending.size();
+			discarded++;
+			reset();
+			skip = left;
+			return feed(ptr, end - ptr, proc, clientdata);
+		}
+
+		int want = framelen - (int)pending.size();
+		int take = (end - ptr < want) ? (int)(end - ptr) : want;
+		pending.insert(pending.end(), ptr, ptr + take);
+		ptr += take;
+		if ((int)pending.size() < framelen) return MQTT_READER_OK;
+
+		frames++;
+		copied++;
+		/* taken out of pending, so a reset from proc can't free it under the handler */
+		std::vector<char> frame;
+		frame.swap(pending);
+		int fl = framelen, hl = hdrlen;
+		framelen = -1;
+		hdrlen = 0;
+		proc(clientdata, frame[0], frame.data() + hl, fl - hl);
+		if (generation != gen) return MQTT_READER_OK;
+		if (frame.capacity() <= PENDING_KEEP_SIZE) {
+			frame.clear();
+			pending.swap(frame);
+		}
+	}
+
+	/* fast path: dispatch every whole frame straight out of the caller's buffer */
+	while (ptr < end) {
+		int n = end - ptr;
+		int hl = 0;
+		int fl = _mqtt_frame_length(ptr, n, &hl);
+		if (fl == MQTT_READER_ERR) {
+			reset();
+			return MQTT_READER_ERR;
+		}
+		if (maxframe > 0 && fl > maxframe) {
+			discarded++;
+			if (fl > n) {
+				skip = fl - n;
+				break;
+			}
+			ptr += fl;
+			continue;
+		}
+		if (fl == 0 || fl > n) {
+			pending.reserve(fl > 0 ? fl : MAX_HEADER_SIZE);
+			pending.assign(ptr, end);
+			framelen = (fl > 0) ? fl : -1;
+			hdrlen = hl;
+			break;
+		}
+		frames++;
+		proc(clientdata, ptr[0], ptr + hl, fl - hl);
+		if (generation != gen) return MQTT_READER_OK;
+		ptr += fl;
+	}
+	return MQTT_READER_OK;
+}
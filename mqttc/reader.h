@@ -0,0 +1,82 @@
+/*
+ * reader.h - incremental mqtt frame reassembler
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_READER_H
+#define __MQTT_READER_H
+
+#include <stdint.h>
+#include <vector>
+
+#define MQTT_READER_OK 0
+#define MQTT_READER_ERR -1
+
+/*
+ * Called once for every complete frame. 'buffer' points at the variable
+ * header and is only valid for the duration of the call. The proc may
+ * reset the reader; feed then drops the rest of what it was given.
+ */
+typedef void MqttFrameProc(void *clientdata, uint8_t header, char *buffer, int buflen);
+
+/*
+ * Stream reassembler. Bytes may arrive in any split: several frames per
+ * read, or one frame across many reads. Frames that sit wholly inside the
+ * fed buffer are dispatched in place; only a trailing partial frame is
+ * copied aside until the rest of it arrives.
+ *
+ * With maxframe set, a frame over it is never buffered or dispatched: its
+ * bytes are skipped as they arrive and the frame only counted.
+ */
+class MqttReader {
+public:
+	int feed(char *buffer, int len, MqttFrameProc *proc, void *clientdata);
+	void reset();
+
+	int maxframe = 0; //bytes, header included; 0 for no limit
+
+	/* statistics */
+	long long frames = 0;
+	long long copied = 0;
+	long long discarded = 0;
+private:
+	std::vector<char> pending; //partial frame, header included
+	int framelen = -1; //total size of the pending frame, -1 while its header is incomplete
+	int hdrlen = 0;
+	int skip = 0; //bytes of an oversize frame still to come
+	unsigned generation = 0; //bumped by reset, so feed notices one from inside proc
+};
+
+/*
+ * Parse a fixed header at buffer. Returns the total frame size, 0 if more
+ * bytes are needed to tell, or MQTT_READER_ERR for a malformed length.
+ */
+int _mqtt_frame_length(const char *buffer, int len, int *hdrlen);
+
+#endif /* __MQTT_READER_H */
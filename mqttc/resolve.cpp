@@ -0,0 +1,574 @@
+/*
+ * resolve.c - shared DNS cache, async lookups and happy eyeballs connect
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "anet.h"
+#include "resolve.h"
+
+/* "[::1]" is how an IPv6 literal comes in a server name */
+static std::string _mqtt_bare_host(std::string const &host)
+{
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+		return host.substr(1, host.size() - 2);
+	}
+	return host;
+}
+
+static bool _mqtt_numeric_host(std::string const &host, MqttAddrList *addrs)
+{
+	MqttAddr a = {};
+	if (inet_pton(AF_INET, host.c_str(), &a.sin.sin_addr) == 1) {
+		a.sin.sin_family = AF_INET;
+		a.len = sizeof(a.sin);
+	} else if (inet_pton(AF_INET6, host.c_str(), &a.sin6.sin6_addr) == 1) {
+		a.sin6.sin6_family = AF_INET6;
+		a.len = sizeof(a.sin6);
+	} else {
+		return false;
+	}
+	addrs->assign(1, a);
+	return true;
+}
+
+static int _mqtt_getaddrinfo(const char *host, MqttAddrList *addrs)
+{
+	struct addrinfo hints = {};
+	struct addrinfo *result = nullptr;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	int rc = getaddrinfo(host, nullptr, &hints, &result);
+	if (rc != 0) return rc;
+	for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+		if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+			ai->ai_addrlen > sizeof(MqttAddr::sin6)) continue;
+		MqttAddr a = {};
+		memcpy(&a.sa, ai->ai_addr, ai->ai_addrlen);
+		a.len = ai->ai_addrlen;
+		bool dup = false;
+		for (auto &b : *addrs) {
+			dup = dup || (b.len == a.len && memcmp(&b.sa, &a.sa, a.len) == 0);
+		}
+		if (!dup) addrs->push_back(a);
+	}
+	freeaddrinfo(result);
+	if (addrs->empty()) return EAI_NONAME;
+	mqtt_sort_addrs(addrs);
+	return 0;
+}
+
+void mqtt_sort_addrs(MqttAddrList *addrs)
+{
+	int first = addrs->empty() ? AF_INET6 : (*addrs)[0].sa.sa_family;
+	MqttAddrList preferred, other, sorted;
+	for (auto &a : *addrs) {
+		(a.sa.sa_family == first ? preferred : other).push_back(a);
+	}
+	for (size_t i = 0; i < preferred.size() || i < other.size(); i++) {
+		if (i < preferred.size()) sorted.push_back(preferred[i]);
+		if (i < other.size()) sorted.push_back(other[i]);
+	}
+	addrs->swap(sorted);
+}
+
+const char *mqtt_connect_strerror(int err)
+{
+	return err < 0 ? gai_strerror(err) : strerror(err);
+}
+
+static void _mqtt_addrs_set_port(MqttAddrList *addrs, int port)
+{
+	for (auto &a : *addrs) {
+		if (a.sa.sa_family == AF_INET6) {
+			a.sin6.sin6_port = htons(port);
+		} else {
+			a.sin.sin_port = htons(port);
+		}
+	}
+}
+
+/*--------------------------------------
+** Resolver.
+--------------------------------------*/
+MqttResolveRequest::~MqttResolveRequest()
+{
+	if (pipefd[0] >= 0) ::close(pipefd[0]);
+	if (pipefd[1] >= 0) ::close(pipefd[1]);
+}
+
+void MqttResolveRequest::cancel()
+{
+	if (proc && el) aeDeleteFileEvent(el, pipefd[0], AE_READABLE);
+	proc = nullptr;
+}
+
+static void _mqtt_resolve_done(MqttResolveRequest *req)
+{
+	req->done.store(true, std::memory_order_release);
+	char c = 0;
+	if (write(req->pipefd[1], &c, 1) < 0) {
+		//only one byte is ever written, the pipe can't be full
+	}
+}
+
+static void _mqtt_resolve_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	AE_NOTUSED(mask);
+	MqttResolveRequest *req = (MqttResolveRequest *)clientdata;
+	char c;
+	if (read(fd, &c, 1) != 1 || !req->done.load(std::memory_order_acquire)) return;
+	aeDeleteFileEvent(el, fd, AE_READABLE);
+	MqttResolveProc *proc = req->proc;
+	req->proc = nullptr;
+	//may release req, which is not touched again
+	if (proc) proc(req->clientdata, req->err, &req->addrs);
+}
+
+MqttResolver::MqttResolver(int threads) : nthreads(threads > 0 ? threads : 1)
+{
+}
+
+MqttResolver::~MqttResolver()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (auto &t : threads) {
+		t.join();
+	}
+}
+
+MqttResolver &MqttResolver::shared()
+{
+	static MqttResolver resolver;
+	return resolver;
+}
+
+void MqttResolver::set_ttl(int ttl, int negative_ttl)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	this->ttl = ttl;
+	this->negative_ttl = negative_ttl;
+}
+
+void MqttResolver::set_lookup(MqttLookupProc *lookup)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	this->lookup = lookup;
+}
+
+//names being looked up stay, so their waiters still get an answer
+void MqttResolver::flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (it->second.resolving) {
+			it->second.expires = 0;
+			it->second.addrs.clear();
+			++it;
+		} else {
+			it = entries.erase(it);
+		}
+	}
+}
+
+int MqttResolver::cached(std::string const &host, int *err, MqttAddrList *addrs)
+{
+	std::string name = _mqtt_bare_host(host);
+	if (_mqtt_numeric_host(name, addrs)) {
+		*err = 0;
+		return 1;
+	}
+	if (_cached(name, err, addrs)) {
+		hits++;
+		return 1;
+	}
+	misses++;
+	return 0;
+}
+
+int MqttResolver::_cached(std::string const &name, int *err, MqttAddrList *addrs)
+{
+	if (_mqtt_numeric_host(name, addrs)) {
+		*err = 0;
+		return 1;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(name);
+	if (it == entries.end() || it->second.expires == 0) return 0;
+	Entry &e = it->second;
+	if (MqttTimerWheel::now() >= e.expires) {
+		if (e.err != 0) return 0;
+		//stale but usable, refresh behind the caller's back
+		if (!e.resolving) start_lookup(name);
+	}
+	*err = e.err;
+	*addrs = e.addrs;
+	return 1;
+}
+
+int MqttResolver::resolve(std::string const &host, MqttAddrList *addrs)
+{
+	int err;
+	if (cached(host, &err, addrs)) return err;
+
+	std::string name = _mqtt_bare_host(host);
+	MqttLookupProc *fn;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		fn = lookup ? lookup : _mqtt_getaddrinfo;
+	}
+	MqttAddrList found;
+	lookups++;
+	err = fn(name.c_str(), &found);
+	std::lock_guard<std::mutex> guard(lock);
+	complete(name, err, std::move(found));
+	Entry &e = entries[name];
+	*addrs = e.addrs;
+	return e.err;
+}
+
+std::shared_ptr<MqttResolveRequest> MqttResolver::resolve_async(aeEventLoop *el, std::string const &host,
+	MqttResolveProc *proc, void *clientdata)
+{
+	auto req = std::make_shared<MqttResolveRequest>();
+	if (pipe(req->pipefd) != 0) return nullptr;
+	anetNonBlock(nullptr, req->pipefd[0]);
+	anetNonBlock(nullptr, req->pipefd[1]);
+	if (aeCreateFileEvent(el, req->pipefd[0], AE_READABLE, _mqtt_resolve_proc, req.get()) == AE_ERR) {
+		return nullptr;
+	}
+	req->el = el;
+	req->proc = proc;
+	req->clientdata = clientdata;
+
+	int err;
+	std::string name = _mqtt_bare_host(host);
+	if (_cached(name, &err, &req->addrs)) {
+		req->err = err;
+		_mqtt_resolve_done(req.get());
+		return req;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	Entry &e = entries[name];
+	e.waiters.push_back(req);
+	if (e.resolving) {
+		coalesced++;
+	} else {
+		start_lookup(name);
+	}
+	return req;
+}
+
+//lock held
+void MqttResolver::start_lookup(std::string const &host)
+{
+	entries[host].resolving = true;
+	jobs.push_back(host);
+	if (threads.empty()) {
+		for (int i = 0; i < nthreads; i++) {
+			threads.emplace_back(&MqttResolver::worker, this);
+		}
+	}
+	wakeup.notify_one();
+}
+
+/*
+ * lock held. A failed lookup keeps addresses that used to work: a DNS
+ * hiccup shouldn't stop reconnects to a broker that hasn't moved.
+ */
+void MqttResolver::complete(std::string const &host, int err, MqttAddrList &&addrs)
+{
+	Entry &e = entries[host];
+	long long now = MqttTimerWheel::now();
+	if (err == 0) {
+		e.addrs = std::move(addrs);
+		e.err = 0;
+		e.expires = now + ttl;
+	} else if (!e.addrs.empty() && e.err == 0) {
+		e.expires = now + negative_ttl;
+	} else {
+		e.addrs.clear();
+		e.err = err;
+		e.expires = now + negative_ttl;
+	}
+	e.resolving = false;
+	for (auto &req : e.waiters) {
+		req->err = e.err;
+		req->addrs = e.addrs;
+		_mqtt_resolve_done(req.get());
+	}
+	e.waiters.clear();
+}
+
+void MqttResolver::worker()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		wakeup.wait(guard, [this]() { return stopping || !jobs.empty(); });
+		if (stopping) return;
+		std::string host = std::move(jobs.front());
+		jobs.pop_front();
+		MqttLookupProc *fn = lookup ? lookup : _mqtt_getaddrinfo;
+		guard.unlock();
+
+		MqttAddrList addrs;
+		lookups++;
+		int err = fn(host.c_str(), &addrs);
+
+		guard.lock();
+		complete(host, err, std::move(addrs));
+	}
+}
+
+/*--------------------------------------
+** Happy eyeballs.
+--------------------------------------*/
+MqttConnector::~MqttConnector()
+{
+	cancel();
+}
+
+int MqttConnector::start(aeEventLoop *el, std::string const &host, int port,
+	MqttConnectProc *proc, void *clientdata, char *err)
+{
+	cancel();
+	this->el = el;
+	this->port = port;
+	this->proc = proc;
+	this->clientdata = clientdata;
+	this->lasterr = 0;
+	this->attempts = 0;
+
+	int rc;
+	MqttAddrList list;
+	if (MqttResolver::shared().cached(host, &rc, &list)) {
+		if (rc != 0) {
+			if (err) snprintf(err, ANET_ERR_LEN, "can't resolve: %s: %s", host.c_str(), gai_strerror(rc));
+			this->proc = nullptr;
+			return ANET_ERR;
+		}
+		_race(list);
+		if (fds.empty()) {
+			if (err) snprintf(err, ANET_ERR_LEN, "connect: %s", strerror(lasterr));
+			cancel();
+			return ANET_ERR;
+		}
+		return ANET_OK;
+	}
+	request = MqttResolver::shared().resolve_async(el, host, _resolved, this);
+	if (!request) {
+		if (err) snprintf(err, ANET_ERR_LEN, "resolve: %s", strerror(errno));
+		this->proc = nullptr;
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+void MqttConnector::cancel()
+{
+	for (int fd : fds) {
+		aeDeleteFileEvent(el, fd, AE_WRITABLE);
+		::close(fd);
+	}
+	fds.clear();
+	if (el) el->timers->cancel(&timer);
+	if (request) {
+		request->cancel();
+		request.reset();
+	}
+	proc = nullptr;
+}
+
+void MqttConnector::_resolved(void *clientdata, int err, MqttAddrList const *addrs)
+{
+	MqttConnector *c = (MqttConnector *)clientdata;
+	MqttAddrList list = *addrs;
+	c->request.reset();
+	if (err != 0) {
+		c->_finish(-1, err);
+		return;
+	}
+	c->_race(list);
+	if (c->fds.empty()) c->_finish(-1, c->lasterr);
+}
+
+void MqttConnector::_race(MqttAddrList const &list)
+{
+	addrs = list;
+	_mqtt_addrs_set_port(&addrs, port);
+	next = 0;
+	_launch();
+}
+
+//start the next address that gets as far as connecting, -1 when none is left
+int MqttConnector::_launch()
+{
+	while (next < addrs.size()) {
+		MqttAddr &a = addrs[next++];
+		attempts++;
+		int fd = fastopen ? anetTcpFastOpenConnectAddr(nullptr, &a.sa, a.len)
+			: anetTcpNonBlockConnectAddr(nullptr, &a.sa, a.len);
+		if (fd < 0) {
+			lasterr = errno;
+			continue;
+		}
+		if (aeCreateFileEvent(el, fd, AE_WRITABLE, _connect_proc, this) == AE_ERR) {
+			::close(fd);
+			lasterr = EMFILE;
+			continue;
+		}
+		fds.push_back(fd);
+		if (next < addrs.size()) {
+			el->timers->add(&timer, attempt_delay, _attempt_timeout, this);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+void MqttConnector::_attempt_timeout(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	AE_NOTUSED(wheel);
+	AE_NOTUSED(timer);
+	MqttConnector *c = (MqttConnector *)clientdata;
+	if (c->_launch() < 0 && c->fds.empty()) c->_finish(-1, c->lasterr);
+}
+
+void MqttConnector::_connect_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	AE_NOTUSED(mask);
+	MqttConnector *c = (MqttConnector *)clientdata;
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+
+	aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	c->fds.erase(std::find(c->fds.begin(), c->fds.end(), fd));
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
+		err = errno;
+	}
+	if (err) {
+		::close(fd);
+		c->lasterr = err;
+		//a refused address doesn't get to hold up the next one
+		if (c->_launch() < 0 && c->fds.empty()) c->_finish(-1, err);
+		return;
+	}
+	c->_finish(fd, 0);
+}
+
+//the winner is handed over, the losers are dropped
+void MqttConnector::_finish(int fd, int err)
+{
+	MqttConnectProc *done = proc;
+	void *data = clientdata;
+	proc = nullptr;
+	cancel();
+	if (done) done(data, fd, err);
+}
+
+int MqttConnector::connect(std::string const &host, int port, int attempt_delay, char *err,
+	bool fastopen)
+{
+	MqttAddrList addrs;
+	int rc = MqttResolver::shared().resolve(host, &addrs);
+	if (rc != 0) {
+		if (err) snprintf(err, ANET_ERR_LEN, "can't resolve: %s: %s", host.c_str(), gai_strerror(rc));
+		return ANET_ERR;
+	}
+	_mqtt_addrs_set_port(&addrs, port);
+
+	std::vector<struct pollfd> pfds;
+	size_t next = 0;
+	int lasterr = 0;
+	int winner = -1;
+	bool launch = true;
+	while (winner < 0) {
+		while (launch && next < addrs.size()) {
+			MqttAddr &a = addrs[next];
+			int fd = fastopen ? anetTcpFastOpenConnectAddr(nullptr, &a.sa, a.len)
+				: anetTcpNonBlockConnectAddr(nullptr, &a.sa, a.len);
+			next++;
+			if (fd < 0) {
+				lasterr = errno;
+				continue;
+			}
+			pfds.push_back({fd, POLLOUT, 0});
+			break;
+		}
+		if (pfds.empty()) break;
+		int n = poll(pfds.data(), pfds.size(), next < addrs.size() ? attempt_delay : -1);
+		if (n < 0 && errno != EINTR) {
+			lasterr = errno;
+			break;
+		}
+		launch = (n == 0);
+		for (size_t i = 0; n > 0 && i < pfds.size();) {
+			if (pfds[i].revents == 0) {
+				i++;
+				continue;
+			}
+			int fd = pfds[i].fd;
+			int soerr = 0;
+			socklen_t errlen = sizeof(soerr);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &errlen) == -1) soerr = errno;
+			pfds.erase(pfds.begin() + i);
+			if (soerr == 0) {
+				winner = fd;
+				break;
+			}
+			::close(fd);
+			lasterr = soerr;
+			launch = true;
+		}
+	}
+	for (auto &p : pfds) {
+		::close(p.fd);
+	}
+	if (winner < 0) {
+		if (err) snprintf(err, ANET_ERR_LEN, "connect: %s", strerror(lasterr ? lasterr : ECONNREFUSED));
+		return ANET_ERR;
+	}
+	anetBlock(nullptr, winner);
+	return winner;
+}
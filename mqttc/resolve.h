@@ -0,0 +1,213 @@
+/*
+ * resolve.h - shared DNS cache, async lookups and happy eyeballs connect
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_RESOLVE_H
+#define __MQTT_RESOLVE_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ae.h"
+
+#define MQTT_RESOLVE_TTL 60000 //ms
+#define MQTT_RESOLVE_NEGATIVE_TTL 5000 //ms
+#define MQTT_RESOLVE_THREADS 2
+#define MQTT_CONNECT_ATTEMPT_DELAY 250 //ms, RFC 8305
+
+/* one resolved address, the port is filled in when connecting */
+struct MqttAddr {
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	};
+	socklen_t len;
+};
+
+typedef std::vector<MqttAddr> MqttAddrList;
+
+/* returns 0 or an EAI_* code, like getaddrinfo */
+typedef int MqttLookupProc(const char *host, MqttAddrList *addrs);
+
+/* err is 0 or an EAI_* code; runs on the loop that asked */
+typedef void MqttResolveProc(void *clientdata, int err, MqttAddrList const *addrs);
+
+/*
+ * An asynchronous lookup in flight. The resolver's thread writes the
+ * answer and pokes the pipe, the requesting loop reads it and calls proc.
+ * Both sides hold a reference, so cancelling never races the writer.
+ */
+struct MqttResolveRequest {
+	aeEventLoop *el = nullptr;
+	int pipefd[2] = {-1, -1};
+	MqttResolveProc *proc = nullptr;
+	void *clientdata = nullptr;
+	std::atomic<bool> done{false};
+	int err = 0;
+	MqttAddrList addrs; //valid until the request is released
+
+	~MqttResolveRequest();
+	void cancel();
+};
+
+/*
+ * Host name cache shared by every connection in the process. getaddrinfo
+ * doesn't tell the record's TTL, so answers are kept for ttl ms and
+ * failures for negative_ttl ms. An expired answer is still handed out
+ * while a fresh one is looked up in the background, so a reconnect never
+ * waits for DNS once the name has been seen. Lookups run on a few
+ * threads off every event loop, and concurrent lookups of one name share
+ * a single getaddrinfo.
+ */
+class MqttResolver {
+public:
+	MqttResolver(int threads = MQTT_RESOLVE_THREADS);
+	~MqttResolver();
+
+	static MqttResolver &shared();
+
+	void set_ttl(int ttl, int negative_ttl);
+	void set_lookup(MqttLookupProc *lookup); //nullptr for getaddrinfo
+	void flush();
+
+	/* answer from the cache without blocking: 1 with err and addrs
+	 * filled, 0 when the name has to be looked up */
+	int cached(std::string const &host, int *err, MqttAddrList *addrs);
+
+	/* the cache, or getaddrinfo on this thread */
+	int resolve(std::string const &host, MqttAddrList *addrs);
+
+	/* always answers later, on el */
+	std::shared_ptr<MqttResolveRequest> resolve_async(aeEventLoop *el, std::string const &host,
+		MqttResolveProc *proc, void *clientdata);
+
+	/* statistics */
+	std::atomic<long long> hits{0};
+	std::atomic<long long> misses{0};
+	std::atomic<long long> lookups{0}; //getaddrinfo calls
+	std::atomic<long long> coalesced{0};
+private:
+	struct Entry {
+		MqttAddrList addrs;
+		int err = 0;
+		long long expires = 0; //0 while nothing is known
+		bool resolving = false;
+		std::vector<std::shared_ptr<MqttResolveRequest>> waiters;
+	};
+
+	int _cached(std::string const &name, int *err, MqttAddrList *addrs);
+	void worker();
+	void start_lookup(std::string const &host);
+	void complete(std::string const &host, int err, MqttAddrList &&addrs);
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::unordered_map<std::string, Entry> entries;
+	std::deque<std::string> jobs;
+	std::vector<std::thread> threads;
+	int nthreads;
+	bool stopping = false;
+	int ttl = MQTT_RESOLVE_TTL;
+	int negative_ttl = MQTT_RESOLVE_NEGATIVE_TTL;
+	MqttLookupProc *lookup = nullptr;
+};
+
+/* fd is connected, or -1 with err an errno or EAI_* code (negative) */
+typedef void MqttConnectProc(void *clientdata, int fd, int err);
+
+/*
+ * Happy eyeballs (RFC 8305): the addresses of a name, families
+ * interleaved, are tried one after another, starting the next one when
+ * the last hasn't connected within attempt_delay ms or has failed, and
+ * the first to connect wins. A dead address costs attempt_delay instead
+ * of a TCP timeout.
+ *
+ * With fastopen, a server the kernel holds a TCP Fast Open cookie for
+ * "connects" at once and the first write goes out in the SYN. Such an
+ * address always wins the race, so a dead one is only found out by the
+ * connection's first read.
+ */
+class MqttConnector {
+public:
+	~MqttConnector();
+
+	int attempt_delay = MQTT_CONNECT_ATTEMPT_DELAY;
+	bool fastopen = false;
+
+	/* resolve host through the shared cache and race its addresses on
+	 * el; proc is called once, unless start fails or cancel comes first */
+	int start(aeEventLoop *el, std::string const &host, int port,
+		MqttConnectProc *proc, void *clientdata, char *err);
+	void cancel();
+	bool active() const { return proc != nullptr; }
+
+	/* the same on a blocking socket, for connections without a loop */
+	static int connect(std::string const &host, int port, int attempt_delay, char *err,
+		bool fastopen = false);
+
+	/* statistics */
+	int attempts = 0;
+private:
+	static void _resolved(void *clientdata, int err, MqttAddrList const *addrs);
+	static void _connect_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void _attempt_timeout(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	void _race(MqttAddrList const &list);
+	int _launch();
+	void _finish(int fd, int err);
+
+	aeEventLoop *el = nullptr;
+	int port = 0;
+	MqttAddrList addrs;
+	size_t next = 0;
+	std::vector<int> fds; //attempts in flight
+	int lasterr = 0;
+	MqttTimer timer;
+	std::shared_ptr<MqttResolveRequest> request;
+	MqttConnectProc *proc = nullptr;
+	void *clientdata = nullptr;
+};
+
+/* interleave the families, keeping the resolver's order within each */
+void mqtt_sort_addrs(MqttAddrList *addrs);
+
+/* "can't resolve" or connect's strerror for a MqttConnectProc err */
+const char *mqtt_connect_strerror(int err);
+
+#endif /* __MQTT_RESOLVE_H */
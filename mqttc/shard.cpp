@@ -0,0 +1,292 @@
+/*
+ * shard.c - mqtt connections spread over per-core event loops
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "anet.h"
+#include "shard.h"
+
+#define MQTT_NOTUSED(V) ((void) V)
+
+/*--------------------------------------
+** MPSC queue.
+--------------------------------------*/
+MqttMpscQueue::MqttMpscQueue()
+	: head(&stub)
+	, tail(&stub)
+{
+}
+
+void MqttMpscQueue::push(MqttShardTask *task)
+{
+	task->next.store(nullptr, std::memory_order_relaxed);
+	MqttShardTask *prev = head.exchange(task, std::memory_order_acq_rel);
+	prev->next.store(task, std::memory_order_release);
+}
+
+MqttShardTask *MqttMpscQueue::pop()
+{
+	MqttShardTask *t = tail;
+	MqttShardTask *next = t->next.load(std::memory_order_acquire);
+	if (t == &stub) {
+		if (!next) return nullptr;
+		tail = next;
+		t = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next) {
+		tail = next;
+		return t;
+	}
+	if (t != head.load(std::memory_order_acquire)) {
+		return nullptr; //a push is half done
+	}
+	push(&stub);
+	next = t->next.load(std::memory_order_acquire);
+	if (next) {
+		tail = next;
+		return t;
+	}
+	return nullptr;
+}
+
+/*--------------------------------------
+** Shard.
+--------------------------------------*/
+void MqttShard::post(MqttShardTask *task)
+{
+	queue.push(task);
+	if (!signalled.exchange(true)) {
+		char c = 0;
+		while (write(wakefd[1], &c, 1) == -1 && errno == EINTR) {
+		}
+	}
+}
+
+static void _shard_wake_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	MQTT_NOTUSED(el);
+	MQTT_NOTUSED(mask);
+	MqttShard *shard = (MqttShard *)clientdata;
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+	shard->signalled = false;
+	shard->drain();
+}
+
+void MqttShard::drain()
+{
+	MqttShardTask *task;
+	while ((task = queue.pop()) != nullptr) {
+		auto it = conns.find(task->clientid);
+		switch (task->type) {
+		case MqttShardTask::TASK_ADD:
+			task->mqtt->mqtt_set_event_loop(el);
+			if (task->mqtt->mqtt_connect() < 0) {
+				//reports MQTT_STATE_DISCONNECTED through the callback
+				task->mqtt->mqtt_disconnect();
+				task->mqtt->mqtt_set_event_loop(nullptr);
+				break;
+			}
+			conns[task->clientid] = task->mqtt;
+			break;
+		case MqttShardTask::TASK_REMOVE:
+			if (it != conns.end()) {
+				it->second->mqtt_disconnect();
+				it->second->mqtt_set_event_loop(nullptr);
+				conns.erase(it);
+			}
+			backlog.erase(task->clientid);
+			break;
+		case MqttShardTask::TASK_PUBLISH: {
+			if (it == conns.end()) break;
+			auto waiting = backlog.find(task->clientid);
+			if (waiting != backlog.end()) {
+				waiting->second.push_back(std::move(task->msg)); //behind the ones already waiting
+			} else if (it->second->mqtt_publish(&task->msg) == MQTT_ERR_INFLIGHT) {
+				backlog[task->clientid].push_back(std::move(task->msg));
+			}
+			break;
+		}
+		case MqttShardTask::TASK_STOP:
+			aeStop(el);
+			break;
+		}
+		delete task;
+	}
+}
+
+void MqttShard::drain_backlog()
+{
+	for (auto it = backlog.begin(); it != backlog.end();) {
+		auto conn = conns.find(it->first);
+		std::deque<MqttMsg> &waiting = it->second;
+		while (conn != conns.end() && !waiting.empty()) {
+			if (conn->second->mqtt_publish(&waiting.front()) == MQTT_ERR_INFLIGHT) break;
+			waiting.pop_front();
+		}
+		if (conn == conns.end() || waiting.empty()) {
+			it = backlog.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+static thread_local MqttShard *_shard_current; //the shard this thread runs
+
+static void _shard_before_sleep(aeEventLoop *el)
+{
+	MQTT_NOTUSED(el);
+	if (!_shard_current->backlog.empty()) _shard_current->drain_backlog();
+}
+
+/* cpu < 0 leaves the thread unpinned */
+void MqttShard::run(int cpu)
+{
+#ifdef __linux__
+	if (cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#else
+	MQTT_NOTUSED(cpu);
+#endif
+	_shard_current = this;
+	aeSetBeforeSleepProc(el, _shard_before_sleep);
+	aeMain(el);
+
+	//connections must not outlive their loop
+	for (auto &it : conns) {
+		it.second->mqtt_disconnect();
+		it.second->mqtt_set_event_loop(nullptr);
+	}
+	conns.clear();
+	backlog.clear();
+}
+
+/*--------------------------------------
+** Shard pool.
+--------------------------------------*/
+MqttShardPool::~MqttShardPool()
+{
+	stop();
+}
+
+int MqttShardPool::start(int nshards, bool pin, int setsize)
+{
+	if (!shards.empty() || nshards < 1) return MQTT_ERR;
+	unsigned int ncpu = std::thread::hardware_concurrency();
+	for (int i = 0; i < nshards; i++) {
+		std::unique_ptr<MqttShard> shard = std::make_unique<MqttShard>();
+		shard->id = i;
+		shard->el = aeCreateEventLoop(setsize);
+		if (!shard->el || pipe(shard->wakefd) != 0) {
+			if (shard->el) aeDeleteEventLoop(shard->el);
+			stop();
+			return MQTT_ERR;
+		}
+		anetNonBlock(nullptr, shard->wakefd[0]);
+		anetNonBlock(nullptr, shard->wakefd[1]);
+		aeCreateFileEvent(shard->el, shard->wakefd[0], AE_READABLE, _shard_wake_proc, shard.get());
+		//unknown CPU count (0): don't pin at all
+		int cpu = (pin && ncpu > 0 && (unsigned)i < ncpu) ? i : -1;
+		shard->thread = std::thread(&MqttShard::run, shard.get(), cpu);
+		shards.push_back(std::move(shard));
+	}
+	return MQTT_OK;
+}
+
+void MqttShardPool::stop()
+{
+	for (auto &shard : shards) {
+		MqttShardTask *task = new MqttShardTask;
+		task->type = MqttShardTask::TASK_STOP;
+		shard->post(task);
+	}
+	for (auto &shard : shards) {
+		shard->thread.join();
+		MqttShardTask *task;
+		while ((task = shard->queue.pop()) != nullptr) {
+			delete task;
+		}
+		aeDeleteEventLoop(shard->el);
+		::close(shard->wakefd[0]);
+		::close(shard->wakefd[1]);
+	}
+	shards.clear();
+}
+
+int MqttShardPool::shard_of(std::string const &clientid) const
+{
+	if (shards.empty()) return -1;
+	return std::hash<std::string>()(clientid) % shards.size();
+}
+
+int MqttShardPool::mqtt_add(std::shared_ptr<Mqtt> const &mqtt)
+{
+	int i = shard_of(mqtt->clientid);
+	if (i < 0) return MQTT_ERR;
+	MqttShardTask *task = new MqttShardTask;
+	task->type = MqttShardTask::TASK_ADD;
+	task->clientid = mqtt->clientid;
+	task->mqtt = mqtt;
+	shards[i]->post(task);
+	return i;
+}
+
+int MqttShardPool::mqtt_remove(std::string const &clientid)
+{
+	int i = shard_of(clientid);
+	if (i < 0) return MQTT_ERR;
+	MqttShardTask *task = new MqttShardTask;
+	task->type = MqttShardTask::TASK_REMOVE;
+	task->clientid = clientid;
+	shards[i]->post(task);
+	return i;
+}
+
+int MqttShardPool::mqtt_publish(std::string const &clientid, MqttMsg &&msg)
+{
+	int i = shard_of(clientid);
+	if (i < 0) return MQTT_ERR;
+	MqttShardTask *task = new MqttShardTask;
+	task->type = MqttShardTask::TASK_PUBLISH;
+	task->clientid = clientid;
+	task->msg = std::move(msg);
+	shards[i]->post(task);
+	return i;
+}
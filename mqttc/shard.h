@@ -0,0 +1,124 @@
+/*
+ * shard.h - mqtt connections spread over per-core event loops
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_SHARD_H
+#define __MQTT_SHARD_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ae.h"
+#include "mqtt.h"
+
+/*
+ * Work handed to a shard thread.
+ */
+struct MqttShardTask {
+	enum Type {
+		TASK_ADD,
+		TASK_REMOVE,
+		TASK_PUBLISH,
+		TASK_STOP
+	};
+	std::atomic<MqttShardTask *> next{nullptr};
+	Type type = TASK_PUBLISH;
+	std::string clientid;
+	std::shared_ptr<Mqtt> mqtt;
+	MqttMsg msg;
+};
+
+/*
+ * Intrusive multi-producer single-consumer queue (Vyukov). push never
+ * blocks or spins; pop may report empty while a push is half done, the
+ * pusher then wakes the consumer again.
+ */
+class MqttMpscQueue {
+public:
+	MqttMpscQueue();
+	void push(MqttShardTask *task);
+	MqttShardTask *pop();
+private:
+	std::atomic<MqttShardTask *> head;
+	MqttShardTask *tail;
+	MqttShardTask stub;
+};
+
+class MqttShard {
+public:
+	int id = 0;
+	aeEventLoop *el = nullptr;
+	std::thread thread;
+	MqttMpscQueue queue;
+	int wakefd[2] = {-1, -1};
+	std::atomic<bool> signalled{false};
+
+	/* owned by the shard thread */
+	std::unordered_map<std::string, std::shared_ptr<Mqtt>> conns;
+	/* QoS 1/2 publishes waiting for an in-flight slot, by client id, in
+	 * the order posted; retried every time the loop is about to sleep,
+	 * so an ack read in this pass lets the next one out */
+	std::unordered_map<std::string, std::deque<MqttMsg>> backlog;
+
+	void post(MqttShardTask *task);
+	void run(int cpu);
+	void drain();
+	void drain_backlog();
+};
+
+/*
+ * N worker threads, each with its own event loop. A connection is pinned
+ * to the shard its client id hashes to, and after mqtt_add only that
+ * shard's thread touches it: every callback runs there, and other threads
+ * publish through the shard's queue instead of writing to the socket.
+ * A QoS 1/2 publish that finds the in-flight window full waits in the
+ * shard's backlog until an ack frees a slot, rather than being dropped.
+ */
+class MqttShardPool {
+public:
+	~MqttShardPool();
+
+	int start(int nshards, bool pin = true, int setsize = 1024 * 10);
+	void stop();
+
+	int shard_of(std::string const &clientid) const;
+	int mqtt_add(std::shared_ptr<Mqtt> const &mqtt);
+	int mqtt_remove(std::string const &clientid);
+	int mqtt_publish(std::string const &clientid, MqttMsg &&msg);
+private:
+	std::vector<std::unique_ptr<MqttShard>> shards;
+};
+
+#endif /* __MQTT_SHARD_H */
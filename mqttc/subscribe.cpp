@@ -1,17 +1,23 @@
 
 #include "client.h"
+#include "packet.h"
 #include "../mqttserver.h"
 
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <chrono>
-
-//extern Client client;
-
+static void on_connack(Mqtt *mqtt, void *data, int rc)
+{
+	(void)data;
+	(void)rc; //a refusal is reported as a disconnect
+	mqtt->connack = 1;
+}
 
-void client_prepare();
-void set_callbacks(Mqtt *mqtt);
+static void on_connect(Mqtt *mqtt, void *data, int state)
+{
+	(void)data;
+	if (state == MQTT_STATE_DISCONNECTED) {
+		printf("mqttc disconnected. %s\n", mqtt->errstr);
+		aeStop(mqtt->el);
+	}
+}
 
 int main()
 {
@@ -19,42 +25,27 @@ int main()
 
 	client.init();
 
+	//reads, writes and keepalive pings all run on this one thread
+	aeEventLoop *el = aeCreateEventLoop(64);
+	client.mqtt->mqtt_set_event_loop(el);
+
 	client.mqtt->mqtt_set_server(MQTT_SERVER);
 	client.mqtt->mqtt_set_username(MQTT_USERNAME);
 
 	client.set_callbacks();
+	client.mqtt->mqtt_set_callback(CONNECT, on_connect);
+	client.mqtt->mqtt_set_callback(CONNACK, on_connack);
 
 	if (client.mqtt->mqtt_connect() < 0) {
 		printf("mqttc connect failed.\n");
 		exit(-1);
 	}
-
-	while (client.mqtt->connack == 0) {
-		client.mqtt->mqtt_read(client.mqtt->fd, 0);
-	}
-
+	//queued behind CONNECT, no round trip to wait for
 	client.mqtt->mqtt_subscribe(MQTT_TOPIC, 0);
 
-	std::mutex mutex;
-	std::condition_variable cond;
-	bool interrupted = false;
-
-	std::thread ping_thread([&](){
-		while (1) {
-			{
-				std::unique_lock<std::mutex> lock(mutex);
-				cond.wait_for(lock, std::chrono::seconds(30));
-				if (interrupted) break;
-			}
-			client.mqtt->mqtt_ping();
-		}
-	});
-
-
-	while (1) {
-		client.mqtt->mqtt_read(client.mqtt->fd, 0);
-	}
+	aeMain(el);
 
+	client.mqtt->mqtt_set_event_loop(nullptr);
+	aeDeleteEventLoop(el);
 	return 0;
 }
-
@@ -0,0 +1,216 @@
+/*
+ * timer.c - hierarchical timing wheel
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <time.h>
+
+#include "timer.h"
+
+#define L0_MASK (L0_SIZE - 1)
+#define LN_MASK (LN_SIZE - 1)
+
+static inline bool _list_empty(const MqttTimer *head)
+{
+	return head->next == head;
+}
+
+static inline void _list_unlink(MqttTimer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = nullptr;
+}
+
+static inline void _list_append(MqttTimer *head, MqttTimer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/* move the whole list from one head to another */
+static inline void _list_splice(MqttTimer *from, MqttTimer *to)
+{
+	if (_list_empty(from)) {
+		to->prev = to->next = to;
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	from->prev = from->next = from;
+}
+
+MqttTimerWheel::MqttTimerWheel(int tick_ms)
+	: base(now())
+	, tick(tick_ms > 0 ? tick_ms : 1)
+{
+	for (int i = 0; i < SLOTS; i++) {
+		slots[i].prev = slots[i].next = &slots[i];
+	}
+}
+
+MqttTimerWheel::~MqttTimerWheel()
+{
+	//leave owners with nodes that no longer look pending
+	for (int i = 0; i < SLOTS; i++) {
+		while (!_list_empty(&slots[i])) {
+			_list_unlink(slots[i].next);
+		}
+	}
+}
+
+long long MqttTimerWheel::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+MqttTimer *MqttTimerWheel::slot(int level, int index)
+{
+	if (level == 0) return &slots[index & L0_MASK];
+	return &slots[L0_SIZE + (level - 1) * LN_SIZE + (index & LN_MASK)];
+}
+
+const MqttTimer *MqttTimerWheel::slot(int level, int index) const
+{
+	return const_cast<MqttTimerWheel *>(this)->slot(level, index);
+}
+
+void MqttTimerWheel::place(MqttTimer *timer)
+{
+	uint64_t expires = timer->expires < current ? current : timer->expires;
+	uint64_t delta = expires - current;
+	if (delta < L0_SIZE) {
+		_list_append(slot(0, expires), timer);
+		return;
+	}
+	int level = 1, shift = L0_BITS;
+	while (level < LEVELS - 1 && delta >= (1ULL << (shift + LN_BITS))) {
+		level++;
+		shift += LN_BITS;
+	}
+	if (delta >= (1ULL << (shift + LN_BITS))) {
+		//beyond the wheel: park in the last level, placed again on cascade
+		expires = current + (1ULL << (shift + LN_BITS)) - 1;
+	}
+	_list_append(slot(level, expires >> shift), timer);
+}
+
+void MqttTimerWheel::cascade(int level)
+{
+	int shift = L0_BITS + (level - 1) * LN_BITS;
+	MqttTimer list;
+	_list_splice(slot(level, current >> shift), &list);
+	while (!_list_empty(&list)) {
+		MqttTimer *timer = list.next;
+		_list_unlink(timer);
+		place(timer);
+	}
+}
+
+void MqttTimerWheel::add_at(MqttTimer *timer, long long when, MqttTimerProc *proc, void *clientdata)
+{
+	cancel(timer);
+	timer->proc = proc;
+	timer->clientdata = clientdata;
+	timer->expires = (when <= base) ? 0 : (when - base + tick - 1) / tick;
+	place(timer);
+	count++;
+}
+
+void MqttTimerWheel::add(MqttTimer *timer, long long ms, MqttTimerProc *proc, void *clientdata)
+{
+	add_at(timer, now() + ms, proc, clientdata);
+}
+
+void MqttTimerWheel::cancel(MqttTimer *timer)
+{
+	if (!timer->pending()) return;
+	_list_unlink(timer);
+	count--;
+}
+
+int MqttTimerWheel::advance(long long now)
+{
+	if (now < base) return 0;
+	uint64_t target = (now - base) / tick;
+	int fired = 0;
+
+	while (current <= target) {
+		if (count == 0) {
+			current = target + 1;
+			break;
+		}
+		if ((current & L0_MASK) == 0) {
+			//bring the next stretch of each level down, highest last
+			for (int level = 1; level < LEVELS; level++) {
+				cascade(level);
+				int shift = L0_BITS + (level - 1) * LN_BITS;
+				if (((current >> shift) & LN_MASK) != 0) break;
+			}
+		}
+		MqttTimer list;
+		_list_splice(slot(0, current), &list);
+		//timers armed from a callback land in a later slot
+		current++;
+		while (!_list_empty(&list)) {
+			MqttTimer *timer = list.next;
+			_list_unlink(timer);
+			count--;
+			fired++;
+			timer->proc(this, timer, timer->clientdata);
+		}
+	}
+	return fired;
+}
+
+long long MqttTimerWheel::next_timeout(long long now) const
+{
+	if (count == 0) return -1;
+	uint64_t t = current;
+	for (;;) {
+		if ((t & L0_MASK) == 0) {
+			if (!_list_empty(slot(1, t >> L0_BITS)) || ((t >> L0_BITS) & LN_MASK) == 0) break;
+		}
+		if (t - current >= L0_SIZE) {
+			//the first level is empty, only cascades are left
+			t = (t | L0_MASK) + 1;
+			continue;
+		}
+		//timers in the first level can lie past the next cascade
+		if (!_list_empty(slot(0, t))) break;
+		t++;
+	}
+	long long when = base + (long long)t * tick;
+	return when > now ? when - now : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * timer.h - hierarchical timing wheel
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MQTT_TIMER_H
+#define __MQTT_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class MqttTimerWheel;
+struct MqttTimer;
+
+typedef void MqttTimerProc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+
+/*
+ * Intrusive timer node, embedded in whatever owns the timeout. The wheel
+ * never allocates; a node must stay put while pending and be cancelled
+ * before it is destroyed.
+ */
+struct MqttTimer {
+	MqttTimer *prev = nullptr;
+	MqttTimer *next = nullptr;
+	uint64_t expires = 0; //in ticks
+	MqttTimerProc *proc = nullptr;
+	void *clientdata = nullptr;
+
+	bool pending() const { return next != nullptr; }
+};
+
+/*
+ * Four levels of slots, 256 + 3 * 64, covering 2^26 ticks (18 hours at
+ * 1ms). add and cancel are O(1); a timer further out than that waits in
+ * the last level and is placed again when it cascades down.
+ */
+class MqttTimerWheel {
+public:
+	MqttTimerWheel(int tick_ms = 1);
+	~MqttTimerWheel();
+
+	/* monotonic clock in milliseconds */
+	static long long now();
+
+	/* (re)arm timer to fire ms from now, or at the absolute time when */
+	void add(MqttTimer *timer, long long ms, MqttTimerProc *proc, void *clientdata);
+	void add_at(MqttTimer *timer, long long when, MqttTimerProc *proc, void *clientdata);
+	void cancel(MqttTimer *timer);
+
+	/* fire everything due by now, returns how many fired */
+	int advance(long long now);
+
+	/* how long a poll may sleep, -1 when nothing is pending */
+	long long next_timeout(long long now) const;
+
+	size_t size() const { return count; }
+private:
+	enum {
+		LEVELS = 4,
+		L0_BITS = 8,
+		LN_BITS = 6,
+		L0_SIZE = 1 << L0_BITS,
+		LN_SIZE = 1 << LN_BITS,
+		SLOTS = L0_SIZE + (LEVELS - 1) * LN_SIZE
+	};
+
+	MqttTimer *slot(int level, int index);
+	const MqttTimer *slot(int level, int index) const;
+	void place(MqttTimer *timer);
+	void cascade(int level);
+
+	MqttTimer slots[SLOTS]; //list heads
+	uint64_t current = 0;   //next tick to run
+	long long base;
+	int tick;
+	size_t count = 0;
+};
+
+#endif /* __MQTT_TIMER_H */
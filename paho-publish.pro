@@ -1,28 +1,36 @@
 TEMPLATE = app
 TARGET = paho-publish
-CONFIG += console
+CONFIG += console c++2a
 
 DESTDIR = $$PWD/_bin
 
 HEADERS += \
+	common/codec.h \
+	mqttc/ae.h \
+	mqttc/anet.h \
+	mqttc/config.h \
+	mqttc/resolve.h \
+	mqttc/timer.h \
+	mqttserver.h \
 	paho/MQTTConnect.h \
 	paho/MQTTFormat.h \
 	paho/MQTTPacket.h \
+	paho/MQTTPacketBuffer.h \
+	paho/MQTTReadAhead.h \
 	paho/MQTTPublish.h \
 	paho/MQTTSubscribe.h \
 	paho/MQTTUnsubscribe.h \
 	paho/MqttClient.h \
 	paho/StackTrace.h
 SOURCES += \
-	paho/MQTTConnectClient.c \
-	paho/MQTTConnectServer.c \
-	paho/MQTTDeserializePublish.c \
+	mqttc/ae.cpp \
+	mqttc/anet.cpp \
+	mqttc/resolve.cpp \
+	mqttc/timer.cpp \
+	paho/MQTTCodec.cpp \
 	paho/MQTTFormat.c \
 	paho/MQTTPacket.c \
-	paho/MQTTSerializePublish.c \
-	paho/MQTTSubscribeClient.c \
-	paho/MQTTSubscribeServer.c \
-	paho/MQTTUnsubscribeClient.c \
-	paho/MQTTUnsubscribeServer.c \
+	paho/MQTTPacketBuffer.c \
+	paho/MQTTReadAhead.c \
 	paho/MqttClient.cpp \
 	paho/publish.cpp
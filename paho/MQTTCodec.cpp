@@ -0,0 +1,401 @@
+/*
+ * MQTTCodec.cpp - paho's MQTTPacket serializers on the shared codec
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "../common/codec.h"
+#include "MQTTPacket.h"
+
+/*
+ * The paho API is kept as it was, but every byte now goes through
+ * common/codec.h, the same encoder and decoder mqttc uses. Deserializers
+ * take the whole packet, fixed header included, and return 1 on success
+ * and 0 on a short or malformed packet; serializers return the packet
+ * length or MQTTPACKET_BUFFER_TOO_SHORT.
+ */
+
+/*---------------------------------------
+** Helpers.
+---------------------------------------*/
+/* lenstring wins over cstring, as writeMQTTString always had it */
+static std::string_view _paho_string(MQTTString const &s)
+{
+	if (s.lenstring.len > 0) return std::string_view(s.lenstring.data, s.lenstring.len);
+	if (s.cstring) return s.cstring;
+	return {};
+}
+
+static void _paho_set_string(MQTTString *s, std::string_view v)
+{
+	s->cstring = NULL;
+	s->lenstring.len = v.size();
+	s->lenstring.data = (char *)v.data();
+}
+
+static std::span<char> _paho_buffer(unsigned char *buf, int buflen)
+{
+	return std::span<char>((char *)buf, buflen > 0 ? buflen : 0);
+}
+
+static int _paho_serialized(size_t len)
+{
+	return len ? (int)len : MQTTPACKET_BUFFER_TOO_SHORT;
+}
+
+/* split the packet in buf, checking its type; 0 for any type */
+static bool _paho_frame(unsigned char *buf, int buflen, int type, uint8_t *header, std::span<const char> *body)
+{
+	if (buflen <= 0) return false;
+	if (mqtt_decode_frame(std::span<const char>((char *)buf, buflen), header, body) <= 0) return false;
+	return type == 0 || (*header >> 4) == type;
+}
+
+/*---------------------------------------
+** Primitives.
+---------------------------------------*/
+int MQTTPacket_encode(unsigned char *buf, int length)
+{
+	char *ptr = (char *)buf;
+	return mqtt_put_remaining_length(ptr, length) - ptr;
+}
+
+int MQTTPacket_len(int rem_len)
+{
+	return mqtt_packet_size(rem_len);
+}
+
+/* the length bytes end the packet's fixed header, so at most 4 are read */
+int MQTTPacket_decodeBuf(unsigned char *buf, int *value, void *opaque)
+{
+	(void)opaque;
+	const char *ptr = (const char *)buf;
+	int n = mqtt_get_remaining_length(&ptr, ptr + 4, value);
+	return n > 0 ? n : MQTTPACKET_READ_ERROR;
+}
+
+int readInt(unsigned char **pptr)
+{
+	unsigned char *ptr = *pptr;
+	*pptr += 2;
+	return (ptr[0] << 8) | ptr[1];
+}
+
+char readChar(unsigned char **pptr)
+{
+	return *(*pptr)++;
+}
+
+void writeChar(unsigned char **pptr, char c)
+{
+	*pptr = (unsigned char *)mqtt_put_char((char *)*pptr, c);
+}
+
+void writeInt(unsigned char **pptr, int anInt)
+{
+	*pptr = (unsigned char *)mqtt_put_int((char *)*pptr, anInt);
+}
+
+void writeCString(unsigned char **pptr, const char *string)
+{
+	*pptr = (unsigned char *)mqtt_put_string((char *)*pptr, string);
+}
+
+void writeMQTTString(unsigned char **pptr, MQTTString mqttstring)
+{
+	*pptr = (unsigned char *)mqtt_put_string((char *)*pptr, _paho_string(mqttstring));
+}
+
+int readMQTTLenString(MQTTString *mqttstring, unsigned char **pptr, unsigned char *enddata)
+{
+	MqttCursor in((const char *)*pptr, (const char *)enddata);
+	std::string_view s = in.read_string();
+	if (!in.ok()) return 0;
+	_paho_set_string(mqttstring, s);
+	*pptr += 2 + s.size();
+	return 1;
+}
+
+int MQTTstrlen(MQTTString mqttstring)
+{
+	return _paho_string(mqttstring).size();
+}
+
+int MQTTPacket_equals(MQTTString *a, char *bptr)
+{
+	std::string_view s = a->cstring ? std::string_view(a->cstring)
+		: std::string_view(a->lenstring.data, a->lenstring.len);
+	return s == bptr;
+}
+
+/*---------------------------------------
+** Connect.
+---------------------------------------*/
+static MqttConnectFields _paho_connect_fields(MQTTPacket_connectData const *options)
+{
+	MqttConnectFields c;
+	c.version = options->MQTTVersion == 4 ? MQTT_PROTOCOL_V311 : MQTT_PROTOCOL_V31;
+	c.cleansess = options->cleansession;
+	c.keepalive = options->keepAliveInterval;
+	c.clientid = _paho_string(options->clientID);
+	if (options->willFlag) {
+		c.will = true;
+		c.willqos = options->will.qos;
+		c.willretain = options->will.retained;
+		c.willtopic = _paho_string(options->will.topicName);
+		c.willmsg = _paho_string(options->will.message);
+	}
+	c.has_username = options->username.cstring || options->username.lenstring.data;
+	c.username = _paho_string(options->username);
+	c.has_password = options->password.cstring || options->password.lenstring.data;
+	c.password = _paho_string(options->password);
+	return c;
+}
+
+int MQTTSerialize_connect(unsigned char *buf, int buflen, MQTTPacket_connectData *options)
+{
+	return _paho_serialized(mqtt_encode_connect(_paho_buffer(buf, buflen), _paho_connect_fields(options)));
+}
+
+extern "C" int MQTTPacket_checkVersion(MQTTString *protocol, int version)
+{
+	std::string_view name = _paho_string(*protocol);
+	return (version == MQTT_PROTOCOL_V31 && name == "MQIsdp") ||
+		(version == MQTT_PROTOCOL_V311 && name == "MQTT");
+}
+
+int MQTTDeserialize_connect(MQTTPacket_connectData *data, unsigned char *buf, int len, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	MqttConnectFields c;
+	if (!_paho_frame(buf, len, CONNECT, &header, &body) || !mqtt_decode_connect(body, &c)) return 0;
+	data->MQTTVersion = c.version;
+	data->cleansession = c.cleansess;
+	data->keepAliveInterval = c.keepalive;
+	_paho_set_string(&data->clientID, c.clientid);
+	data->willFlag = c.will;
+	if (c.will) {
+		data->will.qos = c.willqos;
+		data->will.retained = c.willretain;
+		_paho_set_string(&data->will.topicName, c.willtopic);
+		_paho_set_string(&data->will.message, c.willmsg);
+	}
+	if (c.has_username) _paho_set_string(&data->username, c.username);
+	if (c.has_password) _paho_set_string(&data->password, c.password);
+	return 1;
+}
+
+int MQTTSerialize_connack(unsigned char *buf, int buflen, unsigned char connack_rc, unsigned char sessionPresent)
+{
+	return _paho_serialized(mqtt_encode_connack(_paho_buffer(buf, buflen), sessionPresent, connack_rc));
+}
+
+int MQTTDeserialize_connack(unsigned char *sessionPresent, unsigned char *connack_rc, unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	bool sp;
+	if (!_paho_frame(buf, buflen, CONNACK, &header, &body) ||
+		!mqtt_decode_connack(body, &sp, connack_rc)) {
+		return 0;
+	}
+	*sessionPresent = sp;
+	return 1;
+}
+
+int MQTTSerialize_disconnect(unsigned char *buf, int buflen)
+{
+	return _paho_serialized(mqtt_encode_empty(_paho_buffer(buf, buflen), MQTT_PKT_DISCONNECT));
+}
+
+int MQTTSerialize_pingreq(unsigned char *buf, int buflen)
+{
+	return _paho_serialized(mqtt_encode_empty(_paho_buffer(buf, buflen), MQTT_PKT_PINGREQ));
+}
+
+/*---------------------------------------
+** Publish.
+---------------------------------------*/
+int MQTTSerialize_publish(unsigned char *buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, unsigned char *payload, int payloadlen)
+{
+	MqttPublishFields p;
+	p.qos = qos;
+	p.retain = retained;
+	p.dup = dup;
+	p.id = packetid;
+	p.topic = _paho_string(topicName);
+	p.payload = std::span<const char>((const char *)payload, payloadlen);
+	return _paho_serialized(mqtt_encode_publish(_paho_buffer(buf, buflen), p));
+}
+
+int MQTTDeserialize_publish(unsigned char *dup, int *qos, unsigned char *retained, unsigned short *packetid, MQTTString *topicName,
+		unsigned char **payload, int *payloadlen, unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	MqttPublishFields p;
+	if (!_paho_frame(buf, buflen, PUBLISH, &header, &body) || !mqtt_decode_publish(header, body, &p)) return 0;
+	*dup = p.dup;
+	*qos = p.qos;
+	*retained = p.retain;
+	if (p.qos > 0) *packetid = p.id;
+	_paho_set_string(topicName, p.topic);
+	*payload = (unsigned char *)p.payload.data();
+	*payloadlen = p.payload.size();
+	return 1;
+}
+
+int MQTTSerialize_ack(unsigned char *buf, int buflen, unsigned char packettype, unsigned char dup, unsigned short packetid)
+{
+	uint8_t header = (packettype << 4) | (dup << 3) | (packettype == PUBREL ? 0x02 : 0);
+	return _paho_serialized(mqtt_encode_ack(_paho_buffer(buf, buflen), header, packetid));
+}
+
+int MQTTDeserialize_ack(unsigned char *packettype, unsigned char *dup, unsigned short *packetid, unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	if (!_paho_frame(buf, buflen, 0, &header, &body) || !mqtt_decode_ack(body, packetid)) return 0;
+	*packettype = header >> 4;
+	*dup = (header >> 3) & 1;
+	return 1;
+}
+
+int MQTTSerialize_puback(unsigned char *buf, int buflen, unsigned short packetid)
+{
+	return MQTTSerialize_ack(buf, buflen, PUBACK, 0, packetid);
+}
+
+int MQTTSerialize_pubrel(unsigned char *buf, int buflen, unsigned char dup, unsigned short packetid)
+{
+	return MQTTSerialize_ack(buf, buflen, PUBREL, dup, packetid);
+}
+
+int MQTTSerialize_pubcomp(unsigned char *buf, int buflen, unsigned short packetid)
+{
+	return MQTTSerialize_ack(buf, buflen, PUBCOMP, 0, packetid);
+}
+
+/*---------------------------------------
+** Subscribe.
+---------------------------------------*/
+int MQTTSerialize_subscribe(unsigned char *buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[], int requestedQoSs[])
+{
+	size_t len = mqtt_encode_subscribe(_paho_buffer(buf, buflen), packetid, count, [&](size_t i) {
+		return MqttTopicFilter{_paho_string(topicFilters[i]), (uint8_t)requestedQoSs[i]};
+	}, dup);
+	return _paho_serialized(len);
+}
+
+int MQTTDeserialize_subscribe(unsigned char *dup, unsigned short *packetid,
+		int maxcount, int *count, MQTTString topicFilters[], int *requestedQoSs, unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	if (!_paho_frame(buf, buflen, SUBSCRIBE, &header, &body)) return 0;
+	*dup = (header >> 3) & 1;
+	*count = 0;
+	return mqtt_decode_subscribe(body, packetid, [&](MqttTopicFilter const &filter) {
+		if (*count >= maxcount) return false;
+		_paho_set_string(&topicFilters[*count], filter.topic);
+		requestedQoSs[(*count)++] = filter.qos;
+		return true;
+	});
+}
+
+int MQTTSerialize_suback(unsigned char *buf, int buflen, unsigned short packetid, int count, int *grantedQoSs)
+{
+	size_t len = mqtt_encode_suback(_paho_buffer(buf, buflen), packetid, count, [&](size_t i) {
+		return (uint8_t)grantedQoSs[i];
+	});
+	return _paho_serialized(len);
+}
+
+int MQTTDeserialize_suback(unsigned short *packetid, int maxcount, int *count, int grantedQoSs[], unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	if (!_paho_frame(buf, buflen, SUBACK, &header, &body)) return 0;
+	*count = 0;
+	return mqtt_decode_suback(body, packetid, [&](uint8_t granted) {
+		if (*count >= maxcount) return false;
+		grantedQoSs[(*count)++] = granted;
+		return true;
+	});
+}
+
+/*---------------------------------------
+** Unsubscribe.
+---------------------------------------*/
+int MQTTSerialize_unsubscribe(unsigned char *buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[])
+{
+	size_t len = mqtt_encode_unsubscribe(_paho_buffer(buf, buflen), packetid, count, [&](size_t i) {
+		return _paho_string(topicFilters[i]);
+	}, dup);
+	return _paho_serialized(len);
+}
+
+int MQTTDeserialize_unsubscribe(unsigned char *dup, unsigned short *packetid, int maxcount, int *count, MQTTString *topicFilters,
+		unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	if (!_paho_frame(buf, buflen, UNSUBSCRIBE, &header, &body)) return 0;
+	*dup = (header >> 3) & 1;
+	*count = 0;
+	return mqtt_decode_unsubscribe(body, packetid, [&](std::string_view topic) {
+		if (*count >= maxcount) return false;
+		_paho_set_string(&topicFilters[(*count)++], topic);
+		return true;
+	});
+}
+
+int MQTTSerialize_unsuback(unsigned char *buf, int buflen, unsigned short packetid)
+{
+	return _paho_serialized(mqtt_encode_ack(_paho_buffer(buf, buflen), MQTT_PKT_UNSUBACK, packetid));
+}
+
+int MQTTDeserialize_unsuback(unsigned short *packetid, unsigned char *buf, int buflen, void *opaque)
+{
+	(void)opaque;
+	uint8_t header;
+	std::span<const char> body;
+	return _paho_frame(buf, buflen, UNSUBACK, &header, &body) && mqtt_decode_ack(body, packetid);
+}
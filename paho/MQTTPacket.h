@@ -125,6 +125,9 @@ typedef struct {
 
 int MQTTPacket_readnb(unsigned char *buf, int buflen, MQTTTransport *trp);
 
+#include "MQTTPacketBuffer.h"
+#include "MQTTReadAhead.h"
+
 #ifdef __cplusplus /* If this is a C++ compiler, use C linkage */
 }
 #endif
@@ -0,0 +1,324 @@
+/*
+ * MQTTPacketBuffer.c - paho packet reads into the caller's buffer or a pooled one
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "StackTrace.h"
+#include "MQTTPacket.h"
+
+/*
+ * Large buffers come in power of two sizes from 4KiB up to what the
+ * biggest MQTT packet needs. Freed ones are kept per size for the next
+ * big packet on any connection, a few of the small sizes and one of
+ * each above 1MiB.
+ */
+#define POOL_MIN_SHIFT 12
+#define POOL_CLASSES 18
+#define POOL_KEEP 4
+#define POOL_KEEP_BIG 1
+#define POOL_BIG_CLASS 8
+
+#define MAX_PACKET_SIZE (268435455 + 5)
+
+/* a buffer up to this size stays with its connection between packets */
+#define KEEP_ATTACHED (64 * 1024)
+
+#define SKIP_CHUNK 512
+
+static struct
+{
+	pthread_mutex_t lock;
+	unsigned char *buffers[POOL_CLASSES][POOL_KEEP];
+	int nfree[POOL_CLASSES];
+	long allocs;
+	long reuses;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static int pool_class(int len)
+{
+	int c = 0;
+	while (c < POOL_CLASSES - 1 && (1 << (POOL_MIN_SHIFT + c)) < len)
+		++c;
+	return c;
+}
+
+static unsigned char *pool_get(int len, int *buflen)
+{
+	int c = pool_class(len);
+	unsigned char *buf = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.nfree[c] > 0)
+	{
+		buf = pool.buffers[c][--pool.nfree[c]];
+		pool.reuses++;
+	}
+	else
+		pool.allocs++;
+	pthread_mutex_unlock(&pool.lock);
+	if (buf == NULL)
+		buf = (unsigned char *)malloc((size_t)1 << (POOL_MIN_SHIFT + c));
+	*buflen = buf ? 1 << (POOL_MIN_SHIFT + c) : 0;
+	return buf;
+}
+
+static void pool_put(unsigned char *buf, int buflen)
+{
+	int c = pool_class(buflen);
+	int keep = c < POOL_BIG_CLASS ? POOL_KEEP : POOL_KEEP_BIG;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.nfree[c] < keep)
+	{
+		pool.buffers[c][pool.nfree[c]++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	free(buf);
+}
+
+/**
+ * Large buffers malloc'ed, and taken from the pool instead, since start
+ */
+void MQTTPacketPool_stats(long *allocs, long *reuses)
+{
+	pthread_mutex_lock(&pool.lock);
+	*allocs = pool.allocs;
+	*reuses = pool.reuses;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Prepares a packet buffer
+ * @param pb the packet buffer
+ * @param buf the caller's buffer, for every packet that fits; may be NULL
+ * @param buflen its length
+ * @param maxlen packets longer than this are skipped, 0 for no limit
+ */
+void MQTTPacketBuffer_init(MQTTPacketBuffer *pb, unsigned char *buf, int buflen, int maxlen)
+{
+	memset(pb, 0, sizeof(*pb));
+	pb->fixed = buf;
+	pb->fixedlen = buf ? buflen : 0;
+	pb->maxlen = (maxlen > 0 && maxlen < MAX_PACKET_SIZE) ? maxlen : MAX_PACKET_SIZE;
+}
+
+/**
+ * Hands a large buffer back to the pool. The last packet is gone after this.
+ * @param pb the packet buffer
+ */
+void MQTTPacketBuffer_release(MQTTPacketBuffer *pb)
+{
+	if (pb->large)
+		pool_put(pb->large, pb->largelen);
+	pb->large = NULL;
+	pb->largelen = 0;
+	pb->buf = NULL;
+	pb->len = 0;
+}
+
+/* where a packet of len bytes goes; NULL when no memory */
+static unsigned char *packet_target(MQTTPacketBuffer *pb, int len)
+{
+	if (len <= pb->fixedlen)
+	{
+		if (pb->largelen > KEEP_ATTACHED)
+			MQTTPacketBuffer_release(pb);
+		return pb->fixed;
+	}
+	if (pb->largelen < len)
+	{
+		MQTTPacketBuffer_release(pb);
+		pb->large = pool_get(len, &pb->largelen);
+	}
+	return pb->large;
+}
+
+/* getfn may return less than asked for, as recv does */
+static int read_fully(int (*getfn)(unsigned char *, int, void *), unsigned char *buf, int count, void *opaque)
+{
+	while (count > 0)
+	{
+		int n = (*getfn)(buf, count, opaque);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/**
+ * Reads a packet of any size. Unlike MQTTPacket_read, a packet that
+ * doesn't fit the caller's buffer is still read, into a pooled one.
+ * @param pb the packet buffer, see MQTTPacketBuffer_init
+ * @param getfn pointer to a function which will read any number of bytes from the needed source
+ * @return integer MQTT packet type, MQTTPACKET_BUFFER_TOO_SHORT for a packet over maxlen,
+ * which was skipped, or -1 on error
+ */
+int MQTTPacket_readbuf(MQTTPacketBuffer *pb, int (*getfn)(unsigned char *, int, void *), void *opaque)
+{
+	int rc = MQTTPACKET_READ_ERROR;
+	int hdrlen = 1;
+	int rem_len = 0;
+	int multiplier = 1;
+	unsigned char *buf;
+
+	FUNC_ENTRY;
+	pb->buf = NULL;
+	pb->len = 0;
+	if (read_fully(getfn, pb->head, 1, opaque) != 0)
+		goto exit;
+	do
+	{
+		if (hdrlen == 5 || read_fully(getfn, pb->head + hdrlen, 1, opaque) != 0)
+			goto exit;
+		rem_len += (pb->head[hdrlen] & 127) * multiplier;
+		multiplier *= 128;
+	} while ((pb->head[hdrlen++] & 128) != 0);
+
+	if (hdrlen + rem_len > pb->maxlen)
+	{
+		unsigned char chunk[SKIP_CHUNK];
+		while (rem_len > 0)
+		{
+			int n = rem_len < SKIP_CHUNK ? rem_len : SKIP_CHUNK;
+			if (read_fully(getfn, chunk, n, opaque) != 0)
+				goto exit;
+			rem_len -= n;
+		}
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+	if ((buf = packet_target(pb, hdrlen + rem_len)) == NULL)
+		goto exit;
+	memcpy(buf, pb->head, hdrlen);
+	if (read_fully(getfn, buf + hdrlen, rem_len, opaque) != 0)
+		goto exit;
+	pb->buf = buf;
+	pb->len = hdrlen + rem_len;
+	rc = buf[0] >> 4;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+/**
+ * Reads a packet of any size, non-blocking
+ * @param pb the packet buffer, see MQTTPacketBuffer_init
+ * @param trp pointer to a transport structure holding what is needed to solve getting data from it
+ * @return integer MQTT packet type, 0 for call again, MQTTPACKET_BUFFER_TOO_SHORT for a
+ * packet over maxlen, which was skipped, or -1 on error
+ */
+int MQTTPacket_readbufnb(MQTTPacketBuffer *pb, MQTTTransport *trp)
+{
+	int rc = MQTTPACKET_READ_ERROR, frc;
+	unsigned char c;
+	unsigned char *buf;
+
+	FUNC_ENTRY;
+	switch (trp->state)
+	{
+	default:
+		trp->state = 0;
+		/*FALLTHROUGH*/
+	case 0:
+		pb->buf = NULL;
+		pb->len = 0;
+		if ((frc = (*trp->getfn)(trp->sck, pb->head, 1)) == -1)
+			goto exit;
+		if (frc == 0)
+			return 0;
+		trp->len = 1;
+		trp->rem_len = 0;
+		trp->multiplier = 1;
+		++trp->state;
+		/*FALLTHROUGH*/
+	case 1:
+		do
+		{
+			if (trp->len == 5)
+				goto exit;
+			if ((frc = (*trp->getfn)(trp->sck, &c, 1)) == -1)
+				goto exit;
+			if (frc == 0)
+				return 0;
+			pb->head[trp->len++] = c;
+			trp->rem_len += (c & 127) * trp->multiplier;
+			trp->multiplier *= 128;
+		} while ((c & 128) != 0);
+		if (trp->len + trp->rem_len > pb->maxlen)
+		{
+			trp->state = 3;
+			goto skip;
+		}
+		if ((buf = packet_target(pb, trp->len + trp->rem_len)) == NULL)
+			goto exit;
+		memcpy(buf, pb->head, trp->len);
+		pb->buf = buf;
+		++trp->state;
+		/*FALLTHROUGH*/
+	case 2:
+		while (trp->rem_len > 0)
+		{
+			if ((frc = (*trp->getfn)(trp->sck, pb->buf + trp->len, trp->rem_len)) == -1)
+				goto exit;
+			if (frc == 0)
+				return 0;
+			trp->rem_len -= frc;
+			trp->len += frc;
+		}
+		pb->len = trp->len;
+		rc = pb->buf[0] >> 4;
+		break;
+	case 3:
+	skip:
+		while (trp->rem_len > 0)
+		{
+			unsigned char chunk[SKIP_CHUNK];
+			int n = trp->rem_len < SKIP_CHUNK ? trp->rem_len : SKIP_CHUNK;
+			if ((frc = (*trp->getfn)(trp->sck, chunk, n)) == -1)
+				goto exit;
+			if (frc == 0)
+				return 0;
+			trp->rem_len -= frc;
+		}
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		break;
+	}
+exit:
+	if (rc <= 0)
+		pb->buf = NULL;
+	trp->state = 0;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
@@ -0,0 +1,63 @@
+/*
+ * MQTTPacketBuffer.h - paho packet reads that don't depend on the caller's buffer size
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#if !defined(MQTTPACKETBUFFER_H_)
+#define MQTTPACKETBUFFER_H_
+
+/**
+ * Where MQTTPacket_readbuf puts a packet. Packets that fit in the caller's
+ * fixed buffer are read into it, so deserialized pointers point there as
+ * with MQTTPacket_read; bigger ones go into a buffer from a process-wide
+ * pool. One of up to 64KiB stays for the packets after it, a bigger one
+ * goes back to the pool once a packet no longer needs it. buf and len
+ * describe the last packet read and stay valid until the next read or
+ * release.
+ */
+typedef struct
+{
+	unsigned char *buf;		/**< the last packet read, fixed header included */
+	int len;				/**< its length */
+	unsigned char *fixed;	/**< caller's buffer */
+	int fixedlen;
+	unsigned char *large;	/**< pooled buffer, if any */
+	int largelen;
+	int maxlen;				/**< bigger packets are skipped, 0 for no limit but MQTT's */
+	unsigned char head[5];	/**< fixed header of the packet being read */
+} MQTTPacketBuffer;
+
+DLLExport void MQTTPacketBuffer_init(MQTTPacketBuffer *pb, unsigned char *buf, int buflen, int maxlen);
+DLLExport void MQTTPacketBuffer_release(MQTTPacketBuffer *pb);
+
+DLLExport int MQTTPacket_readbuf(MQTTPacketBuffer *pb, int (*getfn)(unsigned char *, int, void *), void *opaque);
+DLLExport int MQTTPacket_readbufnb(MQTTPacketBuffer *pb, MQTTTransport *trp);
+
+DLLExport void MQTTPacketPool_stats(long *allocs, long *reuses);
+
+#endif /* MQTTPACKETBUFFER_H_ */
@@ -0,0 +1,131 @@
+/*
+ * MQTTReadAhead.c - buffered transport reads for paho
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+
+#include "StackTrace.h"
+#include "MQTTPacket.h"
+
+/**
+ * Prepares a read-ahead buffer
+ * @param ra the read-ahead
+ * @param buf memory for it, a few KiB is plenty for small packets
+ * @param size its length
+ * @param recvfn reads from the transport, like MQTTTransport's getfn
+ * @param sck passed to recvfn
+ */
+void MQTTReadAhead_init(MQTTReadAhead *ra, unsigned char *buf, int size,
+		int (*recvfn)(void *, unsigned char *, int), void *sck)
+{
+	ra->recvfn = recvfn;
+	ra->sck = sck;
+	ra->buf = buf;
+	ra->size = size;
+	ra->start = ra->end = 0;
+	ra->fills = 0;
+}
+
+/* hand over what is buffered, up to count */
+static int drain(MQTTReadAhead *ra, unsigned char *buf, int count)
+{
+	int n = ra->end - ra->start;
+	if (n > count)
+		n = count;
+	memcpy(buf, ra->buf + ra->start, n);
+	ra->start += n;
+	if (ra->start == ra->end)
+		ra->start = ra->end = 0;
+	return n;
+}
+
+/* one recvfn call, straight into buf when the request won't fit the buffer */
+static int fill(MQTTReadAhead *ra, unsigned char *buf, int count)
+{
+	int rc;
+
+	ra->fills++;
+	if (count >= ra->size)
+		return (*ra->recvfn)(ra->sck, buf, count);
+	if (ra->start > 0)
+	{
+		memmove(ra->buf, ra->buf + ra->start, ra->end - ra->start);
+		ra->end -= ra->start;
+		ra->start = 0;
+	}
+	rc = (*ra->recvfn)(ra->sck, ra->buf + ra->end, ra->size - ra->end);
+	if (rc <= 0)
+		return rc;
+	ra->end += rc;
+	return drain(ra, buf, count);
+}
+
+/**
+ * A getfn for MQTTPacket_read and MQTTPacket_readbuf, with the read-ahead
+ * as opaque. Blocks until count bytes are there, as MQTTPacket_read needs.
+ * @return count, or -1 on error
+ */
+int MQTTReadAhead_getdata(unsigned char *buf, int count, void *opaque)
+{
+	MQTTReadAhead *ra = (MQTTReadAhead *)opaque;
+	int got = drain(ra, buf, count);
+
+	FUNC_ENTRY;
+	while (got < count)
+	{
+		int rc = fill(ra, buf + got, count - got);
+		if (rc <= 0)
+		{
+			got = -1;
+			break;
+		}
+		got += rc;
+	}
+	FUNC_EXIT_RC(got);
+	return got;
+}
+
+/**
+ * A getfn for MQTTTransport, with the read-ahead as sck. Calls recvfn
+ * only when nothing is buffered.
+ * @return bytes read, 0 for call again, or -1 on error
+ */
+int MQTTReadAhead_getdatanb(void *opaque, unsigned char *buf, int count)
+{
+	MQTTReadAhead *ra = (MQTTReadAhead *)opaque;
+	int rc;
+
+	FUNC_ENTRY;
+	if (ra->end > ra->start)
+		rc = drain(ra, buf, count);
+	else
+		rc = fill(ra, buf, count);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
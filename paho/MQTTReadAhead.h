@@ -0,0 +1,57 @@
+/*
+ * MQTTReadAhead.h - buffered transport reads for paho
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#if !defined(MQTTREADAHEAD_H_)
+#define MQTTREADAHEAD_H_
+
+/**
+ * Read-ahead for one connection. paho's readers ask the transport for a
+ * byte at a time while they decode the fixed header; with this in
+ * between, those come out of a buffer filled by as few recvfn calls as
+ * the data allows. A request at least as big as the buffer, a large
+ * packet body, bypasses it once what is buffered has been handed over.
+ */
+typedef struct
+{
+	int (*recvfn)(void *sck, unsigned char *buf, int count); /**< -1 for error, 0 for call again, or bytes read */
+	void *sck;
+	unsigned char *buf;
+	int size;
+	int start;	/**< first unread byte */
+	int end;	/**< one past the last */
+	long fills;	/**< calls to recvfn */
+} MQTTReadAhead;
+
+DLLExport void MQTTReadAhead_init(MQTTReadAhead *ra, unsigned char *buf, int size,
+		int (*recvfn)(void *, unsigned char *, int), void *sck);
+DLLExport int MQTTReadAhead_getdata(unsigned char *buf, int count, void *opaque);
+DLLExport int MQTTReadAhead_getdatanb(void *opaque, unsigned char *buf, int count);
+
+#endif /* MQTTREADAHEAD_H_ */
@@ -65,137 +65,47 @@
 #include <net/if.h>
 #endif
 
-#include "../mqttserver.h"
-
 /**
-This simple low-level implementation assumes a single connection for a single thread. Thus, a static
-variable is used for that connection.
-On other scenarios, the user must solve this by taking into account that the current implementation of
-MQTTPacket_read() has a function pointer for a function call to get the data to a buffer, but no provisions
-to know the caller or other indicator (the socket id): int (*getfn)(unsigned char*, int)
+Each MqttClient owns its socket, read-ahead, transport state and send queue, so any number of them
+can share one thread. The transport callbacks get the client (or its socket) through their opaque
+and sck arguments instead of a static variable.
 */
-//static int mysock = INVALID_SOCKET;
-
 
-int MqttClient::transport_sendPacketBuffer(int sock, unsigned char *buf, int buflen, void *opaque)
+MqttClient::MqttClient(aeEventLoop *el) : el(el)
 {
-	int rc = 0;
-	rc = write(sock, buf, buflen);
-	return rc;
+	MQTTPacketBuffer_init(&packet, packet_buf, sizeof(packet_buf), 0);
 }
 
+MqttClient::~MqttClient()
+{
+	eventproc = nullptr;
+	close();
+}
 
-int MqttClient::transport_getdata(unsigned char *buf, int count, void *opaque)
+int MqttClient::transport_sendPacketBuffer(int sock, unsigned char *buf, int buflen, void *opaque)
 {
-	MqttClient *self = reinterpret_cast<MqttClient *>(opaque);
-	int rc = recv(self->mysock, buf, count, 0);
-	//printf("received %d bytes count %d\n", rc, (int)count);
+	(void)opaque;
+	int rc = send(sock, buf, buflen, MSG_NOSIGNAL);
+	if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
 	return rc;
 }
 
+/* -1 when the peer has gone, 0 when the socket has nothing for now */
 int MqttClient::transport_getdatanb(void *sck, unsigned char *buf, int count)
 {
 	int sock = *((int *)sck); 	/* sck: pointer to whatever the system may use to identify the transport */
-	/* this call will return after the timeout set on initialization if no bytes;
-	   in your system you will use whatever you use to get whichever outstanding
-	   bytes your socket equivalent has ready to be extracted right now, if any,
-	   or return immediately */
 	int rc = recv(sock, buf, count, 0);
+	if (rc == 0)
+		return -1;
 	if (rc == -1) {
-		/* check error conditions from your system here, and return -1 */
-		return 0;
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
 	}
 	return rc;
 }
 
-/**
-return >=0 for a socket descriptor, <0 for an error code
-@todo Basically moved from the sample without changes, should accomodate same usage for 'sock' for clarity,
-removing indirections
-*/
-int MqttClient::transport_open(char *addr, int port, void *opaque)
-{
-	int sock = -1;
-	int type = SOCK_STREAM;
-	struct sockaddr_in address;
-#if defined(AF_INET6)
-	struct sockaddr_in6 address6;
-#endif
-	int rc = -1;
-#if defined(WIN32)
-	short family;
-#else
-	sa_family_t family = AF_INET;
-#endif
-	struct addrinfo *result = NULL;
-	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
-	static struct timeval tv;
-
-	sock = -1;
-	if (addr[0] == '[')
-		++addr;
-
-	rc = getaddrinfo(addr, NULL, &hints, &result);
-	if (rc == 0) {
-		struct addrinfo* res = result;
-
-		/* prefer ip4 addresses */
-		while (res) {
-			if (res->ai_family == AF_INET) {
-				result = res;
-				break;
-			}
-			res = res->ai_next;
-		}
-
-#if defined(AF_INET6)
-		if (result->ai_family == AF_INET6) {
-			address6.sin6_port = htons(port);
-			address6.sin6_family = family = AF_INET6;
-			address6.sin6_addr = ((struct sockaddr_in6*)(result->ai_addr))->sin6_addr;
-		} else
-#endif
-			if (result->ai_family == AF_INET)
-			{
-				address.sin_port = htons(port);
-				address.sin_family = family = AF_INET;
-				address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
-			} else {
-				rc = -1;
-			}
-
-		freeaddrinfo(result);
-	}
-
-	if (rc == 0) {
-		sock =	socket(family, type, 0);
-		if (sock != -1) {
-#if defined(NOSIGPIPE)
-			int opt = 1;
-
-			if (setsockopt(*sock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-				Log(TRACE_MIN, -1, "Could not set SO_NOSIGPIPE for socket %d", *sock);
-#endif
-
-			if (family == AF_INET)
-				rc = connect(sock, (struct sockaddr*)&address, sizeof(address));
-#if defined(AF_INET6)
-			else
-				rc = connect(sock, (struct sockaddr*)&address6, sizeof(address6));
-#endif
-		}
-	}
-	if (sock == INVALID_SOCKET) return rc;
-
-	tv.tv_sec = 1;  /* 1 second Timeout */
-	tv.tv_usec = 0;
-	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
-
-	MqttClient *self = reinterpret_cast<MqttClient *>(opaque);
-	self->mysock = sock;
-	return sock;
-}
-
 int MqttClient::transport_close(int sock)
 {
 
@@ -208,147 +118,326 @@ int MqttClient::transport_close(int sock)
 	return rc;
 }
 
-int MqttClient::close()
+unsigned short MqttClient::next_msgid()
 {
-	transport_close(mysock);
-	mysock = -1;
+	if (++last_msgid == 0)
+		last_msgid = 1;
+	return last_msgid;
 }
 
-int MqttClient::publish()
+/*
+ * Serialize a packet onto the end of the send queue, growing the space from
+ * guess while the serializer says it is too short, and try to write it out
+ * unless a write is already pending.
+ */
+template<typename F>
+int MqttClient::enqueue(int guess, F serialize)
 {
-	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
-	int rc = 0;
-	int mysock = 0;
-	unsigned char buf[200];
-	int buflen = sizeof(buf);
-	MQTTString topicString = MQTTString_initializer;
-	char *payload = "Hello, world";
-	int payloadlen = strlen(payload);
-	int len = 0;
-	char *host = MQTT_SERVER;
-	int port = 1883;
-
-	mysock = MqttClient::transport_open(host, port, this);
-	if (mysock < 0) return mysock;
-
-//	printf("Sending to hostname %s port %d\n", host, port);
-
-	data.clientID.cstring = "";
-	data.keepAliveInterval = 20;
-	data.cleansession = 1;
-	data.username.cstring = MQTT_USERNAME;
-	data.password.cstring = MQTT_PASSWORD;
+	size_t off = sendq.size();
+	int len;
+
+	for (;;) {
+		sendq.resize(off + guess);
+		len = serialize(sendq.data() + off, guess);
+		if (len != MQTTPACKET_BUFFER_TOO_SHORT)
+			break;
+		guess *= 2;
+	}
+	if (len <= 0) {
+		sendq.resize(off);
+		return -1;
+	}
+	sendq.resize(off + len);
+	if (mysock >= 0 && !(aeGetFileEvents(el, mysock) & AE_WRITABLE))
+		flush();
+	return len;
+}
 
-	len = MQTTSerialize_connect(buf, buflen, &data);
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
+/* write what the socket takes now, wait for AE_WRITABLE for the rest */
+int MqttClient::flush()
+{
+	size_t off = 0;
+	int rc = 0;
 
-	/* wait for connack */
-	if (MQTTPacket_read(buf, buflen, MqttClient::transport_getdata, this) == CONNACK) {
-		unsigned char sessionPresent, connack_rc;
-		if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, buf, buflen, this) != 1 || connack_rc != 0) {
-			printf("Unable to connect, return code %d\n", connack_rc);
-			goto exit;
+	while (off < sendq.size()) {
+		int n = transport_sendPacketBuffer(mysock, sendq.data() + off, sendq.size() - off, this);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			/* the read side will notice the connection is gone */
+			off = sendq.size();
+			rc = -1;
+			break;
 		}
+		off += n;
+	}
+	if (off > 0) {
+		sendq.erase(sendq.begin(), sendq.begin() + off);
+		last_sent = MqttTimerWheel::now();
+	}
+	if (!sendq.empty()) {
+		if (!(aeGetFileEvents(el, mysock) & AE_WRITABLE))
+			aeCreateFileEvent(el, mysock, AE_WRITABLE, write_proc, this);
 	} else {
-		goto exit;
+		aeDeleteFileEvent(el, mysock, AE_WRITABLE);
+		if (closing)
+			close();
 	}
+	return rc;
+}
 
-	topicString.cstring = MQTT_TOPIC;
-	printf("publishing reading\n");
-	len = MQTTSerialize_publish(buf, buflen, 0, 0, 0, 0, topicString, (unsigned char*)payload, payloadlen);
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
-
-	printf("disconnecting\n");
-	len = MQTTSerialize_disconnect(buf, buflen);
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
+/* the server's addresses were raced by the connector, fd is the winner */
+void MqttClient::connected(void *clientdata, int fd, int err)
+{
+	MqttClient *self = reinterpret_cast<MqttClient *>(clientdata);
 
-exit:
-	close();
-	return 0;
+	if (fd < 0) {
+		self->handle_close(err);
+		return;
+	}
+	self->mysock = fd;
+	/* paho asks for the fixed header a byte at a time, the read-ahead makes that one recv */
+	MQTTReadAhead_init(&self->readahead, self->readahead_buf, sizeof(self->readahead_buf),
+		MqttClient::transport_getdatanb, &self->mysock);
+	self->trp = {MQTTReadAhead_getdatanb, &self->readahead, 0, 0, 0, 0};
+	aeCreateFileEvent(self->el, fd, AE_READABLE, read_proc, self);
+	self->flush();
 }
 
-int MqttClient::subscribe()
+void MqttClient::write_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
 {
-	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
-	int rc = 0;
-	int mysock = 0;
-	unsigned char buf[200];
-	int buflen = sizeof(buf);
-	int msgid = 1;
-	MQTTString topicString = MQTTString_initializer;
-	int req_qos = 0;
-	int len = 0;
-	char *host = MQTT_SERVER;
-	int port = 1883;
-
-	mysock = MqttClient::transport_open(host, port, this);
-	if (mysock < 0) return mysock;
+	(void)el;
+	(void)fd;
+	(void)mask;
+	MqttClient *self = reinterpret_cast<MqttClient *>(clientdata);
+	self->flush();
+}
 
-//	printf("Sending to hostname %s port %d\n", host, port);
+/* every whole packet the socket has, then back to the loop */
+void MqttClient::read_proc(aeEventLoop *el, int fd, void *clientdata, int mask)
+{
+	(void)el;
+	(void)mask;
+	MqttClient *self = reinterpret_cast<MqttClient *>(clientdata);
+	int rc;
 
-	data.clientID.cstring = "";
-	data.keepAliveInterval = 20;
-	data.cleansession = 1;
-	data.username.cstring = MQTT_USERNAME;
-	data.password.cstring = MQTT_PASSWORD;
+	self->wakeups++;
+	while ((rc = MQTTPacket_readbufnb(&self->packet, &self->trp)) != 0) {
+		if (rc == MQTTPACKET_BUFFER_TOO_SHORT)
+			continue; /* over maxlen, skipped */
+		if (rc < 0) {
+			self->handle_close(ECONNRESET);
+			return;
+		}
+		self->packets++;
+		if (self->handle_packet(rc) < 0)
+			return;
+		if (self->mysock != fd)
+			return; /* closed, maybe reopened, by a callback */
+	}
+}
 
-	len = MQTTSerialize_connect(buf, buflen, &data);
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
+int MqttClient::handle_packet(int type)
+{
+	unsigned char *buf = packet.buf;
+	int buflen = packet.len;
+	unsigned char dup, packettype;
+	unsigned short msgid;
 
-	/* wait for connack */
-	if (MQTTPacket_read(buf, buflen, MqttClient::transport_getdata, this) == CONNACK) {
+	switch (type) {
+	case CONNACK: {
 		unsigned char sessionPresent, connack_rc;
-
-		if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, buf, buflen, this) != 1 || connack_rc != 0) {
-			printf("Unable to connect, return code %d\n", connack_rc);
-			goto exit;
+		if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, buf, buflen, this) != 1)
+			break;
+		if (connack_rc == 0) {
+			state = MQTT_CLIENT_CONNECTED;
+			if (keepalive > 0)
+				el->timers->add(&keepalive_timer, keepalive * 1000, keepalive_proc, this);
 		}
-	} else {
-		goto exit;
+		if (eventproc)
+			eventproc(this, CONNACK, connack_rc, clientdata);
+		if (connack_rc != 0 && state != MQTT_CLIENT_CLOSED)
+			handle_close(ECONNREFUSED);
+		return 0;
+	}
+	case PUBLISH: {
+		int qos;
+		unsigned char retained;
+		MQTTString topic;
+		unsigned char *payload;
+		int payloadlen;
+		int sock = mysock;
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &msgid, &topic, &payload, &payloadlen, buf, buflen, this) != 1)
+			break;
+		if (msgproc)
+			msgproc(this, &topic, payload, payloadlen, qos, clientdata);
+		if (mysock != sock)
+			return 0;
+		if (qos == 1)
+			enqueue(4, [&](unsigned char *p, int n) { return MQTTSerialize_puback(p, n, msgid); });
+		else if (qos == 2)
+			enqueue(4, [&](unsigned char *p, int n) { return MQTTSerialize_ack(p, n, PUBREC, 0, msgid); });
+		return 0;
 	}
+	case PUBREC:
+	case PUBREL:
+	case PUBACK:
+	case PUBCOMP:
+		if (MQTTDeserialize_ack(&packettype, &dup, &msgid, buf, buflen, this) != 1)
+			break;
+		if (type == PUBREC)
+			enqueue(4, [&](unsigned char *p, int n) { return MQTTSerialize_pubrel(p, n, 0, msgid); });
+		else if (type == PUBREL)
+			enqueue(4, [&](unsigned char *p, int n) { return MQTTSerialize_pubcomp(p, n, msgid); });
+		else if (eventproc)
+			eventproc(this, type, msgid, clientdata);
+		return 0;
+	case SUBACK: {
+		int count, granted_qos;
+		if (MQTTDeserialize_suback(&msgid, 1, &count, &granted_qos, buf, buflen, this) != 1)
+			break;
+		if (eventproc)
+			eventproc(this, SUBACK, granted_qos, clientdata);
+		return 0;
+	}
+	case UNSUBACK:
+		if (MQTTDeserialize_unsuback(&msgid, buf, buflen, this) != 1)
+			break;
+		if (eventproc)
+			eventproc(this, UNSUBACK, msgid, clientdata);
+		return 0;
+	case PINGRESP:
+		el->timers->cancel(&keepalive_timeout_timer);
+		return 0;
+	default:
+		return 0;
+	}
+	handle_close(EPROTO);
+	return -1;
+}
 
-	/* subscribe */
-	topicString.cstring = MQTT_TOPIC;
-	len = MQTTSerialize_subscribe(buf, buflen, 0, msgid, 1, &topicString, &req_qos);
+/* PINGREQ only when nothing else went out for a whole keepalive period */
+void MqttClient::keepalive_proc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	MqttClient *self = reinterpret_cast<MqttClient *>(clientdata);
+	long long period = self->keepalive * 1000;
+	long long idle = MqttTimerWheel::now() - self->last_sent;
 
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
-	if (MQTTPacket_read(buf, buflen, MqttClient::transport_getdata, this) == SUBACK) {
-		unsigned short submsgid;
-		int subcount;
-		int granted_qos;
+	if (idle < period) {
+		wheel->add(timer, period - idle, keepalive_proc, self);
+		return;
+	}
+	if (!self->keepalive_timeout_timer.pending())
+		wheel->add(&self->keepalive_timeout_timer, period * 3 / 2, keepalive_timeout_proc, self);
+	wheel->add(timer, period, keepalive_proc, self);
+	self->enqueue(2, [](unsigned char *p, int n) { return MQTTSerialize_pingreq(p, n); });
+}
 
-		rc = MQTTDeserialize_suback(&submsgid, 1, &subcount, &granted_qos, buf, buflen, this);
-		if (granted_qos != 0) {
-			printf("granted qos != 0, %d\n", granted_qos);
-			goto exit;
-		}
-	} else {
-		goto exit;
+/* no PINGRESP within 1.5 keepalive periods: the connection is dead */
+void MqttClient::keepalive_timeout_proc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata)
+{
+	(void)wheel;
+	(void)timer;
+	MqttClient *self = reinterpret_cast<MqttClient *>(clientdata);
+	self->handle_close(ETIMEDOUT);
+}
+
+void MqttClient::handle_close(int err)
+{
+	if (state == MQTT_CLIENT_CLOSED)
+		return;
+	connector.cancel();
+	if (mysock >= 0) {
+		aeDeleteFileEvent(el, mysock, AE_READABLE | AE_WRITABLE);
+		transport_close(mysock);
+		mysock = -1;
 	}
+	el->timers->cancel(&keepalive_timer);
+	el->timers->cancel(&keepalive_timeout_timer);
+	MQTTPacketBuffer_release(&packet);
+	sendq.clear();
+	closing = false;
+	state = MQTT_CLIENT_CLOSED;
+	if (eventproc)
+		eventproc(this, DISCONNECT, err, clientdata);
+}
 
-	/* loop getting msgs on subscribed topic */
-	topicString.cstring = MQTT_TOPIC;
-	while (1) {
-		if (MQTTPacket_read(buf, buflen, MqttClient::transport_getdata, this) == PUBLISH) {
-			unsigned char dup;
-			int qos;
-			unsigned char retained;
-			unsigned short msgid;
-			int payloadlen_in;
-			unsigned char *payload_in;
-			int rc;
-			MQTTString receivedTopic;
-
-			rc = MQTTDeserialize_publish(&dup, &qos, &retained, &msgid, &receivedTopic, &payload_in, &payloadlen_in, buf, buflen, this);
-			printf("message arrived %.*s\n", payloadlen_in, payload_in);
-		}
+int MqttClient::open(const char *host, int port, MQTTPacket_connectData *data)
+{
+	if (state != MQTT_CLIENT_CLOSED)
+		return -1;
+	/* every address of host is tried, not just the first IPv4 one */
+	if (connector.start(el, host, port, connected, this, nullptr) < 0)
+		return -1;
+	state = MQTT_CLIENT_CONNECTING;
+	keepalive = data->keepAliveInterval;
+	if (enqueue(128, [&](unsigned char *p, int n) { return MQTTSerialize_connect(p, n, data); }) < 0) {
+		handle_close(EINVAL);
+		return -1;
 	}
+	return 0;
+}
 
-	printf("disconnecting\n");
-	len = MQTTSerialize_disconnect(buf, buflen);
-	rc = MqttClient::transport_sendPacketBuffer(mysock, buf, len, this);
+int MqttClient::publish(const char *topic, unsigned char *payload, int payloadlen, int qos, int retained)
+{
+	MQTTString topicString = MQTTString_initializer;
+	unsigned short msgid = 0;
+
+	if (state == MQTT_CLIENT_CLOSED || closing)
+		return -1;
+	topicString.cstring = (char *)topic;
+	if (qos > 0)
+		msgid = next_msgid();
+	int len = MQTTPacket_len(2 + strlen(topic) + (qos > 0 ? 2 : 0) + payloadlen);
+	if (enqueue(len, [&](unsigned char *p, int n) {
+		return MQTTSerialize_publish(p, n, 0, qos, retained, msgid, topicString, payload, payloadlen);
+	}) < 0)
+		return -1;
+	return msgid;
+}
 
-exit:
-	close();
+int MqttClient::subscribe(const char *topic, int qos)
+{
+	MQTTString topicString = MQTTString_initializer;
+
+	if (state == MQTT_CLIENT_CLOSED || closing)
+		return -1;
+	topicString.cstring = (char *)topic;
+	unsigned short msgid = next_msgid();
+	if (enqueue(8 + strlen(topic), [&](unsigned char *p, int n) {
+		return MQTTSerialize_subscribe(p, n, 0, msgid, 1, &topicString, &qos);
+	}) < 0)
+		return -1;
+	return msgid;
+}
+
+int MqttClient::unsubscribe(const char *topic)
+{
+	MQTTString topicString = MQTTString_initializer;
+
+	if (state == MQTT_CLIENT_CLOSED || closing)
+		return -1;
+	topicString.cstring = (char *)topic;
+	unsigned short msgid = next_msgid();
+	if (enqueue(8 + strlen(topic), [&](unsigned char *p, int n) {
+		return MQTTSerialize_unsubscribe(p, n, 0, msgid, 1, &topicString);
+	}) < 0)
+		return -1;
+	return msgid;
+}
+
+int MqttClient::disconnect()
+{
+	if (state == MQTT_CLIENT_CLOSED || closing)
+		return -1;
+	closing = true;
+	if (enqueue(2, [](unsigned char *p, int n) { return MQTTSerialize_disconnect(p, n); }) < 0)
+		return close();
+	return 0;
+}
+
+int MqttClient::close()
+{
+	handle_close(0);
 	return 0;
 }
@@ -18,19 +18,103 @@
 #ifndef AMAZONALEXA_H
 #define AMAZONALEXA_H
 
+#include <vector>
 
+#include "MQTTPacket.h"
+#include "../mqttc/ae.h"
+#include "../mqttc/resolve.h"
+
+#define MQTT_READAHEAD_SIZE 4096
+#define MQTT_PACKET_FIXED_SIZE 256
+
+enum MqttClientState {
+	MQTT_CLIENT_CLOSED = 0,
+	MQTT_CLIENT_CONNECTING, /* tcp handshake, or waiting for CONNACK */
+	MQTT_CLIENT_CONNECTED
+};
+
+class MqttClient;
+
+/*
+ * type is the packet that completed something: CONNACK (rc is the return
+ * code), SUBACK (granted qos), PUBACK or PUBCOMP (packet id), UNSUBACK
+ * (packet id), or DISCONNECT when the connection is gone (rc is 0 after
+ * close(), an errno otherwise, or a negative EAI_* code if the server
+ * name didn't resolve).
+ */
+typedef void MqttClientEventProc(MqttClient *client, int type, int rc, void *clientdata);
+/* payload points into the read buffer, valid during the call only */
+typedef void MqttClientMessageProc(MqttClient *client, MQTTString *topic,
+		unsigned char *payload, int payloadlen, int qos, void *clientdata);
+
+/*
+ * A non-blocking client driven by an ae event loop. Any number of them can
+ * share one loop, and so one thread: reads go through MQTTPacket_readbufnb,
+ * writes through a send queue flushed when the socket is writable, and
+ * keepalive is a timer on the loop, so an idle client costs no wakeups
+ * until a PINGREQ is due. Everything runs on the loop's thread; a callback
+ * may close() its client but must not destroy it.
+ */
 class MqttClient {
 private:
 	int mysock = -1;
+	int state = MQTT_CLIENT_CLOSED;
+	bool closing = false; /* close once the send queue is flushed */
+	aeEventLoop *el;
+	MqttConnector connector;
+	MQTTReadAhead readahead;
+	unsigned char readahead_buf[MQTT_READAHEAD_SIZE];
+	MQTTTransport trp;
+	MQTTPacketBuffer packet;
+	unsigned char packet_buf[MQTT_PACKET_FIXED_SIZE];
+	std::vector<unsigned char> sendq;
+	int keepalive = 0;
+	long long last_sent = 0;
+	MqttTimer keepalive_timer;
+	MqttTimer keepalive_timeout_timer;
+	unsigned short last_msgid = 0;
+
+	static void connected(void *clientdata, int fd, int err);
+	static void read_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void write_proc(aeEventLoop *el, int fd, void *clientdata, int mask);
+	static void keepalive_proc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+	static void keepalive_timeout_proc(MqttTimerWheel *wheel, MqttTimer *timer, void *clientdata);
+
+	template<typename F> int enqueue(int guess, F serialize);
+	int flush();
+	int handle_packet(int type);
+	void handle_close(int err);
+	unsigned short next_msgid();
 public:
+	MqttClientEventProc *eventproc = nullptr;
+	MqttClientMessageProc *msgproc = nullptr;
+	void *clientdata = nullptr;
+
+	/* statistics */
+	long long wakeups = 0; /* readable events handled */
+	long long packets = 0; /* packets read */
+
+	MqttClient(aeEventLoop *el);
+	~MqttClient();
+	MqttClient(MqttClient const &) = delete;
+	MqttClient &operator=(MqttClient const &) = delete;
+
 	static int transport_sendPacketBuffer(int sock, unsigned char *buf, int buflen, void *opaque);
-	static int transport_getdata(unsigned char *buf, int count, void *opaque);
 	static int transport_getdatanb(void *sck, unsigned char *buf, int count);
-	static int transport_open(char *host, int port, void *opaque);
 	static int transport_close(int sock);
-	int publish();
-	int subscribe();
+
+	/* starts resolving and connecting, CONNECT is sent once a socket is up */
+	int open(const char *host, int port, MQTTPacket_connectData *data);
+	/* queue a packet, these return the packet id, 0 for QoS 0, or <0 on error */
+	int publish(const char *topic, unsigned char *payload, int payloadlen, int qos, int retained = 0);
+	int subscribe(const char *topic, int qos);
+	int unsubscribe(const char *topic);
+	/* DISCONNECT, and close when it has been written */
+	int disconnect();
 	int close();
+
+	int getstate() const { return state; }
+	size_t queued() const { return sendq.size(); }
 };
 
 #endif // AMAZONALEXA_H
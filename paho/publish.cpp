@@ -20,6 +20,7 @@
 #include <stdlib.h>
 
 #include "MqttClient.h"
+#include "../mqttserver.h"
 
 /* This is in order to get an asynchronous signal to stop the sample,
 as the code loops waiting for msgs on the subscribed topic.
@@ -30,6 +31,7 @@ int toStop = 0;
 
 void cfinish(int sig)
 {
+	(void)sig;
 	signal(SIGINT, NULL);
 	toStop = 1;
 }
@@ -43,11 +45,46 @@ void stop_init(void)
 
 
 
+static void on_event(MqttClient *client, int type, int rc, void *clientdata)
+{
+	aeEventLoop *el = (aeEventLoop *)clientdata;
+
+	switch (type) {
+	case CONNACK:
+		if (rc != 0) {
+			printf("Unable to connect, return code %d\n", rc);
+			break;
+		}
+		printf("publishing reading\n");
+		client->publish(MQTT_TOPIC, (unsigned char *)"Hello, world", strlen("Hello, world"), 0);
+		printf("disconnecting\n");
+		client->disconnect();
+		break;
+	case DISCONNECT:
+		aeStop(el);
+		break;
+	}
+}
+
 int main()
 {
 	stop_init();
 
-	MqttClient alexa;
-	alexa.publish();
+	aeEventLoop *el = aeCreateEventLoop(64);
+	MqttClient alexa(el);
+	alexa.eventproc = on_event;
+	alexa.clientdata = el;
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.clientID.cstring = "";
+	data.keepAliveInterval = 20;
+	data.cleansession = 1;
+	data.username.cstring = MQTT_USERNAME;
+	data.password.cstring = MQTT_PASSWORD;
+
+	if (alexa.open(MQTT_SERVER, 1883, &data) >= 0)
+		aeMain(el);
+	alexa.close();
+	aeDeleteEventLoop(el);
 	return 0;
 }
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 
 #include "MqttClient.h"
+#include "../mqttserver.h"
 
 /* This is in order to get an asynchronous signal to stop the sample,
 as the code loops waiting for msgs on the subscribed topic.
@@ -30,6 +31,7 @@ int toStop = 0;
 
 void cfinish(int sig)
 {
+	(void)sig;
 	signal(SIGINT, NULL);
 	toStop = 1;
 }
@@ -43,11 +45,62 @@ void stop_init(void)
 
 
 
+static void on_event(MqttClient *client, int type, int rc, void *clientdata)
+{
+	(void)clientdata;
+	switch (type) {
+	case CONNACK:
+		if (rc != 0) {
+			printf("Unable to connect, return code %d\n", rc);
+			break;
+		}
+		client->subscribe(MQTT_TOPIC, 0);
+		break;
+	case SUBACK:
+		if (rc != 0) {
+			printf("granted qos != 0, %d\n", rc);
+			client->disconnect();
+		}
+		break;
+	}
+}
+
+static void on_message(MqttClient *client, MQTTString *topic,
+		unsigned char *payload, int payloadlen, int qos, void *clientdata)
+{
+	(void)client;
+	(void)topic;
+	(void)qos;
+	(void)clientdata;
+	printf("message arrived %.*s\n", payloadlen, payload);
+}
+
 int main()
 {
 	stop_init();
 
-	MqttClient alexa;
-	alexa.subscribe();
+	/* the thread sleeps in the poll until a message, or a PINGREQ, is due */
+	aeEventLoop *el = aeCreateEventLoop(64);
+	MqttClient alexa(el);
+	alexa.eventproc = on_event;
+	alexa.msgproc = on_message;
+
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	data.clientID.cstring = "";
+	data.keepAliveInterval = 20;
+	data.cleansession = 1;
+	data.username.cstring = MQTT_USERNAME;
+	data.password.cstring = MQTT_PASSWORD;
+
+	if (alexa.open(MQTT_SERVER, 1883, &data) < 0)
+		return 1;
+	while (!toStop && alexa.getstate() != MQTT_CLIENT_CLOSED)
+		aeProcessEvents(el, AE_ALL_EVENTS);
+
+	printf("disconnecting\n");
+	alexa.disconnect();
+	while (alexa.getstate() != MQTT_CLIENT_CLOSED)
+		aeProcessEvents(el, AE_ALL_EVENTS);
+	aeDeleteEventLoop(el);
 	return 0;
 }